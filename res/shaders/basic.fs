@@ -3,10 +3,23 @@
 in vec3 v_position;
 in vec3 v_world_position;
 in vec3 v_normal;
+flat in int v_material_index;
 
 uniform vec3 u_camera_position;
 
 uniform vec4 u_color;
+
+//materials of the mesh (sMaterialInfo padded to vec4)
+struct sMaterial {
+	vec4 Ka;
+	vec4 Kd;
+	vec4 Ks;
+};
+layout(std430, binding = 0) readonly buffer MeshMaterials {
+	sMaterial u_materials[];
+};
+uniform bool u_use_materials;
+
 uniform vec4 u_ambient_light;
 
 uniform vec3 u_light_position;
@@ -30,6 +43,10 @@ void main()
 	float spec = pow(max(dot(V, R), 0.0), u_light_shininess);
 	vec4 specular = spec * u_light_color;
 
-	vec4 phong_color = (u_ambient_light + diffuse + specular) * u_color;
+	vec4 color = u_color;
+	if (u_use_materials)
+		color *= vec4(u_materials[v_material_index].Kd.xyz, 1.0);
+
+	vec4 phong_color = (u_ambient_light + diffuse + specular) * color;
 	FragColor = phong_color * u_light_intensity;
 }
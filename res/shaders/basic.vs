@@ -4,25 +4,47 @@ in vec3 a_vertex;
 in vec3 a_normal;
 in vec2 a_uv;
 in vec4 a_color;
+in float a_material_index; //per draw, see Mesh::multiDrawSubmeshes
 
 uniform mat4 u_model;
 uniform mat4 u_viewprojection;
 uniform vec3 u_camera_position;
 
+//quantized meshes (see Mesh::compactBuffers)
+uniform bool u_compact_vertex;
+uniform vec3 u_quantization_center;
+uniform vec3 u_quantization_halfsize;
+
 //this will store the color for the pixel shader
 out vec3 v_position;
 out vec3 v_world_position;
 out vec3 v_normal;
 out vec2 v_uv;
 out vec4 v_color;
+flat out int v_material_index;
+
+vec3 octDecode( vec2 e )
+{
+	vec3 n = vec3(e.xy, 1.0 - abs(e.x) - abs(e.y));
+	if (n.z < 0.0)
+		n.xy = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+	return normalize(n);
+}
 
 void main()
 {	
+	vec3 vertex = a_vertex;
+	vec3 normal = a_normal;
+	if (u_compact_vertex) {
+		vertex = u_quantization_center + (a_vertex * 2.0 - 1.0) * u_quantization_halfsize;
+		normal = octDecode(a_normal.xy);
+	}
+
 	//calcule the normal in camera space (the NormalMatrix is like ViewMatrix but without traslation)
-	v_normal = (u_model * vec4( a_normal, 0.0) ).xyz;
+	v_normal = (u_model * vec4( normal, 0.0) ).xyz;
 	
 	//calcule the vertex in object space
-	v_position = a_vertex;
+	v_position = vertex;
 	v_world_position = (u_model * vec4( v_position, 1.0) ).xyz;
 	
 	//store the color in the varying var to use it from the pixel shader
@@ -31,6 +53,9 @@ void main()
 	//store the texture coordinates
 	v_uv = a_uv;
 
+	//material of the submesh draw call
+	v_material_index = int(a_material_index);
+
 	//calcule the position of the vertex using the matrices
 	gl_Position = u_viewprojection * vec4( v_world_position, 1.0 );
 }
\ No newline at end of file
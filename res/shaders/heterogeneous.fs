@@ -5,6 +5,7 @@ in vec3 v_world_position;
 in vec3 v_normal;
 
 uniform vec3 u_camera_position;
+uniform float u_jitter; // Offset of the first sample in steps for temporal accumulation, 0 when disabled
 
 uniform vec4 u_ambient_light;
 uniform vec4 u_background_light;
@@ -12,8 +13,20 @@ uniform vec4 u_background_light;
 uniform float u_abs_coef;
 
 uniform float u_step_length;
+uniform float u_step_growth; // Relative growth of the step per unit of distance to the camera
+uniform float u_min_transmittance; // The ray stops when less light than this gets through, 0 to march the whole volume
 uniform float u_noise_scale;
 uniform float u_noise_detail;
+uniform bool u_use_noise_texture;
+uniform sampler3D u_noise_texture; // First octaves of cnoise in the box, see StandardMaterial::updateNoiseTexture
+uniform int u_noise_octaves;       // In the texture, the finer ones are evaluated
+
+// Samples taken by all the rays, read back by StandardMaterial::updateRayStats
+uniform bool u_ray_stats;
+layout(std430, binding = 2) buffer RayStats {
+    uint ray_count;
+    uint sample_count;
+};
 
 out vec4 FragColor;
 
@@ -80,6 +93,33 @@ float cnoise( vec3 P, float scale, float detail )
     return clamp(fractal_noise(P, detail), 0.0, 1.0);
 }
 
+// Octaves of the fBm from the first one on, the ones finer than the noise texture
+float fractal_noise_from( vec3 P, int first, float detail )
+{
+    float fscale = exp2(float(first));
+    float amp = exp2(-float(first));
+    float sum = 0.0;
+    int n = int(clamp(detail, 0.0, 16.0));
+
+    for (int i = first; i <= n; i++) {
+        sum += noise(fscale * P) * amp;
+        amp *= 0.5;
+        fscale *= 2.0;
+    }
+
+    return sum;
+}
+
+// The first octaves of the fBm are baked in a texture over the box (their sum mapped from [-2, 2]), a single fetch instead of evaluating them
+float sampleNoise( vec3 P )
+{
+    if (u_use_noise_texture) {
+        float baked = texture(u_noise_texture, P * 0.5 + 0.5).x * 4.0 - 2.0;
+        return clamp(baked + fractal_noise_from(P * u_noise_scale, u_noise_octaves, u_noise_detail), 0.0, 1.0);
+    }
+    return cnoise(P, u_noise_scale, u_noise_detail);
+}
+
 //MAIN
 
 void main() {
@@ -100,25 +140,45 @@ void main() {
 
     // Initialize variables
     float thickness = 0.0;
+    int samples = 0;
+
+    // Every frame starts the samples at a different offset, the temporal history accumulates them
+    if (u_jitter > 0.0)
+        tNear += fract(u_jitter + 52.9829189 * fract(dot(gl_FragCoord.xy, vec2(0.06711056, 0.00583715)))) * u_step_length;
 
     vec3 position = rayOrigin + tNear * rayDir;
 
     float density = 0;
 
     // Ray-marching loop
-    for (float t = tNear; t < tFar; t += u_step_length) {
+    float dt = u_step_length;
+    for (float t = tNear; t < tFar; t += dt) {
+
+        // Longer steps far from the camera
+        dt = u_step_length * (1.0 + u_step_growth * t);
 
-        density = cnoise(position, u_noise_scale, u_noise_detail);
+        density = sampleNoise(position);
 
         float absorption = density * u_abs_coef;
 
         // Accumulate optical thickness
-        thickness += absorption * u_step_length;
+        thickness += absorption * dt;
 
         // Advance position along the ray
-        position += rayDir * u_step_length;
+        position += rayDir * dt;
+        samples++;
+
+        // Nothing behind this point reaches the camera
+        if (exp(-thickness) < u_min_transmittance)
+            break;
+    }
+
+    if (u_ray_stats) {
+        atomicAdd(ray_count, 1u);
+        atomicAdd(sample_count, uint(samples));
     }
 
     float transmittance = exp(-thickness);
     FragColor = u_background_light * transmittance;
+    FragColor.a = 1.0 - transmittance + u_background_light.a * transmittance; // Coverage, so it can be composited over the scene
 }
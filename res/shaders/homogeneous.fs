@@ -33,4 +33,5 @@ void main()
 	float transmittance = exp(-u_abs_coef*(tFar - tNear));
 
 	FragColor = u_background_light * transmittance;
+	FragColor.a = 1.0 - transmittance + u_background_light.a * transmittance; // Coverage, so it can be composited over the scene
 }
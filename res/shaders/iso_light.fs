@@ -5,6 +5,9 @@ in vec3 v_world_position;
 in vec3 v_normal;
 
 uniform vec3 u_camera_position;
+uniform float u_jitter; // Offset of the first sample in steps for temporal accumulation, 0 when disabled
+uniform vec3 u_box_min; // Bounds of the voxels with density, see StandardMaterial::setVolumeUniforms
+uniform vec3 u_box_max;
 
 uniform vec4 u_ambient_light;
 uniform vec4 u_background_light;
@@ -13,11 +16,18 @@ uniform vec4 u_color;
 uniform mat4 u_model;
 
 uniform float u_step_length;
+uniform float u_step_growth;       // Relative growth of the step per unit of distance to the camera
+uniform bool u_use_adaptive_step;  // Uses the brick ranges to skip empty space
+uniform sampler3D u_range_texture; // Min and max density of every brick, see StandardMaterial::createBrickRanges
 
 uniform sampler3D u_texture;  // 3D texture for density data
 
 uniform float u_h;
 
+uniform bool u_use_gradient_texture;  // Directions of the gradient built on the CPU, see IsosurfaceMaterial::updateGradientTexture
+uniform sampler3D u_gradient_texture;
+uniform vec2 u_gradient_decode;       // Scale and bias from the texture to [-1, 1]
+
 uniform float u_light_intensity;
 uniform vec4 u_light_color;
 uniform vec3 u_light_direction;
@@ -32,13 +42,39 @@ out vec4 FragColor;
 
 // ---------------------------------------------------------------------------------------------------//
 
+// Length of the step at the distance t, from texCoords in the density texture along texDir (texture units per world unit).
+// Empty bricks are crossed in a single step, all their samples are 0, and nearly uniform ones with longer steps
+float adaptiveStep(float t, vec3 texCoords, vec3 texDir)
+{
+    float dt = u_step_length * (1.0 + u_step_growth * t);
+    if (!u_use_adaptive_step)
+        return dt;
+
+    ivec3 bricks = textureSize(u_range_texture, 0);
+    ivec3 brick = clamp(ivec3(floor(texCoords * vec3(bricks))), ivec3(0), bricks - 1);
+    vec2 range = texelFetch(u_range_texture, brick, 0).xy;
+
+    vec3 bound = (vec3(brick) + step(vec3(0.0), texDir)) / vec3(bricks);
+    vec3 tExit = vec3(1e6);
+    for (int i = 0; i < 3; i++)
+        if (abs(texDir[i]) > 1e-6)
+            tExit[i] = (bound[i] - texCoords[i]) / texDir[i];
+    float exit = min(min(tExit.x, tExit.y), tExit.z) + 0.001;
+
+    if (range.y <= 0.0)
+        return max(dt, exit);
+    if (range.y - range.x < 0.02)
+        return max(dt, min(4.0 * dt, exit));
+    return dt;
+}
+
 void main() {
 
     vec3 rayOrigin = u_camera_position;
     vec3 rayDir = normalize(v_world_position - u_camera_position);
 
-    vec3 boxMin = vec3(-1);
-    vec3 boxMax = vec3(1);
+    vec3 boxMin = u_box_min;
+    vec3 boxMax = u_box_max;
 
     // Intersect AABB
     vec3 tMin = (boxMin - rayOrigin) / rayDir;
@@ -48,26 +84,48 @@ void main() {
     float tNear = max(max(t1.x, t1.y), t1.z);
     float tFar = min(min(t2.x, t2.y), t2.z);
 
+    // The proxy mesh only covers the bricks with density, nothing to march before the fragment
+    tNear = max(tNear, dot(v_world_position - rayOrigin, rayDir));
+
+    // Every frame starts the samples at a different offset, the temporal history accumulates them
+    if (u_jitter > 0.0)
+        tNear += fract(u_jitter + 52.9829189 * fract(dot(gl_FragCoord.xy, vec2(0.06711056, 0.00583715)))) * u_step_length;
+
     vec3 position = rayOrigin + tNear * rayDir;
     vec4 final_color = vec4(0.0);
     float density;
 
     bool fin = false;
 
+    // Ray in the density texture, for the adaptive steps
+    mat4 inverse_model = inverse(u_model);
+    vec3 texDir = 0.5 * (inverse_model * vec4(rayDir, 0.0)).xyz;
+
     // Ray-marching loop for emission-absorption
-    for (float t = tNear; t < tFar; t += u_step_length) {
+    float dt = u_step_length;
+    for (float t = tNear; t < tFar; t += dt) {
+
+        // Longer steps far from the camera and in the bricks without detail
+        dt = adaptiveStep(t, (inverse_model * vec4(position, 1.0)).xyz * 0.5 + 0.5, texDir);
 
         vec3 localPosition = (inverse(u_model) * vec4(position, 1.0)).xyz;
         vec3 texCoords = (localPosition + vec3(1.0)) * 0.5; // Map to [0, 1] range
-        density = texture(u_texture, texCoords).x;
+        // Level 0, the mipmaps spread the density out and the implicit derivatives are undefined in this loop
+        density = textureLod(u_texture, texCoords, 0.0).x;
         
         if (density != 0) {
             
-            vec3 gradient = (1 / (2 * u_h)) * vec3(
+            vec3 gradient = vec3(0.0);
+            if (u_use_gradient_texture)
+                gradient = textureLod(u_gradient_texture, texCoords, 0.0).xyz * u_gradient_decode.x + u_gradient_decode.y;
+
+            // Central differences, also where the interpolated directions cancel out
+            if (dot(gradient, gradient) < 1e-4)
+                gradient = (1 / (2 * u_h)) * vec3(
 
-                texture(u_texture, texCoords + vec3(u_h,0,0) ).x - texture(u_texture, texCoords + vec3(-u_h,0,0) ).x ,
-                texture(u_texture, texCoords + vec3(0,u_h,0) ).x - texture(u_texture, texCoords + vec3(0,-u_h,0) ).x ,
-                texture(u_texture, texCoords + vec3(0,0,u_h) ).x - texture(u_texture, texCoords + vec3(0,0,-u_h) ).x );
+                    textureLod(u_texture, texCoords + vec3(u_h,0,0), 0.0).x - textureLod(u_texture, texCoords + vec3(-u_h,0,0), 0.0).x ,
+                    textureLod(u_texture, texCoords + vec3(0,u_h,0), 0.0).x - textureLod(u_texture, texCoords + vec3(0,-u_h,0), 0.0).x ,
+                    textureLod(u_texture, texCoords + vec3(0,0,u_h), 0.0).x - textureLod(u_texture, texCoords + vec3(0,0,-u_h), 0.0).x );
 
             vec3 normal = - normalize(gradient);
 
@@ -91,7 +149,7 @@ void main() {
 
                 vec3 localPosition2 = (inverse(u_model) * vec4(pos2, 1.0)).xyz;
                 vec3 texCoords2 = (localPosition2 + vec3(1.0)) * 0.5; // Map to [0, 1] range
-                float density2 = texture(u_texture, texCoords2).x;
+                float density2 = textureLod(u_texture, texCoords2, 0.0).x;
 
                 if ( density2 != 0 ) {
                     visibility = 0.0;
@@ -120,7 +178,7 @@ void main() {
         }
 
         // Advance position along the ray
-        position += rayDir * u_step_length;
+        position += rayDir * dt;
 
     }
 
@@ -0,0 +1,33 @@
+#version 450 core
+
+in vec3 v_position;
+in vec3 v_world_position;
+in vec3 v_normal;
+
+uniform vec3 u_camera_position;
+
+uniform vec4 u_color;
+
+uniform float u_light_intensity;
+uniform vec4 u_light_color;
+uniform vec3 u_light_position;
+
+uniform vec4 u_ambient;   // Luz ambiental
+uniform vec4 u_ks;        // Coeficiente especular
+uniform float u_alpha;    // Brillo especular (shininess)
+
+out vec4 FragColor;
+
+// Phong of iso_light.fs on the surface extracted on the CPU (see IsosurfaceExtractor), without the shadow rays
+void main()
+{
+    vec3 normal = normalize(v_normal);
+    vec3 wo = normalize(u_camera_position - v_world_position);
+    vec3 wi = normalize(u_light_position - v_world_position);
+    vec3 wr = 2 * dot(wi, normal) * normal - wi;
+
+    vec3 phong_color = u_color.xyz / 3.1416 + (3.1416 * 2 / (u_alpha + 1)) * u_ks.xyz * pow(max(dot(wr, wo), 0.0), u_alpha);
+    vec3 radiance = max(dot(wi, normal), 0.0) * u_light_color.xyz * phong_color * u_light_intensity + u_ambient.xyz;
+
+    FragColor = vec4(radiance, 1.0);
+}
@@ -5,6 +5,9 @@ in vec3 v_world_position;
 in vec3 v_normal;
 
 uniform vec3 u_camera_position;
+uniform float u_jitter; // Offset of the first sample in steps for temporal accumulation, 0 when disabled
+uniform vec3 u_box_min; // Bounds of the voxels with density, see StandardMaterial::setVolumeUniforms
+uniform vec3 u_box_max;
 
 uniform vec4 u_ambient_light;
 uniform vec4 u_background_light;
@@ -13,8 +16,21 @@ uniform vec4 u_color;
 uniform mat4 u_model;
 
 uniform float u_step_length;
+uniform float u_step_growth;       // Relative growth of the step per unit of distance to the camera
+uniform float u_min_transmittance; // The ray stops when less light than this gets through, 0 to march the whole volume
+uniform bool u_use_adaptive_step;  // Uses the brick ranges to skip empty space
+uniform sampler3D u_range_texture; // Min and max density of every brick, see StandardMaterial::createBrickRanges
+uniform bool u_use_lod;            // Reads coarser levels of the density when a sample covers several voxels
+uniform float u_lod_bias;
+uniform float u_pixel_angle;       // Radians covered by a pixel
 
 uniform sampler3D u_texture;  // 3D texture for density data
+uniform bool u_use_virtual;        // Finer bricks paged in on demand, see VirtualVolume
+uniform usampler3D u_page_table;   // Slot in the atlas of every page and if it is resident
+uniform sampler3D u_brick_atlas;
+uniform ivec3 u_virtual_pages;
+uniform int u_brick_size;
+uniform int u_feedback_frame;      // Stamp of the pages requested by this frame, never 0
 
 uniform float u_threshold;
 
@@ -22,6 +38,25 @@ uniform bool u_use_jittering;
 
 uniform bool u_use_isosurface;
 
+uniform bool u_use_sdf;            // Sphere traces the distance field of the threshold instead of the uniform steps
+uniform sampler3D u_sdf_texture;   // Signed distance to the surface in texture units, see IsosurfaceMaterial::updateDistanceField
+uniform float u_sdf_epsilon;       // Distance of a hit, in texture units
+uniform bool u_density_level;      // The threshold is a density like in the distance field, not the accumulated sum
+
+// Samples taken by all the rays, read back by StandardMaterial::updateRayStats
+uniform bool u_ray_stats;
+layout(std430, binding = 2) buffer RayStats {
+    uint ray_count;
+    uint sample_count;
+};
+
+// Pages of the virtual volume the rays need, read back by VirtualVolume::update. The first ray that touches a page
+// stamps it with the frame and appends it, so only page_count pages are read: stamps first, then the list
+layout(std430, binding = 3) buffer PageFeedback {
+    uint page_count;
+    uint page_requests[];
+};
+
 out vec4 FragColor;
 
 // ---------------------------------------------------------------------------------------------------//
@@ -30,13 +65,91 @@ float random (vec2 st) {
     return fract(sin(dot(st.xy, vec2(12.9898,78.233)))*43758.5453123);
 }
 
+vec2 brick_range = vec2(1.0); // Of the brick of the last adaptiveStep
+
+// Length of the step at the distance t, from texCoords in the density texture along texDir (texture units per world unit).
+// Empty bricks are crossed in a single step, all their samples are 0, and nearly uniform ones with longer steps
+float adaptiveStep(float t, vec3 texCoords, vec3 texDir)
+{
+    float dt = u_step_length * (1.0 + u_step_growth * t);
+    if (!u_use_adaptive_step)
+        return dt;
+
+    ivec3 bricks = textureSize(u_range_texture, 0);
+    ivec3 brick = clamp(ivec3(floor(texCoords * vec3(bricks))), ivec3(0), bricks - 1);
+    vec2 range = texelFetch(u_range_texture, brick, 0).xy;
+    brick_range = range;
+
+    vec3 bound = (vec3(brick) + step(vec3(0.0), texDir)) / vec3(bricks);
+    vec3 tExit = vec3(1e6);
+    for (int i = 0; i < 3; i++)
+        if (abs(texDir[i]) > 1e-6)
+            tExit[i] = (bound[i] - texCoords[i]) / texDir[i];
+    float exit = min(min(tExit.x, tExit.y), tExit.z) + 0.001;
+
+    if (range.y <= 0.0)
+        return max(dt, exit);
+    if (range.y - range.x < 0.02)
+        return max(dt, min(4.0 * dt, exit));
+    return dt;
+}
+
+// Level of the density mipmaps for a sample at the distance t, from the voxels covered by the step or the pixel.
+// The empty bricks keep the full resolution, their long steps would give weight to the density around them
+float densityLod(float t, vec3 texDir)
+{
+    if (!u_use_lod || brick_range.y <= 0.0)
+        return 0.0;
+    float footprint = max(u_step_length * (1.0 + u_step_growth * t), t * u_pixel_angle);
+    float voxels = footprint * length(texDir) * float(textureSize(u_texture, 0).x);
+    return max(log2(voxels) + u_lod_bias, 0.0);
+}
+
+// Density at texCoords, from the resident bricks of the virtual volume when the sample needs its full resolution.
+// The empty bricks of the ranges are empty in the virtual volume too, they do not request pages
+float sampleDensity(vec3 texCoords, float lod)
+{
+    if (u_use_virtual && lod <= 0.0 && brick_range.y > 0.0) {
+        vec3 pageCoords = clamp(texCoords, 0.0, 1.0) * vec3(u_virtual_pages);
+        ivec3 page = min(ivec3(pageCoords), u_virtual_pages - 1);
+        uint index = uint(page.x + (page.y + page.z * u_virtual_pages.y) * u_virtual_pages.x);
+        uint stamp = uint(u_feedback_frame);
+        if (page_requests[index] != stamp && atomicExchange(page_requests[index], stamp) != stamp)
+            page_requests[uint(u_virtual_pages.x * u_virtual_pages.y * u_virtual_pages.z) + atomicAdd(page_count, 1u)] = index;
+
+        uvec4 entry = texelFetch(u_page_table, page, 0);
+        if (entry.w != 0u) {
+            // the bricks keep a voxel of their neighbours around them
+            vec3 voxel = vec3(entry.xyz) * float(u_brick_size + 2) + 1.0 + (pageCoords - vec3(page)) * float(u_brick_size);
+            return texture(u_brick_atlas, voxel / vec3(textureSize(u_brick_atlas, 0))).x;
+        }
+    }
+    return textureLod(u_texture, texCoords, lod).x;
+}
+
+// No surface is closer to a point than its distance, so the ray can advance that much. Distance to the hit or -1.
+// texScale is the texture units per world unit along the ray
+float sphereTrace(vec3 rayOrigin, vec3 rayDir, float tNear, float tFar, mat4 inverse_model, float texScale, inout int samples)
+{
+    float t = tNear;
+    for (int i = 0; i < 256 && t < tFar; i++) {
+        vec3 texCoords = (inverse_model * vec4(rayOrigin + t * rayDir, 1.0)).xyz * 0.5 + 0.5;
+        float distance = texture(u_sdf_texture, texCoords).x;
+        samples++;
+        if (distance < u_sdf_epsilon)
+            return t;
+        t += distance / texScale;
+    }
+    return -1.0;
+}
+
 void main() {
 
     vec3 rayOrigin = u_camera_position;
     vec3 rayDir = normalize(v_world_position - u_camera_position);
 
-    vec3 boxMin = vec3(-1);
-    vec3 boxMax = vec3(1);
+    vec3 boxMin = u_box_min;
+    vec3 boxMax = u_box_max;
 
     // Intersect AABB
     vec3 tMin = (boxMin - rayOrigin) / rayDir;
@@ -46,8 +159,16 @@ void main() {
     float tNear = max(max(t1.x, t1.y), t1.z);
     float tFar = min(min(t2.x, t2.y), t2.z);
 
+    // The proxy mesh only covers the bricks with density, nothing to march before the fragment
+    tNear = max(tNear, dot(v_world_position - rayOrigin, rayDir));
+
+    // Every frame starts the samples at a different offset, the temporal history accumulates them
+    if (u_jitter > 0.0)
+        tNear += fract(u_jitter + 52.9829189 * fract(dot(gl_FragCoord.xy, vec2(0.06711056, 0.00583715)))) * u_step_length;
+
     vec3 position = rayOrigin + tNear * rayDir;
     float sum = 0.0;
+    int samples = 0;
     vec4 final_color = u_background_light;
     float density;
 
@@ -59,27 +180,51 @@ void main() {
 
     } 
 
+    // Ray in the density texture, for the adaptive steps
+    mat4 inverse_model = inverse(u_model);
+    vec3 texDir = 0.5 * (inverse_model * vec4(rayDir, 0.0)).xyz;
+
+    // The surface at the threshold from its distance field, the density is not marched
+    if (u_use_isosurface && u_use_sdf) {
+        if (sphereTrace(rayOrigin, rayDir, ray_init_pos, tFar, inverse_model, length(texDir), samples) >= 0.0)
+            final_color = u_color;
+        tFar = ray_init_pos;
+    }
+
     // Ray-marching loop for emission-absorption
-    for (float t = ray_init_pos; t < tFar; t += u_step_length) {
+    float dt = u_step_length;
+    for (float t = ray_init_pos; t < tFar; t += dt) {
+
+        // Longer steps far from the camera and in the bricks without detail
+        dt = adaptiveStep(t, (inverse_model * vec4(position, 1.0)).xyz * 0.5 + 0.5, texDir);
 
         vec3 localPosition = (inverse(u_model) * vec4(position, 1.0)).xyz;
         vec3 texCoords = (localPosition + vec3(1.0)) * 0.5; // Map to [0, 1] range
-        density = texture(u_texture, texCoords).x;
+        density = sampleDensity(texCoords, densityLod(t, texDir));
         
-        sum += density;
+        sum += density * dt / u_step_length; // In samples of the base step, so it does not depend on dt
+        samples++;
 
         if (u_use_isosurface) {
 
-            if (sum > u_threshold) {
+            if (u_density_level ? density >= u_threshold : sum > u_threshold) {
 
             final_color = u_color;
             break;
             }
         }
+        // Nothing behind this point reaches the camera
+        else if (exp(-sum * 2 * u_step_length) < u_min_transmittance)
+            break;
 
         // Advance position along the ray
-        position += rayDir * u_step_length;
+        position += rayDir * dt;
+
+    }
 
+    if (u_ray_stats) {
+        atomicAdd(ray_count, 1u);
+        atomicAdd(sample_count, uint(samples));
     }
 
     // Final color calculation, combining accumulated radiance and background light
@@ -88,6 +233,8 @@ void main() {
         FragColor = final_color;
     }
     else {
-        FragColor = u_background_light * exp(-sum * 2 * u_step_length);
+        float transmittance = exp(-sum * 2 * u_step_length);
+        FragColor = u_background_light * transmittance;
+        FragColor.a = 1.0 - transmittance + u_background_light.a * transmittance; // Coverage, so it can be composited over the scene
     }
 }
\ No newline at end of file
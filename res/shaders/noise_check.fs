@@ -0,0 +1,101 @@
+#version 450 core
+
+uniform sampler3D u_noise_texture; // Baked by StandardMaterial::updateNoiseTexture
+uniform int u_noise_octaves;       // In the texture, the finer ones are added
+uniform float u_noise_scale;
+uniform float u_noise_detail;
+uniform float u_size;              // Pixels per side of the target
+
+out vec4 FragColor;
+
+// Noise functions, the same as the volume shaders
+float hash1( float n )
+{
+    return fract( n*17.0*fract( n*0.3183099 ) );
+}
+
+float noise( vec3 x )
+{
+    vec3 p = floor(x);
+    vec3 w = fract(x);
+    
+    vec3 u = w*w*w*(w*(w*6.0-15.0)+10.0);
+    
+    float n = p.x + 317.0*p.y + 157.0*p.z;
+    
+    float a = hash1(n+0.0);
+    float b = hash1(n+1.0);
+    float c = hash1(n+317.0);
+    float d = hash1(n+318.0);
+    float e = hash1(n+157.0);
+    float f = hash1(n+158.0);
+    float g = hash1(n+474.0);
+    float h = hash1(n+475.0);
+
+    float k0 =   a;
+    float k1 =   b - a;
+    float k2 =   c - a;
+    float k3 =   e - a;
+    float k4 =   a - b - c + d;
+    float k5 =   a - c - e + g;
+    float k6 =   a - b - e + f;
+    float k7 = - a + b + c - d + e - f - g + h;
+
+    return -1.0+2.0*(k0 + k1*u.x + k2*u.y + k3*u.z + k4*u.x*u.y + k5*u.y*u.z + k6*u.z*u.x + k7*u.x*u.y*u.z);
+}
+
+#define MAX_OCTAVES 16
+
+float fractal_noise( vec3 P, float detail )
+{
+    float fscale = 1.0;
+    float amp = 1.0;
+    float sum = 0.0;
+    float octaves = clamp(detail, 0.0, 16.0);
+    int n = int(octaves);
+
+    for (int i = 0; i <= MAX_OCTAVES; i++) {
+        if (i > n) continue;
+        float t = noise(fscale * P);
+        sum += t * amp;
+        amp *= 0.5;
+        fscale *= 2.0;
+    }
+
+    return sum;
+}
+
+float cnoise( vec3 P, float scale, float detail )
+{
+    P *= scale;
+    return clamp(fractal_noise(P, detail), 0.0, 1.0);
+}
+
+// Octaves of the fBm from the first one on, the ones finer than the noise texture
+float fractal_noise_from( vec3 P, int first, float detail )
+{
+    float fscale = exp2(float(first));
+    float amp = exp2(-float(first));
+    float sum = 0.0;
+    int n = int(clamp(detail, 0.0, 16.0));
+
+    for (int i = first; i <= n; i++) {
+        sum += noise(fscale * P) * amp;
+        amp *= 0.5;
+        fscale *= 2.0;
+    }
+
+    return sum;
+}
+
+// Compares the fBm with its CPU version and the baked texture, see StandardMaterial::validateNoise
+void main() {
+
+    // Same points as the CPU, one per pixel
+    vec2 pixel = floor(gl_FragCoord.xy);
+    vec3 P = vec3(pixel / (u_size - 1.0), fract((pixel.x * 7.0 + pixel.y * 13.0) / 256.0)) * 2.0 - 1.0;
+
+    float baked = texture(u_noise_texture, P * 0.5 + 0.5).x * 4.0 - 2.0;
+    baked = clamp(baked + fractal_noise_from(P * u_noise_scale, u_noise_octaves, u_noise_detail), 0.0, 1.0);
+    FragColor = vec4(cnoise(P, u_noise_scale, u_noise_detail), baked, 0.0, 1.0);
+}
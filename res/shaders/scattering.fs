@@ -5,6 +5,9 @@ in vec3 v_world_position;
 in vec3 v_normal;
 
 uniform vec3 u_camera_position;
+uniform float u_jitter; // Offset of the first sample in steps for temporal accumulation, 0 when disabled
+uniform vec3 u_box_min; // Bounds of the voxels with density, see StandardMaterial::setVolumeUniforms
+uniform vec3 u_box_max;
 
 uniform vec4 u_ambient_light;
 uniform vec4 u_background_light;
@@ -14,12 +17,28 @@ uniform mat4 u_model;
 
 uniform float u_abs_coef;
 uniform float u_step_length;
+uniform float u_step_growth;       // Relative growth of the step per unit of distance to the camera
+uniform float u_min_transmittance; // The ray stops when less light than this gets through, 0 to march the whole volume
+uniform bool u_use_adaptive_step;  // Uses the brick ranges to skip empty space
+uniform sampler3D u_range_texture; // Min and max density of every brick, see StandardMaterial::createBrickRanges
+uniform bool u_use_lod;            // Reads coarser levels of the density when a sample covers several voxels
+uniform float u_lod_bias;
+uniform float u_pixel_angle;       // Radians covered by a pixel
 uniform float u_noise_scale;
 uniform float u_noise_detail;
+uniform bool u_use_noise_texture;
+uniform sampler3D u_noise_texture; // First octaves of cnoise in the box, see StandardMaterial::updateNoiseTexture
+uniform int u_noise_octaves;       // In the texture, the finer ones are evaluated
 
 uniform float u_scat_coef;
 
 uniform sampler3D u_texture;  // 3D texture for density data
+uniform bool u_use_virtual;        // Finer bricks paged in on demand, see VirtualVolume
+uniform usampler3D u_page_table;   // Slot in the atlas of every page and if it is resident
+uniform sampler3D u_brick_atlas;
+uniform ivec3 u_virtual_pages;
+uniform int u_brick_size;
+uniform int u_feedback_frame;      // Stamp of the pages requested by this frame, never 0
 uniform int u_density_type;
 
 
@@ -29,6 +48,20 @@ uniform vec3 u_light_direction;
 uniform vec3 u_light_position;
 uniform vec3 u_local_light_position;
 
+// Samples taken by all the rays, read back by StandardMaterial::updateRayStats
+uniform bool u_ray_stats;
+layout(std430, binding = 2) buffer RayStats {
+    uint ray_count;
+    uint sample_count;
+};
+
+// Pages of the virtual volume the rays need, read back by VirtualVolume::update. The first ray that touches a page
+// stamps it with the frame and appends it, so only page_count pages are read: stamps first, then the list
+layout(std430, binding = 3) buffer PageFeedback {
+    uint page_count;
+    uint page_requests[];
+};
+
 out vec4 FragColor;
 
 // Noise functions
@@ -94,15 +127,104 @@ float cnoise( vec3 P, float scale, float detail )
     return clamp(fractal_noise(P, detail), 0.0, 1.0);
 }
 
+// Octaves of the fBm from the first one on, the ones finer than the noise texture
+float fractal_noise_from( vec3 P, int first, float detail )
+{
+    float fscale = exp2(float(first));
+    float amp = exp2(-float(first));
+    float sum = 0.0;
+    int n = int(clamp(detail, 0.0, 16.0));
+
+    for (int i = first; i <= n; i++) {
+        sum += noise(fscale * P) * amp;
+        amp *= 0.5;
+        fscale *= 2.0;
+    }
+
+    return sum;
+}
+
+// The first octaves of the fBm are baked in a texture over the box (their sum mapped from [-2, 2]), a single fetch instead of evaluating them
+float sampleNoise( vec3 P )
+{
+    if (u_use_noise_texture) {
+        float baked = texture(u_noise_texture, P * 0.5 + 0.5).x * 4.0 - 2.0;
+        return clamp(baked + fractal_noise_from(P * u_noise_scale, u_noise_octaves, u_noise_detail), 0.0, 1.0);
+    }
+    return cnoise(P, u_noise_scale, u_noise_detail);
+}
+
 // ---------------------------------------------------------------------------------------------------//
 
+vec2 brick_range = vec2(1.0); // Of the brick of the last adaptiveStep
+
+// Length of the step at the distance t, from texCoords in the density texture along texDir (texture units per world unit).
+// Empty bricks are crossed in a single step, all their samples are 0, and nearly uniform ones with longer steps
+float adaptiveStep(float t, vec3 texCoords, vec3 texDir)
+{
+    float dt = u_step_length * (1.0 + u_step_growth * t);
+    if (!u_use_adaptive_step)
+        return dt;
+
+    ivec3 bricks = textureSize(u_range_texture, 0);
+    ivec3 brick = clamp(ivec3(floor(texCoords * vec3(bricks))), ivec3(0), bricks - 1);
+    vec2 range = texelFetch(u_range_texture, brick, 0).xy;
+    brick_range = range;
+
+    vec3 bound = (vec3(brick) + step(vec3(0.0), texDir)) / vec3(bricks);
+    vec3 tExit = vec3(1e6);
+    for (int i = 0; i < 3; i++)
+        if (abs(texDir[i]) > 1e-6)
+            tExit[i] = (bound[i] - texCoords[i]) / texDir[i];
+    float exit = min(min(tExit.x, tExit.y), tExit.z) + 0.001;
+
+    if (range.y <= 0.0)
+        return max(dt, exit);
+    if (range.y - range.x < 0.02)
+        return max(dt, min(4.0 * dt, exit));
+    return dt;
+}
+
+// Level of the density mipmaps for a sample at the distance t, from the voxels covered by the step or the pixel.
+// The empty bricks keep the full resolution, their long steps would give weight to the density around them
+float densityLod(float t, vec3 texDir)
+{
+    if (!u_use_lod || brick_range.y <= 0.0)
+        return 0.0;
+    float footprint = max(u_step_length * (1.0 + u_step_growth * t), t * u_pixel_angle);
+    float voxels = footprint * length(texDir) * float(textureSize(u_texture, 0).x);
+    return max(log2(voxels) + u_lod_bias, 0.0);
+}
+
+// Density at texCoords, from the resident bricks of the virtual volume when the sample needs its full resolution.
+// The empty bricks of the ranges are empty in the virtual volume too, they do not request pages
+float sampleDensity(vec3 texCoords, float lod)
+{
+    if (u_use_virtual && lod <= 0.0 && brick_range.y > 0.0) {
+        vec3 pageCoords = clamp(texCoords, 0.0, 1.0) * vec3(u_virtual_pages);
+        ivec3 page = min(ivec3(pageCoords), u_virtual_pages - 1);
+        uint index = uint(page.x + (page.y + page.z * u_virtual_pages.y) * u_virtual_pages.x);
+        uint stamp = uint(u_feedback_frame);
+        if (page_requests[index] != stamp && atomicExchange(page_requests[index], stamp) != stamp)
+            page_requests[uint(u_virtual_pages.x * u_virtual_pages.y * u_virtual_pages.z) + atomicAdd(page_count, 1u)] = index;
+
+        uvec4 entry = texelFetch(u_page_table, page, 0);
+        if (entry.w != 0u) {
+            // the bricks keep a voxel of their neighbours around them
+            vec3 voxel = vec3(entry.xyz) * float(u_brick_size + 2) + 1.0 + (pageCoords - vec3(page)) * float(u_brick_size);
+            return texture(u_brick_atlas, voxel / vec3(textureSize(u_brick_atlas, 0))).x;
+        }
+    }
+    return textureLod(u_texture, texCoords, lod).x;
+}
+
 void main() {
 
     vec3 rayOrigin = u_camera_position;
     vec3 rayDir = normalize(v_world_position - u_camera_position);
 
-    vec3 boxMin = vec3(-1);
-    vec3 boxMax = vec3(1);
+    vec3 boxMin = u_box_min;
+    vec3 boxMax = u_box_max;
 
     // Intersect AABB
     vec3 tMin = (boxMin - rayOrigin) / rayDir;
@@ -112,13 +234,29 @@ void main() {
     float tNear = max(max(t1.x, t1.y), t1.z);
     float tFar = min(min(t2.x, t2.y), t2.z);
 
+    // The proxy mesh only covers the bricks with density, nothing to march before the fragment
+    tNear = max(tNear, dot(v_world_position - rayOrigin, rayDir));
+
+    // Every frame starts the samples at a different offset, the temporal history accumulates them
+    if (u_jitter > 0.0)
+        tNear += fract(u_jitter + 52.9829189 * fract(dot(gl_FragCoord.xy, vec2(0.06711056, 0.00583715)))) * u_step_length;
+
     vec3 position = rayOrigin + tNear * rayDir;
     vec4 sum = vec4(0.0);
     float thickness = 0.0;
     float density = 0.0;
+    int samples = 0;
+
+    // Ray in the density texture, for the adaptive steps
+    mat4 inverse_model = inverse(u_model);
+    vec3 texDir = 0.5 * (inverse_model * vec4(rayDir, 0.0)).xyz;
 
     // Ray-marching loop for emission-absorption
-    for (float t = tNear; t < tFar; t += u_step_length) {
+    float dt = u_step_length;
+    for (float t = tNear; t < tFar; t += dt) {
+
+        // Longer steps far from the camera and in the bricks without detail
+        dt = adaptiveStep(t, (inverse_model * vec4(position, 1.0)).xyz * 0.5 + 0.5, texDir);
 
         // Sample density from the 3D volume texture
 
@@ -128,7 +266,7 @@ void main() {
         }
         else if (u_density_type == 1) {
 
-            density = cnoise(position, u_noise_scale, u_noise_detail);;
+            density = sampleNoise(position);
         } 
         else if (u_density_type == 2) {
 
@@ -136,7 +274,7 @@ void main() {
 
             vec3 texCoords = (localPosition + vec3(1.0)) * 0.5; // Map to [0, 1] range
 
-            density = texture(u_texture, texCoords).x;
+            density = sampleDensity(texCoords, densityLod(t, texDir));
         }
 
         // ------------------ SCATTERING RAY MARCHING ---------------------
@@ -154,10 +292,15 @@ void main() {
         vec3 position2 = rayOrigin2;
         float light_thickness = 0.0;
         float density2 = 0.0;
+        vec3 texDir2 = 0.5 * (inverse_model * vec4(rayDir2, 0.0)).xyz;
 
         
         // Second ray-marching
-        for (float t = 0; t < tFar2; t += u_step_length) {
+        float dt2 = u_step_length;
+        for (float t2 = 0; t2 < tFar2; t2 += dt2) {
+
+            // The steps and the level grow along the light ray, from the sample of the camera ray
+            dt2 = adaptiveStep(t2, (inverse_model * vec4(position2, 1.0)).xyz * 0.5 + 0.5, texDir2);
 
             // Sample density from the 3D volume texture
 
@@ -167,7 +310,7 @@ void main() {
             }
             else if (u_density_type == 1) {
 
-                density2 = cnoise(position2, u_noise_scale, u_noise_detail);;
+                density2 = sampleNoise(position2);
             } 
             else if (u_density_type == 2) {
 
@@ -175,13 +318,17 @@ void main() {
 
                 vec3 texCoords2 = (localPosition2 + vec3(1.0)) * 0.5; // Map to [0, 1] range
 
-                density2 = texture(u_texture, texCoords2).x;
+                density2 = sampleDensity(texCoords2, densityLod(t2, texDir2));
             }
 
-            light_thickness += density2 * u_step_length;
+            light_thickness += density2 * dt2;
 
-            position2 += rayDir2 * u_step_length;
+            position2 += rayDir2 * dt2;
+            samples++;
 
+            // The light that gets here is already negligible
+            if (exp(-light_thickness * 100) < u_min_transmittance)
+                break;
         }
 
         // ----------------------------------------------------------------
@@ -198,16 +345,28 @@ void main() {
 
         vec4 scattering_light = scattering * u_light_color;
 
-        //sum += transmittance * (radiance + scattering_light) * u_step_length;
-        sum += (radiance + scattering_light) * u_step_length;
+        // Front to back, the light of this sample is attenuated by everything before it
+        sum += exp(-thickness) * (radiance + scattering_light) * dt;
 
         // Advance position along the ray
-        position += rayDir * u_step_length;
+        position += rayDir * dt;
+        samples++;
 
         // Accumulate optical thickness for background blending
-        thickness += absorption * u_step_length;
+        thickness += absorption * dt;
+
+        // Nothing behind this point reaches the camera
+        if (exp(-thickness) < u_min_transmittance)
+            break;
+    }
+
+    if (u_ray_stats) {
+        atomicAdd(ray_count, 1u);
+        atomicAdd(sample_count, uint(samples));
     }
 
     // Final color calculation, combining accumulated radiance and background light
-    FragColor = (1- exp(-thickness))*sum + u_background_light * exp(-thickness);
+    float transmittance = exp(-thickness);
+    FragColor = sum + u_background_light * transmittance;
+    FragColor.a = 1.0 - transmittance + u_background_light.a * transmittance; // Coverage, so it can be composited over the scene
 }
\ No newline at end of file
@@ -0,0 +1,13 @@
+#version 450 core
+
+in vec3 a_vertex;
+in vec2 a_uv;
+
+out vec2 v_uv;
+
+// Fullscreen quad, see Mesh::getQuad
+void main()
+{
+	v_uv = a_uv;
+	gl_Position = vec4(a_vertex.xy, 0.0, 1.0);
+}
@@ -0,0 +1,17 @@
+#version 450 core
+
+uniform sampler2D u_depth_texture; // Depth of the opaque scene at full resolution
+uniform int u_scale;
+
+void main()
+{
+    // Farthest depth of the pixels of the block, the upsampling rejects the texels whose depth does not match
+    ivec2 size = textureSize(u_depth_texture, 0);
+    ivec2 base = ivec2(gl_FragCoord.xy) * u_scale;
+    float depth = 0.0;
+    for (int y = 0; y < u_scale; y++)
+        for (int x = 0; x < u_scale; x++)
+            depth = max(depth, texelFetch(u_depth_texture, min(base + ivec2(x, y), size - 1), 0).x);
+
+    gl_FragDepth = depth;
+}
@@ -0,0 +1,79 @@
+#version 450 core
+
+uniform sampler2D u_volume_texture;  // Premultiplied color and coverage of the volumes this frame
+uniform sampler2D u_volume_depth;    // Opaque depth of the low resolution pass
+uniform sampler2D u_history_texture; // Accumulated color of the previous frame
+uniform sampler2D u_history_depth;   // Linear opaque depth of the previous frame
+
+uniform mat4 u_inverse_viewprojection;
+uniform mat4 u_prev_viewprojection;
+uniform vec3 u_camera_position;
+uniform vec2 u_camera_nearfar;
+uniform vec3 u_box_min; // World bounds of the volumes
+uniform vec3 u_box_max;
+uniform float u_blend;  // Weight of the new samples
+uniform bool u_reset;
+
+layout(location = 0) out vec4 FragColor;
+layout(location = 1) out vec4 FragDepth;
+
+float linearDepth(float depth)
+{
+    float n = u_camera_nearfar.x;
+    float f = u_camera_nearfar.y;
+    float z = depth * 2.0 - 1.0;
+    return 2.0 * n * f / (f + n - z * (f - n));
+}
+
+void main()
+{
+    ivec2 texel = ivec2(gl_FragCoord.xy);
+    ivec2 size = textureSize(u_volume_texture, 0);
+    vec4 current = texelFetch(u_volume_texture, texel, 0);
+    float depth = texelFetch(u_volume_depth, texel, 0).x;
+    FragDepth = vec4(linearDepth(depth));
+
+    // World position of the opaque surface behind the pixel
+    vec2 uv = (vec2(texel) + 0.5) / vec2(size);
+    vec4 clip = u_inverse_viewprojection * vec4(uv * 2.0 - 1.0, depth * 2.0 - 1.0, 1.0);
+    vec3 opaque = clip.xyz / clip.w;
+
+    // The volume is reprojected from the middle of the ray inside its bounds, the opaque surface when it misses them
+    vec3 rayDir = normalize(opaque - u_camera_position);
+    vec3 tMin = (u_box_min - u_camera_position) / rayDir;
+    vec3 tMax = (u_box_max - u_camera_position) / rayDir;
+    vec3 t1 = min(tMin, tMax);
+    vec3 t2 = max(tMin, tMax);
+    float tNear = max(max(max(t1.x, t1.y), t1.z), 0.0);
+    float tFar = min(min(min(t2.x, t2.y), t2.z), distance(opaque, u_camera_position));
+    vec3 position = tNear < tFar ? u_camera_position + rayDir * (tNear + tFar) * 0.5 : opaque;
+
+    vec4 prev = u_prev_viewprojection * vec4(position, 1.0);
+    vec2 prev_uv = prev.xy / prev.w * 0.5 + 0.5;
+    bool valid = !u_reset && prev.w > 0.0 && all(greaterThanEqual(prev_uv, vec2(0.0))) && all(lessThanEqual(prev_uv, vec2(1.0)));
+
+    // Disocclusion, the opaque surface seen in the history is not the one behind the pixel now
+    if (valid) {
+        vec4 prev_opaque = u_prev_viewprojection * vec4(opaque, 1.0);
+        float history_depth = texture(u_history_depth, prev_opaque.xy / prev_opaque.w * 0.5 + 0.5).x;
+        valid = prev_opaque.w > 0.0 && abs(history_depth - prev_opaque.w) < 0.1 * prev_opaque.w;
+    }
+
+    if (!valid) {
+        FragColor = current;
+        return;
+    }
+
+    // The history is clamped to the colors around the pixel, so stale samples do not leave trails
+    vec4 low = current;
+    vec4 high = current;
+    for (int y = -1; y <= 1; y++)
+        for (int x = -1; x <= 1; x++) {
+            vec4 neighbour = texelFetch(u_volume_texture, clamp(texel + ivec2(x, y), ivec2(0), size - 1), 0);
+            low = min(low, neighbour);
+            high = max(high, neighbour);
+        }
+    vec4 history = clamp(texture(u_history_texture, prev_uv), low, high);
+
+    FragColor = mix(history, current, u_blend);
+}
@@ -0,0 +1,44 @@
+#version 450 core
+
+uniform sampler2D u_volume_texture; // Premultiplied color and coverage of the volumes at low resolution
+uniform sampler2D u_volume_depth;   // Opaque depth used in the low resolution pass
+uniform sampler2D u_scene_depth;    // Opaque depth at full resolution
+uniform vec2 u_camera_nearfar;
+uniform int u_scale;
+
+out vec4 FragColor;
+
+float linearDepth(float depth)
+{
+    float n = u_camera_nearfar.x;
+    float f = u_camera_nearfar.y;
+    float z = depth * 2.0 - 1.0;
+    return 2.0 * n * f / (f + n - z * (f - n));
+}
+
+void main()
+{
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    ivec2 size = textureSize(u_volume_texture, 0);
+    float depth = linearDepth(texelFetch(u_scene_depth, pixel, 0).x);
+
+    // Bilinear weights of the four texels around the pixel, lowered for the ones with a different depth,
+    // so the volumes do not bleed over the edges of the objects in front of them
+    vec2 coord = (vec2(pixel) + 0.5) / float(u_scale) - 0.5;
+    ivec2 base = ivec2(floor(coord));
+    vec2 f = coord - vec2(base);
+
+    vec4 color = vec4(0.0);
+    float total = 0.0;
+    for (int i = 0; i < 4; i++) {
+        ivec2 offset = ivec2(i & 1, i >> 1);
+        ivec2 texel = clamp(base + offset, ivec2(0), size - 1);
+        float bilinear = mix(1.0 - f.x, f.x, float(offset.x)) * mix(1.0 - f.y, f.y, float(offset.y));
+        float difference = abs(linearDepth(texelFetch(u_volume_depth, texel, 0).x) - depth) / depth;
+        float weight = (bilinear + 0.001) / (difference + 0.001);
+        color += texelFetch(u_volume_texture, texel, 0) * weight;
+        total += weight;
+    }
+
+    FragColor = color / total;
+}
@@ -1,6 +1,8 @@
 #include "application.h"
+#include "graphics/fbo.h"
 
 #include <algorithm>
+#include <cfloat>
 
 
 bool render_wireframe = false;
@@ -22,6 +24,29 @@ void Application::init(GLFWwindow* window)
 
     this->flag_grid = false;
     this->flag_wireframe = false;
+    this->flag_culling = true;
+    this->num_visible_nodes = this->num_culled_nodes = 0;
+    this->culling_time = 0.0;
+
+    this->volume_resolution = 0;
+    this->volume_pass = false;
+    this->volume_fbo = nullptr;
+    this->scene_depth = nullptr;
+    this->volume_opaque_depth = nullptr;
+    this->volume_depth_shader = Shader::Get("res/shaders/screen.vs", "res/shaders/volume_depth.fs");
+    this->volume_upsample_shader = Shader::Get("res/shaders/screen.vs", "res/shaders/volume_upsample.fs");
+    this->flag_temporal = false;
+    this->temporal_blend = 0.25f;
+    this->temporal_step_scale = 4.0f;
+    this->volume_jitter = 0.0f;
+    this->volume_step_scale = 1.0f;
+    this->history_fbo[0] = this->history_fbo[1] = nullptr;
+    this->history_index = 0;
+    this->history_valid = false;
+    this->volume_temporal_shader = Shader::Get("res/shaders/screen.vs", "res/shaders/volume_temporal.fs");
+    this->gpu_frame_time[0] = this->gpu_frame_time[1] = this->gpu_frame_time[2] = 0.0f;
+    this->time_queries[0] = this->time_queries[1] = 0;
+    this->frame = 0;
 
     this->ambient_light = glm::vec4(1, 1, 1, 1.0f);
 
@@ -80,6 +105,7 @@ void Application::init(GLFWwindow* window)
     // ///////////////////// LAB 5 ///////////////////////// //
 
     SceneNode* volume = new SceneNode("Isosurface");
+    volume->type = NODE_VOLUME;
     volume->mesh = Mesh::Get("res/meshes/cube.obj");
 
     IsosurfaceMaterial* mat = new IsosurfaceMaterial();
@@ -140,6 +166,23 @@ void Application::update(float dt)
 
 void Application::render()
 {
+    // gpu time of the frame before the last one, its query is already finished
+    if (!this->time_queries[0])
+        glGenQueries(2, this->time_queries);
+    int query = this->frame % 2;
+    if (this->frame >= 2) {
+        GLuint64 elapsed = 0;
+        glGetQueryObjectui64v(this->time_queries[query], GL_QUERY_RESULT, &elapsed);
+        float& time = this->gpu_frame_time[this->time_query_resolution[query]];
+        time = time > 0.0f ? time * 0.95f + elapsed * 1e-6f * 0.05f : elapsed * 1e-6f;
+    }
+    glBeginQuery(GL_TIME_ELAPSED, this->time_queries[query]);
+    this->time_query_resolution[query] = this->volume_resolution;
+    this->frame++;
+
+    // samples per ray of the last frame
+    StandardMaterial::updateRayStats();
+
     // set the clear color (the background color)
     glClearColor(background_light.x, background_light.y, background_light.z, 1.0f);
 
@@ -150,16 +193,179 @@ void Application::render()
     glEnable(GL_DEPTH_TEST);
     glEnable(GL_CULL_FACE);
 
+    // frustum culling, nodes without mesh are always rendered
+    double start = glfwGetTime();
+    this->culling_batch.clear();
+    for (auto& node : this->node_list) {
+        if (node->mesh)
+            this->culling_batch.add(node->model, node->mesh->box);
+        else
+            this->culling_batch.add(node->model, BoundingBox(glm::vec3(0.f), glm::vec3(1e20f)));
+    }
+    this->num_visible_nodes = cullBoxes(this->culling_batch, this->camera->frustum_planes);
+    this->num_culled_nodes = (int)this->node_list.size() - this->num_visible_nodes;
+    this->culling_time = glfwGetTime() - start;
+
+    // at lower resolution or accumulating the volumes are drawn offscreen after the opaque nodes
+    bool offscreen = this->volume_resolution || this->flag_temporal;
+    if (!this->flag_temporal)
+        this->history_valid = false;
+
+    std::vector<SceneNode*> volumes;
     for (unsigned int i = 0; i < this->node_list.size(); i++)
     {
-        
-        this->node_list[i]->render(this->camera);
+        if (this->flag_culling && !this->culling_batch.visible[i]) continue;
+
+        // the surface meshes of the volumes are opaque, they are drawn now and written to the scene depth
+        SceneNode* node = this->node_list[i];
+        if (offscreen && node->type == NODE_VOLUME && !(node->material && node->material->isOpaque()))
+            volumes.push_back(node);
+        else
+            node->render(this->camera);
 
-        if (this->flag_wireframe) this->node_list[i]->renderWireframe(this->camera);
+        if (this->flag_wireframe) node->renderWireframe(this->camera);
     }
 
+    if (volumes.size()) renderVolumes(volumes);
+
     // Draw the floor grid
     if (this->flag_grid) drawGrid();
+
+    glEndQuery(GL_TIME_ELAPSED);
+}
+
+void Application::renderVolumes(const std::vector<SceneNode*>& volumes)
+{
+    int scale = 1 << this->volume_resolution;
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    int width = viewport[2], height = viewport[3];
+
+    // depth of the opaque scene, copied from the framebuffer
+    if (!this->scene_depth || this->scene_depth->width != width || this->scene_depth->height != height) {
+        delete this->scene_depth;
+        this->scene_depth = new Texture(width, height, GL_DEPTH_COMPONENT, GL_FLOAT, false, NULL, GL_DEPTH_COMPONENT24);
+    }
+    glBindTexture(GL_TEXTURE_2D, this->scene_depth->texture_id);
+    glCopyTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, viewport[0], viewport[1], width, height);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    int volume_width = std::max(width / scale, 1), volume_height = std::max(height / scale, 1);
+    if (!this->volume_fbo)
+        this->volume_fbo = new FBO();
+    if (this->volume_fbo->width != volume_width || this->volume_fbo->height != volume_height)
+        this->volume_fbo->create(volume_width, volume_height, 1, GL_RGBA, GL_FLOAT, true, GL_RGBA16F);
+
+    this->volume_fbo->bind();
+    glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+    // opaque depth at low resolution, so the volumes behind the objects are discarded by the depth test
+    GLint depth_func;
+    glGetIntegerv(GL_DEPTH_FUNC, &depth_func);
+    glDepthFunc(GL_ALWAYS);
+    glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+    this->volume_depth_shader->enable();
+    this->volume_depth_shader->setUniform("u_depth_texture", this->scene_depth, 0);
+    this->volume_depth_shader->setUniform("u_scale", scale);
+    Mesh::getQuad()->render(GL_TRIANGLES);
+    this->volume_depth_shader->disable();
+    glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+    glDepthFunc(depth_func);
+
+    // copy of the low resolution opaque depth, it is what the upsampling compares
+    if (!this->volume_opaque_depth || this->volume_opaque_depth->width != volume_width || this->volume_opaque_depth->height != volume_height) {
+        delete this->volume_opaque_depth;
+        this->volume_opaque_depth = new Texture(volume_width, volume_height, GL_DEPTH_COMPONENT, GL_FLOAT, false, NULL, GL_DEPTH_COMPONENT24);
+    }
+    glBindTexture(GL_TEXTURE_2D, this->volume_opaque_depth->texture_id);
+    glCopyTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 0, 0, volume_width, volume_height);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    // the proxies are depth tested and write their depth, so the nearest fragment of overlapping volumes
+    // (or the surface of a mesh) is kept regardless of the order of the nodes
+    if (this->flag_temporal) {
+        this->volume_jitter = std::max(fmodf(this->frame * 0.618034f, 1.0f), 0.001f);
+        this->volume_step_scale = this->temporal_step_scale;
+    }
+    this->volume_pass = true;
+    for (SceneNode* node : volumes)
+        node->render(this->camera);
+    this->volume_pass = false;
+    this->volume_jitter = 0.0f;
+    this->volume_step_scale = 1.0f;
+
+    this->volume_fbo->unbind();
+
+    Texture* volume_texture = this->volume_fbo->color_textures[0];
+    if (this->flag_temporal)
+        volume_texture = resolveTemporal(volumes);
+
+    // upsample and composite the premultiplied volumes over the scene
+    glDisable(GL_DEPTH_TEST);
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+    this->volume_upsample_shader->enable();
+    this->volume_upsample_shader->setUniform("u_volume_texture", volume_texture, 0);
+    this->volume_upsample_shader->setUniform("u_volume_depth", this->volume_opaque_depth, 1);
+    this->volume_upsample_shader->setUniform("u_scene_depth", this->scene_depth, 2);
+    this->volume_upsample_shader->setUniform("u_camera_nearfar", glm::vec2(this->camera->near_plane, this->camera->far_plane));
+    this->volume_upsample_shader->setUniform("u_scale", scale);
+    Mesh::getQuad()->render(GL_TRIANGLES);
+    this->volume_upsample_shader->disable();
+    glDisable(GL_BLEND);
+    glEnable(GL_DEPTH_TEST);
+}
+
+// blends the volumes of this frame with the history, returns the accumulated texture
+Texture* Application::resolveTemporal(const std::vector<SceneNode*>& volumes)
+{
+    int width = this->volume_fbo->width, height = this->volume_fbo->height;
+    for (int i = 0; i < 2; ++i) {
+        if (!this->history_fbo[i])
+            this->history_fbo[i] = new FBO();
+        if (this->history_fbo[i]->width != width || this->history_fbo[i]->height != height) {
+            this->history_fbo[i]->create(width, height, 2, GL_RGBA, GL_FLOAT, false, GL_RGBA16F);
+            this->history_valid = false;
+        }
+    }
+
+    // world bounds of the volumes, the reprojection uses the middle of the rays inside them
+    glm::vec3 box_min(FLT_MAX), box_max(-FLT_MAX);
+    for (SceneNode* node : volumes) {
+        if (!node->mesh) continue;
+        BoundingBox box = transformBoundingBox(node->model, node->mesh->box);
+        box_min = glm::min(box_min, box.center - box.halfsize);
+        box_max = glm::max(box_max, box.center + box.halfsize);
+    }
+
+    FBO* history = this->history_fbo[this->history_index];
+    FBO* target = this->history_fbo[1 - this->history_index];
+
+    glDisable(GL_DEPTH_TEST);
+    target->bind();
+    this->volume_temporal_shader->enable();
+    this->volume_temporal_shader->setUniform("u_volume_texture", this->volume_fbo->color_textures[0], 0);
+    this->volume_temporal_shader->setUniform("u_volume_depth", this->volume_opaque_depth, 1);
+    this->volume_temporal_shader->setUniform("u_history_texture", history->color_textures[0], 2);
+    this->volume_temporal_shader->setUniform("u_history_depth", history->color_textures[1], 3);
+    this->volume_temporal_shader->setUniform("u_inverse_viewprojection", glm::inverse(this->camera->viewprojection_matrix));
+    this->volume_temporal_shader->setUniform("u_prev_viewprojection", this->prev_viewprojection);
+    this->volume_temporal_shader->setUniform("u_camera_position", this->camera->eye);
+    this->volume_temporal_shader->setUniform("u_camera_nearfar", glm::vec2(this->camera->near_plane, this->camera->far_plane));
+    this->volume_temporal_shader->setUniform("u_box_min", box_min);
+    this->volume_temporal_shader->setUniform("u_box_max", box_max);
+    this->volume_temporal_shader->setUniform("u_blend", this->temporal_blend);
+    this->volume_temporal_shader->setUniform("u_reset", !this->history_valid);
+    Mesh::getQuad()->render(GL_TRIANGLES);
+    this->volume_temporal_shader->disable();
+    target->unbind();
+    glEnable(GL_DEPTH_TEST);
+
+    this->history_index = 1 - this->history_index;
+    this->history_valid = true;
+    this->prev_viewprojection = this->camera->viewprojection_matrix;
+    return target->color_textures[0];
 }
 
 void Application::renderGUI()
@@ -238,7 +444,30 @@ void Application::onLeftMouseUp()
     this->lastMousePosition = this->mousePosition;
 }
 
-void Application::onMiddleMouseDown() { }
+void Application::onMiddleMouseDown()
+{
+    // pick the closest node under the mouse
+    glm::vec3 direction = this->camera->getRayDirection(this->mousePosition.x, this->mousePosition.y, (float)this->window_width, (float)this->window_height);
+
+    double start = glfwGetTime();
+    SceneNode* picked = nullptr;
+    float min_distance = this->camera->far_plane;
+    for (auto& node : this->node_list) {
+        if (!node->visible || !node->mesh) continue;
+
+        glm::vec3 collision, normal;
+        if (node->mesh->testRayCollision(node->model, this->camera->eye, direction, collision, normal, min_distance)) {
+            min_distance = glm::length(collision - this->camera->eye);
+            picked = node;
+        }
+    }
+    double time = glfwGetTime() - start;
+
+    if (picked)
+        std::cout << " + Picked: " << picked->name << " at " << min_distance << " (" << time * 1000.0 << "ms)" << std::endl;
+    else
+        std::cout << " + Picked: nothing (" << time * 1000.0 << "ms)" << std::endl;
+}
 
 void Application::onMiddleMouseUp() { }
 
@@ -4,12 +4,15 @@
 #include "framework/camera.h"
 #include "framework/scenenode.h"
 #include "framework/light.h"
+#include "framework/culling.h"
 
 #include "../libraries/easyVDB/src/bbox.h"
 #include "../libraries/easyVDB/src/openvdbReader.h"
 
 #include <glm/vec2.hpp>
 
+class FBO;
+
 class Application
 {
 public:
@@ -26,6 +29,40 @@ public:
 
 	bool flag_grid;
 	bool flag_wireframe;
+	bool flag_culling;
+
+	// frustum culling, filled every frame
+	sCullingBatch culling_batch;
+	int num_visible_nodes;
+	int num_culled_nodes;
+	double culling_time;
+
+	// volumes drawn offscreen at 1/2 or 1/4 of the resolution and upsampled over the opaque scene
+	int volume_resolution; // 0 full, 1 half, 2 quarter
+	bool volume_pass; // the volume materials use a transparent background while it is set
+	FBO* volume_fbo;
+	Texture* scene_depth;
+	Texture* volume_opaque_depth; // opaque depth at the volume resolution, the volume pass writes its own depth
+	Shader* volume_depth_shader;
+	Shader* volume_upsample_shader;
+
+	// temporal accumulation of the volumes, every frame blends jittered samples with the reprojected history
+	bool flag_temporal;
+	float temporal_blend; // weight of the new frame
+	float temporal_step_scale; // longer steps, so fewer samples per frame, while accumulating
+	float volume_jitter; // offset of the first sample of the rays this frame, 0 when not accumulating
+	float volume_step_scale; // step length multiplier of the volume materials this frame
+	FBO* history_fbo[2]; // color and linear opaque depth, read the previous one and write the other
+	int history_index;
+	bool history_valid;
+	glm::mat4 prev_viewprojection;
+	Shader* volume_temporal_shader;
+
+	// gpu time of render() with every volume resolution, smoothed
+	float gpu_frame_time[3];
+	unsigned int time_queries[2];
+	int time_query_resolution[2];
+	int frame;
 
 	bool close = false;
 	bool dragging;
@@ -35,6 +72,8 @@ public:
 	void init(GLFWwindow* window);
 	void update(float dt);
 	void render();
+	void renderVolumes(const std::vector<SceneNode*>& volumes);
+	Texture* resolveTemporal(const std::vector<SceneNode*>& volumes);
 	void renderGUI();
 	void shutdown();
 
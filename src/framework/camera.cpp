@@ -34,6 +34,14 @@ glm::vec3 Camera::projectVector(glm::vec3 pos, bool& negZ)
 		return glm::vec3(result.x, result.y, result.z) / result.w;
 }
 
+glm::vec3 Camera::getRayDirection(float mouse_x, float mouse_y, float window_width, float window_height)
+{
+	// window to normalized device coordinates, in the window y goes down
+	glm::vec4 ndc(mouse_x / window_width * 2.0f - 1.0f, 1.0f - mouse_y / window_height * 2.0f, 1.0f, 1.0f);
+	glm::vec4 far_point = glm::inverse(viewprojection_matrix) * ndc;
+	return glm::normalize(glm::vec3(far_point) / far_point.w - eye);
+}
+
 void Camera::rotate(float angle, const glm::vec3& axis)
 {
 	glm::vec3 front = center - eye;
@@ -235,6 +243,25 @@ void Camera::updateProjectionMatrix()
 void Camera::updateViewProjectionMatrix()
 {
 	viewprojection_matrix = projection_matrix * view_matrix;
+	extractFrustumPlanes();
+}
+
+// Gribb-Hartmann: every plane is the last row of the matrix plus or minus one of the others
+void Camera::extractFrustumPlanes()
+{
+	const glm::mat4& m = viewprojection_matrix;
+	glm::vec4 rows[4];
+	for (int i = 0; i < 4; ++i)
+		rows[i] = glm::vec4(m[0][i], m[1][i], m[2][i], m[3][i]);
+
+	for (int i = 0; i < 3; ++i)
+	{
+		frustum_planes[i * 2] = rows[3] + rows[i];
+		frustum_planes[i * 2 + 1] = rows[3] - rows[i];
+	}
+
+	for (int i = 0; i < 6; ++i)
+		frustum_planes[i] /= glm::length(glm::vec3(frustum_planes[i]));
 }
 
 glm::mat4 Camera::getViewProjectionMatrix()
@@ -36,6 +36,10 @@ public:
 	glm::mat4 projection_matrix;
 	glm::mat4 viewprojection_matrix;
 
+	// Planes of the frustum in world space (left, right, bottom, top, near, far)
+	// xyz is the normal pointing inside and w the distance, a point is inside if dot(N,p) + w >= 0
+	glm::vec4 frustum_planes[6];
+
 	Camera();
 
 	// Setters
@@ -56,6 +60,9 @@ public:
 	// so it does not have to be rendered!
 	glm::vec3 projectVector(glm::vec3 pos, bool& negZ);
 
+	// Direction of the ray that goes from the eye through a pixel of the window
+	glm::vec3 getRayDirection(float mouse_x, float mouse_y, float window_width, float window_height);
+
 	// Set the info for each projection
 	void setPerspective(float fov, float aspect, float near_plane, float far_plane);
 	void setOrthographic(float left, float right, float top, float bottom, float near_plane, float far_plane);
@@ -65,6 +72,7 @@ public:
 	void updateViewMatrix();
 	void updateProjectionMatrix();
 	void updateViewProjectionMatrix();
+	void extractFrustumPlanes();
 
 	glm::mat4 getViewProjectionMatrix();
 
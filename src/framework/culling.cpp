@@ -0,0 +1,128 @@
+#include "culling.h"
+
+#include <cmath>
+
+#include "../graphics/mesh.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_IX86)
+#define CULLING_USE_SSE
+#include <emmintrin.h>
+#endif
+
+void sCullingBatch::clear()
+{
+	for (int i = 0; i < 12; ++i)
+		model[i].clear();
+	for (int i = 0; i < 3; ++i)
+	{
+		center[i].clear();
+		halfsize[i].clear();
+	}
+	visible.clear();
+	count = 0;
+}
+
+void sCullingBatch::add(const glm::mat4& m, const BoundingBox& box)
+{
+	//overwrite the padding added by a previous cullBoxes
+	for (int i = 0; i < 12; ++i)
+		model[i].resize(count);
+	for (int i = 0; i < 3; ++i)
+	{
+		center[i].resize(count);
+		halfsize[i].resize(count);
+	}
+
+	for (int column = 0; column < 4; ++column)
+		for (int row = 0; row < 3; ++row)
+			model[column * 3 + row].push_back(m[column][row]);
+	for (int i = 0; i < 3; ++i)
+	{
+		center[i].push_back(box.center[i]);
+		halfsize[i].push_back(box.halfsize[i]);
+	}
+	count++;
+}
+
+//the world AABB of a transformed box is centered in M*center with halfsize |M|*halfsize (Arvo)
+int cullBoxes(sCullingBatch& batch, const glm::vec4* planes, int num_planes)
+{
+	size_t num_boxes = batch.size();
+	batch.visible.resize(num_boxes);
+	if (!num_boxes)
+		return 0;
+
+	//pad to a multiple of 4, the padding lanes are discarded when storing the results
+	size_t padded = (num_boxes + 3) & ~(size_t)3;
+	for (int i = 0; i < 12; ++i)
+		batch.model[i].resize(padded, 0.0f);
+	for (int i = 0; i < 3; ++i)
+	{
+		batch.center[i].resize(padded, 0.0f);
+		batch.halfsize[i].resize(padded, 0.0f);
+	}
+
+	int num_visible = 0;
+
+#ifdef CULLING_USE_SSE
+	const __m128 sign_mask = _mm_set1_ps(-0.0f);
+	for (size_t i = 0; i < padded; i += 4)
+	{
+		__m128 m[12];
+		for (int k = 0; k < 12; ++k)
+			m[k] = _mm_loadu_ps(&batch.model[k][i]);
+		__m128 c[3], h[3];
+		for (int k = 0; k < 3; ++k)
+		{
+			c[k] = _mm_loadu_ps(&batch.center[k][i]);
+			h[k] = _mm_loadu_ps(&batch.halfsize[k][i]);
+		}
+
+		__m128 world_center[3], world_halfsize[3];
+		for (int row = 0; row < 3; ++row)
+		{
+			world_center[row] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m[row], c[0]), _mm_mul_ps(m[3 + row], c[1])), _mm_add_ps(_mm_mul_ps(m[6 + row], c[2]), m[9 + row]));
+			world_halfsize[row] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_andnot_ps(sign_mask, m[row]), h[0]), _mm_mul_ps(_mm_andnot_ps(sign_mask, m[3 + row]), h[1])), _mm_mul_ps(_mm_andnot_ps(sign_mask, m[6 + row]), h[2]));
+		}
+
+		__m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+		for (int p = 0; p < num_planes; ++p)
+		{
+			const glm::vec4& plane = planes[p];
+			__m128 dist = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(plane.x), world_center[0]), _mm_mul_ps(_mm_set1_ps(plane.y), world_center[1])), _mm_add_ps(_mm_mul_ps(_mm_set1_ps(plane.z), world_center[2]), _mm_set1_ps(plane.w)));
+			__m128 radius = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(fabsf(plane.x)), world_halfsize[0]), _mm_mul_ps(_mm_set1_ps(fabsf(plane.y)), world_halfsize[1])), _mm_mul_ps(_mm_set1_ps(fabsf(plane.z)), world_halfsize[2]));
+			inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(dist, radius), _mm_setzero_ps()));
+		}
+
+		int bits = _mm_movemask_ps(inside);
+		for (size_t lane = 0; lane < 4 && i + lane < num_boxes; ++lane)
+		{
+			batch.visible[i + lane] = (bits >> lane) & 1;
+			num_visible += batch.visible[i + lane];
+		}
+	}
+#else
+	for (size_t i = 0; i < num_boxes; ++i)
+	{
+		float world_center[3], world_halfsize[3];
+		for (int row = 0; row < 3; ++row)
+		{
+			world_center[row] = batch.model[row][i] * batch.center[0][i] + batch.model[3 + row][i] * batch.center[1][i] + batch.model[6 + row][i] * batch.center[2][i] + batch.model[9 + row][i];
+			world_halfsize[row] = fabsf(batch.model[row][i]) * batch.halfsize[0][i] + fabsf(batch.model[3 + row][i]) * batch.halfsize[1][i] + fabsf(batch.model[6 + row][i]) * batch.halfsize[2][i];
+		}
+
+		bool inside = true;
+		for (int p = 0; p < num_planes && inside; ++p)
+		{
+			const glm::vec4& plane = planes[p];
+			float dist = plane.x * world_center[0] + plane.y * world_center[1] + plane.z * world_center[2] + plane.w;
+			float radius = fabsf(plane.x) * world_halfsize[0] + fabsf(plane.y) * world_halfsize[1] + fabsf(plane.z) * world_halfsize[2];
+			inside = dist + radius >= 0.0f;
+		}
+		batch.visible[i] = inside;
+		num_visible += inside;
+	}
+#endif
+
+	return num_visible;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+
+#include <glm/vec3.hpp>
+#include <glm/vec4.hpp>
+#include <glm/matrix.hpp>
+
+class BoundingBox;
+
+//boxes to test against the frustum in SoA layout, so 4 of them are transformed and tested at once
+struct sCullingBatch
+{
+	std::vector<float> model[12]; //affine part of every model, model[column * 3 + row]
+	std::vector<float> center[3];
+	std::vector<float> halfsize[3];
+	std::vector<uint8_t> visible; //result of cullBoxes
+	size_t count = 0; //the arrays may have padding after the boxes
+
+	void clear();
+	void add(const glm::mat4& model, const BoundingBox& box);
+	size_t size() const { return count; }
+};
+
+//transforms every box to world space and tests it against the planes (inside if dot(N,p) + d >= 0)
+//returns the number of visible boxes
+int cullBoxes(sCullingBatch& batch, const glm::vec4* planes, int num_planes = 6);
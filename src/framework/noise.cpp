@@ -0,0 +1,300 @@
+#include "noise.h"
+
+#include <cmath>
+#include <algorithm>
+
+#include "utils.h"
+
+#define NOISE_MAX_OCTAVES 16
+
+#if defined(__AVX512F__)
+#define NOISE_USE_AVX512
+#include <immintrin.h>
+#elif defined(__AVX2__)
+#define NOISE_USE_AVX2
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || defined(_M_IX86)
+#define NOISE_USE_SSE
+#include <emmintrin.h>
+#endif
+
+//the few operations the noise needs for a vector of points, so the batch is written once for every instruction set
+#if defined(NOISE_USE_AVX512)
+#define NOISE_WIDTH 16
+typedef __m512 vfloat;
+static inline vfloat vset(float a) { return _mm512_set1_ps(a); }
+static inline vfloat vload(const float* p) { return _mm512_loadu_ps(p); }
+static inline void vstore(float* p, vfloat a) { _mm512_storeu_ps(p, a); }
+static inline vfloat vadd(vfloat a, vfloat b) { return _mm512_add_ps(a, b); }
+static inline vfloat vsub(vfloat a, vfloat b) { return _mm512_sub_ps(a, b); }
+static inline vfloat vmul(vfloat a, vfloat b) { return _mm512_mul_ps(a, b); }
+static inline vfloat vmin(vfloat a, vfloat b) { return _mm512_min_ps(a, b); }
+static inline vfloat vmax(vfloat a, vfloat b) { return _mm512_max_ps(a, b); }
+static inline vfloat vfloor(vfloat a) { return _mm512_roundscale_ps(a, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC); }
+#elif defined(NOISE_USE_AVX2)
+#define NOISE_WIDTH 8
+typedef __m256 vfloat;
+static inline vfloat vset(float a) { return _mm256_set1_ps(a); }
+static inline vfloat vload(const float* p) { return _mm256_loadu_ps(p); }
+static inline void vstore(float* p, vfloat a) { _mm256_storeu_ps(p, a); }
+static inline vfloat vadd(vfloat a, vfloat b) { return _mm256_add_ps(a, b); }
+static inline vfloat vsub(vfloat a, vfloat b) { return _mm256_sub_ps(a, b); }
+static inline vfloat vmul(vfloat a, vfloat b) { return _mm256_mul_ps(a, b); }
+static inline vfloat vmin(vfloat a, vfloat b) { return _mm256_min_ps(a, b); }
+static inline vfloat vmax(vfloat a, vfloat b) { return _mm256_max_ps(a, b); }
+static inline vfloat vfloor(vfloat a) { return _mm256_floor_ps(a); }
+#elif defined(NOISE_USE_SSE)
+#define NOISE_WIDTH 4
+typedef __m128 vfloat;
+static inline vfloat vset(float a) { return _mm_set1_ps(a); }
+static inline vfloat vload(const float* p) { return _mm_loadu_ps(p); }
+static inline void vstore(float* p, vfloat a) { _mm_storeu_ps(p, a); }
+static inline vfloat vadd(vfloat a, vfloat b) { return _mm_add_ps(a, b); }
+static inline vfloat vsub(vfloat a, vfloat b) { return _mm_sub_ps(a, b); }
+static inline vfloat vmul(vfloat a, vfloat b) { return _mm_mul_ps(a, b); }
+static inline vfloat vmin(vfloat a, vfloat b) { return _mm_min_ps(a, b); }
+static inline vfloat vmax(vfloat a, vfloat b) { return _mm_max_ps(a, b); }
+//SSE2 has no floor: truncate and subtract 1 where that rounded up. From 2^23 every float is already an integer
+//and the conversion overflows at 2^31, so those lanes (and NaN) are kept as they are, like floorf does
+static inline vfloat vfloor(vfloat a)
+{
+	vfloat t = _mm_cvtepi32_ps(_mm_cvttps_epi32(a));
+	t = _mm_sub_ps(t, _mm_and_ps(_mm_cmpgt_ps(t, a), _mm_set1_ps(1.0f)));
+	vfloat fractional = _mm_cmplt_ps(_mm_andnot_ps(_mm_set1_ps(-0.0f), a), _mm_set1_ps(8388608.0f));
+	return _mm_or_ps(_mm_and_ps(fractional, t), _mm_andnot_ps(fractional, a));
+}
+#else
+#define NOISE_WIDTH 1
+typedef float vfloat;
+static inline vfloat vset(float a) { return a; }
+static inline vfloat vload(const float* p) { return *p; }
+static inline void vstore(float* p, vfloat a) { *p = a; }
+static inline vfloat vadd(vfloat a, vfloat b) { return a + b; }
+static inline vfloat vsub(vfloat a, vfloat b) { return a - b; }
+static inline vfloat vmul(vfloat a, vfloat b) { return a * b; }
+static inline vfloat vmin(vfloat a, vfloat b) { return std::min(a, b); }
+static inline vfloat vmax(vfloat a, vfloat b) { return std::max(a, b); }
+static inline vfloat vfloor(vfloat a) { return floorf(a); }
+#endif
+
+static inline float fract(float x)
+{
+	return x - floorf(x);
+}
+
+float hashNoise(float n)
+{
+	return fract(n * 17.0f * fract(n * 0.3183099f));
+}
+
+float valueNoise(const glm::vec3& x)
+{
+	glm::vec3 p(floorf(x.x), floorf(x.y), floorf(x.z));
+	glm::vec3 w = x - p;
+
+	glm::vec3 u = w * w * w * (w * (w * 6.0f - glm::vec3(15.0f)) + glm::vec3(10.0f));
+
+	float n = p.x + 317.0f * p.y + 157.0f * p.z;
+
+	float a = hashNoise(n + 0.0f);
+	float b = hashNoise(n + 1.0f);
+	float c = hashNoise(n + 317.0f);
+	float d = hashNoise(n + 318.0f);
+	float e = hashNoise(n + 157.0f);
+	float f = hashNoise(n + 158.0f);
+	float g = hashNoise(n + 474.0f);
+	float h = hashNoise(n + 475.0f);
+
+	float k0 = a;
+	float k1 = b - a;
+	float k2 = c - a;
+	float k3 = e - a;
+	float k4 = a - b - c + d;
+	float k5 = a - c - e + g;
+	float k6 = a - b - e + f;
+	float k7 = -a + b + c - d + e - f - g + h;
+
+	return -1.0f + 2.0f * (k0 + k1 * u.x + k2 * u.y + k3 * u.z + k4 * u.x * u.y + k5 * u.y * u.z + k6 * u.z * u.x + k7 * u.x * u.y * u.z);
+}
+
+float fractalNoise(const glm::vec3& p, float detail)
+{
+	float fscale = 1.0f;
+	float amp = 1.0f;
+	float sum = 0.0f;
+	int n = (int)std::clamp(detail, 0.0f, 16.0f);
+
+	for (int i = 0; i <= std::min(n, NOISE_MAX_OCTAVES); i++)
+	{
+		sum += valueNoise(fscale * p) * amp;
+		amp *= 0.5f;
+		fscale *= 2.0f;
+	}
+	return sum;
+}
+
+float cnoise(const glm::vec3& p, float scale, float detail)
+{
+	return std::clamp(fractalNoise(p * scale, detail), 0.0f, 1.0f);
+}
+
+static void fbmBatch(const float* x, const float* y, const float* z, int count, float scale, int octaves, bool partial, float* result);
+
+//calls batch with the rows of voxel centers
+template<typename T>
+static void bakeVolume(int resolution, const glm::vec3& min, const glm::vec3& max, std::vector<float>& data, T batch)
+{
+	data.resize((size_t)resolution * resolution * resolution);
+	glm::vec3 voxel = (max - min) / (float)resolution;
+
+	//x of every voxel of a row, y and z are the same for the whole row
+	std::vector<float> xs(resolution);
+	for (int x = 0; x < resolution; ++x)
+		xs[x] = min.x + (x + 0.5f) * voxel.x;
+
+	parallelFor(resolution, [&](int begin, int end) {
+		std::vector<float> ys(resolution), zs(resolution);
+		for (int z = begin; z < end; ++z)
+			for (int y = 0; y < resolution; ++y)
+			{
+				std::fill(ys.begin(), ys.end(), min.y + (y + 0.5f) * voxel.y);
+				std::fill(zs.begin(), zs.end(), min.z + (z + 0.5f) * voxel.z);
+				batch(&xs[0], &ys[0], &zs[0], resolution, &data[((size_t)z * resolution + y) * resolution]);
+			}
+	});
+}
+
+void bakeNoise(int resolution, const glm::vec3& min, const glm::vec3& max, float scale, float detail, std::vector<float>& data)
+{
+	bakeVolume(resolution, min, max, data, [&](const float* x, const float* y, const float* z, int count, float* result) {
+		cnoiseBatch(x, y, z, count, scale, detail, result);
+	});
+}
+
+int getBakeableOctaves(int resolution, float size, float scale, float detail)
+{
+	//octave i has scale * 2^i periods per unit
+	int total = std::min((int)std::clamp(detail, 0.0f, 16.0f), NOISE_MAX_OCTAVES) + 1;
+	int octaves = 0;
+	while (octaves < total && 4.0f * size * scale * (float)(1 << octaves) <= resolution)
+		octaves++;
+	return octaves;
+}
+
+void bakeNoiseOctaves(int resolution, const glm::vec3& min, const glm::vec3& max, float scale, int octaves, std::vector<float>& data)
+{
+	bakeVolume(resolution, min, max, data, [&](const float* x, const float* y, const float* z, int count, float* result) {
+		fbmBatch(x, y, z, count, scale, octaves, true, result);
+	});
+}
+
+int getNoiseBatchWidth()
+{
+	return NOISE_WIDTH;
+}
+
+static inline vfloat vfract(vfloat x)
+{
+	return vsub(x, vfloor(x));
+}
+
+static inline vfloat vhashNoise(vfloat n)
+{
+	return vfract(vmul(vmul(n, vset(17.0f)), vfract(vmul(n, vset(0.3183099f)))));
+}
+
+//valueNoise of NOISE_WIDTH points, every operation in the same order as the scalar one
+static inline vfloat vvalueNoise(vfloat x, vfloat y, vfloat z)
+{
+	vfloat px = vfloor(x), py = vfloor(y), pz = vfloor(z);
+	vfloat w[3] = { vsub(x, px), vsub(y, py), vsub(z, pz) };
+
+	vfloat u[3];
+	for (int i = 0; i < 3; ++i)
+		u[i] = vmul(vmul(vmul(w[i], w[i]), w[i]), vadd(vmul(w[i], vsub(vmul(w[i], vset(6.0f)), vset(15.0f))), vset(10.0f)));
+
+	vfloat n = vadd(vadd(px, vmul(vset(317.0f), py)), vmul(vset(157.0f), pz));
+
+	vfloat a = vhashNoise(vadd(n, vset(0.0f)));
+	vfloat b = vhashNoise(vadd(n, vset(1.0f)));
+	vfloat c = vhashNoise(vadd(n, vset(317.0f)));
+	vfloat d = vhashNoise(vadd(n, vset(318.0f)));
+	vfloat e = vhashNoise(vadd(n, vset(157.0f)));
+	vfloat f = vhashNoise(vadd(n, vset(158.0f)));
+	vfloat g = vhashNoise(vadd(n, vset(474.0f)));
+	vfloat h = vhashNoise(vadd(n, vset(475.0f)));
+
+	vfloat k0 = a;
+	vfloat k1 = vsub(b, a);
+	vfloat k2 = vsub(c, a);
+	vfloat k3 = vsub(e, a);
+	vfloat k4 = vadd(vsub(vsub(a, b), c), d);
+	vfloat k5 = vadd(vsub(vsub(a, c), e), g);
+	vfloat k6 = vadd(vsub(vsub(a, b), e), f);
+	vfloat k7 = vadd(vadd(vsub(vset(0.0f), a), b), c);
+	k7 = vadd(vsub(k7, d), e);
+	k7 = vadd(vsub(vsub(k7, f), g), h);
+
+	vfloat sum = vadd(k0, vmul(k1, u[0]));
+	sum = vadd(sum, vmul(k2, u[1]));
+	sum = vadd(sum, vmul(k3, u[2]));
+	sum = vadd(sum, vmul(vmul(k4, u[0]), u[1]));
+	sum = vadd(sum, vmul(vmul(k5, u[1]), u[2]));
+	sum = vadd(sum, vmul(vmul(k6, u[2]), u[0]));
+	sum = vadd(sum, vmul(vmul(vmul(k7, u[0]), u[1]), u[2]));
+	return vadd(vset(-1.0f), vmul(vset(2.0f), sum));
+}
+
+void cnoiseBatch(const float* x, const float* y, const float* z, int count, float scale, float detail, float* result)
+{
+	fbmBatch(x, y, z, count, scale, std::min((int)std::clamp(detail, 0.0f, 16.0f), NOISE_MAX_OCTAVES) + 1, false, result);
+}
+
+//sum of the first octaves, clamped like cnoise or mapped from [-2, 2] to [0, 1] when partial
+static void fbmBatch(const float* x, const float* y, const float* z, int count, float scale, int octaves, bool partial, float* result)
+{
+	//the last points are copied to a full vector
+	float tail[3][NOISE_WIDTH], tail_result[NOISE_WIDTH];
+	for (int i = 0; i < count; i += NOISE_WIDTH)
+	{
+		const float* px = x + i;
+		const float* py = y + i;
+		const float* pz = z + i;
+		int num = std::min(count - i, NOISE_WIDTH);
+		if (num < NOISE_WIDTH)
+		{
+			for (int k = 0; k < NOISE_WIDTH; ++k)
+			{
+				tail[0][k] = x[i + std::min(k, num - 1)];
+				tail[1][k] = y[i + std::min(k, num - 1)];
+				tail[2][k] = z[i + std::min(k, num - 1)];
+			}
+			px = tail[0]; py = tail[1]; pz = tail[2];
+		}
+
+		vfloat vscale = vset(scale);
+		vfloat p[3] = { vmul(vload(px), vscale), vmul(vload(py), vscale), vmul(vload(pz), vscale) };
+		vfloat sum = vset(0.0f);
+		float fscale = 1.0f, amp = 1.0f;
+		for (int octave = 0; octave < octaves; ++octave)
+		{
+			vfloat s = vset(fscale);
+			sum = vadd(sum, vmul(vvalueNoise(vmul(s, p[0]), vmul(s, p[1]), vmul(s, p[2])), vset(amp)));
+			amp *= 0.5f;
+			fscale *= 2.0f;
+		}
+		if (partial)
+			sum = vadd(vmul(sum, vset(0.25f)), vset(0.5f));
+		else
+			sum = vmin(vmax(sum, vset(0.0f)), vset(1.0f));
+
+		if (num < NOISE_WIDTH)
+		{
+			vstore(tail_result, sum);
+			for (int k = 0; k < num; ++k)
+				result[i + k] = tail_result[k];
+		}
+		else
+			vstore(result + i, sum);
+	}
+}
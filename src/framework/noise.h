@@ -0,0 +1,30 @@
+#pragma once
+
+#include <vector>
+
+#include <glm/vec3.hpp>
+
+//CPU version of the value noise and the fBm of the volume shaders (hash1, noise, fractal_noise and cnoise),
+//with the same float operations so the results agree with the GPU within rounding
+
+float hashNoise(float n);
+float valueNoise(const glm::vec3& x); //in [-1, 1]
+float fractalNoise(const glm::vec3& p, float detail); //detail + 1 octaves, at most 17
+float cnoise(const glm::vec3& p, float scale, float detail); //fBm of p * scale clamped to [0, 1]
+
+//number of points evaluated at once by cnoiseBatch: 16 with AVX-512, 8 with AVX2, 4 with SSE2, 1 without them
+int getNoiseBatchWidth();
+
+//cnoise of count points given in separate x, y and z arrays, with the widest vector instructions enabled in the compiler.
+//the operations are the same ones in the same order, so the results are equal to cnoise unless the compiler fuses its multiply-adds
+void cnoiseBatch(const float* x, const float* y, const float* z, int count, float scale, float detail, float* result);
+
+//cnoise at the centers of the resolution^3 voxels of the box [min, max], x first. The slices are split between threads
+void bakeNoise(int resolution, const glm::vec3& min, const glm::vec3& max, float scale, float detail, std::vector<float>& data);
+
+//first octaves of the fBm (there are detail + 1) whose period is at least 4 voxels of a resolution^3 texture over a box of the size
+int getBakeableOctaves(int resolution, float size, float scale, float detail);
+
+//like bakeNoise with only the first octaves of the fBm and without the clamp, the sum is mapped from [-2, 2] to [0, 1]
+//so every volume format can store it. The shaders add the finer octaves to it and clamp
+void bakeNoiseOctaves(int resolution, const glm::vec3& min, const glm::vec3& max, float scale, int octaves, std::vector<float>& data);
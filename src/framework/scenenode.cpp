@@ -28,8 +28,21 @@ SceneNode::~SceneNode() { }
 
 void SceneNode::render(Camera* camera)
 {
-	if (this->material && this->visible)
+	if (this->material && this->visible) {
+		// use the simplified version of the mesh that looks the same from here, or only its visible meshlets
+		if (this->mesh) {
+			this->mesh->current_lod = this->mesh->selectLOD(this->model, camera, (float)Application::instance->window_height);
+			if (this->mesh->current_lod == 0 && Mesh::use_meshlet_culling)
+				this->mesh->cullMeshlets(this->model, camera);
+		}
+
 		this->material->render(this->mesh, this->model, camera);
+
+		if (this->mesh) {
+			this->mesh->current_lod = 0;
+			this->mesh->draw_visible_meshlets = false;
+		}
+	}
 }
 
 void SceneNode::renderWireframe(Camera* camera)
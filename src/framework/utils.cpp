@@ -4,6 +4,9 @@
 	#include <windows.h>
 #else
 	#include <sys/time.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <fcntl.h>
 #endif
 
 #include "includes.h"
@@ -15,6 +18,12 @@
 
 #include <glm/gtx/transform.hpp>
 
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <algorithm>
+
 long getTime()
 {
 	#ifdef _WIN32
@@ -26,6 +35,118 @@ long getTime()
 	#endif
 }
 
+static thread_local bool in_pool = false; //set while the thread runs ranges of the pool
+
+//threads created by the first parallelFor and kept waiting for the next ones, so the calls do not pay their creation.
+//the ranges of a call are taken in order by the workers and the calling thread
+struct sWorkerPool
+{
+	std::vector<std::thread> workers;
+	std::mutex busy; //held by the thread whose call is running in the pool
+	std::mutex mutex;
+	std::condition_variable start, done;
+	const std::function<void(int begin, int end)>* func = NULL;
+	int count = 0;
+	int range = 0;
+	std::atomic<int> next{ 0 }; //first element of the next range
+	int pending = 0; //workers that have not finished the call
+	unsigned int call = 0;
+	bool quit = false;
+
+	~sWorkerPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			quit = true;
+		}
+		start.notify_all();
+		for (std::thread& worker : workers)
+			worker.join();
+	}
+
+	void runRanges()
+	{
+		for (int begin = next.fetch_add(range); begin < count; begin = next.fetch_add(range))
+			(*func)(begin, std::min(begin + range, count));
+	}
+
+	void work()
+	{
+		in_pool = true;
+		unsigned int last_call = 0;
+		std::unique_lock<std::mutex> lock(mutex);
+		while (true)
+		{
+			start.wait(lock, [&] { return quit || call != last_call; });
+			if (quit)
+				return;
+			last_call = call;
+			lock.unlock();
+			runRanges();
+			lock.lock();
+			if (--pending == 0)
+				done.notify_one();
+		}
+	}
+
+	void run(int count, int range, const std::function<void(int begin, int end)>& func)
+	{
+		if (workers.empty())
+			for (int i = 1; i < (int)std::max(2u, std::thread::hardware_concurrency()); ++i)
+				workers.emplace_back(&sWorkerPool::work, this);
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			this->func = &func;
+			this->count = count;
+			this->range = range;
+			this->next = 0;
+			this->pending = (int)workers.size();
+			this->call++;
+		}
+		start.notify_all();
+		in_pool = true;
+		runRanges();
+		in_pool = false;
+
+		std::unique_lock<std::mutex> lock(mutex);
+		done.wait(lock, [&] { return pending == 0; });
+	}
+};
+
+void parallelFor(int count, const std::function<void(int begin, int end)>& func, int min_range)
+{
+	int num_threads = std::max(1, (int)std::thread::hardware_concurrency());
+	num_threads = std::min(num_threads, count / std::max(min_range, 1));
+	if (num_threads <= 1)
+	{
+		if (count > 0)
+			func(0, count);
+		return;
+	}
+	int range = (count + num_threads - 1) / num_threads;
+
+	static sWorkerPool pool;
+	if (!in_pool)
+	{
+		std::unique_lock<std::mutex> busy(pool.busy, std::try_to_lock);
+		if (busy.owns_lock())
+		{
+			pool.run(count, range, func);
+			return;
+		}
+	}
+
+	//called from the ranges of the pool or while another thread uses the pool, the ranges get their own threads
+	//and the calling thread runs the first one
+	std::vector<std::thread> threads;
+	for (int begin = range; begin < count; begin += range)
+		threads.emplace_back(func, begin, std::min(begin + range, count));
+	func(0, range);
+	for (std::thread& thread : threads)
+		thread.join();
+}
+
 float* snapshot()
 {
 	GLint viewport[4];
@@ -155,6 +276,58 @@ bool readFile(const std::string& filename, std::string& content)
 	return true;
 }
 
+bool mapFile(const char* filename, sMappedFile& file)
+{
+	file = sMappedFile();
+#ifdef _WIN32
+	HANDLE handle = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (handle == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER size;
+	HANDLE mapping = NULL;
+	if (GetFileSizeEx(handle, &size) && size.QuadPart > 0)
+		mapping = CreateFileMappingA(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+	CloseHandle(handle);
+	if (!mapping)
+		return false;
+	file.data = (const uint8_t*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!file.data)
+	{
+		CloseHandle(mapping);
+		return false;
+	}
+	file.size = (size_t)size.QuadPart;
+	file.handle = mapping;
+#else
+	int descriptor = open(filename, O_RDONLY);
+	if (descriptor < 0)
+		return false;
+	struct stat info;
+	void* data = MAP_FAILED;
+	if (fstat(descriptor, &info) == 0 && info.st_size > 0)
+		data = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+	close(descriptor);
+	if (data == MAP_FAILED)
+		return false;
+	file.data = (const uint8_t*)data;
+	file.size = (size_t)info.st_size;
+#endif
+	return true;
+}
+
+void unmapFile(sMappedFile& file)
+{
+	if (!file.data)
+		return;
+#ifdef _WIN32
+	UnmapViewOfFile(file.data);
+	CloseHandle(file.handle);
+#else
+	munmap((void*)file.data, file.size);
+#endif
+	file = sMappedFile();
+}
+
 char const* gl_error_string(GLenum const err) noexcept
 {
 	switch (err)
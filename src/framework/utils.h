@@ -7,6 +7,8 @@
 #include <string>
 #include <sstream>
 #include <vector>
+#include <functional>
+#include <cstdint>
 
 #include <glm/vec3.hpp>
 #include <glm/gtx/quaternion.hpp>
@@ -19,10 +21,24 @@ long getTime();
 float* snapshot();
 bool readFile(const std::string& filename, std::string& content);
 
+//read only view of a whole file, its pages are read from the disk when they are touched
+struct sMappedFile
+{
+	const uint8_t* data = NULL;
+	size_t size = 0;
+	void* handle = NULL; //of the mapping, only in windows
+};
+bool mapFile(const char* filename, sMappedFile& file); //false if the file can not be opened or is empty
+void unmapFile(sMappedFile& file);
+
 //generic purposes fuctions
 void drawGrid();
 glm::vec3 transformQuat(const glm::vec3& a, const glm::quat& q);
 
+//splits [0, count) in consecutive ranges of at least min_range and runs them in parallel, one per hardware thread.
+//the ranges run in a pool of threads kept between the calls
+void parallelFor(int count, const std::function<void(int begin, int end)>& func, int min_range = 1);
+
 //check opengl errors
 bool checkGLErrors();
 
@@ -0,0 +1,643 @@
+#include "volume.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include "utils.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_IX86)
+#define VOLUME_USE_SSE
+#include <emmintrin.h>
+#endif
+
+//the four rows of the source under a row of the result: (y0, z0), (y1, z0), (y0, z1) and (y1, z1)
+static inline float reduceColumn(const float* rows[4], int x, eVolumeFilter filter)
+{
+	if (filter == VOLUME_FILTER_MAX)
+		return std::max(std::max(rows[0][x], rows[1][x]), std::max(rows[2][x], rows[3][x]));
+	return ((rows[0][x] + rows[1][x]) + rows[2][x]) + rows[3][x];
+}
+
+static inline int reduceColumn(const uint8_t* rows[4], int x, eVolumeFilter filter)
+{
+	if (filter == VOLUME_FILTER_MAX)
+		return std::max(std::max(rows[0][x], rows[1][x]), std::max(rows[2][x], rows[3][x]));
+	return rows[0][x] + rows[1][x] + rows[2][x] + rows[3][x];
+}
+
+//voxels [begin, end) of a row of the result, adding the columns in the same order as the SSE version
+static void downsampleRow(const float* rows[4], int width, int begin, int end, eVolumeFilter filter, float* result)
+{
+	for (int x = begin; x < end; ++x)
+	{
+		float a = reduceColumn(rows, 2 * x, filter);
+		float b = reduceColumn(rows, std::min(2 * x + 1, width - 1), filter);
+		result[x] = filter == VOLUME_FILTER_MAX ? std::max(a, b) : (a + b) * 0.125f;
+	}
+}
+
+static void downsampleRow(const uint8_t* rows[4], int width, int begin, int end, eVolumeFilter filter, uint8_t* result)
+{
+	for (int x = begin; x < end; ++x)
+	{
+		int a = reduceColumn(rows, 2 * x, filter);
+		int b = reduceColumn(rows, std::min(2 * x + 1, width - 1), filter);
+		result[x] = (uint8_t)(filter == VOLUME_FILTER_MAX ? std::max(a, b) : (a + b + 4) >> 3);
+	}
+}
+
+//returns the first voxel of the row left for the scalar version
+static int downsampleRowSIMD(const float* rows[4], int width, int result_width, eVolumeFilter filter, float* result)
+{
+	int x = 0;
+#ifdef VOLUME_USE_SSE
+	//4 voxels read 8 columns
+	for (; x + 4 <= result_width && 2 * x + 8 <= width; x += 4)
+	{
+		__m128 low[4], high[4];
+		for (int r = 0; r < 4; ++r)
+		{
+			low[r] = _mm_loadu_ps(rows[r] + 2 * x);
+			high[r] = _mm_loadu_ps(rows[r] + 2 * x + 4);
+		}
+		__m128 a, b;
+		if (filter == VOLUME_FILTER_MAX)
+		{
+			a = _mm_max_ps(_mm_max_ps(low[0], low[1]), _mm_max_ps(low[2], low[3]));
+			b = _mm_max_ps(_mm_max_ps(high[0], high[1]), _mm_max_ps(high[2], high[3]));
+		}
+		else
+		{
+			a = _mm_add_ps(_mm_add_ps(_mm_add_ps(low[0], low[1]), low[2]), low[3]);
+			b = _mm_add_ps(_mm_add_ps(_mm_add_ps(high[0], high[1]), high[2]), high[3]);
+		}
+		__m128 even = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+		__m128 odd = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+		if (filter == VOLUME_FILTER_MAX)
+			_mm_storeu_ps(result + x, _mm_max_ps(even, odd));
+		else
+			_mm_storeu_ps(result + x, _mm_mul_ps(_mm_add_ps(even, odd), _mm_set1_ps(0.125f)));
+	}
+#endif
+	return x;
+}
+
+static int downsampleRowSIMD(const uint8_t* rows[4], int width, int result_width, eVolumeFilter filter, uint8_t* result)
+{
+	int x = 0;
+#ifdef VOLUME_USE_SSE
+	//8 voxels read 16 columns, the pairs of columns are reduced in 16 bit lanes
+	const __m128i low_bytes = _mm_set1_epi16(0x00FF);
+	for (; x + 8 <= result_width && 2 * x + 16 <= width; x += 8)
+	{
+		__m128i columns[4];
+		for (int r = 0; r < 4; ++r)
+			columns[r] = _mm_loadu_si128((const __m128i*)(rows[r] + 2 * x));
+
+		__m128i value;
+		if (filter == VOLUME_FILTER_MAX)
+		{
+			__m128i m = _mm_max_epu8(_mm_max_epu8(columns[0], columns[1]), _mm_max_epu8(columns[2], columns[3]));
+			value = _mm_max_epi16(_mm_and_si128(m, low_bytes), _mm_srli_epi16(m, 8));
+		}
+		else
+		{
+			value = _mm_set1_epi16(4);
+			for (int r = 0; r < 4; ++r)
+				value = _mm_add_epi16(value, _mm_add_epi16(_mm_and_si128(columns[r], low_bytes), _mm_srli_epi16(columns[r], 8)));
+			value = _mm_srli_epi16(value, 3);
+		}
+		_mm_storel_epi64((__m128i*)(result + x), _mm_packus_epi16(value, value));
+	}
+#endif
+	return x;
+}
+
+template <typename T>
+static void downsampleVolumeT(const T* data, int width, int height, int depth, eVolumeFilter filter, std::vector<T>& result)
+{
+	int result_width = getVolumeMipSize(width), result_height = getVolumeMipSize(height), result_depth = getVolumeMipSize(depth);
+	result.resize((size_t)result_width * result_height * result_depth);
+
+	parallelFor(result_depth, [&](int begin, int end) {
+		for (int z = begin; z < end; ++z)
+			for (int y = 0; y < result_height; ++y)
+			{
+				size_t y0 = 2 * y, y1 = std::min(2 * y + 1, height - 1);
+				size_t z0 = 2 * z, z1 = std::min(2 * z + 1, depth - 1);
+				const T* rows[4] = {
+					data + (z0 * height + y0) * width, data + (z0 * height + y1) * width,
+					data + (z1 * height + y0) * width, data + (z1 * height + y1) * width };
+				T* row = &result[((size_t)z * result_height + y) * result_width];
+				int x = downsampleRowSIMD(rows, width, result_width, filter, row);
+				downsampleRow(rows, width, x, result_width, filter, row);
+			}
+	});
+}
+
+template <typename T>
+static void buildVolumeMipsT(const T* data, int width, int height, int depth, eVolumeFilter filter, std::vector<std::vector<T>>& levels)
+{
+	levels.clear();
+	while (width > 1 || height > 1 || depth > 1)
+	{
+		levels.emplace_back();
+		downsampleVolumeT(data, width, height, depth, filter, levels.back());
+		data = &levels.back()[0];
+		width = getVolumeMipSize(width);
+		height = getVolumeMipSize(height);
+		depth = getVolumeMipSize(depth);
+	}
+}
+
+void downsampleVolume(const float* data, int width, int height, int depth, eVolumeFilter filter, std::vector<float>& result)
+{
+	downsampleVolumeT(data, width, height, depth, filter, result);
+}
+
+void downsampleVolume(const uint8_t* data, int width, int height, int depth, eVolumeFilter filter, std::vector<uint8_t>& result)
+{
+	downsampleVolumeT(data, width, height, depth, filter, result);
+}
+
+void buildVolumeMips(const float* data, int width, int height, int depth, eVolumeFilter filter, std::vector<std::vector<float>>& levels)
+{
+	buildVolumeMipsT(data, width, height, depth, filter, levels);
+}
+
+void buildVolumeMips(const uint8_t* data, int width, int height, int depth, eVolumeFilter filter, std::vector<std::vector<uint8_t>>& levels)
+{
+	buildVolumeMipsT(data, width, height, depth, filter, levels);
+}
+
+void computeVolumeGradients(const float* data, int width, int height, int depth, eGradientFilter filter, std::vector<float>& result)
+{
+	size_t slice = (size_t)width * height;
+	result.resize(slice * depth * 3);
+
+	parallelFor(depth, [&](int begin, int end) {
+		const float weights[3] = { 1.0f, 2.0f, 1.0f };
+		for (int z = begin; z < end; ++z)
+		{
+			size_t zs[3] = { (size_t)std::max(z - 1, 0), (size_t)z, (size_t)std::min(z + 1, depth - 1) };
+			for (int y = 0; y < height; ++y)
+			{
+				size_t ys[3] = { (size_t)std::max(y - 1, 0), (size_t)y, (size_t)std::min(y + 1, height - 1) };
+				for (int x = 0; x < width; ++x)
+				{
+					size_t xs[3] = { (size_t)std::max(x - 1, 0), (size_t)x, (size_t)std::min(x + 1, width - 1) };
+					auto voxel = [&](int i, int j, int k) { return data[zs[k] * slice + ys[j] * width + xs[i]]; };
+
+					float* gradient = &result[(z * slice + (size_t)y * width + x) * 3];
+					if (filter == GRADIENT_FILTER_SOBEL)
+					{
+						gradient[0] = gradient[1] = gradient[2] = 0.0f;
+						for (int a = 0; a < 3; ++a)
+							for (int b = 0; b < 3; ++b)
+							{
+								float weight = weights[a] * weights[b] / 32.0f; //the weights of a side add 16 and the sides are 2 voxels apart
+								gradient[0] += weight * (voxel(2, a, b) - voxel(0, a, b));
+								gradient[1] += weight * (voxel(a, 2, b) - voxel(a, 0, b));
+								gradient[2] += weight * (voxel(a, b, 2) - voxel(a, b, 0));
+							}
+					}
+					else
+					{
+						gradient[0] = (voxel(2, 1, 1) - voxel(0, 1, 1)) * 0.5f;
+						gradient[1] = (voxel(1, 2, 1) - voxel(1, 0, 1)) * 0.5f;
+						gradient[2] = (voxel(1, 1, 2) - voxel(1, 1, 0)) * 0.5f;
+					}
+				}
+			}
+		}
+	});
+}
+
+void packVolumeNormals(const std::vector<float>& gradients, eNormalFormat format, std::vector<uint8_t>& result)
+{
+	int count = (int)(gradients.size() / 3);
+	result.resize((size_t)count * (format == NORMAL_FORMAT_RGB10A2 ? 4 : 3));
+
+	parallelFor(count, [&](int begin, int end) {
+		for (int i = begin; i < end; ++i)
+		{
+			const float* gradient = &gradients[(size_t)i * 3];
+			float length = sqrtf(gradient[0] * gradient[0] + gradient[1] * gradient[1] + gradient[2] * gradient[2]);
+			float scale = length > 0.0f ? 1.0f / length : 0.0f;
+			if (format == NORMAL_FORMAT_RGB10A2)
+			{
+				uint32_t packed = 3u << 30;
+				for (int c = 0; c < 3; ++c)
+					packed |= (uint32_t)(gradient[c] * scale * 511.5f + 512.0f) << (10 * c);
+				memcpy(&result[(size_t)i * 4], &packed, sizeof(packed));
+			}
+			else
+				for (int c = 0; c < 3; ++c)
+					result[(size_t)i * 3 + c] = (uint8_t)(int8_t)floorf(gradient[c] * scale * 127.0f + 0.5f);
+		}
+	}, 4096);
+}
+
+void computeDistanceField(const float* data, int width, int height, int depth, float threshold, std::vector<float>& result, float margin)
+{
+	size_t slice = (size_t)width * height, count = slice * depth;
+	result.assign(count, (float)(width + height + depth) - margin);
+
+	//every voxel next to the surface is a seed at the closest linear crossing to its neighbours
+	std::vector<float> seeds(count * 3);
+	std::vector<int> nearest(count, -1), next(count);
+	parallelFor(depth, [&](int begin, int end) {
+		for (int z = begin; z < end; ++z)
+			for (int y = 0; y < height; ++y)
+				for (int x = 0; x < width; ++x)
+				{
+					size_t i = z * slice + (size_t)y * width + x;
+					bool inside = data[i] >= threshold;
+					float best = 2.0f;
+					for (int n = 0; n < 6; ++n)
+					{
+						int axis = n >> 1, side = n & 1 ? 1 : -1;
+						int coords[3] = { x, y, z }, sizes[3] = { width, height, depth };
+						coords[axis] += side;
+						if (coords[axis] < 0 || coords[axis] >= sizes[axis])
+							continue;
+						float neighbour = data[(size_t)coords[2] * slice + (size_t)coords[1] * width + coords[0]];
+						if ((neighbour >= threshold) == inside)
+							continue;
+						float t = (threshold - data[i]) / (neighbour - data[i]);
+						if (t >= best)
+							continue;
+						best = t;
+						seeds[i * 3] = (float)x;
+						seeds[i * 3 + 1] = (float)y;
+						seeds[i * 3 + 2] = (float)z;
+						seeds[i * 3 + axis] += side * t;
+						nearest[i] = (int)i;
+					}
+				}
+	});
+
+	//every voxel takes the closest seed of the voxels at the step around it
+	int max_size = std::max(width, std::max(height, depth));
+	std::vector<int> steps;
+	for (int step = 1; step < max_size; step *= 2)
+		steps.insert(steps.begin(), step);
+	steps.push_back(1);
+
+	for (int step : steps)
+	{
+		parallelFor(depth, [&](int begin, int end) {
+			for (int z = begin; z < end; ++z)
+				for (int y = 0; y < height; ++y)
+					for (int x = 0; x < width; ++x)
+					{
+						size_t i = z * slice + (size_t)y * width + x;
+						int best = nearest[i];
+						float best_distance = 0.0f;
+						if (best >= 0)
+						{
+							const float* seed = &seeds[(size_t)best * 3];
+							best_distance = (seed[0] - x) * (seed[0] - x) + (seed[1] - y) * (seed[1] - y) + (seed[2] - z) * (seed[2] - z);
+						}
+						for (int nz = z - step; nz <= z + step; nz += step)
+							for (int ny = y - step; ny <= y + step; ny += step)
+								for (int nx = x - step; nx <= x + step; nx += step)
+								{
+									if (nx < 0 || ny < 0 || nz < 0 || nx >= width || ny >= height || nz >= depth)
+										continue;
+									int candidate = nearest[(size_t)nz * slice + (size_t)ny * width + nx];
+									if (candidate < 0 || candidate == best)
+										continue;
+									const float* seed = &seeds[(size_t)candidate * 3];
+									float distance = (seed[0] - x) * (seed[0] - x) + (seed[1] - y) * (seed[1] - y) + (seed[2] - z) * (seed[2] - z);
+									if (best < 0 || distance < best_distance)
+									{
+										best = candidate;
+										best_distance = distance;
+									}
+								}
+						next[i] = best;
+					}
+		});
+		nearest.swap(next);
+	}
+
+	parallelFor(depth, [&](int begin, int end) {
+		for (size_t i = begin * slice; i < end * slice; ++i)
+		{
+			if (nearest[i] < 0)
+				continue;
+			int x = (int)(i % width), y = (int)((i / width) % height), z = (int)(i / slice);
+			const float* seed = &seeds[(size_t)nearest[i] * 3];
+			float distance = sqrtf((seed[0] - x) * (seed[0] - x) + (seed[1] - y) * (seed[1] - y) + (seed[2] - z) * (seed[2] - z));
+			result[i] = (data[i] >= threshold ? -distance : distance) - margin;
+		}
+	});
+}
+
+const char* getVolumeFormatName(eVolumeFormat format)
+{
+	switch (format)
+	{
+	case VOLUME_FORMAT_R8: return "R8";
+	case VOLUME_FORMAT_R8_BRICK: return "R8 brick";
+	case VOLUME_FORMAT_R16F: return "R16F";
+	case VOLUME_FORMAT_BC4: return "BC4";
+	default: return "unknown";
+	}
+}
+
+static inline float clampUnit(float value)
+{
+	return std::min(std::max(value, 0.0f), 1.0f);
+}
+
+static inline uint8_t quantizeUnit(float value)
+{
+	return (uint8_t)(clampUnit(value) * 255.0f + 0.5f);
+}
+
+uint16_t floatToHalf(float value)
+{
+	uint32_t f;
+	memcpy(&f, &value, sizeof(f));
+	uint32_t sign = f & 0x80000000u;
+	f ^= sign;
+
+	uint32_t result;
+	if (f >= 0x47800000u) //too large for a half, inf or nan
+		result = f > 0x7F800000u ? 0x7E00 : 0x7C00;
+	else if (f < 0x38800000u)
+	{
+		//subnormal, the add rounds the mantissa to the bits that are kept
+		const uint32_t magic_bits = 0x3F000000u;
+		float magic, shifted;
+		memcpy(&magic, &magic_bits, sizeof(magic));
+		memcpy(&shifted, &f, sizeof(shifted));
+		shifted += magic;
+		memcpy(&result, &shifted, sizeof(result));
+		result -= magic_bits;
+	}
+	else
+	{
+		uint32_t odd = (f >> 13) & 1;
+		f += 0xC8000FFFu + odd; //rebias the exponent and round to the nearest even
+		result = f >> 13;
+	}
+	return (uint16_t)(result | (sign >> 16));
+}
+
+float halfToFloat(uint16_t value)
+{
+	uint32_t f = (uint32_t)(value & 0x7FFF) << 13;
+	uint32_t exponent = f & 0x0F800000u;
+	f += 0x38000000u;
+	if (exponent == 0x0F800000u) //inf or nan
+		f += 0x38000000u;
+	else if (!exponent)
+	{
+		//subnormal, normalized by the float unit
+		const uint32_t magic_bits = 0x38800000u;
+		float magic, normalized;
+		f += 0x00800000u;
+		memcpy(&magic, &magic_bits, sizeof(magic));
+		memcpy(&normalized, &f, sizeof(normalized));
+		normalized -= magic;
+		memcpy(&f, &normalized, sizeof(f));
+	}
+	f |= (uint32_t)(value & 0x8000) << 16;
+
+	float result;
+	memcpy(&result, &f, sizeof(result));
+	return result;
+}
+
+//BC4 endpoints in the first two bytes and 3 bit indices of the texels (x first) in the next six.
+//The values go from the max to the min with the 8 levels of the r0 > r1 mode
+static void encodeBC4Block(const float values[16], uint8_t* block)
+{
+	float min = values[0], max = values[0];
+	for (int i = 1; i < 16; ++i)
+	{
+		min = std::min(min, values[i]);
+		max = std::max(max, values[i]);
+	}
+	int r0 = quantizeUnit(max), r1 = quantizeUnit(min);
+	block[0] = (uint8_t)r0;
+	block[1] = (uint8_t)r1;
+
+	//with r0 == r1 every index is 0, the first endpoint
+	uint64_t indices = 0;
+	if (r0 > r1)
+		for (int i = 0; i < 16; ++i)
+		{
+			//levels are evenly spaced from r0 (level 0) to r1 (level 7), index 0 and 1 are the endpoints
+			int level = (int)floorf((r0 - values[i] * 255.0f) * 7.0f / (r0 - r1) + 0.5f);
+			level = std::min(std::max(level, 0), 7);
+			uint64_t index = level == 0 ? 0 : (level == 7 ? 1 : level + 1);
+			indices |= index << (3 * i);
+		}
+	for (int b = 0; b < 6; ++b)
+		block[2 + b] = (uint8_t)(indices >> (8 * b));
+}
+
+static void decodeBC4Block(const uint8_t* block, float values[16])
+{
+	int r0 = block[0], r1 = block[1];
+	float palette[8] = { r0 / 255.0f, r1 / 255.0f };
+	for (int i = 2; i < 8; ++i)
+	{
+		if (r0 > r1)
+			palette[i] = ((8 - i) * r0 + (i - 1) * r1) / (7.0f * 255.0f);
+		else
+			palette[i] = i == 6 ? 0.0f : (i == 7 ? 1.0f : ((6 - i) * r0 + (i - 1) * r1) / (5.0f * 255.0f));
+	}
+
+	uint64_t indices = 0;
+	for (int b = 0; b < 6; ++b)
+		indices |= (uint64_t)block[2 + b] << (8 * b);
+	for (int i = 0; i < 16; ++i)
+		values[i] = palette[(indices >> (3 * i)) & 7];
+}
+
+void encodeVolume(const float* data, int width, int height, int depth, eVolumeFormat format, sEncodedVolume& result, int brick_size)
+{
+	result = sEncodedVolume();
+	result.format = format;
+	result.width = width;
+	result.height = height;
+	result.depth = depth;
+	size_t slice = (size_t)width * height;
+
+	switch (format)
+	{
+	case VOLUME_FORMAT_R8:
+		result.data.resize(slice * depth);
+		parallelFor(depth, [&](int begin, int end) {
+			for (size_t i = begin * slice; i < end * slice; ++i)
+				result.data[i] = quantizeUnit(data[i]);
+		});
+		break;
+
+	case VOLUME_FORMAT_R16F:
+		result.data.resize(slice * depth * sizeof(uint16_t));
+		parallelFor(depth, [&](int begin, int end) {
+			uint16_t* halfs = (uint16_t*)&result.data[0];
+			for (size_t i = begin * slice; i < end * slice; ++i)
+				halfs[i] = floatToHalf(clampUnit(data[i]));
+		});
+		break;
+
+	case VOLUME_FORMAT_R8_BRICK:
+	{
+		result.brick_size = brick_size;
+		int bricks_x = (width + brick_size - 1) / brick_size, bricks_y = (height + brick_size - 1) / brick_size, bricks_z = (depth + brick_size - 1) / brick_size;
+		result.brick_ranges.resize((size_t)bricks_x * bricks_y * bricks_z * 2);
+		parallelFor(bricks_z, [&](int begin, int end) {
+			for (int bz = begin; bz < end; ++bz)
+				for (int by = 0; by < bricks_y; ++by)
+					for (int bx = 0; bx < bricks_x; ++bx)
+					{
+						float min = 1.0f, max = 0.0f;
+						for (int z = bz * brick_size; z < std::min((bz + 1) * brick_size, depth); ++z)
+							for (int y = by * brick_size; y < std::min((by + 1) * brick_size, height); ++y)
+								for (int x = bx * brick_size; x < std::min((bx + 1) * brick_size, width); ++x)
+								{
+									float value = clampUnit(data[z * slice + (size_t)y * width + x]);
+									min = std::min(min, value);
+									max = std::max(max, value);
+								}
+						size_t brick = ((size_t)bz * bricks_y + by) * bricks_x + bx;
+						result.brick_ranges[brick * 2] = min;
+						result.brick_ranges[brick * 2 + 1] = max;
+					}
+		});
+
+		result.data.resize(slice * depth);
+		parallelFor(depth, [&](int begin, int end) {
+			for (int z = begin; z < end; ++z)
+				for (int y = 0; y < height; ++y)
+					for (int x = 0; x < width; ++x)
+					{
+						size_t brick = ((size_t)(z / brick_size) * bricks_y + y / brick_size) * bricks_x + x / brick_size;
+						float min = result.brick_ranges[brick * 2], range = result.brick_ranges[brick * 2 + 1] - min;
+						size_t i = z * slice + (size_t)y * width + x;
+						result.data[i] = range > 0.0f ? quantizeUnit((clampUnit(data[i]) - min) / range) : 0;
+					}
+		});
+		break;
+	}
+
+	case VOLUME_FORMAT_BC4:
+	{
+		//the blocks past the border repeat the last row and column
+		int blocks_x = (width + 3) / 4, blocks_y = (height + 3) / 4;
+		result.data.resize((size_t)blocks_x * blocks_y * depth * 8);
+		parallelFor(depth, [&](int begin, int end) {
+			float values[16];
+			for (int z = begin; z < end; ++z)
+				for (int by = 0; by < blocks_y; ++by)
+					for (int bx = 0; bx < blocks_x; ++bx)
+					{
+						for (int i = 0; i < 16; ++i)
+						{
+							int x = std::min(bx * 4 + (i & 3), width - 1), y = std::min(by * 4 + (i >> 2), height - 1);
+							values[i] = clampUnit(data[z * slice + (size_t)y * width + x]);
+						}
+						encodeBC4Block(values, &result.data[(((size_t)z * blocks_y + by) * blocks_x + bx) * 8]);
+					}
+		});
+		break;
+	}
+
+	default:
+		break;
+	}
+}
+
+void decodeVolume(const sEncodedVolume& volume, std::vector<float>& result)
+{
+	int width = volume.width, height = volume.height, depth = volume.depth;
+	size_t slice = (size_t)width * height;
+	result.resize(slice * depth);
+	if (result.empty())
+		return;
+
+	switch (volume.format)
+	{
+	case VOLUME_FORMAT_R8:
+		parallelFor(depth, [&](int begin, int end) {
+			for (size_t i = begin * slice; i < end * slice; ++i)
+				result[i] = volume.data[i] / 255.0f;
+		});
+		break;
+
+	case VOLUME_FORMAT_R16F:
+		parallelFor(depth, [&](int begin, int end) {
+			const uint16_t* halfs = (const uint16_t*)&volume.data[0];
+			for (size_t i = begin * slice; i < end * slice; ++i)
+				result[i] = halfToFloat(halfs[i]);
+		});
+		break;
+
+	case VOLUME_FORMAT_R8_BRICK:
+	{
+		int brick_size = volume.brick_size;
+		int bricks_x = (width + brick_size - 1) / brick_size, bricks_y = (height + brick_size - 1) / brick_size;
+		parallelFor(depth, [&](int begin, int end) {
+			for (int z = begin; z < end; ++z)
+				for (int y = 0; y < height; ++y)
+					for (int x = 0; x < width; ++x)
+					{
+						size_t brick = ((size_t)(z / brick_size) * bricks_y + y / brick_size) * bricks_x + x / brick_size;
+						float min = volume.brick_ranges[brick * 2], range = volume.brick_ranges[brick * 2 + 1] - min;
+						size_t i = z * slice + (size_t)y * width + x;
+						result[i] = min + volume.data[i] / 255.0f * range;
+					}
+		});
+		break;
+	}
+
+	case VOLUME_FORMAT_BC4:
+	{
+		int blocks_x = (width + 3) / 4, blocks_y = (height + 3) / 4;
+		parallelFor(depth, [&](int begin, int end) {
+			float values[16];
+			for (int z = begin; z < end; ++z)
+				for (int by = 0; by < blocks_y; ++by)
+					for (int bx = 0; bx < blocks_x; ++bx)
+					{
+						decodeBC4Block(&volume.data[(((size_t)z * blocks_y + by) * blocks_x + bx) * 8], values);
+						for (int i = 0; i < 16; ++i)
+						{
+							int x = bx * 4 + (i & 3), y = by * 4 + (i >> 2);
+							if (x < width && y < height)
+								result[z * slice + (size_t)y * width + x] = values[i];
+						}
+					}
+		});
+		break;
+	}
+
+	default:
+		std::fill(result.begin(), result.end(), 0.0f);
+		break;
+	}
+}
+
+sVolumeError measureVolumeError(const float* reference, const float* decoded, size_t count)
+{
+	sVolumeError error;
+	double sum = 0.0;
+	for (size_t i = 0; i < count; ++i)
+	{
+		double difference = fabs((double)clampUnit(reference[i]) - decoded[i]);
+		error.max_error = std::max(error.max_error, difference);
+		sum += difference * difference;
+	}
+	double mse = count ? sum / count : 0.0;
+	error.rmse = sqrt(mse);
+	error.psnr = mse > 0.0 ? 10.0 * log10(1.0 / mse) : INFINITY;
+	return error;
+}
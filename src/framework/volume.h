@@ -0,0 +1,89 @@
+#pragma once
+
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+//how the voxels of a level are reduced to the next one
+enum eVolumeFilter {
+	VOLUME_FILTER_BOX, //average, rounded for bytes
+	VOLUME_FILTER_MAX
+};
+
+//halves a volume of width * height * depth values (x first) like the GL mipmaps, down to 1 in every axis.
+//every voxel gets the 2x2x2 voxels under it, odd sizes repeat the last one. The slices are split between threads
+//and the rows are done 4 floats or 8 bytes at once with SSE2 when available
+void downsampleVolume(const float* data, int width, int height, int depth, eVolumeFilter filter, std::vector<float>& result);
+void downsampleVolume(const uint8_t* data, int width, int height, int depth, eVolumeFilter filter, std::vector<uint8_t>& result);
+
+//all the levels after data down to 1x1x1, levels[0] is the half of data
+void buildVolumeMips(const float* data, int width, int height, int depth, eVolumeFilter filter, std::vector<std::vector<float>>& levels);
+void buildVolumeMips(const uint8_t* data, int width, int height, int depth, eVolumeFilter filter, std::vector<std::vector<uint8_t>>& levels);
+
+//size of the level after size
+inline int getVolumeMipSize(int size) { return size > 1 ? size / 2 : 1; }
+
+//how the gradient of a voxel is estimated from its neighbours
+enum eGradientFilter {
+	GRADIENT_FILTER_CENTRAL, //differences of the 6 neighbours
+	GRADIENT_FILTER_SOBEL //differences of the 3x3 neighbours on each side weighted 1 2 1, smoother
+};
+
+//gradient of every voxel in voxel units, 3 floats per voxel x first, the borders repeat the last voxel. The slices are split between threads
+void computeVolumeGradients(const float* data, int width, int height, int depth, eGradientFilter filter, std::vector<float>& result);
+
+//how the directions of the gradients are stored
+enum eNormalFormat {
+	NORMAL_FORMAT_RGB8_SNORM, //3 signed bytes per voxel
+	NORMAL_FORMAT_RGB10A2 //a packed uint per voxel with [-1, 1] mapped to [0, 1023], x in the low bits
+};
+
+//unit directions of the gradients (0 where the gradient is 0) in the bytes of the format
+void packVolumeNormals(const std::vector<float>& gradients, eNormalFormat format, std::vector<uint8_t>& result);
+
+//signed distance in voxels from every voxel to the surface where the volume crosses the threshold, negative inside (value >= threshold).
+//jump flooding from the crossings between neighbour voxels, with log2 passes of halving steps and a last one of 1 voxel.
+//the voxels of every pass are split between threads. Without surface every voxel gets the sum of the sizes.
+//margin is subtracted from every distance, DISTANCE_FIELD_MARGIN keeps the trilinear interpolation below the distance to the surface
+#define DISTANCE_FIELD_MARGIN 0.87f //half the diagonal of a voxel
+void computeDistanceField(const float* data, int width, int height, int depth, float threshold, std::vector<float>& result, float margin = 0.0f);
+
+//how the values of a volume are stored on the CPU and uploaded, all of them for values in [0, 1]
+enum eVolumeFormat {
+	VOLUME_FORMAT_R8, //a byte per voxel
+	VOLUME_FORMAT_R8_BRICK, //a byte per voxel relative to the min and max of its brick, uploaded as R16F
+	VOLUME_FORMAT_R16F, //a half per voxel
+	VOLUME_FORMAT_BC4, //8 bytes per 4x4 block of every slice, uploaded as R8 because GL does not take RGTC 3D textures
+	VOLUME_FORMAT_COUNT
+};
+
+const char* getVolumeFormatName(eVolumeFormat format);
+
+struct sEncodedVolume
+{
+	eVolumeFormat format = VOLUME_FORMAT_R8;
+	int width = 0, height = 0, depth = 0;
+	int brick_size = 0; //voxels per side of the bricks of R8_BRICK
+	std::vector<uint8_t> data; //the voxels x first, the BC4 blocks x first too
+	std::vector<float> brick_ranges; //R8_BRICK min and max of every brick, x first
+
+	size_t getBytes() const { return data.size() + brick_ranges.size() * sizeof(float); }
+	float getBytesPerVoxel() const { return width ? getBytes() / ((float)width * height * depth) : 0.0f; }
+};
+
+//differences between a volume and its decoded version
+struct sVolumeError
+{
+	double max_error = 0.0;
+	double rmse = 0.0;
+	double psnr = 0.0; //in dB for a peak of 1, infinite when there is no error
+};
+
+//the values are clamped to [0, 1]. The slices are split between threads
+void encodeVolume(const float* data, int width, int height, int depth, eVolumeFormat format, sEncodedVolume& result, int brick_size = 8);
+void decodeVolume(const sEncodedVolume& volume, std::vector<float>& result);
+sVolumeError measureVolumeError(const float* reference, const float* decoded, size_t count); //reference clamped like the encoder
+
+//IEEE half floats, rounded to the nearest even
+uint16_t floatToHalf(float value);
+float halfToFloat(uint16_t value);
@@ -0,0 +1,556 @@
+#include "bvh.h"
+
+#include <cassert>
+#include <cstring>
+#include <cfloat>
+#include <algorithm>
+
+#include <glm/glm.hpp>
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_IX86)
+#define BVH_USE_SSE
+#include <emmintrin.h>
+#endif
+
+#define BVH_STACK_SIZE 128
+//deeper nodes are split in two halves, the median splits add at most 32 levels so the traversal stack never overflows
+#define BVH_MAX_SAH_DEPTH 64
+
+static inline float boxArea(const glm::vec3& min, const glm::vec3& max)
+{
+	glm::vec3 e = max - min;
+	return e.x * e.y + e.y * e.z + e.z * e.x;
+}
+
+void BVH::clear()
+{
+	nodes.clear();
+	blocks.clear();
+}
+
+void BVH::build(const std::vector<glm::vec3>& positions)
+{
+	clear();
+	unsigned int num_triangles = (unsigned int)(positions.size() / 3);
+	if (!num_triangles)
+		return;
+
+	std::vector<unsigned int> ids(num_triangles);
+	std::vector<glm::vec3> centroids(num_triangles);
+	for (unsigned int i = 0; i < num_triangles; ++i)
+	{
+		ids[i] = i;
+		centroids[i] = (positions[i * 3] + positions[i * 3 + 1] + positions[i * 3 + 2]) * (1.0f / 3.0f);
+	}
+
+	//a binary tree never has more than 2N - 1 nodes, so references to nodes stay valid while building
+	nodes.reserve(num_triangles * 2);
+	sNode root;
+	root.left_first = 0;
+	root.count = num_triangles;
+	nodes.push_back(root);
+	updateBounds(0, ids, positions);
+	subdivide(0, 0, ids, centroids, positions);
+
+	//pack the triangles of every leaf together, in the order they will be visited
+	for (sNode& node : nodes)
+	{
+		if (!node.count)
+			continue;
+
+		sTriangleBlock block;
+		memset(&block, 0, sizeof(block));
+		for (unsigned int lane = 0; lane < node.count; ++lane)
+		{
+			unsigned int id = ids[node.left_first + lane];
+			const glm::vec3& v0 = positions[id * 3];
+			glm::vec3 e1 = positions[id * 3 + 1] - v0;
+			glm::vec3 e2 = positions[id * 3 + 2] - v0;
+			for (int k = 0; k < 3; ++k)
+			{
+				block.v0[k][lane] = v0[k];
+				block.e1[k][lane] = e1[k];
+				block.e2[k][lane] = e2[k];
+			}
+			block.ids[lane] = id;
+		}
+		node.left_first = (unsigned int)blocks.size();
+		blocks.push_back(block);
+	}
+}
+
+void BVH::updateBounds(unsigned int node_id, const std::vector<unsigned int>& ids, const std::vector<glm::vec3>& positions)
+{
+	sNode& node = nodes[node_id];
+	node.aabb_min = glm::vec3(FLT_MAX);
+	node.aabb_max = glm::vec3(-FLT_MAX);
+	for (unsigned int i = 0; i < node.count; ++i)
+	{
+		unsigned int id = ids[node.left_first + i];
+		for (int k = 0; k < 3; ++k)
+		{
+			node.aabb_min = glm::min(node.aabb_min, positions[id * 3 + k]);
+			node.aabb_max = glm::max(node.aabb_max, positions[id * 3 + k]);
+		}
+	}
+}
+
+//binned SAH: the centroids are distributed in BVH_BINS bins per axis and every plane between bins is evaluated
+void BVH::subdivide(unsigned int node_id, int depth, std::vector<unsigned int>& ids, const std::vector<glm::vec3>& centroids, const std::vector<glm::vec3>& positions)
+{
+	sNode& node = nodes[node_id];
+	unsigned int first = node.left_first;
+	unsigned int count = node.count;
+
+	//a full leaf costs a single SIMD test, like visiting one more node
+	if (count <= BVH_MAX_LEAF_TRIANGLES)
+		return;
+
+	glm::vec3 cmin(FLT_MAX), cmax(-FLT_MAX);
+	for (unsigned int i = first; i < first + count; ++i)
+	{
+		cmin = glm::min(cmin, centroids[ids[i]]);
+		cmax = glm::max(cmax, centroids[ids[i]]);
+	}
+
+	struct sBin {
+		glm::vec3 min = glm::vec3(FLT_MAX);
+		glm::vec3 max = glm::vec3(-FLT_MAX);
+		unsigned int count = 0;
+	};
+
+	float best_cost = FLT_MAX;
+	int best_axis = -1;
+	int best_bin = 0;
+	for (int axis = 0; axis < 3 && depth < BVH_MAX_SAH_DEPTH; ++axis)
+	{
+		float extent = cmax[axis] - cmin[axis];
+		if (extent <= 0.0f)
+			continue;
+
+		sBin bins[BVH_BINS];
+		float scale = BVH_BINS / extent;
+		for (unsigned int i = first; i < first + count; ++i)
+		{
+			unsigned int id = ids[i];
+			int b = std::min(BVH_BINS - 1, (int)((centroids[id][axis] - cmin[axis]) * scale));
+			bins[b].count++;
+			for (int k = 0; k < 3; ++k)
+			{
+				bins[b].min = glm::min(bins[b].min, positions[id * 3 + k]);
+				bins[b].max = glm::max(bins[b].max, positions[id * 3 + k]);
+			}
+		}
+
+		//sweep from both sides to get the area and count of every partition
+		float left_area[BVH_BINS - 1], right_area[BVH_BINS - 1];
+		unsigned int left_count[BVH_BINS - 1], right_count[BVH_BINS - 1];
+		sBin left, right;
+		for (int i = 0; i < BVH_BINS - 1; ++i)
+		{
+			left.count += bins[i].count;
+			left.min = glm::min(left.min, bins[i].min);
+			left.max = glm::max(left.max, bins[i].max);
+			left_count[i] = left.count;
+			left_area[i] = left.count ? boxArea(left.min, left.max) : 0.0f;
+
+			const sBin& rbin = bins[BVH_BINS - 1 - i];
+			right.count += rbin.count;
+			right.min = glm::min(right.min, rbin.min);
+			right.max = glm::max(right.max, rbin.max);
+			right_count[BVH_BINS - 2 - i] = right.count;
+			right_area[BVH_BINS - 2 - i] = right.count ? boxArea(right.min, right.max) : 0.0f;
+		}
+
+		//triangles are tested in blocks, so the cost depends on the number of blocks of every side
+		for (int i = 0; i < BVH_BINS - 1; ++i)
+		{
+			float cost = ((left_count[i] + 3) / 4) * left_area[i] + ((right_count[i] + 3) / 4) * right_area[i];
+			if (cost < best_cost)
+			{
+				best_cost = cost;
+				best_axis = axis;
+				best_bin = i;
+			}
+		}
+	}
+
+	unsigned int mid = first + count / 2;
+	if (best_axis != -1)
+	{
+		float scale = BVH_BINS / (cmax[best_axis] - cmin[best_axis]);
+		float axis_min = cmin[best_axis];
+		auto it = std::partition(ids.begin() + first, ids.begin() + first + count, [&](unsigned int id) {
+			return std::min(BVH_BINS - 1, (int)((centroids[id][best_axis] - axis_min) * scale)) <= best_bin;
+		});
+		unsigned int split = (unsigned int)(it - ids.begin());
+		if (split != first && split != first + count)
+			mid = split;
+	}
+	else if (depth >= BVH_MAX_SAH_DEPTH)
+	{
+		//too deep, median split on the longest axis of the centroids
+		glm::vec3 extent = cmax - cmin;
+		int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+		std::nth_element(ids.begin() + first, ids.begin() + mid, ids.begin() + first + count, [&](unsigned int a, unsigned int b) {
+			return centroids[a][axis] < centroids[b][axis];
+		});
+	}
+	//else all the centroids are in the same point, split them in two halves
+
+	unsigned int left_id = (unsigned int)nodes.size();
+	sNode child;
+	child.left_first = first;
+	child.count = mid - first;
+	nodes.push_back(child);
+	child.left_first = mid;
+	child.count = first + count - mid;
+	nodes.push_back(child);
+
+	node.left_first = left_id;
+	node.count = 0;
+
+	updateBounds(left_id, ids, positions);
+	updateBounds(left_id + 1, ids, positions);
+	subdivide(left_id, depth + 1, ids, centroids, positions);
+	subdivide(left_id + 1, depth + 1, ids, centroids, positions);
+}
+
+#ifdef BVH_USE_SSE
+
+struct sRay {
+	__m128 origin;
+	__m128 inv_direction;
+	__m128 o[3]; //origin and direction broadcasted for the 4-wide triangle test
+	__m128 d[3];
+};
+
+//slab test, the w lane of the loaded vectors is left_first/count and gets masked out
+static inline float intersectBox(const BVH::sNode& node, const sRay& ray, float max_t)
+{
+	const __m128 mask_xyz = _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1));
+	__m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(&node.aabb_min.x), ray.origin), ray.inv_direction);
+	__m128 t2 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(&node.aabb_max.x), ray.origin), ray.inv_direction);
+	__m128 vmin = _mm_and_ps(_mm_min_ps(t1, t2), mask_xyz); //w = 0, the ray starts at the origin
+	__m128 vmax = _mm_or_ps(_mm_and_ps(_mm_max_ps(t1, t2), mask_xyz), _mm_andnot_ps(mask_xyz, _mm_set1_ps(max_t)));
+	vmin = _mm_max_ps(vmin, _mm_shuffle_ps(vmin, vmin, _MM_SHUFFLE(1, 0, 3, 2)));
+	vmin = _mm_max_ps(vmin, _mm_shuffle_ps(vmin, vmin, _MM_SHUFFLE(2, 3, 0, 1)));
+	vmax = _mm_min_ps(vmax, _mm_shuffle_ps(vmax, vmax, _MM_SHUFFLE(1, 0, 3, 2)));
+	vmax = _mm_min_ps(vmax, _mm_shuffle_ps(vmax, vmax, _MM_SHUFFLE(2, 3, 0, 1)));
+	float tnear = _mm_cvtss_f32(vmin);
+	float tfar = _mm_cvtss_f32(vmax);
+	return tnear <= tfar ? tnear : FLT_MAX;
+}
+
+//Moller-Trumbore with the 4 triangles of the block at once, returns the lane hit or -1
+static inline int intersectBlock(const BVH::sTriangleBlock& block, const sRay& ray, float& best_t)
+{
+	__m128 e1x = _mm_loadu_ps(block.e1[0]), e1y = _mm_loadu_ps(block.e1[1]), e1z = _mm_loadu_ps(block.e1[2]);
+	__m128 e2x = _mm_loadu_ps(block.e2[0]), e2y = _mm_loadu_ps(block.e2[1]), e2z = _mm_loadu_ps(block.e2[2]);
+
+	//p = d x e2
+	__m128 px = _mm_sub_ps(_mm_mul_ps(ray.d[1], e2z), _mm_mul_ps(ray.d[2], e2y));
+	__m128 py = _mm_sub_ps(_mm_mul_ps(ray.d[2], e2x), _mm_mul_ps(ray.d[0], e2z));
+	__m128 pz = _mm_sub_ps(_mm_mul_ps(ray.d[0], e2y), _mm_mul_ps(ray.d[1], e2x));
+	__m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+	__m128 abs_det = _mm_andnot_ps(_mm_set1_ps(-0.0f), det);
+	__m128 mask = _mm_cmpgt_ps(abs_det, _mm_set1_ps(1e-12f)); //also rejects the empty lanes
+	__m128 inv_det = _mm_div_ps(_mm_set1_ps(1.0f), det);
+
+	//s = o - v0
+	__m128 sx = _mm_sub_ps(ray.o[0], _mm_loadu_ps(block.v0[0]));
+	__m128 sy = _mm_sub_ps(ray.o[1], _mm_loadu_ps(block.v0[1]));
+	__m128 sz = _mm_sub_ps(ray.o[2], _mm_loadu_ps(block.v0[2]));
+	__m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)), _mm_mul_ps(sz, pz)), inv_det);
+
+	//q = s x e1
+	__m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+	__m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+	__m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+	__m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ray.d[0], qx), _mm_mul_ps(ray.d[1], qy)), _mm_mul_ps(ray.d[2], qz)), inv_det);
+	__m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inv_det);
+
+	__m128 zero = _mm_setzero_ps();
+	mask = _mm_and_ps(mask, _mm_cmpge_ps(u, zero));
+	mask = _mm_and_ps(mask, _mm_cmpge_ps(v, zero));
+	mask = _mm_and_ps(mask, _mm_cmple_ps(_mm_add_ps(u, v), _mm_set1_ps(1.0f)));
+	mask = _mm_and_ps(mask, _mm_cmpgt_ps(t, zero));
+	mask = _mm_and_ps(mask, _mm_cmplt_ps(t, _mm_set1_ps(best_t)));
+
+	int bits = _mm_movemask_ps(mask);
+	if (!bits)
+		return -1;
+
+	alignas(16) float ts[4];
+	_mm_store_ps(ts, t);
+	int hit = -1;
+	for (int lane = 0; lane < 4; ++lane)
+		if ((bits & (1 << lane)) && ts[lane] < best_t)
+		{
+			best_t = ts[lane];
+			hit = lane;
+		}
+	return hit;
+}
+
+#else
+
+struct sRay {
+	glm::vec3 origin;
+	glm::vec3 inv_direction;
+	glm::vec3 direction;
+};
+
+static inline float intersectBox(const BVH::sNode& node, const sRay& ray, float max_t)
+{
+	glm::vec3 t1 = (node.aabb_min - ray.origin) * ray.inv_direction;
+	glm::vec3 t2 = (node.aabb_max - ray.origin) * ray.inv_direction;
+	glm::vec3 vmin = glm::min(t1, t2);
+	glm::vec3 vmax = glm::max(t1, t2);
+	float tnear = std::max(std::max(vmin.x, vmin.y), std::max(vmin.z, 0.0f));
+	float tfar = std::min(std::min(vmax.x, vmax.y), std::min(vmax.z, max_t));
+	return tnear <= tfar ? tnear : FLT_MAX;
+}
+
+static inline int intersectBlock(const BVH::sTriangleBlock& block, const sRay& ray, float& best_t)
+{
+	int hit = -1;
+	for (int lane = 0; lane < 4; ++lane)
+	{
+		glm::vec3 v0(block.v0[0][lane], block.v0[1][lane], block.v0[2][lane]);
+		glm::vec3 e1(block.e1[0][lane], block.e1[1][lane], block.e1[2][lane]);
+		glm::vec3 e2(block.e2[0][lane], block.e2[1][lane], block.e2[2][lane]);
+		glm::vec3 p = glm::cross(ray.direction, e2);
+		float det = glm::dot(e1, p);
+		if (fabs(det) <= 1e-12f)
+			continue;
+		float inv_det = 1.0f / det;
+		glm::vec3 s = ray.origin - v0;
+		float u = glm::dot(s, p) * inv_det;
+		glm::vec3 q = glm::cross(s, e1);
+		float v = glm::dot(ray.direction, q) * inv_det;
+		float t = glm::dot(e2, q) * inv_det;
+		if (u >= 0.0f && v >= 0.0f && u + v <= 1.0f && t > 0.0f && t < best_t)
+		{
+			best_t = t;
+			hit = lane;
+		}
+	}
+	return hit;
+}
+
+#endif
+
+bool BVH::testRay(const glm::vec3& origin, const glm::vec3& direction, float max_dist, float& t, unsigned int& triangle_id, glm::vec3& normal) const
+{
+	if (nodes.empty())
+		return false;
+
+	sRay ray;
+	glm::vec3 inv_direction = 1.0f / direction;
+#ifdef BVH_USE_SSE
+	ray.origin = _mm_set_ps(0.0f, origin.z, origin.y, origin.x);
+	ray.inv_direction = _mm_set_ps(0.0f, inv_direction.z, inv_direction.y, inv_direction.x);
+	for (int k = 0; k < 3; ++k)
+	{
+		ray.o[k] = _mm_set1_ps(origin[k]);
+		ray.d[k] = _mm_set1_ps(direction[k]);
+	}
+#else
+	ray.origin = origin;
+	ray.inv_direction = inv_direction;
+	ray.direction = direction;
+#endif
+
+	float best_t = max_dist;
+	const sTriangleBlock* best_block = NULL;
+	int best_lane = -1;
+
+	unsigned int stack[BVH_STACK_SIZE];
+	int stack_size = 0;
+	if (intersectBox(nodes[0], ray, best_t) == FLT_MAX)
+		return false;
+	stack[stack_size++] = 0;
+
+	while (stack_size)
+	{
+		const sNode& node = nodes[stack[--stack_size]];
+		if (node.count)
+		{
+			const sTriangleBlock& block = blocks[node.left_first];
+			int lane = intersectBlock(block, ray, best_t);
+			if (lane != -1)
+			{
+				best_block = &block;
+				best_lane = lane;
+			}
+			continue;
+		}
+
+		//visit the closest child first so the farthest is usually culled by best_t
+		float dist_left = intersectBox(nodes[node.left_first], ray, best_t);
+		float dist_right = intersectBox(nodes[node.left_first + 1], ray, best_t);
+		unsigned int near_id = node.left_first, far_id = node.left_first + 1;
+		if (dist_right < dist_left)
+		{
+			std::swap(dist_left, dist_right);
+			std::swap(near_id, far_id);
+		}
+		assert(stack_size + 2 <= BVH_STACK_SIZE && "BVH too deep");
+		if (dist_right != FLT_MAX)
+			stack[stack_size++] = far_id;
+		if (dist_left != FLT_MAX)
+			stack[stack_size++] = near_id;
+	}
+
+	if (!best_block)
+		return false;
+
+	glm::vec3 e1(best_block->e1[0][best_lane], best_block->e1[1][best_lane], best_block->e1[2][best_lane]);
+	glm::vec3 e2(best_block->e2[0][best_lane], best_block->e2[1][best_lane], best_block->e2[2][best_lane]);
+	normal = glm::normalize(glm::cross(e1, e2));
+	triangle_id = best_block->ids[best_lane];
+	t = best_t;
+	return true;
+}
+
+//from Real-Time Collision Detection (Ericson), 5.1.5
+static glm::vec3 closestPointOnTriangle(const glm::vec3& p, const glm::vec3& a, const glm::vec3& b, const glm::vec3& c)
+{
+	glm::vec3 ab = b - a, ac = c - a, ap = p - a;
+	float d1 = glm::dot(ab, ap), d2 = glm::dot(ac, ap);
+	if (d1 <= 0.0f && d2 <= 0.0f) return a;
+
+	glm::vec3 bp = p - b;
+	float d3 = glm::dot(ab, bp), d4 = glm::dot(ac, bp);
+	if (d3 >= 0.0f && d4 <= d3) return b;
+
+	float vc = d1 * d4 - d3 * d2;
+	if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f) return a + ab * (d1 / (d1 - d3));
+
+	glm::vec3 cp = p - c;
+	float d5 = glm::dot(ab, cp), d6 = glm::dot(ac, cp);
+	if (d6 >= 0.0f && d5 <= d6) return c;
+
+	float vb = d5 * d2 - d1 * d6;
+	if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f) return a + ac * (d2 / (d2 - d6));
+
+	float va = d3 * d6 - d5 * d4;
+	if (va <= 0.0f && (d4 - d3) >= 0.0f && (d5 - d6) >= 0.0f) return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+
+	float denom = 1.0f / (va + vb + vc);
+	return a + ab * (vb * denom) + ac * (vc * denom);
+}
+
+bool BVH::testSphere(const glm::vec3& center, float radius, glm::vec3& collision, glm::vec3& normal) const
+{
+	if (nodes.empty())
+		return false;
+
+	float best_dist2 = radius * radius;
+	bool found = false;
+
+	unsigned int stack[BVH_STACK_SIZE];
+	int stack_size = 0;
+	stack[stack_size++] = 0;
+
+	while (stack_size)
+	{
+		const sNode& node = nodes[stack[--stack_size]];
+
+		glm::vec3 closest = glm::clamp(center, node.aabb_min, node.aabb_max);
+		glm::vec3 delta = closest - center;
+		if (glm::dot(delta, delta) > best_dist2)
+			continue;
+
+		if (!node.count)
+		{
+			assert(stack_size + 2 <= BVH_STACK_SIZE && "BVH too deep");
+			stack[stack_size++] = node.left_first + 1;
+			stack[stack_size++] = node.left_first;
+			continue;
+		}
+
+		const sTriangleBlock& block = blocks[node.left_first];
+		for (unsigned int lane = 0; lane < node.count; ++lane)
+		{
+			glm::vec3 a(block.v0[0][lane], block.v0[1][lane], block.v0[2][lane]);
+			glm::vec3 e1(block.e1[0][lane], block.e1[1][lane], block.e1[2][lane]);
+			glm::vec3 e2(block.e2[0][lane], block.e2[1][lane], block.e2[2][lane]);
+			glm::vec3 p = closestPointOnTriangle(center, a, a + e1, a + e2);
+			glm::vec3 d = center - p;
+			float dist2 = glm::dot(d, d);
+			if (dist2 >= best_dist2)
+				continue;
+
+			best_dist2 = dist2;
+			collision = p;
+			normal = glm::normalize(glm::cross(e1, e2));
+			if (glm::dot(normal, d) < 0.0f)
+				normal = -normal;
+			found = true;
+		}
+	}
+
+	return found;
+}
+
+size_t BVH::getSerializedSize() const
+{
+	return sizeof(unsigned int) * 2 + nodes.size() * sizeof(sNode) + blocks.size() * sizeof(sTriangleBlock);
+}
+
+void BVH::write(FILE* f) const
+{
+	unsigned int num_nodes = (unsigned int)nodes.size();
+	unsigned int num_blocks = (unsigned int)blocks.size();
+	fwrite(&num_nodes, sizeof(unsigned int), 1, f);
+	fwrite(&num_blocks, sizeof(unsigned int), 1, f);
+	if (num_nodes)
+		fwrite(&nodes[0], sizeof(sNode), num_nodes, f);
+	if (num_blocks)
+		fwrite(&blocks[0], sizeof(sTriangleBlock), num_blocks, f);
+}
+
+bool BVH::read(const char* data, size_t size)
+{
+	clear();
+	unsigned int num_nodes, num_blocks;
+	if (size < sizeof(unsigned int) * 2)
+		return false;
+	memcpy(&num_nodes, data, sizeof(unsigned int));
+	memcpy(&num_blocks, data + sizeof(unsigned int), sizeof(unsigned int));
+	data += sizeof(unsigned int) * 2;
+	if ((unsigned long long)size != sizeof(unsigned int) * 2 + (unsigned long long)num_nodes * sizeof(sNode) + (unsigned long long)num_blocks * sizeof(sTriangleBlock))
+		return false;
+
+	nodes.resize(num_nodes);
+	blocks.resize(num_blocks);
+	if (num_nodes)
+		memcpy(&nodes[0], data, num_nodes * sizeof(sNode));
+	data += num_nodes * sizeof(sNode);
+	if (num_blocks)
+		memcpy(&blocks[0], data, num_blocks * sizeof(sTriangleBlock));
+
+	//the traversals trust the indices: children after their parent and inside the nodes, leaves inside the blocks,
+	//and not deeper than the stack
+	std::vector<unsigned char> depths(num_nodes, 0);
+	bool valid = true;
+	for (unsigned int i = 0; i < num_nodes && valid; ++i)
+	{
+		const sNode& node = nodes[i];
+		if (node.count)
+			valid = node.count <= BVH_MAX_LEAF_TRIANGLES && node.left_first < num_blocks;
+		else if (node.left_first <= i || node.left_first >= num_nodes - 1 || depths[i] + 2 >= BVH_STACK_SIZE)
+			valid = false;
+		else
+		{
+			//a child can be shared when corrupted, the parents come first so it gets the deepest of them
+			depths[node.left_first] = std::max(depths[node.left_first], (unsigned char)(depths[i] + 1));
+			depths[node.left_first + 1] = std::max(depths[node.left_first + 1], (unsigned char)(depths[i] + 1));
+		}
+	}
+	if (!valid)
+		clear();
+	return valid;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <vector>
+#include <cstdio>
+
+#include <glm/vec3.hpp>
+
+#define BVH_MAX_LEAF_TRIANGLES 4 //leaves are tested with one 4-wide SIMD ray-triangle test
+#define BVH_BINS 12 //bins per axis for the SAH evaluation
+
+//bounding volume hierarchy over the triangles of a mesh, used for ray picking and collisions
+class BVH
+{
+public:
+	//32 bytes, two nodes per cache line. Children are always consecutive.
+	struct sNode {
+		glm::vec3 aabb_min;
+		unsigned int left_first; //inner: index of the left child, leaf: index of the triangle block
+		glm::vec3 aabb_max;
+		unsigned int count; //0 for inner nodes, triangles in the block for leaves
+	};
+
+	//triangles of a leaf in SoA layout, unused lanes are degenerated triangles
+	struct sTriangleBlock {
+		float v0[3][4];
+		float e1[3][4]; //v1 - v0
+		float e2[3][4]; //v2 - v0
+		unsigned int ids[4]; //index of the triangle in the mesh
+	};
+
+	std::vector<sNode> nodes; //depth first, root is the first one
+	std::vector<sTriangleBlock> blocks;
+
+	void clear();
+	bool empty() const { return nodes.empty(); }
+
+	//triangle soup: three positions per triangle
+	void build(const std::vector<glm::vec3>& positions);
+
+	//returns the closest triangle hit closer than max_dist, t is in units of direction
+	bool testRay(const glm::vec3& origin, const glm::vec3& direction, float max_dist, float& t, unsigned int& triangle_id, glm::vec3& normal) const;
+	//returns the point of the mesh closest to center if it is inside the sphere
+	bool testSphere(const glm::vec3& center, float radius, glm::vec3& collision, glm::vec3& normal) const;
+
+	//serialization used by the .mbin
+	void write(FILE* f) const;
+	bool read(const char* data, size_t size);
+	size_t getSerializedSize() const;
+
+private:
+	void subdivide(unsigned int node_id, int depth, std::vector<unsigned int>& ids, const std::vector<glm::vec3>& centroids, const std::vector<glm::vec3>& positions);
+	void updateBounds(unsigned int node_id, const std::vector<unsigned int>& ids, const std::vector<glm::vec3>& positions);
+};
@@ -0,0 +1,78 @@
+#include "fbo.h"
+
+#include "texture.h"
+
+FBO::FBO() { }
+
+FBO::~FBO()
+{
+	clear();
+}
+
+void FBO::clear()
+{
+	for (int i = 0; i < 4; ++i)
+	{
+		delete color_textures[i];
+		color_textures[i] = NULL;
+	}
+	delete depth_texture;
+	depth_texture = NULL;
+	if (fbo_id)
+		glDeleteFramebuffers(1, &fbo_id);
+	fbo_id = 0;
+	num_color_textures = width = height = 0;
+}
+
+bool FBO::create(int width, int height, int num_textures, unsigned int format, unsigned int type, bool use_depth_texture, unsigned int internal_format)
+{
+	assert(width && height && num_textures > 0 && num_textures <= 4);
+	clear();
+
+	this->width = width;
+	this->height = height;
+	this->num_color_textures = num_textures;
+
+	glGenFramebuffers(1, &fbo_id);
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo_id);
+
+	GLenum buffers[4];
+	for (int i = 0; i < num_textures; ++i)
+	{
+		color_textures[i] = new Texture(width, height, format, type, false, NULL, internal_format);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + i, GL_TEXTURE_2D, color_textures[i]->texture_id, 0);
+		buffers[i] = GL_COLOR_ATTACHMENT0 + i;
+	}
+	glDrawBuffers(num_textures, buffers);
+
+	if (use_depth_texture)
+	{
+		depth_texture = new Texture(width, height, GL_DEPTH_COMPONENT, GL_FLOAT, false, NULL, GL_DEPTH_COMPONENT24);
+		glBindTexture(GL_TEXTURE_2D, depth_texture->texture_id);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depth_texture->texture_id, 0);
+	}
+
+	bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	if (!complete)
+		std::cout << "[ERROR] FBO not complete" << std::endl;
+	return complete;
+}
+
+void FBO::bind()
+{
+	assert(fbo_id && "FBO not created");
+	glGetIntegerv(GL_FRAMEBUFFER_BINDING, &old_fbo);
+	glGetIntegerv(GL_VIEWPORT, old_viewport);
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo_id);
+	glViewport(0, 0, width, height);
+}
+
+void FBO::unbind()
+{
+	glBindFramebuffer(GL_FRAMEBUFFER, old_fbo);
+	glViewport(old_viewport[0], old_viewport[1], old_viewport[2], old_viewport[3]);
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "../framework/includes.h"
+
+class Texture;
+
+//render target with color textures and an optional depth texture, what is drawn between bind and unbind goes to them
+class FBO
+{
+public:
+	GLuint fbo_id = 0;
+	Texture* color_textures[4] = { NULL, NULL, NULL, NULL };
+	Texture* depth_texture = NULL;
+	int num_color_textures = 0;
+	int width = 0;
+	int height = 0;
+
+	FBO();
+	~FBO();
+
+	//the textures are not mipmapped, depth is GL_DEPTH_COMPONENT24 sampled with GL_NEAREST
+	bool create(int width, int height, int num_textures = 1, unsigned int format = GL_RGBA, unsigned int type = GL_UNSIGNED_BYTE, bool use_depth_texture = true, unsigned int internal_format = 0);
+	void clear();
+
+	void bind(); //sets the viewport of the textures, unbind restores the previous framebuffer and viewport
+	void unbind();
+
+private:
+	GLint old_fbo = 0;
+	GLint old_viewport[4] = { 0, 0, 0, 0 };
+};
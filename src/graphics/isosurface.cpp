@@ -0,0 +1,277 @@
+#include "isosurface.h"
+
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <algorithm>
+#include <unordered_map>
+
+#include <glm/glm.hpp>
+
+#include "../framework/utils.h"
+#include "../framework/volume.h"
+
+void IsosurfaceExtractor::create(const float* data, int width, int height, int depth, int block_size)
+{
+	this->width = width;
+	this->height = height;
+	this->depth = depth;
+	this->block_size = block_size;
+	this->threshold = -1.0f;
+	density.assign(data, data + (size_t)width * height * depth);
+	computeVolumeGradients(data, width, height, depth, GRADIENT_FILTER_CENTRAL, gradients);
+
+	cells = glm::max(glm::ivec3(width, height, depth) - glm::ivec3(1), glm::ivec3(0));
+	num_blocks = (cells + glm::ivec3(block_size - 1)) / block_size;
+	blocks.assign((size_t)num_blocks.x * num_blocks.y * num_blocks.z, sIsosurfaceBlock());
+	cell_vertex.assign((size_t)cells.x * cells.y * cells.z, 0);
+
+	//the corners of the last cells of a block are the first voxels of the next one
+	parallelFor(num_blocks.z, [&](int begin, int end) {
+		for (int bz = begin; bz < end; ++bz)
+			for (int by = 0; by < num_blocks.y; ++by)
+				for (int bx = 0; bx < num_blocks.x; ++bx)
+				{
+					glm::ivec3 first = glm::ivec3(bx, by, bz) * block_size;
+					glm::ivec3 last = glm::min(first + glm::ivec3(block_size), cells);
+					glm::vec2 range(getVoxel(first.x, first.y, first.z));
+					for (int z = first.z; z <= last.z; ++z)
+						for (int y = first.y; y <= last.y; ++y)
+							for (int x = first.x; x <= last.x; ++x)
+							{
+								float value = getVoxel(x, y, z);
+								range.x = std::min(range.x, value);
+								range.y = std::max(range.y, value);
+							}
+					blocks[((size_t)bz * num_blocks.y + by) * num_blocks.x + bx].range = range;
+				}
+	});
+}
+
+bool IsosurfaceExtractor::update(float threshold, bool all_blocks)
+{
+	if (blocks.empty() || (threshold == this->threshold && !all_blocks))
+		return false;
+	double start = glfwGetTime();
+
+	//a block has surface when some voxel is inside and some outside, the others are empty before and after
+	std::vector<int> dirty;
+	for (size_t i = 0; i < blocks.size(); ++i)
+	{
+		const glm::vec2& range = blocks[i].range;
+		bool before = range.x < this->threshold && range.y >= this->threshold;
+		bool after = range.x < threshold && range.y >= threshold;
+		if (before || after || all_blocks)
+			dirty.push_back((int)i);
+	}
+	this->threshold = threshold;
+
+	parallelFor((int)dirty.size(), [&](int begin, int end) {
+		for (int i = begin; i < end; ++i)
+		{
+			sIsosurfaceBlock& block = blocks[dirty[i]];
+			block.vertices.clear();
+			block.normals.clear();
+			block.cells.clear();
+			block.quads.clear();
+			if (all_blocks || (block.range.x < threshold && block.range.y >= threshold))
+				extractBlock(dirty[i]);
+		}
+	});
+
+	stats.dirty_blocks = (int)dirty.size();
+	stats.extract_time = glfwGetTime() - start;
+	return dirty.size() > 0;
+}
+
+void IsosurfaceExtractor::extractBlock(int index)
+{
+	sIsosurfaceBlock& block = blocks[index];
+	glm::ivec3 b(index % num_blocks.x, (index / num_blocks.x) % num_blocks.y, index / (num_blocks.x * num_blocks.y));
+	glm::ivec3 first = b * block_size;
+	glm::ivec3 last = glm::min(first + glm::ivec3(block_size), cells);
+	glm::vec3 scale = 2.0f / glm::vec3(width, height, depth);
+	auto cellIndex = [&](const glm::ivec3& c) { return (unsigned int)(((size_t)c.z * cells.y + c.y) * cells.x + c.x); };
+
+	for (int z = first.z; z < last.z; ++z)
+		for (int y = first.y; y < last.y; ++y)
+			for (int x = first.x; x < last.x; ++x)
+			{
+				//corner k is at (k & 1, (k >> 1) & 1, k >> 2)
+				float values[8];
+				int mask = 0;
+				for (int k = 0; k < 8; ++k)
+				{
+					values[k] = getVoxel(x + (k & 1), y + ((k >> 1) & 1), z + (k >> 2));
+					mask |= (values[k] >= threshold) << k;
+				}
+				if (mask == 0 || mask == 255)
+					continue;
+
+				//average of the crossings of the 12 edges
+				glm::vec3 sum(0.0f);
+				int count = 0;
+				for (int k0 = 0; k0 < 8; ++k0)
+					for (int axis = 0; axis < 3; ++axis)
+					{
+						int k1 = k0 | (1 << axis);
+						if (k1 == k0 || ((mask >> k0) & 1) == ((mask >> k1) & 1))
+							continue;
+						glm::vec3 p((float)(k0 & 1), (float)((k0 >> 1) & 1), (float)(k0 >> 2));
+						p[axis] = (threshold - values[k0]) / (values[k1] - values[k0]);
+						sum += p;
+						count++;
+					}
+				glm::vec3 p = sum / (float)count;
+				glm::vec3 voxel = glm::vec3(x, y, z) + p;
+				auto cornerWeight = [&](int k) { return glm::vec3(k & 1 ? p.x : 1.0f - p.x, (k >> 1) & 1 ? p.y : 1.0f - p.y, k >> 2 ? p.z : 1.0f - p.z); };
+
+				//gradients of the voxels interpolated like the texture, the one of the cell where they cancel out
+				glm::vec3 gradient(0.0f);
+				for (int k = 0; k < 8; ++k)
+				{
+					glm::ivec3 corner(x + (k & 1), y + ((k >> 1) & 1), z + (k >> 2));
+					glm::vec3 weight = cornerWeight(k);
+					const float* g = &gradients[(((size_t)corner.z * height + corner.y) * width + corner.x) * 3];
+					gradient += glm::vec3(g[0], g[1], g[2]) * (weight.x * weight.y * weight.z);
+				}
+				if (glm::dot(gradient, gradient) <= 1e-12f)
+					for (int k = 0; k < 8; ++k)
+						for (int axis = 0; axis < 3; ++axis)
+						{
+							if (k & (1 << axis))
+								continue;
+							glm::vec3 weight = cornerWeight(k);
+							weight[axis] = 1.0f;
+							gradient[axis] += (values[k | (1 << axis)] - values[k]) * weight.x * weight.y * weight.z;
+						}
+
+				block.vertices.push_back((voxel + glm::vec3(0.5f)) * scale - glm::vec3(1.0f));
+				block.normals.push_back(glm::dot(gradient, gradient) > 0.0f ? -glm::normalize(gradient) : glm::vec3(0.0f, 1.0f, 0.0f));
+				block.cells.push_back(cellIndex(glm::ivec3(x, y, z)));
+
+				//a quad for every crossed edge that starts at the first corner, joining the cells around it
+				glm::ivec3 c(x, y, z);
+				for (int axis = 0; axis < 3; ++axis)
+				{
+					if ((mask & 1) == ((mask >> (1 << axis)) & 1))
+						continue;
+					int u = (axis + 1) % 3, v = (axis + 2) % 3;
+					if (c[u] == 0 || c[v] == 0)
+						continue;
+					glm::ivec3 du(0), dv(0);
+					du[u] = 1;
+					dv[v] = 1;
+					unsigned int quad[4] = { cellIndex(c - du - dv), cellIndex(c - dv), cellIndex(c), cellIndex(c - du) };
+
+					//counter clockwise around the axis, it faces the outside when the first corner is inside
+					if (mask & 1)
+						block.quads.insert(block.quads.end(), { quad[0], quad[1], quad[2], quad[3] });
+					else
+						block.quads.insert(block.quads.end(), { quad[0], quad[3], quad[2], quad[1] });
+				}
+			}
+}
+
+void IsosurfaceExtractor::buildMesh(std::vector<glm::vec3>& vertices, std::vector<glm::vec3>& normals, std::vector<unsigned int>& indices)
+{
+	double start = glfwGetTime();
+
+	std::vector<unsigned int> first_vertex(blocks.size() + 1, 0), first_index(blocks.size() + 1, 0);
+	for (size_t i = 0; i < blocks.size(); ++i)
+	{
+		first_vertex[i + 1] = first_vertex[i] + (unsigned int)blocks[i].vertices.size();
+		first_index[i + 1] = first_index[i] + (unsigned int)(blocks[i].quads.size() / 4 * 6);
+	}
+	vertices.resize(first_vertex.back());
+	normals.resize(first_vertex.back());
+	indices.resize(first_index.back());
+
+	//the quads of a block use the vertices of its neighbours, so all the cells get their vertex first
+	parallelFor((int)blocks.size(), [&](int begin, int end) {
+		for (int i = begin; i < end; ++i)
+		{
+			const sIsosurfaceBlock& block = blocks[i];
+			std::copy(block.vertices.begin(), block.vertices.end(), vertices.begin() + first_vertex[i]);
+			std::copy(block.normals.begin(), block.normals.end(), normals.begin() + first_vertex[i]);
+			for (size_t j = 0; j < block.cells.size(); ++j)
+				cell_vertex[block.cells[j]] = first_vertex[i] + (unsigned int)j;
+		}
+	}, 16);
+
+	parallelFor((int)blocks.size(), [&](int begin, int end) {
+		for (int i = begin; i < end; ++i)
+		{
+			const std::vector<unsigned int>& quads = blocks[i].quads;
+			unsigned int* triangles = indices.size() ? &indices[first_index[i]] : NULL;
+			for (size_t q = 0; q < quads.size(); q += 4)
+			{
+				unsigned int v[4] = { cell_vertex[quads[q]], cell_vertex[quads[q + 1]], cell_vertex[quads[q + 2]], cell_vertex[quads[q + 3]] };
+				const unsigned int order[6] = { 0, 1, 2, 0, 2, 3 };
+				for (int k = 0; k < 6; ++k)
+					*triangles++ = v[order[k]];
+			}
+		}
+	}, 16);
+
+	stats.vertices = (int)vertices.size();
+	stats.triangles = (int)(indices.size() / 3);
+	stats.build_time = glfwGetTime() - start;
+}
+
+void IsosurfaceExtractor::validate(int resolution)
+{
+	// soft spheres away from the borders, so every surface is closed
+	std::vector<float> data((size_t)resolution * resolution * resolution, 0.0f);
+	for (int s = 0; s < 12; ++s)
+	{
+		float radius = resolution * (0.08f + 0.1f * rand() / (float)RAND_MAX);
+		glm::vec3 center = glm::vec3(radius + 2.0f) + glm::vec3(rand(), rand(), rand()) / (float)RAND_MAX * (resolution - 2.0f * radius - 4.0f);
+		for (int z = 0; z < resolution; ++z)
+			for (int y = 0; y < resolution; ++y)
+				for (int x = 0; x < resolution; ++x)
+				{
+					float falloff = std::max(0.0f, 1.0f - glm::length(glm::vec3(x, y, z) - center) / radius);
+					float& value = data[((size_t)z * resolution + y) * resolution + x];
+					value = std::min(1.0f, value + falloff);
+				}
+	}
+
+	IsosurfaceExtractor incremental;
+	incremental.create(&data[0], resolution, resolution, resolution);
+	const float thresholds[] = { 0.5f, 0.45f, 0.3f, 0.32f, 0.7f, 0.15f };
+	for (float threshold : thresholds)
+	{
+		std::vector<glm::vec3> vertices, normals, full_vertices, full_normals;
+		std::vector<unsigned int> indices, full_indices;
+		incremental.update(threshold);
+		incremental.buildMesh(vertices, normals, indices);
+
+		IsosurfaceExtractor full;
+		full.create(&data[0], resolution, resolution, resolution);
+		full.update(threshold, true);
+		full.buildMesh(full_vertices, full_normals, full_indices);
+
+		// the same blocks extracted in the same order give the same arrays
+		bool same = vertices.size() == full_vertices.size() && indices == full_indices;
+		for (size_t i = 0; same && i < vertices.size(); ++i)
+			same = glm::length(vertices[i] - full_vertices[i]) == 0.0f && glm::length(normals[i] - full_normals[i]) == 0.0f;
+
+		// every edge used as many times in each direction
+		std::unordered_map<unsigned long long, int> edges;
+		for (size_t t = 0; t < indices.size(); t += 3)
+			for (int k = 0; k < 3; ++k)
+			{
+				unsigned int a = indices[t + k], b = indices[t + (k + 1) % 3];
+				edges[((unsigned long long)std::min(a, b) << 32) | std::max(a, b)] += a < b ? 1 : -1;
+			}
+		int open_edges = 0;
+		for (auto& it : edges)
+			open_edges += it.second != 0;
+
+		std::cout << " + Threshold " << threshold << ": " << incremental.stats.triangles << " triangles " << incremental.stats.vertices << " vertices, "
+			<< incremental.stats.dirty_blocks << " of " << full.stats.dirty_blocks << " blocks extracted in " << incremental.stats.extract_time * 1000.0 << "ms (all in "
+			<< full.stats.extract_time * 1000.0 << "ms), mesh built in " << incremental.stats.build_time * 1000.0 << "ms  "
+			<< (same ? "same as full" : "DIFFERENT from full") << ", " << open_edges << " open edges" << std::endl;
+	}
+}
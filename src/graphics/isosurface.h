@@ -0,0 +1,62 @@
+#pragma once
+
+#include <vector>
+
+#include <glm/vec2.hpp>
+#include <glm/vec3.hpp>
+
+struct sIsosurfaceStats
+{
+	int dirty_blocks = 0; //extracted again by the last update
+	int vertices = 0;
+	int triangles = 0;
+	double extract_time = 0.0; //of the last update, in seconds
+	double build_time = 0.0; //of the last buildMesh, in seconds
+};
+
+//part of the surface inside a block of cells
+struct sIsosurfaceBlock
+{
+	glm::vec2 range = glm::vec2(0.0f); //min and max of the voxels at the corners of its cells
+	std::vector<glm::vec3> vertices; //object space, the volume fills the cube [-1, 1]
+	std::vector<glm::vec3> normals;
+	std::vector<unsigned int> cells; //cell of every vertex
+	std::vector<unsigned int> quads; //four cells per quad, counter clockwise seen from outside
+};
+
+//surface where a density volume crosses a threshold (inside where the density is >= threshold), extracted with surface nets:
+//a vertex per cell of 2x2x2 voxels the surface goes through, at the average of its crossings, and a quad joining the four cells
+//around every edge it crosses. Vertices are shared by construction and get the normal of the interpolated density gradient.
+//The cells are grouped in blocks that keep their part of the surface, so a new threshold only extracts again the blocks whose
+//range contains the old or the new one. The blocks are split between threads
+class IsosurfaceExtractor
+{
+public:
+	int width = 0, height = 0, depth = 0; //voxels
+	int block_size = 8; //cells per side of the blocks
+	float threshold = -1.0f; //of the current surface, -1 before the first update
+	std::vector<sIsosurfaceBlock> blocks;
+	sIsosurfaceStats stats;
+
+	//copies the density (x first) and computes its gradients and the range of every block
+	void create(const float* density, int width, int height, int depth, int block_size = 8);
+
+	//extracts the blocks that changed, or every cell of all of them, returns false if the surface is the same
+	bool update(float threshold, bool all_blocks = false);
+
+	//the surface of all the blocks, three indices per triangle
+	void buildMesh(std::vector<glm::vec3>& vertices, std::vector<glm::vec3>& normals, std::vector<unsigned int>& indices);
+
+	//extracts the surface of soft spheres at several thresholds, checks the incremental updates give the same surface
+	//as extracting every block and that it is closed. Results are printed
+	static void validate(int resolution = 128);
+
+private:
+	std::vector<float> density;
+	std::vector<float> gradients; //3 per voxel, see computeVolumeGradients
+	std::vector<unsigned int> cell_vertex; //vertex of every cell in the last buildMesh
+	glm::ivec3 cells = glm::ivec3(0), num_blocks = glm::ivec3(0);
+
+	void extractBlock(int index); //appends the surface of its cells to the cleared block
+	float getVoxel(int x, int y, int z) const { return density[((size_t)z * height + y) * width + x]; }
+};
@@ -1,10 +1,14 @@
 #include "material.h"
 
 #include "application.h"
+#include "fbo.h"
+#include "../framework/noise.h"
+#include "../framework/volume.h"
 
 #include <istream>
 #include <fstream>
 #include <algorithm>
+#include <type_traits>
 
 /////////////////////////// BASE MATERIALS ///////////////////////////
 
@@ -84,7 +88,12 @@ StandardMaterial::StandardMaterial(glm::vec4 color)
 	this->shader = this->base_shader;
 }
 
-StandardMaterial::~StandardMaterial() { }
+StandardMaterial::~StandardMaterial()
+{
+	//the provider of the virtual volume reads the grids of the reader
+	delete this->virtual_volume;
+	delete this->vdb_reader;
+}
 
 void StandardMaterial::setUniforms(Camera* camera, glm::mat4 model)
 {
@@ -118,6 +127,11 @@ void StandardMaterial::renderInMenu()
 void StandardMaterial::render(Mesh* mesh, glm::mat4 model, Camera* camera)
 {
 	bool first_pass = true;
+
+	//the volume shaders only need the fragments of the bricks with density
+	if (hasVolumeProxy())
+		mesh = this->proxy_mesh;
+
 	if (mesh && this->shader)
 	{
 		// enable shader
@@ -139,7 +153,10 @@ void StandardMaterial::render(Mesh* mesh, glm::mat4 model, Camera* camera)
 			}
 
 			this->shader->setUniform("u_ambient_light", Application::instance->ambient_light * (float)first_pass);
-			this->shader->setUniform("u_background_light", Application::instance->background_light);
+			// offscreen volumes are composited later over the scene, they need a transparent background
+			glm::vec4 background = Application::instance->volume_pass ? glm::vec4(0.f) : Application::instance->background_light;
+			this->shader->setUniform("u_background_light", background);
+			this->shader->setUniform("u_jitter", Application::instance->volume_jitter);
 
 			if (num_lights > 0) {
 				Light* light = Application::instance->light_list[nlight];
@@ -218,7 +235,7 @@ void VolumeMaterial::setUniforms(Camera* camera, glm::mat4 model)
 	this->shader->setUniform("u_abs_coef", this->absorption_coef);
 
 	// STEP LENGTH
-	this->shader->setUniform("u_step_length", this->step_length);
+	this->shader->setUniform("u_step_length", this->step_length * Application::instance->volume_step_scale);
 
 	// NOISE SCALE
 	this->shader->setUniform("u_noise_scale", this->noise_scale);
@@ -226,9 +243,15 @@ void VolumeMaterial::setUniforms(Camera* camera, glm::mat4 model)
 	// NOISE DETAIL
 	this->shader->setUniform("u_noise_detail", this->noise_detail);
 
+	// heterogeneous and emission-absorption
+	if (this->current_shader == 3 || this->current_shader == 4)
+		updateNoiseTexture(this->noise_scale, this->noise_detail);
+
 	// SCAT COEF
 	this->shader->setUniform("u_scat_coef", this->scattering_coef);
 
+	// Bounds and adaptive step
+	setVolumeUniforms(model);
 }
 
 
@@ -272,6 +295,7 @@ void VolumeMaterial::renderInMenu()
 
 	ImGui::DragFloat("Scattering Coefficient", (float*)&this->scattering_coef, 0.1f, 0.5);
 
+	renderVolumeInMenu();
 }
 
 RabbitMaterial::RabbitMaterial(glm::vec4 color) {
@@ -302,7 +326,7 @@ void RabbitMaterial::setUniforms(Camera* camera, glm::mat4 model)
 	this->shader->setUniform("u_abs_coef", this->absorption_coef);
 
 	// STEP LENGTH
-	this->shader->setUniform("u_step_length", this->step_length);
+	this->shader->setUniform("u_step_length", this->step_length * Application::instance->volume_step_scale);
 
 	// NOISE SCALE
 	this->shader->setUniform("u_noise_scale", this->noise_scale);
@@ -317,6 +341,12 @@ void RabbitMaterial::setUniforms(Camera* camera, glm::mat4 model)
 	// Density Type
 	this->shader->setUniform("u_density_type", this->density_type);
 
+	if (this->density_type == 1)
+		updateNoiseTexture(this->noise_scale, this->noise_detail);
+
+	// Bounds
+	setVolumeUniforms(model);
+
 }
 
 void RabbitMaterial::renderInMenu()
@@ -325,6 +355,8 @@ void RabbitMaterial::renderInMenu()
 
 	ImGui::Combo("Shader Type", &this->density_type, "Constant Density\0 3D Noise\0Rabbit");
 
+	renderVolumeInMenu();
+
 
 	if (!this->show_normals) ImGui::ColorEdit3("Color", (float*)&this->color);
 
@@ -342,11 +374,21 @@ void RabbitMaterial::renderInMenu()
 
 void StandardMaterial::loadVDB(std::string file_path)
 {
-	easyVDB::OpenVDBReader* vdbReader = new easyVDB::OpenVDBReader();
-	vdbReader->read(file_path);
+	// the virtual volume reads the grid of the previous reader, both are replaced
+	delete this->virtual_volume;
+	this->virtual_volume = NULL;
+	delete this->vdb_reader;
+	this->vdb_reader = new easyVDB::OpenVDBReader();
+	this->vdb_reader->read(file_path);
 
 	// now, read the grid from the vdbReader and store the data in a 3D texture
-	estimate3DTexture(vdbReader);
+	estimate3DTexture(this->vdb_reader);
+}
+
+// density read by the shaders, the R8 texture clamps the values to [0,1]
+static float textureDensity(float value)
+{
+	return std::min(std::max(value, 0.0f), 1.0f);
 }
 
 void StandardMaterial::estimate3DTexture(easyVDB::OpenVDBReader* vdbReader)
@@ -459,11 +501,646 @@ void StandardMaterial::estimate3DTexture(easyVDB::OpenVDBReader* vdbReader)
 		// now we create the texture with the data
 		// use this: https://www.khronos.org/opengl/wiki/OpenGL_Type
 		// and this: https://registry.khronos.org/OpenGL-Refpages/gl4/html/glTexImage3D.xhtml
+		std::vector<float> density(data, data + resolutionPow3);
+		for (float& value : density)
+			value = textureDensity(value);
+
+		sEncodedVolume encoded;
+		encodeVolume(&density[0], resolution, resolution, resolution, this->density_format, encoded, VOLUME_BRICK_SIZE);
 		this->texture = new Texture();
-		this->texture->create3D(resolution, resolution, resolution, GL_RED, GL_FLOAT, false, data, GL_R8);
+		this->texture->create3D(encoded);
+
+		std::vector<float> decoded;
+		decodeVolume(encoded, decoded);
+		this->density_bytes = encoded.getBytesPerVoxel();
+		this->density_error = measureVolumeError(&density[0], &decoded[0], decoded.size());
+		std::cout << " + Density " << getVolumeFormatName(this->density_format) << ": " << this->density_bytes << " bytes per voxel, max error "
+			<< this->density_error.max_error << ", RMSE " << this->density_error.rmse << std::endl;
+
+		// box filtered levels of the density as the texture reads it, for the steps and pixels that cover several voxels
+		std::vector<std::vector<float>> mips;
+		buildVolumeMips(&density[0], resolution, resolution, resolution, VOLUME_FILTER_BOX, mips);
+		this->texture->upload3DMipmaps(mips);
+
+		// proxy geometry with the bricks that have density, it also gives the tight bounds for the rays
+		if (!this->proxy_mesh)
+			this->proxy_mesh = new Mesh();
+		if (this->proxy_mesh->createVolumeProxy(data, resolution, resolution, resolution)) {
+			this->proxy_mesh->uploadToVRAM();
+			BoundingBox& box = this->proxy_mesh->box;
+			std::cout << " + Volume proxy: " << this->proxy_mesh->vertices.size() / 3 << " triangles, "
+				<< (int)(100 * box.halfsize.x * box.halfsize.y * box.halfsize.z) << "% of the cube in the bounds" << std::endl;
+		}
+		else {
+			delete this->proxy_mesh;
+			this->proxy_mesh = NULL;
+		}
+
+		// min and max of the bricks for the adaptive steps
+		createBrickRanges(data, resolution);
+
+		// the same grid at a higher resolution, read brick by brick when the rays reach them
+		glm::vec3 virtual_step = step * (float)resolution / (float)this->virtual_resolution;
+		glm::vec3 first_voxel = target - step * 0.5f + virtual_step * 0.5f;
+		int virtual_resolution = this->virtual_resolution;
+
+		// the same splat of every voxel over its neighbours, with the radius in voxels of the virtual resolution.
+		// a virtual voxel is a fraction of a voxel of the texture, so its splat is scaled by it and the sums match
+		struct sSplat { glm::ivec3 offset; float weight; };
+		std::vector<sSplat> splat;
+		float virtual_scale = (float)virtual_resolution / resolution;
+		float virtual_radius = radius * virtual_scale;
+		int virtualBleed = (int)virtual_radius;
+		for (int sz = -virtualBleed; sz < virtualBleed; sz++)
+			for (int sy = -virtualBleed; sy < virtualBleed; sy++)
+				for (int sx = -virtualBleed; sx < virtualBleed; sx++) {
+					float offset = std::max(0.0, std::min(1.0, 1.0 - std::hypot(sx, sy, sz) / (virtual_radius / 2.0)));
+					if (offset > 0.0f)
+						splat.push_back({ glm::ivec3(sx, sy, sz), offset / (virtual_scale * virtual_scale * virtual_scale) });
+				}
+		if (!virtualBleed)
+			splat.push_back({ glm::ivec3(0), 1.0f });
+
+		if (!this->virtual_volume)
+			this->virtual_volume = new VirtualVolume();
+		this->virtual_volume->create(virtual_resolution, VOLUME_BRICK_SIZE, 16, [&grid, first_voxel, virtual_step, virtual_resolution, virtualBleed, splat](const glm::ivec3& first, int size, float* brick) {
+			// values of the voxels that splat over the brick, read once
+			glm::ivec3 last_voxel(virtual_resolution - 1);
+			glm::ivec3 low = glm::max(glm::clamp(first, glm::ivec3(0), last_voxel) - glm::ivec3(virtualBleed), glm::ivec3(0));
+			glm::ivec3 high = glm::min(glm::clamp(first + glm::ivec3(size - 1), glm::ivec3(0), last_voxel) + glm::ivec3(virtualBleed), last_voxel);
+			glm::ivec3 extent = high - low + glm::ivec3(1);
+			std::vector<float> values((size_t)extent.x * extent.y * extent.z);
+			for (int z = 0; z < extent.z; ++z)
+				for (int y = 0; y < extent.y; ++y)
+					for (int x = 0; x < extent.x; ++x)
+						values[x + (y + (size_t)z * extent.y) * extent.x] = grid.getValue(first_voxel + virtual_step * glm::vec3(low + glm::ivec3(x, y, z)));
+
+			for (int z = 0; z < size; ++z)
+				for (int y = 0; y < size; ++y)
+					for (int x = 0; x < size; ++x) {
+						glm::ivec3 voxel = glm::clamp(first + glm::ivec3(x, y, z), glm::ivec3(0), last_voxel);
+						float value = 0.0f;
+						for (const sSplat& s : splat) {
+							glm::ivec3 source = voxel - s.offset - low;
+							if (source.x < 0 || source.y < 0 || source.z < 0 || source.x >= extent.x || source.y >= extent.y || source.z >= extent.z)
+								continue;
+							value += s.weight * values[source.x + (source.y + (size_t)source.z * extent.y) * extent.x] * 255.f;
+							value = std::min(value, 255.f);
+						}
+						brick[x + (y + z * size) * size] = textureDensity(value);
+					}
+		});
+
+		delete[] data;
+	}
+}
+
+// min and max of every brick, one voxel around it included because the trilinear samples inside it also read them.
+// The bricks match the texels of a texture with (resolution / brick_size)^3 texels when the resolution is a multiple
+static void computeBrickRanges(const float* data, int resolution, int brick_size, std::vector<glm::vec2>& ranges)
+{
+	int bricks = (resolution + brick_size - 1) / brick_size;
+	ranges.assign(bricks * bricks * bricks, glm::vec2(1.0f, 0.0f));
+	for (int bz = 0; bz < bricks; ++bz)
+		for (int by = 0; by < bricks; ++by)
+			for (int bx = 0; bx < bricks; ++bx)
+			{
+				glm::vec2& range = ranges[bx + by * bricks + bz * bricks * bricks];
+				glm::ivec3 first = glm::max(glm::ivec3(bx, by, bz) * brick_size - glm::ivec3(1), glm::ivec3(0));
+				glm::ivec3 last = glm::min(glm::ivec3(bx + 1, by + 1, bz + 1) * brick_size, glm::ivec3(resolution - 1));
+				for (int z = first.z; z <= last.z; ++z)
+					for (int y = first.y; y <= last.y; ++y)
+						for (int x = first.x; x <= last.x; ++x)
+						{
+							float value = textureDensity(data[x + y * resolution + z * resolution * resolution]);
+							range.x = std::min(range.x, value);
+							range.y = std::max(range.y, value);
+						}
+			}
+}
+
+void StandardMaterial::createBrickRanges(const float* data, int resolution)
+{
+	std::vector<glm::vec2> ranges;
+	computeBrickRanges(data, resolution, VOLUME_BRICK_SIZE, ranges);
+	int bricks = (resolution + VOLUME_BRICK_SIZE - 1) / VOLUME_BRICK_SIZE;
+
+	if (!this->range_texture)
+		this->range_texture = new Texture();
+	this->range_texture->create3D(bricks, bricks, bricks, GL_RG, GL_FLOAT, false, (float*)&ranges[0], GL_RG16F);
+
+	// the shaders read a whole brick, never between two
+	glBindTexture(GL_TEXTURE_3D, this->range_texture->texture_id);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glBindTexture(GL_TEXTURE_3D, 0);
+}
+
+bool StandardMaterial::ray_stats = false;
+float StandardMaterial::samples_per_ray = 0.0f;
+static GLuint ray_stats_ssbo = 0; //number of rays and samples, binding 2 of the volume shaders
+
+void StandardMaterial::updateRayStats()
+{
+	if (!ray_stats)
+		return;
+
+	GLuint counts[2] = { 0, 0 };
+	if (!ray_stats_ssbo) {
+		glGenBuffers(1, &ray_stats_ssbo);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, ray_stats_ssbo);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(counts), counts, GL_DYNAMIC_READ);
+	}
+	else {
+		// counts of the last frame, waits for it to finish so only while the stats are enabled
+		glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, ray_stats_ssbo);
+		glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(counts), counts);
+		if (counts[0])
+			samples_per_ray = (float)counts[1] / counts[0];
+		counts[0] = counts[1] = 0;
+		glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(counts), counts);
+	}
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, ray_stats_ssbo);
+}
+
+void StandardMaterial::updateNoiseTexture(float scale, float detail)
+{
+	if (!this->use_noise_texture || (this->baked_noise.x == scale && this->baked_noise.y == detail))
+		return;
+	this->baked_noise = glm::vec2(scale, detail);
+
+	// the finer octaves would alias in the texture, the shaders evaluate them
+	this->noise_octaves = getBakeableOctaves(this->noise_resolution, 2.0f, scale, detail);
+	if (!this->noise_octaves) {
+		delete this->noise_texture;
+		this->noise_texture = NULL;
+		return;
+	}
+
+	// 4 voxels per period of the finest octave baked, in whole bricks
+	int resolution = (int)ceilf(8.0f * scale * (float)(1 << (this->noise_octaves - 1)));
+	resolution = std::min(this->noise_resolution, (resolution + VOLUME_BRICK_SIZE - 1) / VOLUME_BRICK_SIZE * VOLUME_BRICK_SIZE);
+
+	std::vector<float> data;
+	bakeNoiseOctaves(resolution, glm::vec3(-1.0f), glm::vec3(1.0f), scale, this->noise_octaves, data);
+	sEncodedVolume encoded;
+	encodeVolume(&data[0], resolution, resolution, resolution, this->noise_format, encoded, VOLUME_BRICK_SIZE);
+
+	if (!this->noise_texture)
+		this->noise_texture = new Texture();
+	this->noise_texture->create3D(encoded);
+
+	// mirrored so the samples just outside the box continue the noise without a seam
+	glBindTexture(GL_TEXTURE_3D, this->noise_texture->texture_id);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_MIRRORED_REPEAT);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_MIRRORED_REPEAT);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_MIRRORED_REPEAT);
+	glBindTexture(GL_TEXTURE_3D, 0);
+}
+
+void StandardMaterial::setVolumeUniforms(const glm::mat4& model)
+{
+	// bounds of the proxy, the whole cube when there is no proxy
+	glm::vec3 box_min(-1.f), box_max(1.f);
+	if (hasVolumeProxy()) {
+		box_min = this->proxy_mesh->box.center - this->proxy_mesh->box.halfsize;
+		box_max = this->proxy_mesh->box.center + this->proxy_mesh->box.halfsize;
+	}
+	this->shader->setUniform("u_box_min", box_min);
+	this->shader->setUniform("u_box_max", box_max);
+
+	// the ranges only say something about the density when the shader reads the texture
+	this->shader->setUniform("u_step_growth", this->step_growth);
+	this->shader->setUniform("u_use_adaptive_step", this->adaptive_step && this->range_texture && usesDensityTexture());
+	if (this->range_texture)
+		this->shader->setUniform("u_range_texture", this->range_texture, 1);
+
+	this->shader->setUniform("u_use_noise_texture", this->use_noise_texture && this->noise_texture);
+	if (this->noise_texture) {
+		this->shader->setUniform("u_noise_texture", this->noise_texture, 2);
+		this->shader->setUniform("u_noise_octaves", this->noise_octaves);
+	}
+
+	// angle of a pixel of the volume pass, for the footprint of the samples far from the camera
+	Camera* camera = Application::instance->camera;
+	float pixel_angle = 2.0f * tanf(glm::radians(camera->fov) * 0.5f) * (1 << Application::instance->volume_resolution) / std::max(Application::instance->window_height, 1);
+	this->shader->setUniform("u_use_lod", this->use_density_lod && this->texture && this->texture->mipmaps);
+	this->shader->setUniform("u_lod_bias", this->lod_bias);
+	this->shader->setUniform("u_pixel_angle", pixel_angle);
+
+	// the pages the rays touched last frame are loaded once per frame
+	if (this->virtual_volume && this->use_virtual_volume && usesDensityTexture()) {
+		if (this->virtual_frame != Application::instance->frame) {
+			glm::vec3 eye = glm::vec3(glm::inverse(model) * glm::vec4(camera->eye, 1.0f)) * 0.5f + glm::vec3(0.5f);
+			this->virtual_volume->update(eye);
+			this->virtual_frame = Application::instance->frame;
+		}
+		this->virtual_volume->setUniforms(this->shader, 3);
+	}
+	else {
+		// the integer sampler can not share the unit of the density
+		this->shader->setUniform("u_use_virtual", false);
+		this->shader->setUniform("u_page_table", 3);
+		this->shader->setUniform("u_brick_atlas", 4);
+	}
+
+	this->shader->setUniform("u_min_transmittance", this->min_transmittance);
+	this->shader->setUniform("u_ray_stats", ray_stats && ray_stats_ssbo != 0);
+}
+
+void StandardMaterial::renderVolumeInMenu()
+{
+	if (this->proxy_mesh) ImGui::Checkbox("Use Proxy Geometry", &this->use_proxy);
+
+	if (this->range_texture) ImGui::Checkbox("Adaptive Step", &this->adaptive_step);
+
+	ImGui::DragFloat("Step Growth", (float*)&this->step_growth, 0.005f, 0.0f, 1.0f);
+
+	if (this->noise_texture) {
+		ImGui::Checkbox("Baked Noise", &this->use_noise_texture);
+		// baked again in the new format the next time it is used
+		if (ImGui::Combo("Noise Format", (int*)&this->noise_format, "R8\0R8 brick\0R16F\0BC4\0"))
+			this->baked_noise = glm::vec2(-1.0f);
+	}
+
+	if (this->texture && this->density_bytes > 0.0f)
+		ImGui::Text("Density %s: %.2f bytes per voxel, RMSE %.5f", getVolumeFormatName(this->density_format), this->density_bytes, this->density_error.rmse);
+
+	if (this->virtual_volume) {
+		ImGui::Checkbox("Virtual Volume", &this->use_virtual_volume);
+		if (this->use_virtual_volume) {
+			const VolumeResidency& residency = this->virtual_volume->residency;
+			ImGui::Text("%d^3: %d/%d bricks resident, %d loads %d evictions %d deferred", this->virtual_volume->resolution, residency.getNumResident(),
+				(int)residency.slot_page.size(), residency.stats.loads, residency.stats.evictions, residency.stats.deferred);
+		}
+	}
+
+	if (this->texture && this->texture->mipmaps) {
+		ImGui::Checkbox("Density LOD", &this->use_density_lod);
+		ImGui::SliderFloat("LOD Bias", (float*)&this->lod_bias, -2.0f, 2.0f);
+	}
+
+	ImGui::SliderFloat("Min Transmittance", (float*)&this->min_transmittance, 0.0f, 0.1f, "%.3f");
+
+	ImGui::Checkbox("Ray Statistics", &ray_stats);
+	if (ray_stats) {
+		ImGui::SameLine();
+		ImGui::Text("%.1f samples per ray", samples_per_ray);
 	}
 }
 
+// GL_LINEAR and GL_CLAMP_TO_EDGE sample of the density texture, without texture_values of any other volume
+static float sampleDensity(const float* data, int resolution, const glm::vec3& coords, bool texture_values = true)
+{
+	glm::vec3 p = glm::clamp(coords * (float)resolution - glm::vec3(0.5f), glm::vec3(0.0f), glm::vec3(resolution - 1.0f));
+	glm::ivec3 i0 = glm::ivec3(p);
+	glm::ivec3 i1 = glm::min(i0 + glm::ivec3(1), glm::ivec3(resolution - 1));
+	glm::vec3 f = p - glm::vec3(i0);
+
+	float value = 0.0f;
+	for (int k = 0; k < 8; ++k)
+	{
+		glm::ivec3 i((k & 1) ? i1.x : i0.x, (k & 2) ? i1.y : i0.y, (k & 4) ? i1.z : i0.z);
+		float weight = ((k & 1) ? f.x : 1.0f - f.x) * ((k & 2) ? f.y : 1.0f - f.y) * ((k & 4) ? f.z : 1.0f - f.z);
+		float voxel = data[i.x + i.y * resolution + i.z * resolution * resolution];
+		value += weight * (texture_values ? textureDensity(voxel) : voxel);
+	}
+	return value;
+}
+
+// same as adaptiveStep in the shaders
+static float adaptiveStep(const std::vector<glm::vec2>& ranges, int bricks, float step_length, float growth, bool adaptive, float t, const glm::vec3& coords, const glm::vec3& dir)
+{
+	float dt = step_length * (1.0f + growth * t);
+	if (!adaptive)
+		return dt;
+
+	glm::ivec3 brick = glm::clamp(glm::ivec3(glm::floor(coords * (float)bricks)), glm::ivec3(0), glm::ivec3(bricks - 1));
+	glm::vec2 range = ranges[brick.x + brick.y * bricks + brick.z * bricks * bricks];
+
+	float exit = 1e6f;
+	for (int i = 0; i < 3; ++i)
+		if (fabsf(dir[i]) > 1e-6f)
+			exit = std::min(exit, ((brick[i] + (dir[i] >= 0.0f ? 1.0f : 0.0f)) / bricks - coords[i]) / dir[i]);
+	exit += 0.001f;
+
+	if (range.y <= 0.0f)
+		return std::max(dt, exit);
+	if (range.y - range.x < 0.02f)
+		return std::max(dt, std::min(4.0f * dt, exit));
+	return dt;
+}
+
+void StandardMaterial::benchmarkAdaptiveStep(int num_rays)
+{
+	// blobs with a saturated core and a smooth border in a mostly empty volume, like a cloud
+	const int resolution = 128;
+	const glm::vec4 blobs[3] = { glm::vec4(-0.3f, 0.1f, 0.0f, 0.45f), glm::vec4(0.35f, -0.2f, 0.2f, 0.3f), glm::vec4(0.1f, 0.45f, -0.3f, 0.25f) };
+	std::vector<float> data(resolution * resolution * resolution, 0.0f);
+	for (int z = 0; z < resolution; ++z)
+		for (int y = 0; y < resolution; ++y)
+			for (int x = 0; x < resolution; ++x)
+			{
+				glm::vec3 p = (glm::vec3(x, y, z) + glm::vec3(0.5f)) / (float)resolution * 2.0f - glm::vec3(1.0f);
+				float& value = data[x + y * resolution + z * resolution * resolution];
+				for (const glm::vec4& blob : blobs)
+					value = std::max(value, std::min(1.0f, 2.0f * (1.0f - glm::length(p - glm::vec3(blob)) / blob.w)));
+			}
+
+	std::vector<glm::vec2> ranges;
+	computeBrickRanges(&data[0], resolution, VOLUME_BRICK_SIZE, ranges);
+	int bricks = resolution / VOLUME_BRICK_SIZE;
+
+	// rays from around the volume to points inside it, in object space with a model of identity
+	std::vector<glm::vec3> origins(num_rays), directions(num_rays);
+	for (int i = 0; i < num_rays; ++i)
+	{
+		glm::vec3 around = glm::vec3(rand(), rand(), rand()) / (float)RAND_MAX * 2.0f - glm::vec3(1.0f);
+		origins[i] = glm::normalize(around + glm::vec3(0.0f, 0.0f, 0.001f)) * 3.0f;
+		glm::vec3 target = (glm::vec3(rand(), rand(), rand()) / (float)RAND_MAX * 2.0f - glm::vec3(1.0f)) * 0.9f;
+		directions[i] = glm::normalize(target - origins[i]);
+	}
+
+	const float step_length = 0.05f;
+	const float absorption_coef = 2.0f;
+	const float tolerance = 0.01f;
+	std::vector<float> reference(num_rays);
+
+	// fixed steps first, then the adaptive ones without and with growth, and stopping the opaque rays
+	for (int mode = 0; mode < 4; ++mode)
+	{
+		bool adaptive = mode > 0;
+		float growth = mode == 2 ? 0.05f : 0.0f;
+		float min_transmittance = mode == 3 ? 0.01f : 0.0f;
+		long samples = 0;
+		double max_error = 0.0, error_sum = 0.0;
+		int outside = 0;
+
+		double start = glfwGetTime();
+		for (int i = 0; i < num_rays; ++i)
+		{
+			glm::vec3 t_min = (glm::vec3(-1.0f) - origins[i]) / directions[i];
+			glm::vec3 t_max = (glm::vec3(1.0f) - origins[i]) / directions[i];
+			glm::vec3 t1 = glm::min(t_min, t_max), t2 = glm::max(t_min, t_max);
+			float t_near = std::max(std::max(t1.x, t1.y), t1.z);
+			float t_far = std::min(std::min(t2.x, t2.y), t2.z);
+
+			float thickness = 0.0f, dt = step_length;
+			for (float t = t_near; t < t_far; t += dt)
+			{
+				glm::vec3 coords = (origins[i] + directions[i] * t) * 0.5f + glm::vec3(0.5f);
+				dt = adaptiveStep(ranges, bricks, step_length, growth, adaptive, t, coords, directions[i] * 0.5f);
+				thickness += sampleDensity(&data[0], resolution, coords) * absorption_coef * dt;
+				samples++;
+				if (expf(-thickness) < min_transmittance)
+					break;
+			}
+
+			float transmittance = expf(-thickness);
+			if (!adaptive)
+				reference[i] = transmittance;
+			double error = fabs(transmittance - reference[i]);
+			max_error = std::max(max_error, error);
+			error_sum += error;
+			outside += error > tolerance;
+		}
+		double time = glfwGetTime() - start;
+
+		const char* names[4] = { "Fixed step", "Adaptive step", "Adaptive step with growth 0.05", "Adaptive step with min transmittance 0.01" };
+		std::cout << " + " << names[mode] << ": " << (double)samples / num_rays << " samples per ray, " << time * 1000.0 << "ms";
+		if (adaptive)
+			std::cout << "  transmittance error avg: " << error_sum / num_rays << " max: " << max_error << "  rays above " << tolerance << ": " << 100.0 * outside / num_rays << "%";
+		std::cout << std::endl;
+	}
+}
+
+void StandardMaterial::validateNoise(float scale, float detail)
+{
+	const int size = 256;
+	const float tolerance = 0.01f;
+
+	StandardMaterial material;
+	double start = glfwGetTime();
+	material.updateNoiseTexture(scale, detail);
+	double bake_time = glfwGetTime() - start;
+	if (!material.noise_texture) {
+		std::cout << " + Noise scale " << scale << " is too high to bake any octave in " << material.noise_resolution << "^3" << std::endl;
+		return;
+	}
+
+	// one point per pixel, the shader evaluates the fBm and samples the texture in the same ones
+	FBO fbo;
+	fbo.create(size, size, 1, GL_RG, GL_FLOAT, false, GL_RG32F);
+	std::vector<glm::vec2> gpu(size * size);
+	Shader* shader = Shader::Get("res/shaders/screen.vs", "res/shaders/noise_check.fs");
+
+	fbo.bind();
+	glDisable(GL_DEPTH_TEST);
+	glDisable(GL_BLEND);
+	shader->enable();
+	shader->setUniform("u_noise_scale", scale);
+	shader->setUniform("u_noise_detail", detail);
+	shader->setUniform("u_size", (float)size);
+	shader->setUniform("u_noise_texture", material.noise_texture, 0);
+	shader->setUniform("u_noise_octaves", material.noise_octaves);
+	Mesh::getQuad()->render(GL_TRIANGLES);
+	shader->disable();
+	glReadPixels(0, 0, size, size, GL_RG, GL_FLOAT, &gpu[0]);
+	fbo.unbind();
+	glEnable(GL_DEPTH_TEST);
+
+	double function_error = 0.0, function_max = 0.0, texture_error = 0.0, texture_max = 0.0;
+	int function_outside = 0;
+	for (int y = 0; y < size; ++y)
+		for (int x = 0; x < size; ++x)
+		{
+			glm::vec3 p = glm::vec3(x / (size - 1.0f), y / (size - 1.0f), fmodf((x * 7.0f + y * 13.0f) / 256.0f, 1.0f)) * 2.0f - glm::vec3(1.0f);
+			float value = cnoise(p, scale, detail);
+			const glm::vec2& result = gpu[x + y * size];
+
+			double error = fabs(result.x - value);
+			function_error += error;
+			function_max = std::max(function_max, error);
+			function_outside += error > tolerance;
+
+			error = fabs(result.y - value);
+			texture_error += error;
+			texture_max = std::max(texture_max, error);
+		}
+
+	int count = size * size;
+	std::cout << " + Noise scale " << scale << " detail " << detail << ", " << material.noise_octaves << " octaves in " << material.noise_texture->width << "^3 baked in " << bake_time * 1000.0 << "ms" << std::endl;
+	std::cout << " + Shader fBm vs CPU: error avg " << function_error / count << " max " << function_max << "  points above " << tolerance << ": " << 100.0 * function_outside / count << "%" << std::endl;
+	std::cout << " + Baked texture vs CPU: error avg " << texture_error / count << " max " << texture_max << std::endl;
+
+	delete material.noise_texture;
+}
+void StandardMaterial::benchmarkNoise(int num_points, float scale, float detail)
+{
+	std::vector<float> x(num_points), y(num_points), z(num_points);
+	for (int i = 0; i < num_points; ++i)
+	{
+		x[i] = rand() / (float)RAND_MAX * 2.0f - 1.0f;
+		y[i] = rand() / (float)RAND_MAX * 2.0f - 1.0f;
+		z[i] = rand() / (float)RAND_MAX * 2.0f - 1.0f;
+	}
+	std::vector<float> scalar(num_points), batch(num_points), threaded(num_points);
+
+	double start = glfwGetTime();
+	for (int i = 0; i < num_points; ++i)
+		scalar[i] = cnoise(glm::vec3(x[i], y[i], z[i]), scale, detail);
+	double scalar_time = glfwGetTime() - start;
+
+	start = glfwGetTime();
+	cnoiseBatch(&x[0], &y[0], &z[0], num_points, scale, detail, &batch[0]);
+	double batch_time = glfwGetTime() - start;
+
+	start = glfwGetTime();
+	parallelFor(num_points, [&](int begin, int end) {
+		cnoiseBatch(&x[begin], &y[begin], &z[begin], end - begin, scale, detail, &threaded[begin]);
+	}, 4096);
+	double threaded_time = glfwGetTime() - start;
+
+	double max_error = 0.0;
+	int different = 0;
+	for (int i = 0; i < num_points; ++i)
+	{
+		max_error = std::max(max_error, (double)fabsf(batch[i] - scalar[i]));
+		different += batch[i] != scalar[i] || threaded[i] != batch[i];
+	}
+
+	std::cout << " + Noise " << num_points << " points, " << (int)detail + 1 << " octaves" << std::endl;
+	std::cout << " + Scalar: " << num_points / scalar_time * 1e-9 << " Gsamples/s" << std::endl;
+	std::cout << " + Batch of " << getNoiseBatchWidth() << ": " << num_points / batch_time * 1e-9 << " Gsamples/s, "
+		<< num_points / threaded_time * 1e-9 << " Gsamples/s with all the threads" << std::endl;
+	std::cout << " + Batch vs scalar: max error " << max_error << ", " << different << " different results" << std::endl;
+}
+// straightforward 2x2x2 reduction of every voxel, what downsampleVolume has to match
+template <typename T>
+static void naiveDownsample(const T* data, int width, int height, int depth, eVolumeFilter filter, std::vector<T>& result)
+{
+	int w = getVolumeMipSize(width), h = getVolumeMipSize(height), d = getVolumeMipSize(depth);
+	result.resize((size_t)w * h * d);
+	for (int z = 0; z < d; ++z)
+		for (int y = 0; y < h; ++y)
+			for (int x = 0; x < w; ++x)
+			{
+				double sum = 0.0, max = 0.0;
+				for (int k = 0; k < 8; ++k)
+				{
+					int sx = std::min(2 * x + (k & 1), width - 1);
+					int sy = std::min(2 * y + ((k >> 1) & 1), height - 1);
+					int sz = std::min(2 * z + ((k >> 2) & 1), depth - 1);
+					double value = data[((size_t)sz * height + sy) * width + sx];
+					sum += value;
+					max = k ? std::max(max, value) : value;
+				}
+				double value = filter == VOLUME_FILTER_MAX ? max : sum / 8.0;
+				result[((size_t)z * h + y) * w + x] = std::is_integral<T>::value ? (T)floor(value + 0.5) : (T)value;
+			}
+}
+
+template <typename T>
+static void validateVolumeMipsT(const char* name, int width, int height, int depth, eVolumeFilter filter)
+{
+	std::vector<T> data((size_t)width * height * depth);
+	for (T& value : data)
+		value = std::is_integral<T>::value ? (T)(rand() % 256) : (T)(rand() / (double)RAND_MAX);
+
+	double start = glfwGetTime();
+	std::vector<std::vector<T>> levels;
+	buildVolumeMips(&data[0], width, height, depth, filter, levels);
+	double time = glfwGetTime() - start;
+
+	// every level against the naive reduction of the previous one, so the errors do not accumulate
+	double max_error = 0.0, naive_time = 0.0;
+	const T* source = &data[0];
+	int w = width, h = height, d = depth;
+	std::vector<T> reference;
+	for (const std::vector<T>& level : levels)
+	{
+		start = glfwGetTime();
+		naiveDownsample(source, w, h, d, filter, reference);
+		naive_time += glfwGetTime() - start;
+		for (size_t i = 0; i < level.size(); ++i)
+			max_error = std::max(max_error, fabs((double)level[i] - (double)reference[i]));
+		source = &level[0];
+		w = getVolumeMipSize(w); h = getVolumeMipSize(h); d = getVolumeMipSize(d);
+	}
+
+	std::cout << " + " << name << " " << width << "x" << height << "x" << depth << (filter == VOLUME_FILTER_MAX ? " max" : " box") << ": "
+		<< levels.size() << " levels in " << time * 1000.0 << "ms (naive " << naive_time * 1000.0 << "ms)  max error " << max_error << std::endl;
+}
+
+void StandardMaterial::validateVolumeMips()
+{
+	// powers of two like the density texture and odd sizes that repeat the last voxel
+	for (int filter = VOLUME_FILTER_BOX; filter <= VOLUME_FILTER_MAX; ++filter)
+	{
+		validateVolumeMipsT<float>("Float", 128, 128, 128, (eVolumeFilter)filter);
+		validateVolumeMipsT<float>("Float", 37, 20, 9, (eVolumeFilter)filter);
+		validateVolumeMipsT<uint8_t>("Byte", 128, 128, 128, (eVolumeFilter)filter);
+		validateVolumeMipsT<uint8_t>("Byte", 61, 33, 5, (eVolumeFilter)filter);
+	}
+}
+
+static void validateVolumeFormatsOf(const char* name, const std::vector<float>& data, int resolution)
+{
+	for (int format = 0; format < VOLUME_FORMAT_COUNT; ++format)
+	{
+		double start = glfwGetTime();
+		sEncodedVolume encoded;
+		encodeVolume(&data[0], resolution, resolution, resolution, (eVolumeFormat)format, encoded, VOLUME_BRICK_SIZE);
+		double encode_time = glfwGetTime() - start;
+
+		start = glfwGetTime();
+		std::vector<float> decoded;
+		decodeVolume(encoded, decoded);
+		double decode_time = glfwGetTime() - start;
+
+		sVolumeError error = measureVolumeError(&data[0], &decoded[0], data.size());
+		std::cout << " + " << name << " " << getVolumeFormatName((eVolumeFormat)format) << ": " << encoded.getBytesPerVoxel() << " bytes per voxel, encoded in "
+			<< encode_time * 1000.0 << "ms, decoded in " << decode_time * 1000.0 << "ms  max error " << error.max_error
+			<< ", RMSE " << error.rmse << ", PSNR " << error.psnr << "dB" << std::endl;
+	}
+}
+
+void StandardMaterial::validateVolumeFormats(int resolution)
+{
+	// every half but the nans has to come back from its float
+	int half_errors = 0;
+	for (int i = 0; i < 0x10000; ++i)
+	{
+		float value = halfToFloat((uint16_t)i);
+		half_errors += value == value && floatToHalf(value) != i;
+	}
+	std::cout << " + Half conversions: " << half_errors << " errors" << std::endl;
+
+	// smooth values over the whole range
+	std::vector<float> noise;
+	bakeNoise(resolution, glm::vec3(-1.0f), glm::vec3(1.0f), 2.5f, 5.0f, noise);
+	validateVolumeFormatsOf("Noise", noise, resolution);
+
+	// soft spheres of low density in empty space, like the clouds
+	std::vector<float> sparse((size_t)resolution * resolution * resolution, 0.0f);
+	for (int s = 0; s < 16; ++s)
+	{
+		glm::vec3 center = glm::vec3(rand(), rand(), rand()) / (float)RAND_MAX * (float)resolution;
+		float radius = resolution * (0.05f + 0.1f * rand() / (float)RAND_MAX);
+		float peak = 0.05f + 0.25f * rand() / (float)RAND_MAX;
+		for (int z = 0; z < resolution; ++z)
+			for (int y = 0; y < resolution; ++y)
+				for (int x = 0; x < resolution; ++x)
+				{
+					float falloff = std::max(0.0f, 1.0f - glm::length(glm::vec3(x, y, z) + glm::vec3(0.5f) - center) / radius);
+					float& value = sparse[((size_t)z * resolution + y) * resolution + x];
+					value = std::min(1.0f, value + peak * falloff * falloff);
+				}
+	}
+	validateVolumeFormatsOf("Sparse", sparse, resolution);
+}
 
 IsosurfaceMaterial::IsosurfaceMaterial(glm::vec4 color) {
 
@@ -473,6 +1150,8 @@ IsosurfaceMaterial::IsosurfaceMaterial(glm::vec4 color) {
 
 	iso_light_shader = Shader::Get("res/shaders/basic.vs", "res/shaders/iso_light.fs");
 
+	iso_mesh_shader = Shader::Get("res/shaders/basic.vs", "res/shaders/iso_mesh.fs");
+
 	switch (this->current_shader) {
 	case 0:
 		this->shader = this->iso_shader;
@@ -480,6 +1159,9 @@ IsosurfaceMaterial::IsosurfaceMaterial(glm::vec4 color) {
 	case 1:
 		this->shader = this->iso_light_shader;
 		break;
+	case 2:
+		this->shader = this->iso_mesh_shader;
+		break;
 
 	}
 
@@ -502,7 +1184,7 @@ void IsosurfaceMaterial::setUniforms(Camera* camera, glm::mat4 model)
 
 
 	// STEP LENGTH
-	this->shader->setUniform("u_step_length", this->step_length);
+	this->shader->setUniform("u_step_length", this->step_length * Application::instance->volume_step_scale);
 
 	// THRESHOLD
 	this->shader->setUniform("u_threshold", this->threshold);
@@ -525,13 +1207,345 @@ void IsosurfaceMaterial::setUniforms(Camera* camera, glm::mat4 model)
 	// alpha
 	this->shader->setUniform("u_alpha", this->alpha);
 
+	// precomputed gradient, only read by the lit shader
+	if (this->shader == this->iso_light_shader)
+		updateGradientTexture();
+	this->shader->setUniform("u_use_gradient_texture", this->use_gradient_texture && this->gradient_texture);
+	if (this->gradient_texture) {
+		this->shader->setUniform("u_gradient_texture", this->gradient_texture, 5);
+		this->shader->setUniform("u_gradient_decode", this->gradient_format == NORMAL_FORMAT_RGB10A2 ? glm::vec2(2.f, -1.f) : glm::vec2(1.f, 0.f));
+	}
+
+	// distance field for the sphere tracing, only read by the shader without illumination
+	if (this->shader == this->iso_shader && this->isosurface)
+		updateDistanceField();
+	// the field of the last threshold is traced until the new one is ready. Before the first one of the density the uniform
+	// steps are used, testing the density level like the field instead of the sum so the surface does not change
+	this->shader->setUniform("u_use_sdf", this->use_sdf && this->isosurface && this->sdf_texture && this->sdf_source == this->texture);
+	this->shader->setUniform("u_density_level", this->use_sdf && this->isosurface);
+	if (this->sdf_texture) {
+		this->shader->setUniform("u_sdf_texture", this->sdf_texture, 6);
+		this->shader->setUniform("u_sdf_epsilon", 0.25f / std::max(this->sdf_texture->width, std::max(this->sdf_texture->height, this->sdf_texture->depth)));
+	}
+
+	// Bounds
+	setVolumeUniforms(model);
+
+}
+
+void IsosurfaceMaterial::render(Mesh* mesh, glm::mat4 model, Camera* camera)
+{
+	if (this->compare_gradients && this->shader == this->iso_light_shader)
+		compareGradients(mesh, model, camera);
+	this->compare_gradients = false;
+
+	// the surface drawn as triangles, only extracted again when the threshold changes
+	if (this->current_shader == 2) {
+		if (updateSurfaceMesh())
+			StandardMaterial::render(this->surface_mesh, model, camera);
+		return;
+	}
+
+	StandardMaterial::render(mesh, model, camera);
+}
+
+// level 0 of a 3D texture as floats, whatever its format
+static void readDensity(Texture* texture, std::vector<float>& density)
+{
+	density.resize((size_t)texture->width * texture->height * texture->depth);
+	glBindTexture(GL_TEXTURE_3D, texture->texture_id);
+	glGetTexImage(GL_TEXTURE_3D, 0, GL_RED, GL_FLOAT, &density[0]);
+	glBindTexture(GL_TEXTURE_3D, 0);
+}
+
+bool IsosurfaceMaterial::updateSurfaceMesh()
+{
+	if (!this->texture)
+		return false;
+
+	if (!this->extractor || this->surface_source != this->texture) {
+		std::vector<float> density;
+		readDensity(this->texture, density);
+		if (!this->extractor)
+			this->extractor = new IsosurfaceExtractor();
+		this->extractor->create(&density[0], (int)this->texture->width, (int)this->texture->height, (int)this->texture->depth, VOLUME_BRICK_SIZE);
+		this->surface_source = this->texture;
+	}
+
+	if (this->extractor->update(this->surface_threshold)) {
+		std::vector<glm::vec3> vertices, normals;
+		std::vector<unsigned int> indices;
+		this->extractor->buildMesh(vertices, normals, indices);
+
+		if (!this->surface_mesh)
+			this->surface_mesh = new Mesh();
+		this->surface_mesh->clear();
+		if (indices.size()) {
+			this->surface_mesh->vertices = vertices;
+			this->surface_mesh->normals = normals;
+			// the indices of the meshes are the bits of three uints in every glm::vec3
+			this->surface_mesh->indices.resize(indices.size() / 3);
+			memcpy((void*)&this->surface_mesh->indices[0].x, &indices[0], indices.size() * sizeof(unsigned int));
+			this->surface_mesh->updateBoundingBox();
+			this->surface_mesh->uploadToVRAM();
+		}
+	}
+
+	return this->surface_mesh && this->surface_mesh->indices.size();
+}
+
+void IsosurfaceMaterial::updateGradientTexture()
+{
+	if (!this->use_gradient_texture || !this->texture)
+		return;
+	if (this->gradient_texture && this->gradient_source == this->texture && this->built_gradient.x == this->gradient_filter && this->built_gradient.y == this->gradient_format)
+		return;
+
+	// the density as the shaders read it, whatever format it was encoded in
+	int width = (int)this->texture->width, height = (int)this->texture->height, depth = (int)this->texture->depth;
+	std::vector<float> density;
+	readDensity(this->texture, density);
+
+	double start = glfwGetTime();
+	std::vector<float> gradients;
+	computeVolumeGradients(&density[0], width, height, depth, this->gradient_filter, gradients);
+	double gradient_time = glfwGetTime() - start;
+
+	start = glfwGetTime();
+	std::vector<uint8_t> normals;
+	packVolumeNormals(gradients, this->gradient_format, normals);
+	double pack_time = glfwGetTime() - start;
+
+	if (!this->gradient_texture)
+		this->gradient_texture = new Texture();
+	if (this->gradient_format == NORMAL_FORMAT_RGB10A2)
+		this->gradient_texture->create3D(width, height, depth, GL_RGBA, GL_UNSIGNED_INT_2_10_10_10_REV, false, &normals[0], GL_RGB10_A2);
+	else
+		this->gradient_texture->create3D(width, height, depth, GL_RGB, GL_BYTE, false, &normals[0], GL_RGB8_SNORM);
+	this->gradient_source = this->texture;
+	this->built_gradient = glm::ivec2(this->gradient_filter, this->gradient_format);
+
+	std::cout << " + Gradients " << (this->gradient_filter == GRADIENT_FILTER_SOBEL ? "Sobel" : "central") << " " << width << "x" << height << "x" << depth
+		<< " in " << gradient_time * 1000.0 << "ms, packed as " << (this->gradient_format == NORMAL_FORMAT_RGB10A2 ? "RGB10A2" : "RGB8 snorm")
+		<< " in " << pack_time * 1000.0 << "ms" << std::endl;
+}
+
+void IsosurfaceMaterial::updateDistanceField()
+{
+	// a finished job replaces the field, the density it was computed from may have changed meanwhile
+	if (this->sdf_job.valid() && this->sdf_job.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+		std::vector<float> distances = this->sdf_job.get();
+		Texture* source = this->sdf_job_source;
+		if (source == this->texture) {
+			if (!this->sdf_texture)
+				this->sdf_texture = new Texture();
+			this->sdf_texture->create3D(source->width, source->height, source->depth, GL_RED, GL_FLOAT, false, &distances[0], GL_R16F);
+			this->sdf_source = source;
+			this->sdf_threshold = this->sdf_job_threshold;
+			std::cout << " + Distance field " << source->width << "x" << source->height << "x" << source->depth << " at threshold " << this->sdf_threshold
+				<< " in " << (glfwGetTime() - this->sdf_job_start) * 1000.0 << "ms" << std::endl;
+		}
+	}
+
+	// one job at a time, the threshold it has when the job ends starts the next one
+	if (!this->use_sdf || !this->texture || isDistanceFieldReady() || this->sdf_job.valid())
+		return;
+
+	// the copy of the density is only read again when the texture changes
+	if (this->sdf_density_source != this->texture) {
+		readDensity(this->texture, this->sdf_density);
+		this->sdf_density_source = this->texture;
+	}
+
+	int width = (int)this->texture->width, height = (int)this->texture->height, depth = (int)this->texture->depth;
+	float threshold = this->threshold;
+	const std::vector<float>* density = &this->sdf_density;
+	this->sdf_job_source = this->texture;
+	this->sdf_job_threshold = threshold;
+	this->sdf_job_start = glfwGetTime();
+	this->sdf_job = std::async(std::launch::async, [density, width, height, depth, threshold]() {
+		std::vector<float> distances;
+		computeDistanceField(&(*density)[0], width, height, depth, threshold, distances, DISTANCE_FIELD_MARGIN);
+
+		// from voxels to texture units, the largest side keeps the distances a lower bound along every axis
+		float scale = 1.0f / std::max(width, std::max(height, depth));
+		for (float& distance : distances)
+			distance *= scale;
+		return distances;
+	});
+}
+
+void IsosurfaceMaterial::benchmarkDistanceField(int num_rays)
+{
+	// blobs and a sheet thinner than a voxel at the threshold, that the long uniform steps jump over
+	const int resolution = 128;
+	const float threshold = 0.5f;
+	const float voxel = 2.0f / resolution; // in object space
+	const glm::vec4 blobs[3] = { glm::vec4(-0.3f, 0.1f, 0.0f, 0.45f), glm::vec4(0.35f, -0.2f, 0.2f, 0.3f), glm::vec4(0.1f, 0.45f, -0.3f, 0.25f) };
+	std::vector<float> data(resolution * resolution * resolution, 0.0f);
+	for (int z = 0; z < resolution; ++z)
+		for (int y = 0; y < resolution; ++y)
+			for (int x = 0; x < resolution; ++x)
+			{
+				glm::vec3 p = (glm::vec3(x, y, z) + glm::vec3(0.5f)) / (float)resolution * 2.0f - glm::vec3(1.0f);
+				float& value = data[x + y * resolution + z * resolution * resolution];
+				for (const glm::vec4& blob : blobs)
+					value = std::max(value, std::min(1.0f, 2.0f * (1.0f - glm::length(p - glm::vec3(blob)) / blob.w)));
+				value = std::max(value, 1.0f - fabsf(p.x - 0.7f) / (1.5f * voxel));
+			}
+
+	double start = glfwGetTime();
+	std::vector<float> distances;
+	computeDistanceField(&data[0], resolution, resolution, resolution, threshold, distances, DISTANCE_FIELD_MARGIN);
+	std::cout << " + Distance field " << resolution << "^3 in " << (glfwGetTime() - start) * 1000.0 << "ms" << std::endl;
+	for (float& distance : distances)
+		distance /= resolution;
+
+	// rays from around the volume to points inside it, in object space with a model of identity
+	std::vector<glm::vec3> origins(num_rays), directions(num_rays);
+	for (int i = 0; i < num_rays; ++i)
+	{
+		glm::vec3 around = glm::vec3(rand(), rand(), rand()) / (float)RAND_MAX * 2.0f - glm::vec3(1.0f);
+		origins[i] = glm::normalize(around + glm::vec3(0.0f, 0.0f, 0.001f)) * 3.0f;
+		glm::vec3 target = (glm::vec3(rand(), rand(), rand()) / (float)RAND_MAX * 2.0f - glm::vec3(1.0f)) * 0.9f;
+		directions[i] = glm::normalize(target - origins[i]);
+	}
+
+	// fine uniform steps as the reference, then the steps of the material, shorter ones and the sphere tracing
+	const float epsilon = 0.25f / resolution; // same as the shader, in texture units
+	const float step_lengths[3] = { voxel / 16.0f, 0.05f, 0.01f };
+	std::vector<float> reference(num_rays);
+	for (int mode = 0; mode < 4; ++mode)
+	{
+		bool sphere_tracing = mode == 3;
+		long samples = 0, hit_samples = 0;
+		int hits = 0, missed = 0, false_hits = 0, compared = 0;
+		double max_error = 0.0, error_sum = 0.0;
+
+		start = glfwGetTime();
+		for (int i = 0; i < num_rays; ++i)
+		{
+			glm::vec3 t_min = (glm::vec3(-1.0f) - origins[i]) / directions[i];
+			glm::vec3 t_max = (glm::vec3(1.0f) - origins[i]) / directions[i];
+			glm::vec3 t1 = glm::min(t_min, t_max), t2 = glm::max(t_min, t_max);
+			float t_near = std::max(std::max(t1.x, t1.y), t1.z);
+			float t_far = std::min(std::min(t2.x, t2.y), t2.z);
+
+			float hit = -1.0f;
+			int ray_samples = 0;
+			for (float t = t_near; t < t_far && ray_samples < 4096; ++ray_samples)
+			{
+				glm::vec3 coords = (origins[i] + directions[i] * t) * 0.5f + glm::vec3(0.5f);
+				if (sphere_tracing)
+				{
+					// the texture coordinates advance half of the object space ones
+					float distance = sampleDensity(&distances[0], resolution, coords, false);
+					if (distance < epsilon)
+					{
+						hit = t;
+						break;
+					}
+					t += distance * 2.0f;
+				}
+				else
+				{
+					if (sampleDensity(&data[0], resolution, coords) >= threshold)
+					{
+						hit = t;
+						break;
+					}
+					t += step_lengths[mode];
+				}
+			}
+			samples += ray_samples;
+
+			if (mode == 0)
+				reference[i] = hit;
+			if (hit >= 0.0f)
+			{
+				hits++;
+				hit_samples += ray_samples;
+			}
+			missed += reference[i] >= 0.0f && hit < 0.0f;
+			false_hits += reference[i] < 0.0f && hit >= 0.0f;
+			if (reference[i] >= 0.0f && hit >= 0.0f)
+			{
+				double error = fabs(hit - reference[i]) / voxel;
+				max_error = std::max(max_error, error);
+				error_sum += error;
+				compared++;
+			}
+		}
+		double time = glfwGetTime() - start;
+
+		if (sphere_tracing)
+			std::cout << " + Sphere tracing";
+		else
+			std::cout << " + Step " << step_lengths[mode];
+		std::cout << ": " << (double)samples / num_rays << " steps per ray, " << (hits ? (double)hit_samples / hits : 0.0) << " per hit, " << time * 1000.0 << "ms";
+		if (mode > 0)
+			std::cout << "  missed: " << 100.0 * missed / num_rays << "% false hits: " << 100.0 * false_hits / num_rays << "%  depth error in voxels avg: "
+				<< (compared ? error_sum / compared : 0.0) << " max: " << max_error;
+		std::cout << std::endl;
+	}
+}
+
+void IsosurfaceMaterial::compareGradients(Mesh* mesh, const glm::mat4& model, Camera* camera)
+{
+	const int num_frames = 20;
+	const float tolerance = 2.0f / 255.0f;
+	int width = Application::instance->window_width, height = Application::instance->window_height;
+
+	// the same view with the 6 fetches and with the texture, timed over several passes
+	FBO fbo;
+	fbo.create(width, height, 1, GL_RGBA, GL_FLOAT, true, GL_RGBA32F);
+	std::vector<glm::vec4> images[2];
+	double times[2];
+	bool use_texture = this->use_gradient_texture;
+	for (int i = 0; i < 2; ++i)
+	{
+		this->use_gradient_texture = i == 1;
+		fbo.bind();
+		StandardMaterial::render(mesh, model, camera); // builds the texture the first time
+		glFinish();
+
+		double start = glfwGetTime();
+		for (int frame = 0; frame < num_frames; ++frame)
+			StandardMaterial::render(mesh, model, camera);
+		glFinish();
+		times[i] = (glfwGetTime() - start) / num_frames;
+
+		glClearColor(0.f, 0.f, 0.f, 0.f);
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		StandardMaterial::render(mesh, model, camera);
+		images[i].resize((size_t)width * height);
+		glReadPixels(0, 0, width, height, GL_RGBA, GL_FLOAT, &images[i][0]);
+		fbo.unbind();
+	}
+	this->use_gradient_texture = use_texture;
+
+	double error = 0.0, max_error = 0.0;
+	int different = 0;
+	for (size_t p = 0; p < images[0].size(); ++p)
+	{
+		glm::vec4 difference = glm::abs(images[1][p] - images[0][p]);
+		double pixel_error = std::max(difference.x, std::max(difference.y, difference.z));
+		error += pixel_error;
+		max_error = std::max(max_error, pixel_error);
+		different += pixel_error > tolerance;
+	}
+
+	std::cout << " + Lit isosurface " << width << "x" << height << ": " << times[0] * 1000.0 << "ms with 6 fetches, "
+		<< times[1] * 1000.0 << "ms with the gradient texture" << std::endl;
+	std::cout << " + Image difference: avg " << error / images[0].size() << " max " << max_error << "  pixels above " << tolerance << ": "
+		<< 100.0 * different / images[0].size() << "%" << std::endl;
 }
 
 
 void IsosurfaceMaterial::renderInMenu()
 {
 
-	if (ImGui::Combo("Shader Type", &this->current_shader, "No illumination\0 Illumination")) {
+	if (ImGui::Combo("Shader Type", &this->current_shader, "No illumination\0 Illumination\0 Extracted Mesh")) {
 
 		switch (this->current_shader) {
 		case 0:
@@ -540,20 +1554,49 @@ void IsosurfaceMaterial::renderInMenu()
 		case 1:
 			this->shader = this->iso_light_shader;
 			break;
+		case 2:
+			this->shader = this->iso_mesh_shader;
+			break;
 
 		}
 	}
 
 	ImGui::DragFloat("Step Length", (float*)&this->step_length, 0.0005f, 0.005f);
 
-	ImGui::DragFloat("Threshold", (float*)&this->threshold, 0.01f);
+	// the mesh is the surface where the density crosses a level, the rays compare their own sums with the threshold
+	if (this->current_shader == 2)
+		ImGui::SliderFloat("Surface Density", &this->surface_threshold, 0.0f, 1.0f);
+	else
+		ImGui::DragFloat("Threshold", (float*)&this->threshold, 0.01f);
 
 	ImGui::Checkbox("Use Jittering", &this->jittering);
 
 	ImGui::Checkbox("Use Isosurface", &this->isosurface);
 
+	if (this->current_shader == 0 && this->isosurface)
+		ImGui::Checkbox("Sphere Tracing", &this->use_sdf);
+
+	renderVolumeInMenu();
+
 	ImGui::DragFloat("Rate of Change (h)", (float*)&this->h, 0.001f); 
 
+	if (this->current_shader == 1) {
+		ImGui::Checkbox("Gradient Texture", &this->use_gradient_texture);
+		ImGui::Combo("Gradient Filter", (int*)&this->gradient_filter, "Central Differences\0Sobel\0");
+		ImGui::Combo("Gradient Format", (int*)&this->gradient_format, "RGB8 Snorm\0RGB10A2\0");
+		if (ImGui::Button("Compare Gradients"))
+			this->compare_gradients = true;
+	}
+
+	if (this->current_shader == 2 && this->extractor) {
+		const sIsosurfaceStats& stats = this->extractor->stats;
+		if (stats.triangles)
+			ImGui::Text("%d triangles, %d blocks extracted in %.2fms, mesh in %.2fms", stats.triangles, stats.dirty_blocks,
+				stats.extract_time * 1000.0, stats.build_time * 1000.0);
+		else
+			ImGui::Text("No surface at this density");
+	}
+
 	ImGui::ColorEdit3("Base Color", (float*)&this->color);
 
 	ImGui::ColorEdit3("Phong Ambient", (float*)&this->ambient);
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <future>
+
 #include <glm/vec3.hpp>
 #include <glm/vec4.hpp>
 #include <glm/matrix.hpp>
@@ -8,10 +10,15 @@
 #include "mesh.h"
 #include "texture.h"
 #include "shader.h"
+#include "virtual_volume.h"
+#include "isosurface.h"
+#include "../framework/volume.h"
 
 #include "../libraries/easyVDB/src/bbox.h"
 #include "../libraries/easyVDB/src/openvdbReader.h"
 
+#define VOLUME_BRICK_SIZE 8 //voxels per side of the bricks of the proxy and the adaptive steps
+
 class Material {
 public:
 
@@ -22,6 +29,7 @@ public:
 	virtual void setUniforms(Camera* camera, glm::mat4 model) = 0;
 	virtual void render(Mesh* mesh, glm::mat4 model, Camera* camera) = 0;
 	virtual void renderInMenu() = 0;
+	virtual bool isOpaque() { return false; } //true while it draws triangles instead of marching rays, it goes with the opaque nodes
 };
 
 class FlatMaterial : public Material {
@@ -65,6 +73,70 @@ public:
 	void loadVDB(std::string file_path);
 
 	void estimate3DTexture(easyVDB::OpenVDBReader* vdbReader);
+
+	//bricks of the 3D texture with density, drawn instead of the cube so only the fragments near the data are shaded
+	Mesh* proxy_mesh = NULL;
+	bool use_proxy = true;
+
+	//min and max density of every brick, the rays skip the empty ones and take longer steps in the uniform ones
+	Texture* range_texture = NULL;
+	bool adaptive_step = true;
+	float step_growth = 0.0f; //relative growth of the step per unit of distance to the camera
+
+	//the marchers read coarser levels of the density mipmaps when a step or a pixel covers several voxels
+	bool use_density_lod = true;
+	float lod_bias = -1.0f; //levels added to the footprint, -1 keeps the full resolution until the steps skip voxels
+
+	//format of the density texture, encoded when the volume is loaded
+	eVolumeFormat density_format = VOLUME_FORMAT_R8;
+	float density_bytes = 0.0f; //per voxel
+	sVolumeError density_error; //against the density in floats
+
+	//bricks of a finer density paged in where the rays need them, the texture is read where they are not resident
+	VirtualVolume* virtual_volume = NULL;
+	easyVDB::OpenVDBReader* vdb_reader = NULL; //owns the grid the bricks are read from, deleted with the virtual volume
+	bool use_virtual_volume = false;
+	int virtual_resolution = 512;
+	int virtual_frame = -1; //last frame that loaded bricks
+
+	//the rays stop when the transmittance to the camera falls below this, 0 to march the whole volume
+	float min_transmittance = 0.01f;
+
+	//first octaves of the fBm of the noise shaders baked in the box [-1, 1], the ones with a period of at least 4 voxels.
+	//the shaders fetch them at once and only evaluate the finer octaves
+	Texture* noise_texture = NULL;
+	bool use_noise_texture = true;
+	int noise_resolution = 128; //at most, less when all the octaves fit in fewer voxels
+	int noise_octaves = 0; //in the texture, 0 when the scale is too high for any
+	eVolumeFormat noise_format = VOLUME_FORMAT_R16F;
+	glm::vec2 baked_noise = glm::vec2(-1.0f); //scale and detail of the noise texture
+	void updateNoiseTexture(float scale, float detail); //bakes it again only when they changed
+
+	//average samples taken by the volume rays, counted by the shaders and read the next frame
+	static bool ray_stats;
+	static float samples_per_ray;
+	static void updateRayStats(); //once per frame, before rendering the volumes
+
+	virtual bool usesDensityTexture() { return this->texture != NULL; } //false if the current shader does not read the texture
+	bool hasVolumeProxy() { return usesDensityTexture() && this->proxy_mesh && this->use_proxy; }
+	void createBrickRanges(const float* data, int resolution);
+	void setVolumeUniforms(const glm::mat4& model); //bounds, adaptive step, paging and early termination of the ray marching
+	void renderVolumeInMenu();
+
+	//compares the adaptive steps and the early termination with the fixed steps on the CPU, results are printed
+	static void benchmarkAdaptiveStep(int num_rays = 20000);
+
+	//compares the fBm of the shaders and the baked texture with the CPU version, results are printed
+	static void validateNoise(float scale = 2.5f, float detail = 5.0f);
+
+	//samples per second of the scalar and the vectorized CPU noise, results are printed
+	static void benchmarkNoise(int num_points = 1 << 21, float scale = 2.5f, float detail = 5.0f);
+
+	//compares the mipmaps of float and byte volumes with a naive reduction, results are printed
+	static void validateVolumeMips();
+
+	//size, error and encoding times of every volume format with the baked noise and a sparse density, results are printed
+	static void validateVolumeFormats(int resolution = 128);
 };
 
 class VolumeMaterial : public StandardMaterial {
@@ -91,6 +163,8 @@ public:
 	void setUniforms(Camera* camera, glm::mat4 model);
 
 	void renderInMenu();
+
+	bool usesDensityTexture() { return this->texture && this->current_shader == 5; }
 };
 
 class RabbitMaterial : public StandardMaterial {
@@ -114,7 +188,7 @@ public:
 
 	void renderInMenu();
 
-
+	bool usesDensityTexture() { return this->texture && this->density_type == 2; }
 };
 
 
@@ -127,6 +201,8 @@ public:
 
 	Shader* iso_light_shader = NULL;
 
+	Shader* iso_mesh_shader = NULL;
+
 	float step_length = 0.05f;
 
 	float threshold = 1.0f;
@@ -143,11 +219,53 @@ public:
 
 	float alpha = 1.0;
 
+	//directions of the density gradient built on the CPU, the lit shader reads them instead of 6 density fetches
+	Texture* gradient_texture = NULL;
+	bool use_gradient_texture = true;
+	eGradientFilter gradient_filter = GRADIENT_FILTER_CENTRAL;
+	eNormalFormat gradient_format = NORMAL_FORMAT_RGB8_SNORM;
+	Texture* gradient_source = NULL; //density texture the gradients were built from
+	glm::ivec2 built_gradient = glm::ivec2(-1); //filter and format of the gradient texture
+	void updateGradientTexture(); //builds it again only when the density or the options changed
+
+	//the next render compares the images and the times of the lit shader with and without the gradient texture, results are printed
+	bool compare_gradients = false;
+	void compareGradients(Mesh* mesh, const glm::mat4& model, Camera* camera);
+
+	//triangles of the surface at the threshold extracted on the CPU, drawn instead of marching the rays by the mesh shader
+	IsosurfaceExtractor* extractor = NULL;
+	Mesh* surface_mesh = NULL;
+	Texture* surface_source = NULL; //density texture the extractor was created from
+	float surface_threshold = 0.5f; //density of the extracted surface in [0, 1], the ray shaders use threshold instead
+	bool updateSurfaceMesh(); //extracts again the blocks the threshold changed, false if there is no surface
+	bool usesDensityTexture() { return this->texture && this->current_shader != 2; }
+	bool isOpaque() { return this->current_shader == 2; }
+
+	//signed distance to the surface at the threshold, the shader without illumination sphere traces it instead of the uniform steps
+	Texture* sdf_texture = NULL;
+	bool use_sdf = false;
+	Texture* sdf_source = NULL; //density texture the distances were computed from
+	float sdf_threshold = -1.0f; //of the distance field
+	//the field takes seconds, it is computed by a worker from a copy of the density and the old one is traced meanwhile
+	std::vector<float> sdf_density;
+	Texture* sdf_density_source = NULL;
+	std::future<std::vector<float>> sdf_job;
+	Texture* sdf_job_source = NULL;
+	float sdf_job_threshold = -1.0f;
+	double sdf_job_start = 0.0;
+	void updateDistanceField(); //starts a job when the density or the threshold changed, swaps the field in when it finishes
+	bool isDistanceFieldReady() { return this->sdf_texture && this->sdf_source == this->texture && this->sdf_threshold == this->threshold; }
+
+	//compares the uniform steps with the sphere tracing of the distance field on the CPU, results are printed
+	static void benchmarkDistanceField(int num_rays = 20000);
+
 
 	IsosurfaceMaterial(glm::vec4 color = glm::vec4(1.f));
 
 	void setUniforms(Camera* camera, glm::mat4 model);
 
+	void render(Mesh* mesh, glm::mat4 model, Camera* camera);
+
 	void renderInMenu();
 
 };
@@ -3,10 +3,21 @@
 #include <cassert>
 #include <iostream>
 #include <limits>
+#include <cstddef>
 #include <sys/stat.h>
+#include <sstream>
+#include <thread>
+#include <condition_variable>
+#include <deque>
+#include <chrono>
+#include <unordered_map>
+
+#include <glm/gtc/packing.hpp>
 
 #include "shader.h"
 #include "texture.h"
+#include "bvh.h"
+#include "simplify.h"
 #include "../framework/includes.h"
 #include "../framework/utils.h"
 #include "../framework/camera.h"
@@ -14,8 +25,21 @@
 bool Mesh::use_binary = true;			//checks if there is .wbin, it there is one tries to read it instead of the other file
 bool Mesh::auto_upload_to_vram = true;	//uploads the mesh to the GPU VRAM to speed up rendering
 bool Mesh::interleave_meshes = true;	//places the geometry in an interleaved array
+bool Mesh::compact_meshes = false;		//quantizes the interleaved array to half its size
+bool Mesh::use_vaos = true;				//a draw becomes a single glBindVertexArray plus the draw call
+bool Mesh::use_multidraw = true;		//meshes with materials are rendered with a single glMultiDraw*Indirect
+bool Mesh::use_instance_ring = true;	//instances are written in mapped memory instead of reallocating a buffer every call
+bool Mesh::store_collision_model = false; //otherwise the BVH is built the first time a ray or sphere is tested
+bool Mesh::generate_lods = false;		//the simplification is slow, only done when the .mbin is created
+float Mesh::lod_pixel_error = 1.0f;		//below a pixel the change of LOD is not noticeable
+bool Mesh::generate_meshlets = false;	//only useful for big meshes seen from inside or from close
+bool Mesh::use_meshlet_culling = true;	//meshes without meshlets are drawn as always
+sMeshletStats Mesh::meshlet_stats;
 
 std::map<std::string, Mesh*> Mesh::sMeshesLoaded;
+size_t Mesh::upload_budget = 8 * 1024 * 1024; //bytes per frame uploaded by processUploads
+std::mutex meshes_mutex; //sMeshesLoaded and meshes_loading are accessed from the loader threads
+std::map<std::string, std::shared_future<Mesh*>> meshes_loading; //requested with GetAsync and not registered yet
 long Mesh::num_meshes_rendered = 0;
 long Mesh::num_triangles_rendered = 0;
 
@@ -28,8 +52,8 @@ const glm::vec3 corners[] = { {1,1,1},  {1,1,-1},  {1,-1,1},  {1,-1,-1},  {-1,1,
 
 BoundingBox transformBoundingBox(const glm::mat4 m, const BoundingBox& box)
 {
-	glm::vec3 box_min(10000000.0f, 1000000.0f, 1000000.0f);
-	glm::vec3 box_max(-10000000.0f, -1000000.0f, -1000000.0f);
+	glm::vec3 box_min(10000000.0f, 10000000.0f, 10000000.0f);
+	glm::vec3 box_max(-10000000.0f, -10000000.0f, -10000000.0f);
 
 	for (int i = 0; i < 8; ++i)
 	{
@@ -44,9 +68,9 @@ BoundingBox transformBoundingBox(const glm::mat4 m, const BoundingBox& box)
 		if (corner.z < box_min.z) box_min.z = corner.z;
 
 		//box_max.setMax(corner);
-		if (corner.x > box_min.x) box_min.x = corner.x;
-		if (corner.y > box_min.y) box_min.y = corner.y;
-		if (corner.z > box_min.z) box_min.z = corner.z;
+		if (corner.x > box_max.x) box_max.x = corner.x;
+		if (corner.y > box_max.y) box_max.y = corner.y;
+		if (corner.z > box_max.z) box_max.z = corner.z;
 	}
 
 	glm::vec3 halfsize = (box_max - box_min) * 0.5f;
@@ -56,7 +80,11 @@ BoundingBox transformBoundingBox(const glm::mat4 m, const BoundingBox& box)
 Mesh::Mesh()
 {
 	radius = 0;
+	current_lod = 0;
+	meshlet_indices_vbo_id = meshlet_commands_buffer_id = 0;
+	draw_visible_meshlets = false;
 	vertices_vbo_id = uvs_vbo_id = uvs1_vbo_id = normals_vbo_id = colors_vbo_id = interleaved_vbo_id = indices_vbo_id = bones_vbo_id = weights_vbo_id = 0;
+	indirect_buffer_id = draw_materials_vbo_id = materials_ssbo_id = 0;
 	collision_model = NULL;
 	clear();
 }
@@ -87,9 +115,43 @@ void Mesh::clear()
 		glDeleteBuffersARB(1, &weights_vbo_id);
 	if (uvs1_vbo_id)
 		glDeleteBuffersARB(1, &uvs1_vbo_id);
+	if (indirect_buffer_id)
+		glDeleteBuffersARB(1, &indirect_buffer_id);
+	if (draw_materials_vbo_id)
+		glDeleteBuffersARB(1, &draw_materials_vbo_id);
+	if (materials_ssbo_id)
+		glDeleteBuffersARB(1, &materials_ssbo_id);
+
+	clearVAOs();
+
+	delete (BVH*)collision_model;
+	collision_model = NULL;
+
+	for (sMeshLOD& lod : lods)
+		if (lod.indices_vbo_id)
+			glDeleteBuffersARB(1, &lod.indices_vbo_id);
+	lods.clear();
+	current_lod = 0;
+
+	if (meshlet_indices_vbo_id)
+		glDeleteBuffersARB(1, &meshlet_indices_vbo_id);
+	if (meshlet_commands_buffer_id)
+		glDeleteBuffersARB(1, &meshlet_commands_buffer_id);
+	meshlet_indices_vbo_id = meshlet_commands_buffer_id = 0;
+	meshlets.clear();
+	meshlet_indices.clear();
+	meshlet_visible.clear();
+	meshlet_commands.clear();
+	draw_visible_meshlets = false;
+
+	for (auto& it : staged_blocks)
+		UploadManager::cancel(it.second);
+	staged_blocks.clear();
 
 	//VBOs ids
 	vertices_vbo_id = uvs_vbo_id = normals_vbo_id = colors_vbo_id = interleaved_vbo_id = indices_vbo_id = weights_vbo_id = bones_vbo_id = uvs1_vbo_id = 0;
+	indirect_buffer_id = draw_materials_vbo_id = materials_ssbo_id = 0;
+	num_indirect_draws = 0;
 
 	//buffers
 	vertices.clear();
@@ -97,10 +159,12 @@ void Mesh::clear()
 	uvs.clear();
 	colors.clear();
 	interleaved.clear();
+	compact.clear();
 	indices.clear();
 	bones.clear();
 	weights.clear();
 	uvs1.clear();
+	draw_materials.clear();
 }
 
 int vertex_location = -1;
@@ -110,6 +174,24 @@ int color_location = -1;
 int bones_location = -1;
 int weights_location = -1;
 int uv1_location = -1;
+GLuint current_vao = 0;
+
+//packs the location of every attribute a mesh can feed (5 bits each), shaders with the same layout share the VAO
+static uint64_t getAttribLayout(Shader* sh)
+{
+	const char* names[] = { "a_vertex", "a_normal", "a_uv", "a_uv1", "a_color", "a_bones", "a_weights" };
+	uint64_t layout = 0;
+	for (int i = 0; i < 7; ++i)
+		layout |= (uint64_t)((sh->getAttribLocation(names[i]) + 1) & 31) << (i * 5);
+	return layout;
+}
+
+void Mesh::clearVAOs()
+{
+	for (auto& it : vaos)
+		glDeleteVertexArrays(1, &it.second);
+	vaos.clear();
+}
 
 void Mesh::enableBuffers(Shader* sh)
 {
@@ -119,6 +201,41 @@ void Mesh::enableBuffers(Shader* sh)
 	if (vertex_location == -1)
 		return;
 
+	//quantized meshes are decoded in the vertex shader
+	sh->setUniform("u_compact_vertex", compact.size() > 0);
+	if (compact.size())
+	{
+		sh->setUniform("u_quantization_center", box.center);
+		sh->setUniform("u_quantization_halfsize", box.halfsize);
+	}
+
+	//VAOs can only capture buffers in VRAM
+	current_vao = 0;
+	if (use_vaos && (interleaved_vbo_id || vertices_vbo_id))
+	{
+		uint64_t layout = getAttribLayout(sh);
+		auto it = vaos.find(layout);
+		if (it != vaos.end())
+		{
+			current_vao = it->second;
+			glBindVertexArray(current_vao);
+			return;
+		}
+
+		//first time with this layout, record the attributes setup below in a new VAO
+		glGenVertexArrays(1, &current_vao);
+		glBindVertexArray(current_vao);
+		vaos[layout] = current_vao;
+		if (indices_vbo_id)
+			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
+	}
+
+	if (compact.size())
+	{
+		enableCompactBuffers(sh);
+		return;
+	}
+
 	int spacing = 0;
 	int offset_normal = 0;
 	int offset_uv = 0;
@@ -243,6 +360,33 @@ void Mesh::enableBuffers(Shader* sh)
 
 }
 
+void Mesh::enableCompactBuffers(Shader* sh)
+{
+	assert(interleaved_vbo_id && "quantized meshes must be uploaded to the GPU");
+
+	int spacing = sizeof(tInterleavedCompact);
+	glBindBuffer(GL_ARRAY_BUFFER, interleaved_vbo_id);
+
+	glEnableVertexAttribArray(vertex_location);
+	glVertexAttribPointer(vertex_location, 3, GL_UNSIGNED_SHORT, GL_TRUE, spacing, (void*)offsetof(tInterleavedCompact, vertex));
+
+	normal_location = sh->getAttribLocation("a_normal");
+	if (normal_location != -1)
+	{
+		glEnableVertexAttribArray(normal_location);
+		glVertexAttribPointer(normal_location, 2, GL_SHORT, GL_TRUE, spacing, (void*)offsetof(tInterleavedCompact, normal));
+	}
+
+	uv_location = sh->getAttribLocation("a_uv");
+	if (uv_location != -1)
+	{
+		glEnableVertexAttribArray(uv_location);
+		glVertexAttribPointer(uv_location, 2, GL_HALF_FLOAT, GL_FALSE, spacing, (void*)offsetof(tInterleavedCompact, uv));
+	}
+
+	uv1_location = color_location = bones_location = weights_location = -1;
+}
+
 void Mesh::render(unsigned int primitive, int submesh_id, int num_instances)
 {
 	Shader* shader = Shader::current;
@@ -251,33 +395,163 @@ void Mesh::render(unsigned int primitive, int submesh_id, int num_instances)
 		assert(0 && "no shader or shader not compiled or enabled");
 		return;
 	}
-	assert((interleaved.size() || vertices.size()) && "No vertices in this mesh");
+	assert((compact.size() || interleaved.size() || vertices.size()) && "No vertices in this mesh");
 
 	//bind buffers to attribute locations
 	enableBuffers(shader);
 
+	drawSubmeshes(primitive, submesh_id, num_instances);
+
+	//unbind them
+	disableBuffers(shader);
+}
+
+void Mesh::drawSubmeshes(unsigned int primitive, int submesh_id, int num_instances)
+{
+	Shader* shader = Shader::current;
+
+	//simplified meshes are drawn at once, without submeshes
+	if (current_lod > 0 && current_lod <= (int)lods.size())
+	{
+		drawLOD(primitive, num_instances);
+		return;
+	}
+
+	//visible meshlets of the last cullMeshlets
+	if (draw_visible_meshlets && submesh_id == -1 && num_instances == 0)
+	{
+		drawMeshlets(primitive);
+		return;
+	}
+
 	//draw call
 	if (submesh_id == -1 && materials.size() > 0) // if there's mesh mtl
 	{
+		//instanced draws already use the instance index for their own attributes
+		if (use_multidraw && indirect_buffer_id && num_instances == 0)
+		{
+			multiDrawSubmeshes(primitive);
+			return;
+		}
+
+		bindMaterials(shader);
+		int material_location = materials_ssbo_id ? shader->getAttribLocation("a_material_index") : -1;
+		int draw_id = 0;
+
 		for (int i = 0; i < submeshes.size(); ++i) {
 			sSubmeshInfo& submesh = submeshes[i];
-			for (uint32_t j = 0; j < submesh.num_draw_calls; ++j) {
+			for (uint32_t j = 0; j < submesh.draw_calls.size(); ++j) {
 				const sSubmeshDrawCallInfo& dc = submesh.draw_calls[j];
 				if (materials.count(dc.material) > 0) {
 					shader->setUniform("u_Ka", materials[dc.material].Ka);
 					shader->setUniform("u_Kd", materials[dc.material].Kd);
 					shader->setUniform("u_Ks", materials[dc.material].Ks);
 				}
+				if (material_location != -1)
+					glVertexAttrib1f(material_location, draw_materials[draw_id]);
+				draw_id++;
 				drawCall(primitive, i, j, num_instances);
 			}
 		}
 	}
 	else {
+		shader->setUniform("u_use_materials", false);
 		drawCall(primitive, submesh_id, 0, num_instances);
 	}
+}
 
-	//unbind them
-	disableBuffers(shader);
+void Mesh::drawLOD(unsigned int primitive, int num_instances)
+{
+	const sMeshLOD& lod = lods[current_lod - 1];
+	Shader::current->setUniform("u_use_materials", false);
+
+	//binding an element buffer changes the bound VAO, the mesh one is restored after the draw
+	const void* data = lod.indices_vbo_id ? NULL : &lod.indices[0];
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, lod.indices_vbo_id);
+	if (num_instances > 0)
+		glDrawElementsInstanced(primitive, (GLsizei)lod.indices.size(), GL_UNSIGNED_INT, data, num_instances);
+	else
+		glDrawElements(primitive, (GLsizei)lod.indices.size(), GL_UNSIGNED_INT, data);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, current_vao ? indices_vbo_id : 0);
+
+	num_triangles_rendered += static_cast<long>((lod.indices.size() / 3) * (num_instances ? num_instances : 1));
+	num_meshes_rendered++;
+}
+
+void Mesh::drawMeshlets(unsigned int primitive)
+{
+	//everything culled
+	if (!meshlet_commands.size())
+		return;
+
+	//the commands change every frame, orphan the previous ones
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, meshlet_commands_buffer_id);
+	glBufferData(GL_DRAW_INDIRECT_BUFFER, meshlet_commands.size() * sizeof(sDrawElementsIndirectCommand), &meshlet_commands[0], GL_STREAM_DRAW);
+
+	int material_location = enableDrawMaterials(Shader::current);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, meshlet_indices_vbo_id);
+	glMultiDrawElementsIndirect(primitive, GL_UNSIGNED_INT, NULL, (GLsizei)meshlet_commands.size(), 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, current_vao ? indices_vbo_id : 0);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+	disableDrawMaterials(material_location);
+
+	for (const sDrawElementsIndirectCommand& command : meshlet_commands)
+		num_triangles_rendered += command.count / 3;
+	num_meshes_rendered++;
+}
+
+void Mesh::bindMaterials(Shader* shader)
+{
+	shader->setUniform("u_use_materials", materials_ssbo_id != 0);
+	if (materials_ssbo_id)
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, materials_ssbo_id);
+}
+
+//every command has its own baseInstance, so a per instance attribute gives the material of every draw
+int Mesh::enableDrawMaterials(Shader* shader)
+{
+	bindMaterials(shader);
+	int material_location = draw_materials_vbo_id ? shader->getAttribLocation("a_material_index") : -1;
+	if (material_location != -1)
+	{
+		glBindBuffer(GL_ARRAY_BUFFER, draw_materials_vbo_id);
+		glEnableVertexAttribArray(material_location);
+		glVertexAttribPointer(material_location, 1, GL_FLOAT, GL_FALSE, 0, NULL);
+		glVertexAttribDivisor(material_location, 1);
+	}
+	return material_location;
+}
+
+//the attribute may have been recorded in the bound VAO, leave it as it was
+void Mesh::disableDrawMaterials(int material_location)
+{
+	if (material_location != -1)
+	{
+		glVertexAttribDivisor(material_location, 0);
+		glDisableVertexAttribArray(material_location);
+	}
+}
+
+void Mesh::multiDrawSubmeshes(unsigned int primitive)
+{
+	int material_location = enableDrawMaterials(Shader::current);
+
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, indirect_buffer_id);
+	if (indices.size())
+	{
+		if (!current_vao) glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
+		glMultiDrawElementsIndirect(primitive, GL_UNSIGNED_INT, NULL, num_indirect_draws, 0);
+		if (!current_vao) glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	}
+	else
+		glMultiDrawArraysIndirect(primitive, NULL, num_indirect_draws, 0);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+	disableDrawMaterials(material_location);
+
+	for (const sSubmeshInfo& submesh : submeshes)
+		for (const sSubmeshDrawCallInfo& dc : submesh.draw_calls)
+			num_triangles_rendered += static_cast<long>(indices.size() ? dc.length : dc.length / 3);
+	num_meshes_rendered++;
 }
 
 void Mesh::drawCall(unsigned int primitive, int submesh_id, int draw_call_id, int num_instances)
@@ -286,6 +560,8 @@ void Mesh::drawCall(unsigned int primitive, int submesh_id, int draw_call_id, in
 	size_t size = vertices.size();
 	if (indices.size())
 		size = indices.size();
+	else if (compact.size())
+		size = compact.size();
 	else if (interleaved.size())
 		size = interleaved.size();
 
@@ -301,20 +577,21 @@ void Mesh::drawCall(unsigned int primitive, int submesh_id, int draw_call_id, in
 	//DRAW
 	if (indices.size())
 	{
+		//the VAO already has the indices bound, unbinding them would modify it
 		if (num_instances > 0)
 		{
 			assert(indices_vbo_id && "indices must be uploaded to the GPU");
-			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
+			if (!current_vao) glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
 			glDrawElementsInstanced(primitive, size * 3, GL_UNSIGNED_INT, (void*)(start * sizeof(glm::vec3)), num_instances);
-			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+			if (!current_vao) glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 		}
 		else
 		{
 			if (indices_vbo_id)
 			{
-				glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
+				if (!current_vao) glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
 				glDrawElements(primitive, size * 3, GL_UNSIGNED_INT, (void*)(start * sizeof(glm::vec3)));
-				glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+				if (!current_vao) glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 			}
 			else
 				glDrawElements(primitive, size * 3, GL_UNSIGNED_INT, (void*)(&indices[0] + start)); //no multiply, its a vector3u pointer)
@@ -334,6 +611,15 @@ void Mesh::drawCall(unsigned int primitive, int submesh_id, int draw_call_id, in
 
 void Mesh::disableBuffers(Shader* shader)
 {
+	//the attributes stay enabled inside the VAO
+	if (current_vao)
+	{
+		glBindVertexArray(0);
+		current_vao = 0;
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		return;
+	}
+
 	glDisableVertexAttribArray(vertex_location);
 	if (normal_location != -1) glDisableVertexAttribArray(normal_location);
 	if (uv_location != -1) glDisableVertexAttribArray(uv_location);
@@ -344,7 +630,85 @@ void Mesh::disableBuffers(Shader* shader)
 	glBindBuffer(GL_ARRAY_BUFFER, 0);    //if crashes here, COMMENT THIS LINE ****************************
 }
 
-GLuint instances_buffer_id = 0;
+GLuint instances_buffer_id = 0; //used when the ring is disabled or not supported
+
+//the instance ring is a persistent mapped buffer split in regions, the CPU fills one region while the GPU
+//may still be reading the others. A fence per region tells when it can be overwritten.
+#define INSTANCE_RING_REGIONS 3
+#define INSTANCE_RING_REGION_SIZE (16 * 1024 * 1024) //262144 mat4 per region
+
+GLuint instances_ring_id = 0;
+uint8_t* instances_ring_data = NULL;
+GLsync instances_ring_fences[INSTANCE_RING_REGIONS] = {};
+int instances_ring_region = 0;
+size_t instances_ring_offset = 0; //inside the current region
+
+static bool initInstancesRing()
+{
+	if (instances_ring_data)
+		return true;
+	if (glBufferStorage == 0)
+		return false;
+
+	GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+	glGenBuffers(1, &instances_ring_id);
+	glBindBuffer(GL_ARRAY_BUFFER, instances_ring_id);
+	glBufferStorage(GL_ARRAY_BUFFER, INSTANCE_RING_REGIONS * INSTANCE_RING_REGION_SIZE, NULL, flags);
+	instances_ring_data = (uint8_t*)glMapBufferRange(GL_ARRAY_BUFFER, 0, INSTANCE_RING_REGIONS * INSTANCE_RING_REGION_SIZE, flags);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	return instances_ring_data != NULL;
+}
+
+void* Mesh::allocInstances(size_t size)
+{
+	if (!use_instance_ring || size > INSTANCE_RING_REGION_SIZE || !initInstancesRing())
+		return NULL;
+
+	size = (size + 63) & ~(size_t)63;
+	if (instances_ring_offset + size > INSTANCE_RING_REGION_SIZE)
+	{
+		//the region can be reused once the draws issued so far are completed
+		instances_ring_fences[instances_ring_region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		instances_ring_region = (instances_ring_region + 1) % INSTANCE_RING_REGIONS;
+		instances_ring_offset = 0;
+
+		GLsync& fence = instances_ring_fences[instances_ring_region];
+		if (fence)
+		{
+			while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED);
+			glDeleteSync(fence);
+			fence = 0;
+		}
+	}
+
+	void* data = instances_ring_data + instances_ring_region * INSTANCE_RING_REGION_SIZE + instances_ring_offset;
+	instances_ring_offset += size;
+	return data;
+}
+
+//binds the buffer with the instances to GL_ARRAY_BUFFER and returns their offset in it
+static size_t bindInstances(const void* data, size_t size)
+{
+	const uint8_t* ptr = (const uint8_t*)data;
+	bool in_ring = instances_ring_data && ptr >= instances_ring_data && ptr < instances_ring_data + INSTANCE_RING_REGIONS * INSTANCE_RING_REGION_SIZE;
+	if (!in_ring)
+	{
+		uint8_t* dst = (uint8_t*)Mesh::allocInstances(size);
+		if (!dst)
+		{
+			if (instances_buffer_id == 0)
+				glGenBuffersARB(1, &instances_buffer_id);
+			glBindBufferARB(GL_ARRAY_BUFFER_ARB, instances_buffer_id);
+			glBufferDataARB(GL_ARRAY_BUFFER_ARB, size, data, GL_STREAM_DRAW_ARB);
+			return 0;
+		}
+		memcpy(dst, data, size);
+		ptr = dst;
+	}
+
+	glBindBuffer(GL_ARRAY_BUFFER, instances_ring_id);
+	return ptr - instances_ring_data;
+}
 
 //should be faster but in some system it is slower
 void Mesh::renderInstanced(unsigned int primitive, const glm::mat4* instanced_models, int num_instances)
@@ -355,38 +719,40 @@ void Mesh::renderInstanced(unsigned int primitive, const glm::mat4* instanced_mo
 	Shader* shader = Shader::current;
 	assert(shader && "shader must be enabled");
 
-	if (instances_buffer_id == 0)
-		glGenBuffersARB(1, &instances_buffer_id);
-	glBindBufferARB(GL_ARRAY_BUFFER_ARB, instances_buffer_id);
-	glBufferDataARB(GL_ARRAY_BUFFER_ARB, num_instances * sizeof(glm::mat4), instanced_models, GL_STREAM_DRAW_ARB);
-
 	int attribLocation = shader->getAttribLocation("u_model");
 	assert(attribLocation != -1 && "shader must have attribute mat4 u_model (not a uniform)");
 	if (attribLocation == -1)
 		return; //this shader doesnt support instanced model
 
+	//bind the mesh first so the instanced attributes are set in its VAO
+	enableBuffers(shader);
+
+	size_t instances_offset = bindInstances(instanced_models, num_instances * sizeof(glm::mat4));
+
 	//mat4 count as 4 different attributes of vec4... (thanks opengl...)
 	for (int k = 0; k < 4; ++k)
 	{
 		glEnableVertexAttribArray(attribLocation + k);
-		int offset = sizeof(float) * 4 * k;
+		size_t offset = instances_offset + sizeof(float) * 4 * k;
 		const uint8_t* addr = (uint8_t*)offset;
 		glVertexAttribPointer(attribLocation + k, 4, GL_FLOAT, false, sizeof(glm::mat4x4), addr);
 		glVertexAttribDivisor(attribLocation + k, 1); // This makes it instanced!
 	}
 
 	//regular render
-	render(primitive, -1, num_instances);
+	drawSubmeshes(primitive, -1, num_instances);
 
-	//disable instanced attribs
+	//disable instanced attribs (restores the VAO)
 	for (int k = 0; k < 4; ++k)
 	{
 		glDisableVertexAttribArray(attribLocation + k);
 		glVertexAttribDivisor(attribLocation + k, 0);
 	}
+
+	disableBuffers(shader);
 }
 
-void Mesh::renderInstanced(unsigned int primitive, const std::vector<glm::vec3> positions, const char* uniform_name)
+void Mesh::renderInstanced(unsigned int primitive, const std::vector<glm::vec3>& positions, const char* uniform_name)
 {
 	if (!positions.size())
 		return;
@@ -395,26 +761,28 @@ void Mesh::renderInstanced(unsigned int primitive, const std::vector<glm::vec3>
 	Shader* shader = Shader::current;
 	assert(shader && "shader must be enabled");
 
-	if (instances_buffer_id == 0)
-		glGenBuffersARB(1, &instances_buffer_id);
-	glBindBufferARB(GL_ARRAY_BUFFER_ARB, instances_buffer_id);
-	glBufferDataARB(GL_ARRAY_BUFFER_ARB, num_instances * sizeof(glm::vec3), &positions[0], GL_STREAM_DRAW_ARB);
-
 	int attribLocation = shader->getAttribLocation(uniform_name);
 	assert(attribLocation != -1 && "shader uniform not found");
 	if (attribLocation == -1)
 		return; //this shader doesnt have instanced uniform
 
+	//bind the mesh first so the instanced attribute is set in its VAO
+	enableBuffers(shader);
+
+	size_t instances_offset = bindInstances(&positions[0], num_instances * sizeof(glm::vec3));
+
 	glEnableVertexAttribArray(attribLocation);
-	glVertexAttribPointer(attribLocation, 3, GL_FLOAT, false, sizeof(glm::vec3), 0);
+	glVertexAttribPointer(attribLocation, 3, GL_FLOAT, false, sizeof(glm::vec3), (void*)instances_offset);
 	glVertexAttribDivisor(attribLocation, 1); // This makes it instanced!
 
 	//regular render
-	render(primitive, -1, num_instances);
+	drawSubmeshes(primitive, -1, num_instances);
 
-	//disable instanced attribs
+	//disable instanced attribs (restores the VAO)
 	glDisableVertexAttribArray(attribLocation);
 	glVertexAttribDivisor(attribLocation, 0);
+
+	disableBuffers(shader);
 }
 
 
@@ -509,7 +877,7 @@ void Mesh::renderFixedPipeline(int primitive)
 
 void Mesh::uploadToVRAM()
 {
-	assert(vertices.size() || interleaved.size());
+	assert(vertices.size() || interleaved.size() || compact.size());
 
 	if (glGenBuffersARB == 0)
 	{
@@ -517,13 +885,24 @@ void Mesh::uploadToVRAM()
 		exit(0);
 	}
 
-	if (interleaved.size())
+	//the buffers layout may change, VAOs will be recreated on the next render
+	clearVAOs();
+
+	if (compact.size())
+	{
+		// Quantized Vertex,Normal,UV
+		if (interleaved_vbo_id == 0)
+			glGenBuffersARB(1, &interleaved_vbo_id);
+		glBindBufferARB(GL_ARRAY_BUFFER_ARB, interleaved_vbo_id);
+		uploadBuffer(GL_ARRAY_BUFFER_ARB, &compact[0], compact.size() * sizeof(tInterleavedCompact));
+	}
+	else if (interleaved.size())
 	{
 		// Vertex,Normal,UV
 		if (interleaved_vbo_id == 0)
 			glGenBuffersARB(1, &interleaved_vbo_id);
 		glBindBufferARB(GL_ARRAY_BUFFER_ARB, interleaved_vbo_id);
-		glBufferDataARB(GL_ARRAY_BUFFER_ARB, interleaved.size() * sizeof(tInterleaved), &interleaved[0], GL_STATIC_DRAW_ARB);
+		uploadBuffer(GL_ARRAY_BUFFER_ARB, &interleaved[0], interleaved.size() * sizeof(tInterleaved));
 	}
 	else
 	{
@@ -531,7 +910,7 @@ void Mesh::uploadToVRAM()
 		if (vertices_vbo_id == 0)
 			glGenBuffersARB(1, &vertices_vbo_id);
 		glBindBufferARB(GL_ARRAY_BUFFER_ARB, vertices_vbo_id);
-		glBufferDataARB(GL_ARRAY_BUFFER_ARB, vertices.size() * sizeof(glm::vec3), &vertices[0], GL_STATIC_DRAW_ARB);
+		uploadBuffer(GL_ARRAY_BUFFER_ARB, &vertices[0], vertices.size() * sizeof(glm::vec3));
 
 		// UVs
 		if (uvs.size())
@@ -539,7 +918,7 @@ void Mesh::uploadToVRAM()
 			if (uvs_vbo_id == 0)
 				glGenBuffersARB(1, &uvs_vbo_id);
 			glBindBufferARB(GL_ARRAY_BUFFER_ARB, uvs_vbo_id);
-			glBufferDataARB(GL_ARRAY_BUFFER_ARB, uvs.size() * sizeof(glm::vec2), &uvs[0], GL_STATIC_DRAW_ARB);
+			uploadBuffer(GL_ARRAY_BUFFER_ARB, &uvs[0], uvs.size() * sizeof(glm::vec2));
 		}
 
 		// Normals
@@ -548,7 +927,7 @@ void Mesh::uploadToVRAM()
 			if (normals_vbo_id == 0)
 				glGenBuffersARB(1, &normals_vbo_id);
 			glBindBufferARB(GL_ARRAY_BUFFER_ARB, normals_vbo_id);
-			glBufferDataARB(GL_ARRAY_BUFFER_ARB, normals.size() * sizeof(glm::vec3), &normals[0], GL_STATIC_DRAW_ARB);
+			uploadBuffer(GL_ARRAY_BUFFER_ARB, &normals[0], normals.size() * sizeof(glm::vec3));
 		}
 	}
 
@@ -558,7 +937,7 @@ void Mesh::uploadToVRAM()
 		if (uvs1_vbo_id == 0)
 			glGenBuffersARB(1, &uvs1_vbo_id);
 		glBindBufferARB(GL_ARRAY_BUFFER_ARB, uvs1_vbo_id);
-		glBufferDataARB(GL_ARRAY_BUFFER_ARB, uvs1.size() * sizeof(glm::vec2), &uvs1[0], GL_STATIC_DRAW_ARB);
+		uploadBuffer(GL_ARRAY_BUFFER_ARB, &uvs1[0], uvs1.size() * sizeof(glm::vec2));
 	}
 
 	// Colors
@@ -567,7 +946,7 @@ void Mesh::uploadToVRAM()
 		if (colors_vbo_id == 0)
 			glGenBuffersARB(1, &colors_vbo_id);
 		glBindBufferARB(GL_ARRAY_BUFFER_ARB, colors_vbo_id);
-		glBufferDataARB(GL_ARRAY_BUFFER_ARB, colors.size() * sizeof(glm::vec4), &colors[0], GL_STATIC_DRAW_ARB);
+		uploadBuffer(GL_ARRAY_BUFFER_ARB, &colors[0], colors.size() * sizeof(glm::vec4));
 	}
 
 	if (bones.size())
@@ -575,14 +954,14 @@ void Mesh::uploadToVRAM()
 		if (bones_vbo_id == 0)
 			glGenBuffersARB(1, &bones_vbo_id);
 		glBindBufferARB(GL_ARRAY_BUFFER_ARB, bones_vbo_id);
-		glBufferDataARB(GL_ARRAY_BUFFER_ARB, bones.size() * sizeof(glm::uvec4), &bones[0], GL_STATIC_DRAW_ARB);
+		uploadBuffer(GL_ARRAY_BUFFER_ARB, &bones[0], bones.size() * sizeof(glm::uvec4));
 	}
 	if (weights.size())
 	{
 		if (weights_vbo_id == 0)
 			glGenBuffersARB(1, &weights_vbo_id);
 		glBindBufferARB(GL_ARRAY_BUFFER_ARB, weights_vbo_id);
-		glBufferDataARB(GL_ARRAY_BUFFER_ARB, weights.size() * sizeof(glm::vec4), &weights[0], GL_STATIC_DRAW_ARB);
+		uploadBuffer(GL_ARRAY_BUFFER_ARB, &weights[0], weights.size() * sizeof(glm::vec4));
 	}
 
 	glBindBufferARB(GL_ARRAY_BUFFER_ARB, 0);
@@ -593,17 +972,150 @@ void Mesh::uploadToVRAM()
 		if (indices_vbo_id == 0)
 			glGenBuffersARB(1, &indices_vbo_id);
 		glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
-		glBufferDataARB(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(glm::uvec3), &indices[0], GL_STATIC_DRAW_ARB);
+		uploadBuffer(GL_ELEMENT_ARRAY_BUFFER, &indices[0], indices.size() * sizeof(glm::uvec3));
+	}
+	glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+	// LODs indices
+	for (sMeshLOD& lod : lods)
+	{
+		if (lod.indices_vbo_id == 0)
+			glGenBuffersARB(1, &lod.indices_vbo_id);
+		glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER, lod.indices_vbo_id);
+		uploadBuffer(GL_ELEMENT_ARRAY_BUFFER, &lod.indices[0], lod.indices.size() * sizeof(unsigned int));
 	}
 	glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER, 0);
 
+	// Meshlets, they are drawn with glMultiDrawElementsIndirect
+	if (meshlets.size() && glMultiDrawElementsIndirect)
+	{
+		if (meshlet_indices_vbo_id == 0)
+			glGenBuffersARB(1, &meshlet_indices_vbo_id);
+		glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER, meshlet_indices_vbo_id);
+		uploadBuffer(GL_ELEMENT_ARRAY_BUFFER, &meshlet_indices[0], meshlet_indices.size() * sizeof(unsigned int));
+		glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER, 0);
+		if (meshlet_commands_buffer_id == 0)
+			glGenBuffersARB(1, &meshlet_commands_buffer_id);
+	}
+
+	uploadDrawCommands();
 
+	//blocks of buffers that changed after being staged
+	for (auto& it : staged_blocks)
+		UploadManager::cancel(it.second);
+	staged_blocks.clear();
 
 	checkGLErrors();
 
 	//clear buffers to save memory
 }
 
+//through the staging ring, using the block written by stageBuffers if there is one
+void Mesh::uploadBuffer(unsigned int target, const void* data, size_t size)
+{
+	auto it = staged_blocks.find(data);
+	UploadManager::uploadBuffer(target, data, size, it != staged_blocks.end() ? &it->second : NULL);
+	if (it != staged_blocks.end())
+		staged_blocks.erase(it);
+}
+
+void Mesh::stageBuffers()
+{
+	auto stage = [this](const void* data, size_t size) {
+		sStagingBlock block;
+		if (size && UploadManager::alloc(size, block))
+		{
+			memcpy(block.data, data, size);
+			staged_blocks[data] = block;
+		}
+	};
+
+	//the same buffers uploadToVRAM sends
+	if (compact.size())
+		stage(&compact[0], compact.size() * sizeof(tInterleavedCompact));
+	else if (interleaved.size())
+		stage(&interleaved[0], interleaved.size() * sizeof(tInterleaved));
+	else
+	{
+		stage(vertices.data(), vertices.size() * sizeof(glm::vec3));
+		stage(uvs.data(), uvs.size() * sizeof(glm::vec2));
+		stage(normals.data(), normals.size() * sizeof(glm::vec3));
+	}
+	stage(uvs1.data(), uvs1.size() * sizeof(glm::vec2));
+	stage(colors.data(), colors.size() * sizeof(glm::vec4));
+	stage(bones.data(), bones.size() * sizeof(glm::uvec4));
+	stage(weights.data(), weights.size() * sizeof(glm::vec4));
+	stage(indices.data(), indices.size() * sizeof(glm::uvec3));
+	for (const sMeshLOD& lod : lods)
+		stage(lod.indices.data(), lod.indices.size() * sizeof(unsigned int));
+	stage(meshlet_indices.data(), meshlet_indices.size() * sizeof(unsigned int));
+}
+
+//packs the draw calls of all the submeshes in a GL_DRAW_INDIRECT_BUFFER and the materials in a SSBO
+void Mesh::uploadDrawCommands()
+{
+	draw_materials.clear();
+	num_indirect_draws = 0;
+	if (!submeshes.size() || !materials.size())
+		return;
+
+	//std430 aligns vec3 to 16 bytes, so every sMaterialInfo is stored as 3 vec4
+	std::map<std::string, int> material_ids;
+	std::vector<glm::vec4> materials_data;
+	for (auto& it : materials)
+	{
+		material_ids[it.first] = (int)(materials_data.size() / 3);
+		materials_data.push_back(glm::vec4(it.second.Ka, 1.0f));
+		materials_data.push_back(glm::vec4(it.second.Kd, 1.0f));
+		materials_data.push_back(glm::vec4(it.second.Ks, 1.0f));
+	}
+
+	std::vector<sDrawArraysIndirectCommand> array_commands;
+	std::vector<sDrawElementsIndirectCommand> element_commands;
+	for (const sSubmeshInfo& submesh : submeshes)
+		for (const sSubmeshDrawCallInfo& dc : submesh.draw_calls)
+		{
+			auto it = material_ids.find(dc.material);
+			unsigned int base_instance = (unsigned int)draw_materials.size();
+			draw_materials.push_back(it != material_ids.end() ? (float)it->second : 0.0f);
+
+			//start and length are in primitives, indexed meshes store triangles
+			if (indices.size())
+				element_commands.push_back({ (unsigned int)dc.length * 3, 1, (unsigned int)dc.start * 3, 0, base_instance });
+			else
+				array_commands.push_back({ (unsigned int)dc.length, 1, (unsigned int)dc.start, base_instance });
+		}
+
+	if (glMultiDrawArraysIndirect == 0)
+	{
+		std::cout << "[WARN] multi draw indirect not supported, using a draw call per material" << std::endl;
+		return;
+	}
+
+	if (indirect_buffer_id == 0)
+		glGenBuffersARB(1, &indirect_buffer_id);
+	glBindBufferARB(GL_DRAW_INDIRECT_BUFFER, indirect_buffer_id);
+	if (indices.size())
+		glBufferDataARB(GL_DRAW_INDIRECT_BUFFER, element_commands.size() * sizeof(sDrawElementsIndirectCommand), &element_commands[0], GL_STATIC_DRAW_ARB);
+	else
+		glBufferDataARB(GL_DRAW_INDIRECT_BUFFER, array_commands.size() * sizeof(sDrawArraysIndirectCommand), &array_commands[0], GL_STATIC_DRAW_ARB);
+	glBindBufferARB(GL_DRAW_INDIRECT_BUFFER, 0);
+
+	if (draw_materials_vbo_id == 0)
+		glGenBuffersARB(1, &draw_materials_vbo_id);
+	glBindBufferARB(GL_ARRAY_BUFFER_ARB, draw_materials_vbo_id);
+	glBufferDataARB(GL_ARRAY_BUFFER_ARB, draw_materials.size() * sizeof(float), &draw_materials[0], GL_STATIC_DRAW_ARB);
+	glBindBufferARB(GL_ARRAY_BUFFER_ARB, 0);
+
+	if (materials_ssbo_id == 0)
+		glGenBuffersARB(1, &materials_ssbo_id);
+	glBindBufferARB(GL_SHADER_STORAGE_BUFFER, materials_ssbo_id);
+	glBufferDataARB(GL_SHADER_STORAGE_BUFFER, materials_data.size() * sizeof(glm::vec4), &materials_data[0], GL_STATIC_DRAW_ARB);
+	glBindBufferARB(GL_SHADER_STORAGE_BUFFER, 0);
+
+	num_indirect_draws = (unsigned int)draw_materials.size();
+}
+
 bool Mesh::interleaveBuffers()
 {
 	if (!vertices.size() || !normals.size() || !uvs.size())
@@ -627,6 +1139,57 @@ bool Mesh::interleaveBuffers()
 	return true;
 }
 
+//octahedral mapping of a unit vector to [-1,1]^2
+static glm::vec2 octEncode(glm::vec3 n)
+{
+	n /= (fabs(n.x) + fabs(n.y) + fabs(n.z));
+	glm::vec2 e(n.x, n.y);
+	if (n.z < 0.0f)
+	{
+		e.x = (1.0f - fabs(n.y)) * (n.x >= 0.0f ? 1.0f : -1.0f);
+		e.y = (1.0f - fabs(n.x)) * (n.y >= 0.0f ? 1.0f : -1.0f);
+	}
+	return e;
+}
+
+bool Mesh::compactBuffers()
+{
+	if (!interleaved.size())
+		return false;
+
+	updateBoundingBox();
+
+	//avoid dividing by zero in flat meshes
+	glm::vec3 inv_size;
+	for (int k = 0; k < 3; ++k)
+		inv_size[k] = box.halfsize[k] > 0.0f ? 0.5f / box.halfsize[k] : 0.0f;
+
+	compact.resize(interleaved.size());
+
+	for (unsigned int i = 0; i < interleaved.size(); ++i)
+	{
+		const tInterleaved& src = interleaved[i];
+		tInterleavedCompact& dst = compact[i];
+
+		glm::vec3 local = (src.vertex - box.center) * inv_size + glm::vec3(0.5f);
+		for (int k = 0; k < 3; ++k)
+			dst.vertex[k] = glm::packUnorm1x16(local[k]);
+		dst.vertex[3] = 0;
+
+		float len = glm::length(src.normal);
+		glm::vec2 oct = len > 0.0f ? octEncode(src.normal / len) : glm::vec2(0.0f);
+		dst.normal[0] = (int16_t)glm::packSnorm1x16(oct.x);
+		dst.normal[1] = (int16_t)glm::packSnorm1x16(oct.y);
+
+		dst.uv[0] = glm::packHalf1x16(src.uv.x);
+		dst.uv[1] = glm::packHalf1x16(src.uv.y);
+	}
+
+	interleaved.resize(0);
+
+	return true;
+}
+
 struct sMeshInfo
 {
 	int version = 0;
@@ -680,7 +1243,13 @@ bool Mesh::readBin(const char* filename)
 		return false;
 	}
 
-	if (info.streams[0] == 'I')
+	if (info.streams[0] == 'Q')
+	{
+		compact.resize(info.size);
+		memcpy((void*)&compact[0], pos, sizeof(tInterleavedCompact) * info.size);
+		pos += sizeof(tInterleavedCompact) * info.size;
+	}
+	else if (info.streams[0] == 'I')
 	{
 		interleaved.resize(info.size);
 		memcpy((void*)&interleaved[0], pos, sizeof(tInterleaved) * info.size);
@@ -756,11 +1325,146 @@ bool Mesh::readBin(const char* filename)
 	radius = info.radius;
 	bind_matrix = info.bind_matrix;
 
+	//every submesh is stored as its name, the number of draw calls and the draw calls.
+	//the counts come from the file, a truncated or corrupted one fails the load instead of reading past the data
+	const char* end = data + size;
 	submeshes.resize(info.num_submeshes);
-	if (info.num_submeshes)
+	for (sSubmeshInfo& submesh : submeshes)
 	{
-		memcpy(&submeshes[0], pos, sizeof(sSubmeshInfo) * info.num_submeshes);
-		pos += sizeof(sSubmeshInfo) * info.num_submeshes;
+		unsigned int num_draw_calls = 0;
+		if (pos > end || (size_t)(end - pos) < sizeof(submesh.name) + sizeof(unsigned int))
+		{
+			std::cout << "[ERROR] loading BIN: truncated submeshes: " << filename << std::endl;
+			clear();
+			submeshes.clear();
+			delete[] data;
+			return false;
+		}
+		memcpy(submesh.name, pos, sizeof(submesh.name));
+		pos += sizeof(submesh.name);
+		memcpy(&num_draw_calls, pos, sizeof(unsigned int));
+		pos += sizeof(unsigned int);
+		if ((size_t)(end - pos) / sizeof(sSubmeshDrawCallInfo) < num_draw_calls)
+		{
+			std::cout << "[ERROR] loading BIN: truncated draw calls: " << filename << std::endl;
+			clear();
+			submeshes.clear();
+			delete[] data;
+			return false;
+		}
+		submesh.draw_calls.resize(num_draw_calls);
+		if (num_draw_calls)
+		{
+			memcpy(&submesh.draw_calls[0], pos, sizeof(sSubmeshDrawCallInfo) * num_draw_calls);
+			pos += sizeof(sSubmeshDrawCallInfo) * num_draw_calls;
+		}
+	}
+
+	//optional chunks after the streams: 4 chars tag, size in bytes and data. Unknown ones are skipped
+	while (pos + 4 + sizeof(unsigned int) <= data + size)
+	{
+		char tag[4];
+		unsigned int chunk_size = 0;
+		memcpy(tag, pos, 4);
+		memcpy(&chunk_size, pos + 4, sizeof(unsigned int));
+		pos += 4 + sizeof(unsigned int);
+		if (pos + chunk_size > data + size)
+			break;
+
+		if (memcmp(tag, "BVH ", 4) == 0)
+		{
+			BVH* bvh = new BVH();
+			if (bvh->read(pos, chunk_size))
+				collision_model = bvh;
+			else
+				delete bvh;
+		}
+		else if (memcmp(tag, "LOD ", 4) == 0)
+		{
+			//number of LODs and for every one its error, number of indices and indices. A truncated chunk or
+			//an index out of the vertices discards all the LODs
+			const char* lod_pos = pos;
+			const char* lod_end = pos + chunk_size;
+			unsigned int num_lods = 0;
+			unsigned int num_vertices = getNumVertices();
+			bool valid = chunk_size >= sizeof(unsigned int);
+			if (valid)
+			{
+				memcpy(&num_lods, lod_pos, sizeof(unsigned int));
+				lod_pos += sizeof(unsigned int);
+				valid = num_lods <= MAX_MESH_LODS;
+			}
+			if (valid)
+				lods.resize(num_lods);
+			for (unsigned int i = 0; valid && i < num_lods; ++i)
+			{
+				sMeshLOD& lod = lods[i];
+				unsigned int num_indices = 0;
+				lod.indices_vbo_id = 0;
+				if ((size_t)(lod_end - lod_pos) < sizeof(float) + sizeof(unsigned int)) { valid = false; break; }
+				memcpy(&lod.error, lod_pos, sizeof(float));
+				memcpy(&num_indices, lod_pos + sizeof(float), sizeof(unsigned int));
+				lod_pos += sizeof(float) + sizeof(unsigned int);
+				if (!num_indices || num_indices % 3 || (size_t)(lod_end - lod_pos) / sizeof(unsigned int) < num_indices) { valid = false; break; }
+				lod.indices.resize(num_indices);
+				memcpy(&lod.indices[0], lod_pos, num_indices * sizeof(unsigned int));
+				lod_pos += num_indices * sizeof(unsigned int);
+				for (unsigned int index : lod.indices)
+					if (index >= num_vertices) { valid = false; break; }
+			}
+			if (!valid)
+			{
+				lods.clear();
+				std::cerr << "LOD chunk corrupted, ignored: " << filename << std::endl;
+			}
+		}
+		else if (memcmp(tag, "MLET", 4) == 0)
+		{
+			//number of meshlets, meshlets, number of indices and indices. A truncated chunk or
+			//meshlets out of the indices (or indices out of the vertices) discard them all
+			const char* meshlet_pos = pos;
+			const char* meshlet_end = pos + chunk_size;
+			unsigned int num_meshlets = 0, num_indices = 0;
+			unsigned int num_vertices = getNumVertices();
+			bool valid = chunk_size >= sizeof(unsigned int);
+			if (valid)
+			{
+				memcpy(&num_meshlets, meshlet_pos, sizeof(unsigned int));
+				meshlet_pos += sizeof(unsigned int);
+				valid = (size_t)(meshlet_end - meshlet_pos) / sizeof(sMeshlet) >= num_meshlets;
+			}
+			if (valid)
+			{
+				meshlets.resize(num_meshlets);
+				if (num_meshlets)
+					memcpy(&meshlets[0], meshlet_pos, num_meshlets * sizeof(sMeshlet));
+				meshlet_pos += num_meshlets * sizeof(sMeshlet);
+				valid = (size_t)(meshlet_end - meshlet_pos) >= sizeof(unsigned int);
+			}
+			if (valid)
+			{
+				memcpy(&num_indices, meshlet_pos, sizeof(unsigned int));
+				meshlet_pos += sizeof(unsigned int);
+				valid = (size_t)(meshlet_end - meshlet_pos) / sizeof(unsigned int) >= num_indices;
+			}
+			if (valid)
+			{
+				meshlet_indices.resize(num_indices);
+				if (num_indices)
+					memcpy(&meshlet_indices[0], meshlet_pos, num_indices * sizeof(unsigned int));
+				for (const sMeshlet& meshlet : meshlets)
+					valid = valid && meshlet.first_index <= num_indices && meshlet.num_triangles <= (num_indices - meshlet.first_index) / 3;
+				for (unsigned int index : meshlet_indices)
+					valid = valid && index < num_vertices;
+			}
+			if (!valid)
+			{
+				meshlets.clear();
+				meshlet_indices.clear();
+				std::cerr << "MLET chunk corrupted, ignored: " << filename << std::endl;
+			}
+		}
+		pos += chunk_size;
 	}
 
 	// if the mtl is not specified in the obj but it's needed
@@ -782,7 +1486,7 @@ bool Mesh::readBin(const char* filename)
 
 bool Mesh::writeBin(const char* filename)
 {
-	assert(vertices.size() || interleaved.size());
+	assert(vertices.size() || interleaved.size() || compact.size());
 	std::string s_filename = filename;
 	s_filename += ".mbin";
 
@@ -800,7 +1504,7 @@ bool Mesh::writeBin(const char* filename)
 	memset(&info, 0, sizeof(info));
 	info.version = MESH_BIN_VERSION;
 	info.header_bytes = sizeof(sMeshInfo);
-	info.size = interleaved.size() ? interleaved.size() : vertices.size();
+	info.size = getNumVertices();
 	info.num_indices = indices.size();
 	info.aabb_max = aabb_max;
 	info.aabb_min = aabb_min;
@@ -811,7 +1515,7 @@ bool Mesh::writeBin(const char* filename)
 	info.bind_matrix = bind_matrix;
 	info.num_submeshes = submeshes.size();
 
-	info.streams[0] = interleaved.size() ? 'I' : 'V';
+	info.streams[0] = compact.size() ? 'Q' : interleaved.size() ? 'I' : 'V';
 	info.streams[1] = normals.size() ? 'N' : ' ';
 	info.streams[2] = uvs.size() ? 'U' : ' ';
 	info.streams[3] = colors.size() ? 'C' : ' ';
@@ -824,7 +1528,9 @@ bool Mesh::writeBin(const char* filename)
 	fwrite((void*)&info, sizeof(sMeshInfo), 1, f);
 
 	//write streams
-	if (interleaved.size())
+	if (compact.size())
+		fwrite((void*)&compact[0], compact.size() * sizeof(tInterleavedCompact), 1, f);
+	else if (interleaved.size())
 		fwrite((void*)&interleaved[0], interleaved.size() * sizeof(tInterleaved), 1, f);
 	else
 	{
@@ -850,8 +1556,55 @@ bool Mesh::writeBin(const char* filename)
 	if (uvs1.size())
 		fwrite((void*)&uvs1[0], uvs1.size() * sizeof(glm::vec2), 1, f);
 
-	if (submeshes.size())
-		fwrite((void*)&submeshes[0], submeshes.size() * sizeof(sSubmeshInfo), 1, f);
+	for (const sSubmeshInfo& submesh : submeshes)
+	{
+		unsigned int num_draw_calls = (unsigned int)submesh.draw_calls.size();
+		fwrite((void*)submesh.name, sizeof(submesh.name), 1, f);
+		fwrite((void*)&num_draw_calls, sizeof(unsigned int), 1, f);
+		if (num_draw_calls)
+			fwrite((void*)&submesh.draw_calls[0], num_draw_calls * sizeof(sSubmeshDrawCallInfo), 1, f);
+	}
+
+	//chunks
+	if (collision_model)
+	{
+		BVH* bvh = (BVH*)collision_model;
+		unsigned int chunk_size = (unsigned int)bvh->getSerializedSize();
+		fwrite("BVH ", sizeof(char), 4, f);
+		fwrite((void*)&chunk_size, sizeof(unsigned int), 1, f);
+		bvh->write(f);
+	}
+
+	if (lods.size())
+	{
+		unsigned int num_lods = (unsigned int)lods.size();
+		unsigned int chunk_size = sizeof(unsigned int);
+		for (const sMeshLOD& lod : lods)
+			chunk_size += sizeof(float) + sizeof(unsigned int) + (unsigned int)(lod.indices.size() * sizeof(unsigned int));
+		fwrite("LOD ", sizeof(char), 4, f);
+		fwrite((void*)&chunk_size, sizeof(unsigned int), 1, f);
+		fwrite((void*)&num_lods, sizeof(unsigned int), 1, f);
+		for (const sMeshLOD& lod : lods)
+		{
+			unsigned int num_indices = (unsigned int)lod.indices.size();
+			fwrite((void*)&lod.error, sizeof(float), 1, f);
+			fwrite((void*)&num_indices, sizeof(unsigned int), 1, f);
+			fwrite((void*)&lod.indices[0], sizeof(unsigned int), num_indices, f);
+		}
+	}
+
+	if (meshlets.size())
+	{
+		unsigned int num_meshlets = (unsigned int)meshlets.size();
+		unsigned int num_indices = (unsigned int)meshlet_indices.size();
+		unsigned int chunk_size = (unsigned int)(sizeof(unsigned int) * 2 + num_meshlets * sizeof(sMeshlet) + num_indices * sizeof(unsigned int));
+		fwrite("MLET", sizeof(char), 4, f);
+		fwrite((void*)&chunk_size, sizeof(unsigned int), 1, f);
+		fwrite((void*)&num_meshlets, sizeof(unsigned int), 1, f);
+		fwrite((void*)&meshlets[0], sizeof(sMeshlet), num_meshlets, f);
+		fwrite((void*)&num_indices, sizeof(unsigned int), 1, f);
+		fwrite((void*)&meshlet_indices[0], sizeof(unsigned int), num_indices, f);
+	}
 
 	fclose(f);
 	return true;
@@ -998,10 +1751,8 @@ bool Mesh::loadOBJ(const char* filename)
 	aabb_max = glm::vec3(min_float, min_float, min_float);
 
 	unsigned int vertex_i = 0;
-	unsigned int submesh_draw_calls = 0;
 
 	sSubmeshInfo submesh_info;
-	memset(&submesh_info, 0, sizeof(submesh_info));
 
 	sSubmeshDrawCallInfo submesh_dc_info;
 	memset(&submesh_dc_info, 0, sizeof(submesh_dc_info));
@@ -1069,22 +1820,20 @@ bool Mesh::loadOBJ(const char* filename)
 		}
 		else if (tokens[0] == "o") // submesh
 		{
-			if (submesh_draw_calls > 0)
+			if (submesh_info.draw_calls.size() > 0)
 			{
 				// Store last submesh drawcall
 				submesh_dc_info.length = vertices.size() - submesh_dc_info.start;
 				last_submesh_vertex = vertices.size();
-				submesh_info.draw_calls[submesh_draw_calls] = submesh_dc_info;
+				submesh_info.draw_calls.push_back(submesh_dc_info);
 				submesh_dc_info.start = last_submesh_vertex;
 
 				// Store submesh
-				submesh_info.num_draw_calls = submesh_draw_calls + 1;
 				submeshes.push_back(submesh_info);
 
 				// New submesh
-				memset(&submesh_info, 0, sizeof(submesh_info));
+				submesh_info = sSubmeshInfo();
 				strcpy(submesh_info.name, tokens[1].c_str());
-				submesh_draw_calls = 0;
 			}
 			else
 				strcpy(submesh_info.name, tokens[1].c_str());
@@ -1096,8 +1845,7 @@ bool Mesh::loadOBJ(const char* filename)
 				// Store draw call
 				submesh_dc_info.length = vertices.size() - submesh_dc_info.start;
 				last_submesh_vertex = vertices.size();
-				submesh_info.draw_calls[submesh_draw_calls] = submesh_dc_info;
-				submesh_draw_calls++;
+				submesh_info.draw_calls.push_back(submesh_dc_info);
 
 				// New draw call
 				memset(&submesh_dc_info, 0, sizeof(submesh_dc_info));
@@ -1161,11 +1909,10 @@ bool Mesh::loadOBJ(const char* filename)
 
 	box.center = (aabb_max + aabb_min) * 0.5f;
 	box.halfsize = (aabb_max - box.center);
-	radius = (float)fmax(aabb_max.length(), aabb_min.length());
+	radius = (float)fmax(glm::length(aabb_max), glm::length(aabb_min));
 
 	submesh_dc_info.length = vertices.size() - last_submesh_vertex;
-	submesh_info.draw_calls[submesh_draw_calls] = submesh_dc_info;
-	submesh_info.num_draw_calls = submesh_draw_calls + 1;
+	submesh_info.draw_calls.push_back(submesh_dc_info);
 	submeshes.push_back(submesh_info);
 	return true;
 }
@@ -1259,9 +2006,89 @@ void Mesh::createCube()
 
 	box.center = glm::vec3(0, 0, 0);
 	box.halfsize = glm::vec3(1, 1, 1);
-	radius = (float)box.halfsize.length();
+	radius = glm::length(box.halfsize);
+
+	updateBoundingBox();
+}
+
+//the volume is the cube [-1,1] split in bricks of brick_size voxels, only the bricks with some density are kept.
+//a voxel also counts for the neighbour bricks, so the trilinear filtering around it is inside too
+bool Mesh::createVolumeProxy(const float* density, int width, int height, int depth, int brick_size)
+{
+	clear();
+	if (!density || width <= 0 || height <= 0 || depth <= 0 || brick_size <= 0)
+		return false;
+
+	glm::ivec3 size(width, height, depth);
+	glm::ivec3 bricks = (size + glm::ivec3(brick_size - 1)) / brick_size;
+	std::vector<unsigned char> occupied(bricks.x * bricks.y * bricks.z, 0);
+	for (int z = 0; z < depth; ++z)
+		for (int y = 0; y < height; ++y)
+			for (int x = 0; x < width; ++x)
+			{
+				if (density[x + y * width + z * width * height] <= 0.0f)
+					continue;
+				glm::ivec3 first = glm::max(glm::ivec3(x - 1, y - 1, z - 1), glm::ivec3(0)) / brick_size;
+				glm::ivec3 last = glm::min(glm::ivec3(x + 1, y + 1, z + 1), size - glm::ivec3(1)) / brick_size;
+				for (int bz = first.z; bz <= last.z; ++bz)
+					for (int by = first.y; by <= last.y; ++by)
+						for (int bx = first.x; bx <= last.x; ++bx)
+							occupied[bx + by * bricks.x + bz * bricks.x * bricks.y] = 1;
+			}
+
+	auto isOccupied = [&](glm::ivec3 b) {
+		if (b.x < 0 || b.y < 0 || b.z < 0 || b.x >= bricks.x || b.y >= bricks.y || b.z >= bricks.z)
+			return false;
+		return occupied[b.x + b.y * bricks.x + b.z * bricks.x * bricks.y] != 0;
+	};
+
+	//a quad for every face between an occupied brick and an empty one, counter clockwise seen from outside
+	glm::vec3 voxel = 2.0f / glm::vec3(size);
+	for (int bz = 0; bz < bricks.z; ++bz)
+		for (int by = 0; by < bricks.y; ++by)
+			for (int bx = 0; bx < bricks.x; ++bx)
+			{
+				glm::ivec3 b(bx, by, bz);
+				if (!isOccupied(b))
+					continue;
+				glm::vec3 min = glm::vec3(b * brick_size) * voxel - 1.0f;
+				glm::vec3 max = glm::vec3(glm::min((b + glm::ivec3(1)) * brick_size, size)) * voxel - 1.0f;
+
+				for (int axis = 0; axis < 3; ++axis)
+					for (int side = -1; side <= 1; side += 2)
+					{
+						glm::ivec3 neighbour = b;
+						neighbour[axis] += side;
+						if (isOccupied(neighbour))
+							continue;
+
+						int u = (axis + 1) % 3, v = (axis + 2) % 3;
+						glm::vec3 corners[4];
+						corners[0] = min;
+						corners[0][axis] = side > 0 ? max[axis] : min[axis];
+						corners[1] = corners[0]; corners[1][u] = max[u];
+						corners[2] = corners[1]; corners[2][v] = max[v];
+						corners[3] = corners[0]; corners[3][v] = max[v];
+						if (side < 0)
+							std::swap(corners[1], corners[3]);
+
+						glm::vec3 normal(0.0f);
+						normal[axis] = (float)side;
+						const int order[6] = { 0, 1, 2, 0, 2, 3 };
+						for (int k = 0; k < 6; ++k)
+						{
+							vertices.push_back(corners[order[k]]);
+							normals.push_back(normal);
+						}
+					}
+			}
+
+	if (vertices.empty())
+		return false;
 
 	updateBoundingBox();
+	radius = glm::length(box.halfsize);
+	return true;
 }
 
 void Mesh::createWireBox()
@@ -1272,7 +2099,7 @@ void Mesh::createWireBox()
 
 	box.center = glm::vec3(0, 0, 0);
 	box.halfsize = glm::vec3(1, 1, 1);
-	radius = (float)box.halfsize.length();
+	radius = glm::length(box.halfsize);
 }
 
 void Mesh::createQuad(float center_x, float center_y, float w, float h, bool flip_uvs)
@@ -1343,7 +2170,7 @@ void Mesh::createPlane(float size)
 
 	box.center = glm::vec3(0, 0, 0);
 	box.halfsize = glm::vec3(size, 0, size);
-	radius = (float)box.halfsize.length();
+	radius = glm::length(box.halfsize);
 }
 
 void Mesh::createSubdividedPlane(float size, int subdivisions, bool centered)
@@ -1385,7 +2212,7 @@ void Mesh::createSubdividedPlane(float size, int subdivisions, bool centered)
 		box.center = glm::vec3(size * 0.5f, 0.0f, size * 0.5f);
 
 	box.halfsize = glm::vec3(size * 0.5f, 0.0f, size * 0.5f);
-	radius = static_cast<float>(box.halfsize.length());
+	radius = glm::length(box.halfsize);
 }
 
 void Mesh::displace(Image* heightmap, float altitude)
@@ -1408,7 +2235,7 @@ void Mesh::displace(Image* heightmap, float altitude)
 	}
 	box.center.y += altitude * 0.5f;
 	box.halfsize.y += altitude * 0.5f;
-	radius = static_cast<float>(box.halfsize.length());
+	radius = glm::length(box.halfsize);
 }
 
 
@@ -1509,6 +2336,442 @@ void Mesh::renderBounding(const glm::mat4& model, bool world_bounding)
 
 
 
+void Mesh::benchmarkDrawSubmission(int num_meshes)
+{
+	std::vector<Mesh*> meshes(num_meshes);
+	for (int i = 0; i < num_meshes; ++i)
+	{
+		meshes[i] = new Mesh();
+		meshes[i]->createCube();
+		meshes[i]->uploadToVRAM();
+	}
+
+	Shader* shader = Shader::getDefaultShader("flat");
+	shader->enable();
+	shader->setUniform("u_viewprojection", glm::mat4(1.f));
+	shader->setUniform("u_model", glm::mat4(1.f));
+
+	//we only want to measure the CPU side of the submission
+	glEnable(GL_RASTERIZER_DISCARD);
+
+	bool prev_use_vaos = use_vaos;
+	double times[2];
+	for (int pass = 0; pass < 3; ++pass)
+	{
+		use_vaos = pass != 1; //first pass only warms up (creates the VAOs)
+		glFinish();
+		double start = glfwGetTime();
+		for (int i = 0; i < num_meshes; ++i)
+			meshes[i]->render(GL_TRIANGLES);
+		glFinish();
+		if (pass)
+			times[pass - 1] = glfwGetTime() - start;
+	}
+	use_vaos = prev_use_vaos;
+
+	glDisable(GL_RASTERIZER_DISCARD);
+	shader->disable();
+
+	for (int i = 0; i < num_meshes; ++i)
+		delete meshes[i];
+
+	std::cout << " + Draw submission: " << num_meshes << " meshes  No VAO: " << times[0] * 1000.0 << "ms  VAO: " << times[1] * 1000.0 << "ms  Speedup: " << times[0] / times[1] << "x" << std::endl;
+}
+
+void Mesh::benchmarkInstancing(int num_instances)
+{
+	Mesh mesh;
+	mesh.createCube();
+	mesh.uploadToVRAM();
+
+	std::vector<glm::mat4> models(num_instances);
+	for (int i = 0; i < num_instances; ++i)
+		models[i] = glm::translate(glm::vec3((float)(i % 100), (float)((i / 100) % 100), (float)(i / 10000)));
+
+	Shader* shader = Shader::getDefaultShader("flat_instanced");
+	shader->enable();
+	shader->setUniform("u_viewprojection", glm::mat4(1.f));
+
+	//we only want to measure the CPU side of the streaming
+	glEnable(GL_RASTERIZER_DISCARD);
+
+	const int num_frames = 30;
+	const char* names[] = { "BufferData", "Ring (copy)", "Ring (direct)" };
+	bool prev_use_instance_ring = use_instance_ring;
+	double times[3];
+	for (int mode = 0; mode < 3; ++mode)
+	{
+		use_instance_ring = mode > 0;
+		glFinish();
+		double start = glfwGetTime();
+		for (int frame = 0; frame < num_frames; ++frame)
+		{
+			const glm::mat4* data = &models[0];
+			glm::mat4* mapped = mode == 2 ? (glm::mat4*)allocInstances(num_instances * sizeof(glm::mat4)) : NULL;
+			if (mapped) //the transforms are written straight in the GPU buffer
+			{
+				for (int i = 0; i < num_instances; ++i)
+					mapped[i] = models[i];
+				data = mapped;
+			}
+			mesh.renderInstanced(GL_TRIANGLES, data, num_instances);
+		}
+		glFinish();
+		times[mode] = (glfwGetTime() - start) / num_frames;
+	}
+	use_instance_ring = prev_use_instance_ring;
+
+	glDisable(GL_RASTERIZER_DISCARD);
+	shader->disable();
+
+	std::cout << " + Instancing: " << num_instances << " instances";
+	for (int mode = 0; mode < 3; ++mode)
+		std::cout << "  " << names[mode] << ": " << times[mode] * 1000.0 << "ms/frame";
+	std::cout << std::endl;
+}
+
+void Mesh::getTrianglePositions(std::vector<glm::vec3>& positions)
+{
+	unsigned int num_vertices = getNumVertices();
+	std::vector<glm::vec3> vertex_positions;
+	const glm::vec3* src = vertices.size() ? &vertices[0] : NULL;
+	if (compact.size())
+	{
+		vertex_positions.resize(num_vertices);
+		for (unsigned int i = 0; i < num_vertices; ++i)
+		{
+			glm::vec3 v(compact[i].vertex[0], compact[i].vertex[1], compact[i].vertex[2]);
+			vertex_positions[i] = box.center + (v / 65535.0f * 2.0f - 1.0f) * box.halfsize;
+		}
+		src = &vertex_positions[0];
+	}
+	else if (interleaved.size())
+	{
+		vertex_positions.resize(num_vertices);
+		for (unsigned int i = 0; i < num_vertices; ++i)
+			vertex_positions[i] = interleaved[i].vertex;
+		src = &vertex_positions[0];
+	}
+
+	positions.clear();
+	if (!src)
+		return;
+
+	if (indices.size())
+	{
+		positions.resize(indices.size() * 3);
+		for (size_t i = 0; i < indices.size(); ++i)
+		{
+			positions[i * 3] = src[(unsigned int)indices[i].x];
+			positions[i * 3 + 1] = src[(unsigned int)indices[i].y];
+			positions[i * 3 + 2] = src[(unsigned int)indices[i].z];
+		}
+	}
+	else
+		positions.assign(src, src + (num_vertices / 3) * 3);
+}
+
+bool Mesh::createLODs(int num_lods)
+{
+	std::vector<glm::vec3> positions;
+	getTrianglePositions(positions);
+
+	//not worth it for small meshes
+	if (positions.size() < 3 * 1024)
+		return false;
+
+	//an id for every different normal and uvs, the simplification only welds corners that share them
+	unsigned int num_vertices = getNumVertices();
+	std::vector<unsigned int> vertex_attributes(num_vertices);
+	std::unordered_map<std::string, unsigned int> attribute_ids;
+	for (unsigned int i = 0; i < num_vertices; ++i)
+	{
+		float key[5] = { 0, 0, 0, 0, 0 };
+		if (compact.size())
+		{
+			key[0] = compact[i].normal[0]; key[1] = compact[i].normal[1];
+			key[3] = compact[i].uv[0]; key[4] = compact[i].uv[1];
+		}
+		else if (interleaved.size())
+		{
+			memcpy(key, &interleaved[i].normal, sizeof(glm::vec3));
+			memcpy(key + 3, &interleaved[i].uv, sizeof(glm::vec2));
+		}
+		else
+		{
+			if (i < normals.size()) memcpy(key, &normals[i], sizeof(glm::vec3));
+			if (i < uvs.size()) memcpy(key + 3, &uvs[i], sizeof(glm::vec2));
+		}
+		auto it = attribute_ids.emplace(std::string((const char*)key, sizeof(key)), (unsigned int)attribute_ids.size()).first;
+		vertex_attributes[i] = it->second;
+	}
+	std::vector<unsigned int> attributes(positions.size());
+	for (size_t i = 0; i < attributes.size(); ++i)
+		attributes[i] = vertex_attributes[indices.size() ? (unsigned int)indices[i / 3][i % 3] : (unsigned int)i];
+
+	std::vector<sSimplifiedLevel> levels;
+	simplifyMesh(positions, attributes, num_lods, 0.5f, levels);
+
+	lods.resize(levels.size());
+	for (size_t i = 0; i < levels.size(); ++i)
+	{
+		sMeshLOD& lod = lods[i];
+		lod.error = levels[i].error;
+		lod.indices_vbo_id = 0;
+
+		//from triangle corners to the vertices of the mesh
+		lod.indices.resize(levels[i].corners.size());
+		for (size_t j = 0; j < lod.indices.size(); ++j)
+		{
+			unsigned int corner = levels[i].corners[j];
+			lod.indices[j] = indices.size() ? (unsigned int)indices[corner / 3][corner % 3] : corner;
+		}
+	}
+
+	return lods.size() > 0;
+}
+
+int Mesh::selectLOD(const glm::mat4& model, Camera* camera, float viewport_height)
+{
+	if (!lods.size() || camera->type != Camera::PERSPECTIVE)
+		return 0;
+
+	float scale = std::max(glm::length(glm::vec3(model[0])), std::max(glm::length(glm::vec3(model[1])), glm::length(glm::vec3(model[2]))));
+	glm::vec3 center = model * glm::vec4(box.center, 1.0f);
+	float distance = glm::length(center - camera->eye) - glm::length(box.halfsize) * scale;
+	if (distance <= camera->near_plane)
+		return 0;
+
+	//pixels covered by one unit at that distance
+	float pixels_per_unit = viewport_height / (2.0f * tanf(camera->fov * 3.14159265359f / 360.0f) * distance);
+
+	int lod = 0;
+	for (int i = 0; i < (int)lods.size(); ++i)
+		if (lods[i].error * scale * pixels_per_unit <= lod_pixel_error)
+			lod = i + 1;
+	return lod;
+}
+
+bool Mesh::createMeshlets()
+{
+	std::vector<glm::vec3> positions;
+	getTrianglePositions(positions);
+	if (!positions.size())
+		return false;
+
+	//the triangles of every draw call go to different meshlets, so each one has a single material
+	std::vector<unsigned int> ranges;
+	if (materials.size())
+		for (const sSubmeshInfo& submesh : submeshes)
+			for (const sSubmeshDrawCallInfo& dc : submesh.draw_calls)
+			{
+				size_t start = indices.size() ? dc.start : dc.start / 3;
+				size_t length = indices.size() ? dc.length : dc.length / 3;
+				ranges.push_back((unsigned int)start);
+				ranges.push_back((unsigned int)(start + length));
+			}
+
+	std::vector<unsigned int> corners(positions.size());
+	for (unsigned int i = 0; i < corners.size(); ++i)
+		corners[i] = i;
+	buildMeshlets(corners, positions, ranges, meshlets, meshlet_indices);
+
+	//from triangle corners to the vertices of the mesh
+	if (indices.size())
+		for (unsigned int& index : meshlet_indices)
+			index = (unsigned int)indices[index / 3][index % 3];
+
+	return meshlets.size() > 0;
+}
+
+bool Mesh::cullMeshlets(const glm::mat4& model, Camera* camera)
+{
+	//the cones are tested from the eye, that is not valid for orthographic cameras
+	draw_visible_meshlets = false;
+	if (!meshlets.size() || !meshlet_commands_buffer_id || camera->type != Camera::PERSPECTIVE)
+		return false;
+
+	double start = glfwGetTime();
+	glm::vec3 object_eye = glm::inverse(model) * glm::vec4(camera->eye, 1.0f);
+	::cullMeshlets(meshlets, model, camera->frustum_planes, object_eye, meshlet_visible, meshlet_stats);
+
+	//consecutive visible meshlets of the same draw call become a single command
+	meshlet_commands.clear();
+	for (size_t i = 0; i < meshlets.size(); ++i)
+	{
+		if (!meshlet_visible[i])
+			continue;
+		const sMeshlet& meshlet = meshlets[i];
+		if (meshlet_commands.size())
+		{
+			sDrawElementsIndirectCommand& last = meshlet_commands.back();
+			if (last.first_index + last.count == meshlet.first_index && last.base_instance == meshlet.draw_call)
+			{
+				last.count += meshlet.num_triangles * 3;
+				continue;
+			}
+		}
+		meshlet_commands.push_back({ meshlet.num_triangles * 3, 1, meshlet.first_index, 0, meshlet.draw_call });
+	}
+
+	meshlet_stats.time += glfwGetTime() - start;
+	draw_visible_meshlets = true;
+	return true;
+}
+
+bool Mesh::createCollisionModel()
+{
+	if (collision_model)
+		return true;
+
+	std::vector<glm::vec3> positions;
+	getTrianglePositions(positions);
+	if (!positions.size())
+		return false;
+
+	BVH* bvh = new BVH();
+	bvh->build(positions);
+	collision_model = bvh;
+	return true;
+}
+
+bool Mesh::testRayCollision(glm::mat4 model, glm::vec3 ray_origin, glm::vec3 ray_direction, glm::vec3& collision, glm::vec3& normal, float max_ray_dist, bool in_object_space)
+{
+	if (!createCollisionModel())
+		return false;
+	BVH* bvh = (BVH*)collision_model;
+
+	//the direction is not normalized in object space, so the distances are the same in both spaces
+	glm::mat4 inv = glm::inverse(model);
+	glm::vec3 origin = inv * glm::vec4(ray_origin, 1.0f);
+	glm::vec3 direction = inv * glm::vec4(ray_direction, 0.0f);
+
+	float t;
+	unsigned int triangle_id;
+	if (!bvh->testRay(origin, direction, max_ray_dist, t, triangle_id, normal))
+		return false;
+
+	collision = origin + direction * t;
+	if (!in_object_space)
+	{
+		collision = model * glm::vec4(collision, 1.0f);
+		normal = glm::normalize(glm::mat3(glm::transpose(inv)) * normal);
+	}
+	return true;
+}
+
+bool Mesh::testSphereCollision(glm::mat4 model, glm::vec3 center, float radius, glm::vec3& collision, glm::vec3& normal)
+{
+	if (!createCollisionModel())
+		return false;
+	BVH* bvh = (BVH*)collision_model;
+
+	//assumes an uniform scale
+	glm::mat4 inv = glm::inverse(model);
+	float scale = glm::length(glm::vec3(model[0]));
+	if (!bvh->testSphere(inv * glm::vec4(center, 1.0f), radius / scale, collision, normal))
+		return false;
+
+	collision = model * glm::vec4(collision, 1.0f);
+	normal = glm::normalize(glm::mat3(glm::transpose(inv)) * normal);
+	return true;
+}
+
+static float randomUnit() { return rand() / (float)RAND_MAX; }
+
+void Mesh::benchmarkRayCasting(int subdivisions, int num_rays)
+{
+	Mesh mesh;
+	mesh.createSubdividedPlane(1.0f, subdivisions);
+	for (glm::vec3& v : mesh.vertices)
+		v.y = 0.05f * sinf(v.x * 40.0f) * cosf(v.z * 40.0f);
+
+	double start = glfwGetTime();
+	mesh.createCollisionModel();
+	double build_time = glfwGetTime() - start;
+
+	//the rays go from above the plane to random points of it
+	std::vector<glm::vec3> origins(num_rays), directions(num_rays);
+	for (int i = 0; i < num_rays; ++i)
+	{
+		origins[i] = glm::vec3(randomUnit(), 1.0f, randomUnit());
+		directions[i] = glm::normalize(glm::vec3(randomUnit(), 0.0f, randomUnit()) - origins[i]);
+	}
+
+	int hits = 0;
+	glm::vec3 collision, normal;
+	start = glfwGetTime();
+	for (int i = 0; i < num_rays; ++i)
+		hits += mesh.testRayCollision(glm::mat4(1.f), origins[i], directions[i], collision, normal, 10.0f, true);
+	double time = glfwGetTime() - start;
+
+	std::cout << " + Ray casting: " << mesh.getNumVertices() / 3 << " triangles  Build: " << build_time * 1000.0 << "ms  "
+		<< num_rays / time / 1000000.0 << " Mrays/s (" << time / num_rays * 1000000.0 << "us per ray, " << hits << " hits)" << std::endl;
+}
+
+void Mesh::benchmarkMeshletCulling(int subdivisions, int num_views)
+{
+	//a sphere, any view of it has front and back faces
+	Mesh mesh;
+	mesh.createSubdividedPlane(1.0f, subdivisions);
+	for (glm::vec3& v : mesh.vertices)
+	{
+		float theta = v.x * 3.14159265f, phi = v.z * 6.28318531f;
+		v = glm::vec3(sinf(theta) * cosf(phi), cosf(theta), sinf(theta) * sinf(phi));
+	}
+
+	double start = glfwGetTime();
+	mesh.createMeshlets();
+	double build_time = glfwGetTime() - start;
+
+	Camera* current = Camera::current;
+	Camera camera;
+	Camera::current = current;
+	camera.setPerspective(60.0f, 1.0f, 0.1f, 100.0f);
+
+	sMeshletStats stats;
+	std::vector<unsigned char> visible;
+	long cullable = 0, errors = 0;
+	for (int i = 0; i < num_views; ++i)
+	{
+		glm::vec3 direction = glm::vec3(randomUnit(), randomUnit(), randomUnit()) * 2.0f - 1.0f;
+		glm::vec3 eye = glm::normalize(direction + glm::vec3(0.0f, 0.0f, 0.001f)) * (1.5f + randomUnit() * 3.0f);
+		camera.lookAt(eye, glm::vec3(randomUnit(), randomUnit(), randomUnit()) * 2.0f - 1.0f, glm::vec3(0.f, 1.f, 0.f));
+
+		start = glfwGetTime();
+		::cullMeshlets(mesh.meshlets, glm::mat4(1.f), camera.frustum_planes, eye, visible, stats);
+		stats.time += glfwGetTime() - start;
+
+		//a triangle can be culled when it faces away or it is outside a plane, the culled ones must be one of them
+		for (size_t j = 0; j < mesh.meshlets.size(); ++j)
+		{
+			const sMeshlet& meshlet = mesh.meshlets[j];
+			for (unsigned int t = 0; t < meshlet.num_triangles; ++t)
+			{
+				const unsigned int* tri = &mesh.meshlet_indices[meshlet.first_index + t * 3];
+				const glm::vec3& p0 = mesh.vertices[tri[0]];
+				const glm::vec3& p1 = mesh.vertices[tri[1]];
+				const glm::vec3& p2 = mesh.vertices[tri[2]];
+				bool can_cull = glm::dot(glm::cross(p1 - p0, p2 - p0), p0 - eye) >= 0.0f;
+				for (int p = 0; p < 6 && !can_cull; ++p)
+				{
+					glm::vec3 n = glm::vec3(camera.frustum_planes[p]);
+					float w = camera.frustum_planes[p].w;
+					can_cull = glm::dot(n, p0) + w < 0.0f && glm::dot(n, p1) + w < 0.0f && glm::dot(n, p2) + w < 0.0f;
+				}
+				cullable += can_cull;
+				errors += !visible[j] && !can_cull;
+			}
+		}
+	}
+
+	std::cout << " + Meshlet culling: " << mesh.vertices.size() / 3 << " triangles in " << mesh.meshlets.size() << " meshlets  Build: " << build_time * 1000.0 << "ms  "
+		<< stats.time / num_views * 1000000.0 << "us per view (" << stats.tested / stats.time / 1000000.0 << " Mmeshlets/s)" << std::endl;
+	std::cout << "\t frustum culled: " << 100.0 * stats.frustum_culled / stats.tested << "%  backface culled: " << 100.0 * stats.backface_culled / stats.tested
+		<< "%  triangles culled: " << 100.0 * stats.triangles_culled / stats.triangles_tested << "% (" << 100.0 * stats.triangles_culled / std::max(cullable, 1L)
+		<< "% of the invisible ones)  visible triangles culled: " << errors << std::endl;
+}
+
 Mesh* Mesh::getQuad()
 {
 	static Mesh* quad = NULL;
@@ -1524,10 +2787,48 @@ Mesh* Mesh::getQuad()
 Mesh* Mesh::Get(const char* filename)
 {
 	assert(filename);
-	std::map<std::string, Mesh*>::iterator it = sMeshesLoaded.find(filename);
-	if (it != sMeshesLoaded.end())
-		return it->second;
+	std::shared_future<Mesh*> pending;
+	std::promise<Mesh*> promise; //for the GetAsync of the same file while it is loaded here
+	{
+		std::lock_guard<std::mutex> lock(meshes_mutex);
+		std::map<std::string, Mesh*>::iterator it = sMeshesLoaded.find(filename);
+		if (it != sMeshesLoaded.end())
+			return it->second;
+		auto loading = meshes_loading.find(filename);
+		if (loading != meshes_loading.end())
+			pending = loading->second;
+		else
+			meshes_loading[filename] = promise.get_future().share();
+	}
+
+	//requested with GetAsync, wait for the worker and upload it here
+	if (pending.valid())
+	{
+		while (pending.wait_for(std::chrono::milliseconds(1)) != std::future_status::ready)
+			processUploads(std::numeric_limits<size_t>::max());
+		return pending.get();
+	}
+
+	std::ostringstream log;
+	Mesh* m = Load(filename, log);
+	std::cout << log.str();
+
+	if (m)
+	{
+		if (auto_upload_to_vram)
+			m->uploadToVRAM();
+		m->registerMesh(filename);
+	}
+	{
+		std::lock_guard<std::mutex> lock(meshes_mutex);
+		meshes_loading.erase(filename);
+	}
+	promise.set_value(m);
+	return m;
+}
 
+Mesh* Mesh::Load(const std::string& filename, std::ostream& log)
+{
 	Mesh* m = new Mesh();
 	std::string name = filename;
 
@@ -1544,13 +2845,14 @@ Mesh* Mesh::Get(const char* filename)
 		file_format = FORMAT_MESH;
 	else
 	{
-		std::cerr << "Unknown mesh format: " << filename << std::endl;
+		delete m;
+		log << "Unknown mesh format: " << filename << std::endl;
 		return NULL;
 	}
 
 	//stats
 	long time = getTime();
-	std::cout << " + Mesh loading: " << filename << " ... ";
+	log << " + Mesh loading: " << filename << " ... ";
 	std::string binfilename = filename;
 
 	if (file_format != FORMAT_MBIN)
@@ -1559,67 +2861,210 @@ Mesh* Mesh::Get(const char* filename)
 	//try loading the binary version
 	if (use_binary && m->readBin(binfilename.c_str()))
 	{
-		if (interleave_meshes && m->interleaved.size() == 0)
+		if (interleave_meshes && m->interleaved.size() == 0 && m->compact.size() == 0)
 		{
-			std::cout << "[INTERL] ";
+			log << "[INTERL] ";
 			m->interleaveBuffers();
 		}
 
+		if (compact_meshes && m->compact.size() == 0 && m->compactBuffers())
+			log << "[QUANT] ";
+
 		if (auto_upload_to_vram)
-		{
-			std::cout << "[VRAM] ";
-			m->uploadToVRAM();
-		}
+			log << "[VRAM] ";
 
-		std::cout << "[OK BIN]  Faces: " << (m->interleaved.size() ? m->interleaved.size() : m->vertices.size()) / 3 << " Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
-		m->registerMesh(filename);
+		log << "[OK BIN]  Faces: " << m->getNumVertices() / 3 << " Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
 		return m;
 	}
 
 	//load the ascii version
 	bool loaded = false;
 	if (file_format == FORMAT_OBJ)
-		loaded = m->loadOBJ(filename);
+		loaded = m->loadOBJ(filename.c_str());
 	/*else if (file_format == FORMAT_ASE)
 		loaded = m->loadASE(filename);*/
 	else if (file_format == FORMAT_MESH)
-		loaded = m->loadMESH(filename);
+		loaded = m->loadMESH(filename.c_str());
 
 	if (!loaded)
 	{
 		delete m;
-		std::cout << "[ERROR]: Mesh not found" << std::endl;
+		log << "[ERROR]: Mesh not found" << std::endl;
 		return NULL;
 	}
 
 	//to optimize, interleave the meshes
 	if (interleave_meshes)
 	{
-		std::cout << "[INTERL] ";
+		log << "[INTERL] ";
 		m->interleaveBuffers();
 	}
 
-	//and upload them to VRAM
+	//and quantize them
+	if (compact_meshes && m->compactBuffers())
+		log << "[QUANT] ";
+
+	//simplify them
+	if (generate_lods && m->createLODs())
+		log << "[LODS " << m->lods.size() << "] ";
+
+	//split them in clusters
+	if (generate_meshlets && m->createMeshlets())
+		log << "[MESHLETS " << m->meshlets.size() << "] ";
+
+	//the caller uploads them to VRAM
 	if (auto_upload_to_vram)
-	{
-		std::cout << "[VRAM] ";
-		m->uploadToVRAM();
-	}
+		log << "[VRAM] ";
+
+	//so the .mbin includes it
+	if (store_collision_model && m->createCollisionModel())
+		log << "[BVH] ";
 
-	std::cout << "[OK]  Faces: " << m->vertices.size() / 3 << " Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
+	log << "[OK]  Faces: " << m->getNumVertices() / 3 << " Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
 	if (use_binary)
 	{
-		std::cout << "\t\t Writing .BIN ... ";
-		m->writeBin(filename);
-		std::cout << "[OK]" << std::endl;
+		log << "\t\t Writing .BIN ... ";
+		m->writeBin(filename.c_str());
+		log << "[OK]" << std::endl;
 	}
 
-	m->registerMesh(name);
 	return m;
 }
 
+//a mesh requested with GetAsync
+struct sMeshLoadJob
+{
+	std::string filename;
+	Mesh* mesh = NULL; //NULL if it could not be loaded
+	std::promise<Mesh*> promise;
+};
+
+//worker threads parse the meshes and leave them in the uploads queue for the render thread.
+//it is never destroyed, so the workers waiting for jobs do not outlive it at exit
+struct sMeshLoader
+{
+	std::mutex mutex;
+	std::condition_variable condition;
+	std::deque<sMeshLoadJob*> jobs;
+	std::deque<sMeshLoadJob*> uploads;
+};
+
+sMeshLoader* mesh_loader = NULL;
+
+static void meshLoaderWorker(sMeshLoader* loader)
+{
+	while (true)
+	{
+		sMeshLoadJob* job = NULL;
+		{
+			std::unique_lock<std::mutex> lock(loader->mutex);
+			loader->condition.wait(lock, [loader] { return !loader->jobs.empty(); });
+			job = loader->jobs.front();
+			loader->jobs.pop_front();
+		}
+
+		std::ostringstream log;
+		job->mesh = Mesh::Load(job->filename, log);
+		std::cout << log.str();
+
+		//the copy to the staging ring is done here too, the render thread only issues the GPU copies
+		if (job->mesh && Mesh::auto_upload_to_vram)
+			job->mesh->stageBuffers();
+
+		std::lock_guard<std::mutex> lock(loader->mutex);
+		loader->uploads.push_back(job);
+	}
+}
+
+std::shared_future<Mesh*> Mesh::GetAsync(const char* filename)
+{
+	assert(filename);
+	std::lock_guard<std::mutex> lock(meshes_mutex);
+	std::map<std::string, Mesh*>::iterator it = sMeshesLoaded.find(filename);
+	if (it != sMeshesLoaded.end())
+	{
+		std::promise<Mesh*> loaded;
+		loaded.set_value(it->second);
+		return loaded.get_future().share();
+	}
+
+	//the same file is only loaded once
+	auto loading = meshes_loading.find(filename);
+	if (loading != meshes_loading.end())
+		return loading->second;
+
+	if (!mesh_loader)
+	{
+		mesh_loader = new sMeshLoader();
+		int num_workers = std::max(1, std::min(4, (int)std::thread::hardware_concurrency() - 1));
+		for (int i = 0; i < num_workers; ++i)
+			std::thread(meshLoaderWorker, mesh_loader).detach();
+	}
+
+	sMeshLoadJob* job = new sMeshLoadJob();
+	job->filename = filename;
+	std::shared_future<Mesh*> future = job->promise.get_future().share();
+	meshes_loading[filename] = future;
+	{
+		std::lock_guard<std::mutex> loader_lock(mesh_loader->mutex);
+		mesh_loader->jobs.push_back(job);
+	}
+	mesh_loader->condition.notify_one();
+	return future;
+}
+
+void Mesh::processUploads(size_t max_bytes)
+{
+	if (!mesh_loader)
+		return;
+
+	size_t uploaded = 0;
+	while (true)
+	{
+		sMeshLoadJob* job = NULL;
+		{
+			std::lock_guard<std::mutex> lock(mesh_loader->mutex);
+			if (mesh_loader->uploads.empty())
+				break;
+			job = mesh_loader->uploads.front();
+			size_t size = (job->mesh && auto_upload_to_vram) ? job->mesh->getUploadSize() : 0;
+			//at least one per frame, so meshes bigger than the budget are uploaded too
+			if (uploaded && uploaded + size > max_bytes)
+				break;
+			mesh_loader->uploads.pop_front();
+			uploaded += size;
+		}
+
+		if (job->mesh)
+		{
+			if (auto_upload_to_vram)
+				job->mesh->uploadToVRAM();
+			job->mesh->registerMesh(job->filename);
+		}
+		{
+			std::lock_guard<std::mutex> lock(meshes_mutex);
+			meshes_loading.erase(job->filename);
+		}
+		job->promise.set_value(job->mesh);
+		delete job;
+	}
+}
+
+size_t Mesh::getUploadSize()
+{
+	size_t size = compact.size() * sizeof(tInterleavedCompact) + interleaved.size() * sizeof(tInterleaved);
+	if (!compact.size() && !interleaved.size())
+		size += vertices.size() * sizeof(glm::vec3) + normals.size() * sizeof(glm::vec3) + uvs.size() * sizeof(glm::vec2);
+	size += uvs1.size() * sizeof(glm::vec2) + colors.size() * sizeof(glm::vec4) + bones.size() * sizeof(glm::uvec4) + weights.size() * sizeof(glm::vec4);
+	size += indices.size() * sizeof(glm::uvec3) + meshlet_indices.size() * sizeof(unsigned int);
+	for (const sMeshLOD& lod : lods)
+		size += lod.indices.size() * sizeof(unsigned int);
+	return size;
+}
+
 void Mesh::registerMesh(std::string name)
 {
+	std::lock_guard<std::mutex> lock(meshes_mutex);
 	this->name = name;
 	sMeshesLoaded[name] = this;
 }
\ No newline at end of file
@@ -3,6 +3,8 @@
 #include <vector>
 #include <map>
 #include <string>
+#include <future>
+#include <ostream>
 
 #include <glm/vec2.hpp>
 #include <glm/vec3.hpp>
@@ -10,14 +12,16 @@
 #include <glm/matrix.hpp>
 #include <glm/gtx/transform.hpp>
 
+#include "meshlet.h"
+#include "upload.h"
+
 class Shader; //for binding
+class Camera; //for LOD selection and meshlet culling
 class Image; //for displace
 class Skeleton; //for skinned meshes
 
-//version from 21/01/2024
-#define MESH_BIN_VERSION 12 //this is used to regenerate bins if the format changes
-
-#define MAX_SUBMESH_DRAW_CALLS 16
+//version from 19/10/2026
+#define MESH_BIN_VERSION 16 //this is used to regenerate bins if the format changes
 
 class BoundingBox
 {
@@ -47,9 +51,36 @@ struct sSubmeshDrawCallInfo
 
 struct sSubmeshInfo
 {
-	unsigned int num_draw_calls;
-	char name[32];
-	sSubmeshDrawCallInfo draw_calls[MAX_SUBMESH_DRAW_CALLS];
+	char name[32] = {};
+	std::vector<sSubmeshDrawCallInfo> draw_calls; //one per material used by the submesh
+};
+
+//layout of the commands read from the GL_DRAW_INDIRECT_BUFFER
+struct sDrawArraysIndirectCommand
+{
+	unsigned int count;
+	unsigned int instance_count;
+	unsigned int first;
+	unsigned int base_instance;
+};
+
+struct sDrawElementsIndirectCommand
+{
+	unsigned int count;
+	unsigned int instance_count;
+	unsigned int first_index;
+	int base_vertex;
+	unsigned int base_instance;
+};
+
+#define MAX_MESH_LODS 4
+
+//simplified version of a mesh, it reuses the vertices of the full resolution one
+struct sMeshLOD
+{
+	std::vector<unsigned int> indices; //three per triangle
+	float error; //max distance to the full resolution surface, in object space
+	unsigned int indices_vbo_id;
 };
 
 struct sMaterialInfo
@@ -63,9 +94,20 @@ class Mesh
 {
 public:
 	static std::map<std::string, Mesh*> sMeshesLoaded;
+	static size_t upload_budget; //max bytes uploaded per frame by the meshes loaded with GetAsync
 	static bool use_binary; //always load the binary version of a mesh when possible
 	static bool interleave_meshes; //loaded meshes will me automatically interleaved
 	static bool auto_upload_to_vram; //loaded meshes will be stored in the VRAM
+	static bool compact_meshes; //loaded meshes will be quantized (needs a vertex shader that decodes them, like basic.vs)
+	static bool use_vaos; //uploaded meshes cache their attribute setup in a VAO per attribute layout
+	static bool use_multidraw; //all the draw calls of a mesh are submitted at once from a GL_DRAW_INDIRECT_BUFFER
+	static bool use_instance_ring; //instanced attributes are streamed through a persistent mapped buffer
+	static bool store_collision_model; //the BVH is built when a mesh is loaded and saved in its .mbin
+	static bool generate_lods; //meshes loaded from ASCII get a LOD chain, saved in its .mbin
+	static float lod_pixel_error; //max error on screen allowed when selecting a LOD
+	static bool generate_meshlets; //meshes loaded from ASCII are split in meshlets, saved in its .mbin
+	static bool use_meshlet_culling; //only the meshlets inside the frustum and facing the camera are drawn
+	static sMeshletStats meshlet_stats; //accumulated by every cullMeshlets
 	static long num_meshes_rendered;
 	static long num_triangles_rendered;
 
@@ -88,8 +130,29 @@ public:
 
 	std::vector< tInterleaved > interleaved; //to render interleaved
 
+	//quantized version of tInterleaved: 16 bytes per vertex instead of 32
+	struct tInterleavedCompact {
+		uint16_t vertex[4]; //unorm16 relative to the mesh box (w is padding)
+		int16_t normal[2];	//snorm16 octahedral encoded normal
+		uint16_t uv[2];		//half floats
+	};
+
+	std::vector< tInterleavedCompact > compact; //to render quantized (uses the interleaved_vbo_id)
+
 	std::vector< glm::vec3 > indices; //for indexed meshes
 
+	std::vector< sMeshLOD > lods; //each one with half the triangles of the previous
+	int current_lod; //0 is the full resolution, N uses lods[N-1]
+
+	//clusters of the full resolution mesh, drawn with a command per run of visible meshlets
+	std::vector< sMeshlet > meshlets;
+	std::vector< unsigned int > meshlet_indices; //triangles of every meshlet, vertex ids of the mesh
+	std::vector< unsigned char > meshlet_visible; //result of the last cullMeshlets
+	std::vector< sDrawElementsIndirectCommand > meshlet_commands;
+	unsigned int meshlet_indices_vbo_id;
+	unsigned int meshlet_commands_buffer_id;
+	bool draw_visible_meshlets; //the next render only draws the meshlet_commands
+
 	//for animated meshes
 	std::vector< glm::vec4 > bones; //tells which bones afect the vertex (4 max)
 	std::vector< glm::vec4 > weights; //tells how much affect every bone
@@ -113,6 +176,17 @@ public:
 	unsigned int weights_vbo_id;
 	unsigned int uvs1_vbo_id;
 
+	std::map<uint64_t, unsigned int> vaos; //attribute layout -> VAO id
+
+	//multi draw indirect, one command per draw call of every submesh
+	unsigned int indirect_buffer_id;
+	unsigned int draw_materials_vbo_id; //material index of every command, read with baseInstance
+	unsigned int materials_ssbo_id; //sMaterialInfo of every material, indexed by a_material_index
+	unsigned int num_indirect_draws;
+	std::vector<float> draw_materials; //material index of every draw call, in submesh order
+
+	std::map<const void*, sStagingBlock> staged_blocks; //buffer data -> its copy in the staging ring
+
 	Mesh();
 	~Mesh();
 
@@ -120,30 +194,49 @@ public:
 
 	void render(unsigned int primitive, int submesh_id = -1, int num_instances = 0);
 	void renderInstanced(unsigned int primitive, const glm::mat4* instanced_models, int number);
-	void renderInstanced(unsigned int primitive, const std::vector<glm::vec3> positions, const char* uniform_name);
+	void renderInstanced(unsigned int primitive, const std::vector<glm::vec3>& positions, const char* uniform_name);
+	static void* allocInstances(size_t size); //memory in the instance ring, write the instances here and pass it to renderInstanced to skip the copy
 	void renderBounding(const glm::mat4& model, bool world_bounding = true);
 	void renderFixedPipeline(int primitive); //sloooooooow
 	void renderAnimated(unsigned int primitive, Skeleton* sk);
 
 	void enableBuffers(Shader* shader);
+	void enableCompactBuffers(Shader* shader);
 	void drawCall(unsigned int primitive, int submesh_id, int draw_call_id, int num_instances);
 	void disableBuffers(Shader* shader);
+	void clearVAOs();
+	void uploadDrawCommands();
 
 	bool readBin(const char* filename);
 	bool writeBin(const char* filename);
 
 	unsigned int getNumSubmeshes() { return (unsigned int)submeshes.size(); }
-	unsigned int getNumVertices() { return (unsigned int)interleaved.size() ? (unsigned int)interleaved.size() : (unsigned int)vertices.size(); }
+	unsigned int getNumVertices() { return compact.size() ? (unsigned int)compact.size() : interleaved.size() ? (unsigned int)interleaved.size() : (unsigned int)vertices.size(); }
 
 	//collision testing
-	void* collision_model;
-	//bool createCollisionModel(bool is_static = false); //is_static sets if the inv matrix should be computed after setTransform (true) or before rayCollision (false)
-	////help: model is the transform of the mesh, ray origin and direction, a Vector3 where to store the collision if found, a Vector3 where to store the normal if there was a collision, max ray distance in case the ray should go to infintiy, and in_object_space to get the collision point in object space or world space
-	//bool testRayCollision(Matrix44 model, Vector3 ray_origin, Vector3 ray_direction, Vector3& collision, Vector3& normal, float max_ray_dist = 3.4e+38F, bool in_object_space = false);
-	//bool testSphereCollision(Matrix44 model, Vector3 center, float radius, Vector3& collision, Vector3& normal);
+	void* collision_model; //BVH, built the first time a collision test needs it
+	bool createCollisionModel();
+	//help: model is the transform of the mesh, ray origin and direction, a vec3 where to store the collision if found, a vec3 where to store the normal if there was a collision, max ray distance in case the ray should go to infintiy, and in_object_space to get the collision point in object space or world space
+	bool testRayCollision(glm::mat4 model, glm::vec3 ray_origin, glm::vec3 ray_direction, glm::vec3& collision, glm::vec3& normal, float max_ray_dist = 3.4e+38F, bool in_object_space = false);
+	bool testSphereCollision(glm::mat4 model, glm::vec3 center, float radius, glm::vec3& collision, glm::vec3& normal);
+
+	//three positions per triangle in object space, whatever the layout of the mesh
+	void getTrianglePositions(std::vector<glm::vec3>& positions);
+
+	//levels of detail
+	bool createLODs(int num_lods = MAX_MESH_LODS);
+	int selectLOD(const glm::mat4& model, Camera* camera, float viewport_height); //coarsest LOD whose error projects below lod_pixel_error
+
+	//meshlets
+	bool createMeshlets();
+	bool cullMeshlets(const glm::mat4& model, Camera* camera); //fills the meshlet_commands used by the next render
 
 	//loader
 	static Mesh* Get(const char* filename);
+	static std::shared_future<Mesh*> GetAsync(const char* filename); //parsed in a worker thread, ready once processUploads uploads it
+	static void processUploads(size_t max_bytes = upload_budget); //call it every frame from the thread with the GL context
+	static Mesh* Load(const std::string& filename, std::ostream& log); //reads the file without uploading or registering it, thread safe
+	size_t getUploadSize(); //bytes sent to VRAM by uploadToVRAM
 	void registerMesh(std::string name);
 
 	//create help meshes
@@ -151,18 +244,39 @@ public:
 	void createPlane(float size);
 	void createSubdividedPlane(float size = 1, int subdivisions = 256, bool centered = false);
 	void createCube();
+	bool createVolumeProxy(const float* density, int width, int height, int depth, int brick_size = 8); //faces of the bricks with density, box gets the occupied bounds
 	void createWireBox();
 	void createGrid(float dist);
 	void displace(Image* heightmap, float altitude);
 	static Mesh* getQuad(); //get global quad
 
+	//renders many small meshes with and without VAOs and prints the CPU submission time
+	static void benchmarkDrawSubmission(int num_meshes = 10000);
+	//renders a cube many times per frame with and without the instance ring and prints the CPU time per frame
+	static void benchmarkInstancing(int num_instances = 100000);
+	//casts random rays against a displaced plane of 2 * subdivisions^2 triangles and prints the rays per second
+	static void benchmarkRayCasting(int subdivisions = 708, int num_rays = 1000000);
+	//culls the meshlets of a sphere of 2 * subdivisions^2 triangles from random views, checks no visible triangle is culled and prints the culling rate
+	static void benchmarkMeshletCulling(int subdivisions = 400, int num_views = 1000);
+
 	void updateBoundingBox();
 
 	//optimize meshes
 	void uploadToVRAM();
+	void stageBuffers(); //copies the buffers to the staging ring from any thread, the next uploadToVRAM sends them from there
 	bool interleaveBuffers();
+	bool compactBuffers(); //quantizes the interleaved buffer, box must contain all the vertices
 
 private:
+	void drawSubmeshes(unsigned int primitive, int submesh_id, int num_instances);
+	void multiDrawSubmeshes(unsigned int primitive);
+	void drawLOD(unsigned int primitive, int num_instances);
+	void uploadBuffer(unsigned int target, const void* data, size_t size);
+	void drawMeshlets(unsigned int primitive);
+	int enableDrawMaterials(Shader* shader);
+	void disableDrawMaterials(int material_location);
+	void bindMaterials(Shader* shader);
+
 	//bool loadASE(const char* filename);
 	bool loadOBJ(const char* filename);
 	bool parseMTL(const char* filename);
@@ -0,0 +1,253 @@
+#include "meshlet.h"
+
+#include <cmath>
+#include <cstring>
+#include <cfloat>
+#include <atomic>
+#include <algorithm>
+#include <unordered_map>
+
+#include <glm/glm.hpp>
+
+#include "../framework/utils.h"
+
+struct sPositionHash
+{
+	size_t operator()(const glm::vec3& p) const
+	{
+		unsigned int h[3];
+		memcpy(h, &p.x, sizeof(h));
+		return (h[0] * 73856093u) ^ (h[1] * 19349663u) ^ (h[2] * 83492791u);
+	}
+};
+
+struct sPositionEqual
+{
+	bool operator()(const glm::vec3& a, const glm::vec3& b) const { return a.x == b.x && a.y == b.y && a.z == b.z; }
+};
+
+static void computeMeshletBounds(sMeshlet& meshlet, const unsigned int* indices, const std::vector<glm::vec3>& positions)
+{
+	//sphere centered in the box of the triangles
+	glm::vec3 min(FLT_MAX), max(-FLT_MAX);
+	for (unsigned int i = 0; i < meshlet.num_triangles * 3; ++i)
+	{
+		min = glm::min(min, positions[indices[i]]);
+		max = glm::max(max, positions[indices[i]]);
+	}
+	meshlet.center = (min + max) * 0.5f;
+	meshlet.radius = 0.0f;
+	for (unsigned int i = 0; i < meshlet.num_triangles * 3; ++i)
+		meshlet.radius = std::max(meshlet.radius, glm::length(positions[indices[i]] - meshlet.center));
+
+	//the cone contains the normals of all the triangles
+	std::vector<glm::vec3> normals;
+	normals.reserve(meshlet.num_triangles);
+	glm::vec3 axis(0.0f);
+	for (unsigned int t = 0; t < meshlet.num_triangles; ++t)
+	{
+		const glm::vec3& p0 = positions[indices[t * 3]];
+		glm::vec3 n = glm::cross(positions[indices[t * 3 + 1]] - p0, positions[indices[t * 3 + 2]] - p0);
+		float length = glm::length(n);
+		if (length <= 0.0f)
+			continue;
+		normals.push_back(n / length);
+		axis += normals.back();
+	}
+
+	meshlet.cone_axis = glm::vec3(0.0f, 0.0f, 1.0f);
+	meshlet.cone_apex = meshlet.center;
+	meshlet.cone_cutoff = 2.0f;
+	float length = glm::length(axis);
+	if (length <= 0.0f)
+		return;
+	axis = axis / length;
+
+	float min_dot = 1.0f;
+	for (const glm::vec3& n : normals)
+		min_dot = std::min(min_dot, glm::dot(axis, n));
+	//too wide, almost any point sees some front face
+	if (min_dot <= 0.1f)
+		return;
+
+	//move the apex back along the axis until it is behind the planes of all the triangles
+	float max_t = 0.0f;
+	for (unsigned int t = 0, n = 0; t < meshlet.num_triangles; ++t)
+	{
+		const glm::vec3& p0 = positions[indices[t * 3]];
+		glm::vec3 normal = glm::cross(positions[indices[t * 3 + 1]] - p0, positions[indices[t * 3 + 2]] - p0);
+		if (glm::length(normal) <= 0.0f)
+			continue;
+		const glm::vec3& unit_normal = normals[n++];
+		max_t = std::max(max_t, glm::dot(meshlet.center - p0, unit_normal) / glm::dot(axis, unit_normal));
+	}
+
+	meshlet.cone_axis = axis;
+	meshlet.cone_apex = meshlet.center - axis * max_t;
+	meshlet.cone_cutoff = sqrtf(1.0f - min_dot * min_dot);
+}
+
+void buildMeshlets(const std::vector<unsigned int>& indices, const std::vector<glm::vec3>& positions, const std::vector<unsigned int>& ranges, std::vector<sMeshlet>& meshlets, std::vector<unsigned int>& meshlet_indices)
+{
+	meshlets.clear();
+	meshlet_indices.clear();
+	unsigned int num_triangles = (unsigned int)(indices.size() / 3);
+	if (!num_triangles)
+		return;
+	meshlet_indices.reserve(num_triangles * 3);
+
+	//vertices with the same position are the same one, so unindexed meshes have neighbours too
+	std::unordered_map<glm::vec3, unsigned int, sPositionHash, sPositionEqual> welded_ids;
+	std::vector<unsigned int> welded(indices.size());
+	for (size_t i = 0; i < indices.size(); ++i)
+		welded[i] = welded_ids.emplace(positions[indices[i]], (unsigned int)welded_ids.size()).first->second;
+
+	//triangles around every vertex, in a single array
+	std::vector<unsigned int> first_triangle(welded_ids.size() + 1, 0);
+	for (unsigned int id : welded)
+		first_triangle[id + 1]++;
+	for (size_t i = 1; i < first_triangle.size(); ++i)
+		first_triangle[i] += first_triangle[i - 1];
+	std::vector<unsigned int> vertex_triangles(welded.size());
+	std::vector<unsigned int> offsets(first_triangle.begin(), first_triangle.end() - 1);
+	for (size_t i = 0; i < welded.size(); ++i)
+		vertex_triangles[offsets[welded[i]]++] = (unsigned int)(i / 3);
+
+	std::vector<bool> used(num_triangles, false);
+	std::vector<int> vertex_meshlet(welded_ids.size(), -1); //last meshlet that used every vertex
+	std::vector<unsigned int> candidates;
+
+	std::vector<unsigned int> draw_ranges = ranges;
+	if (draw_ranges.empty())
+		draw_ranges = { 0, num_triangles };
+
+	for (size_t r = 0; r + 1 < draw_ranges.size(); r += 2)
+	{
+		unsigned int range_start = draw_ranges[r], range_end = std::min(draw_ranges[r + 1], num_triangles);
+		for (unsigned int seed = range_start; seed < range_end; ++seed)
+		{
+			if (used[seed])
+				continue;
+
+			sMeshlet meshlet{};
+			meshlet.first_index = (unsigned int)meshlet_indices.size();
+			meshlet.draw_call = (unsigned int)(r / 2);
+			int meshlet_id = (int)meshlets.size();
+			unsigned int num_vertices = 0;
+			glm::vec3 centroid_sum(0.0f);
+
+			candidates.clear();
+			unsigned int triangle = seed;
+			while (true)
+			{
+				//add the triangle and its neighbours as candidates
+				used[triangle] = true;
+				meshlet.num_triangles++;
+				for (int k = 0; k < 3; ++k)
+				{
+					unsigned int id = welded[triangle * 3 + k];
+					meshlet_indices.push_back(indices[triangle * 3 + k]);
+					centroid_sum += positions[indices[triangle * 3 + k]];
+					if (vertex_meshlet[id] == meshlet_id)
+						continue;
+					vertex_meshlet[id] = meshlet_id;
+					num_vertices++;
+					for (unsigned int i = first_triangle[id]; i < first_triangle[id + 1]; ++i)
+					{
+						unsigned int neighbour = vertex_triangles[i];
+						if (!used[neighbour] && neighbour >= range_start && neighbour < range_end)
+							candidates.push_back(neighbour);
+					}
+				}
+
+				if (meshlet.num_triangles == MESHLET_MAX_TRIANGLES)
+					break;
+
+				//the candidate that adds less vertices, the closest one to the center when there is a tie
+				glm::vec3 centroid = centroid_sum / (float)(meshlet.num_triangles * 3);
+				unsigned int best = 0xFFFFFFFF, best_new_vertices = 4;
+				float best_distance = FLT_MAX;
+				size_t num_candidates = 0;
+				for (unsigned int candidate : candidates)
+				{
+					if (used[candidate])
+						continue;
+					candidates[num_candidates++] = candidate;
+
+					unsigned int new_vertices = 0;
+					for (int k = 0; k < 3; ++k)
+						new_vertices += vertex_meshlet[welded[candidate * 3 + k]] != meshlet_id;
+					if (new_vertices > best_new_vertices)
+						continue;
+					glm::vec3 center = (positions[indices[candidate * 3]] + positions[indices[candidate * 3 + 1]] + positions[indices[candidate * 3 + 2]]) / 3.0f;
+					float distance = glm::dot(center - centroid, center - centroid);
+					if (new_vertices < best_new_vertices || distance < best_distance)
+					{
+						best = candidate;
+						best_new_vertices = new_vertices;
+						best_distance = distance;
+					}
+				}
+				candidates.resize(num_candidates);
+
+				if (best == 0xFFFFFFFF || num_vertices + best_new_vertices > MESHLET_MAX_VERTICES)
+					break;
+				triangle = best;
+			}
+
+			computeMeshletBounds(meshlet, &meshlet_indices[meshlet.first_index], positions);
+			meshlets.push_back(meshlet);
+		}
+	}
+}
+
+int cullMeshlets(const std::vector<sMeshlet>& meshlets, const glm::mat4& model, const glm::vec4* planes, const glm::vec3& object_eye, std::vector<unsigned char>& visible, sMeshletStats& stats)
+{
+	int num_meshlets = (int)meshlets.size();
+	visible.resize(num_meshlets);
+
+	float scale = std::max(glm::length(glm::vec3(model[0])), std::max(glm::length(glm::vec3(model[1])), glm::length(glm::vec3(model[2]))));
+	std::atomic<int> frustum_culled(0), backface_culled(0);
+	std::atomic<long> triangles_culled(0);
+
+	parallelFor(num_meshlets, [&](int begin, int end) {
+		int frustum = 0, backface = 0;
+		long triangles = 0;
+		for (int i = begin; i < end; ++i)
+		{
+			const sMeshlet& meshlet = meshlets[i];
+			glm::vec3 center = glm::vec3(model * glm::vec4(meshlet.center, 1.0f));
+			float radius = meshlet.radius * scale;
+
+			bool inside = true;
+			for (int p = 0; p < 6 && inside; ++p)
+				inside = glm::dot(glm::vec3(planes[p]), center) + planes[p].w >= -radius;
+
+			bool front = inside;
+			if (inside && meshlet.cone_cutoff <= 1.0f)
+			{
+				glm::vec3 to_apex = meshlet.cone_apex - object_eye;
+				float length = glm::length(to_apex);
+				front = length <= 0.0f || glm::dot(to_apex, meshlet.cone_axis) < meshlet.cone_cutoff * length;
+			}
+
+			visible[i] = front;
+			frustum += !inside;
+			backface += inside && !front;
+			if (!front)
+				triangles += meshlet.num_triangles;
+		}
+		frustum_culled += frustum;
+		backface_culled += backface;
+		triangles_culled += triangles;
+	}, 1024);
+
+	stats.tested += num_meshlets;
+	stats.frustum_culled += frustum_culled;
+	stats.backface_culled += backface_culled;
+	stats.triangles_culled += triangles_culled;
+	for (const sMeshlet& meshlet : meshlets)
+		stats.triangles_tested += meshlet.num_triangles;
+
+	return num_meshlets - frustum_culled - backface_culled;
+}
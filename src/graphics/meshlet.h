@@ -0,0 +1,48 @@
+#pragma once
+
+#include <vector>
+
+#include <glm/vec3.hpp>
+#include <glm/vec4.hpp>
+#include <glm/matrix.hpp>
+
+#define MESHLET_MAX_VERTICES 64
+#define MESHLET_MAX_TRIANGLES 124
+
+//small cluster of neighbour triangles with the bounds needed to cull it, 64 bytes
+struct sMeshlet
+{
+	glm::vec3 center; //bounding sphere in object space
+	float radius;
+	glm::vec3 cone_apex; //all the triangles face away from any point inside the cone
+	float cone_cutoff; //backfacing if dot(normalize(cone_apex - eye), cone_axis) >= cone_cutoff, above 1 when there is no cone
+	glm::vec3 cone_axis;
+	unsigned int first_index; //in the meshlet indices, three per triangle
+	unsigned int num_triangles;
+	unsigned int draw_call; //draw call of the mesh the triangles come from, used to find its material
+	unsigned int padding[2];
+};
+
+//culling results
+struct sMeshletStats
+{
+	int tested = 0;
+	int frustum_culled = 0;
+	int backface_culled = 0;
+	long triangles_tested = 0;
+	long triangles_culled = 0;
+	double time = 0.0;
+
+	void clear() { *this = sMeshletStats(); }
+};
+
+//splits the triangles in meshlets, growing every one from its first triangle to the neighbours that add less vertices.
+//indices are three vertex ids per triangle and positions the position of every vertex id.
+//ranges are pairs of [first, end) triangles that can not share a meshlet (the draw calls), empty for a single range.
+//meshlet_indices are the triangles reordered by meshlet.
+void buildMeshlets(const std::vector<unsigned int>& indices, const std::vector<glm::vec3>& positions, const std::vector<unsigned int>& ranges, std::vector<sMeshlet>& meshlets, std::vector<unsigned int>& meshlet_indices);
+
+//tests every meshlet against the frustum planes (world space, see Camera::frustum_planes) and the eye (object space).
+//visible gets 1 for the visible meshlets. The cone test assumes the model has uniform scale.
+//the meshlets are split between the available threads, stats are accumulated
+int cullMeshlets(const std::vector<sMeshlet>& meshlets, const glm::mat4& model, const glm::vec4* planes, const glm::vec3& object_eye, std::vector<unsigned char>& visible, sMeshletStats& stats);
@@ -0,0 +1,899 @@
+#include "png.h"
+
+#include <cstring>
+#include <cstdlib>
+#include <vector>
+#include <iostream>
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_IX86)
+#define PNG_USE_SSE
+#include <emmintrin.h>
+#endif
+
+#define PNG_INPUT_SIZE 65536 //bytes of the IDAT chunks read from the file at once
+#define PNG_ROW_PADDING 16 //after the rows, so the SSE filters can load and store whole registers
+#define PNG_MAX_SIZE 65536 //pixels per side
+#define INFLATE_WINDOW 32768 //farthest distance of the deflate matches
+#define INFLATE_OUTPUT (2 * INFLATE_WINDOW) //the window and the bytes inflated since the last flush
+#define HUFFMAN_FAST_BITS 9 //codes up to this length are decoded with a single lookup
+
+static const uint8_t png_signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+
+//extra bits and base of the lengths 257 to 285 and of the 30 distances of deflate
+static const uint16_t length_base[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const uint8_t length_extra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const uint16_t distance_base[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const uint8_t distance_extra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+//order of the lengths of the code length alphabet in the dynamic blocks
+static const uint8_t code_length_order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+static uint32_t readBE32(const uint8_t* data)
+{
+	return (uint32_t)data[0] << 24 | (uint32_t)data[1] << 16 | (uint32_t)data[2] << 8 | data[3];
+}
+
+static void writeBE32(uint8_t* data, uint32_t value)
+{
+	data[0] = (uint8_t)(value >> 24);
+	data[1] = (uint8_t)(value >> 16);
+	data[2] = (uint8_t)(value >> 8);
+	data[3] = (uint8_t)value;
+}
+
+static int reverseBits(int code, int length)
+{
+	int reversed = 0;
+	for (int i = 0; i < length; ++i)
+		reversed |= ((code >> i) & 1) << (length - 1 - i);
+	return reversed;
+}
+
+static inline uint8_t paeth(int a, int b, int c)
+{
+	int pa = abs(b - c), pb = abs(a - c), pc = abs(a + b - 2 * c);
+	return (uint8_t)(pa <= pb && pa <= pc ? a : pb <= pc ? b : c);
+}
+
+//canonical Huffman code of a deflate alphabet
+struct sHuffman
+{
+	uint16_t fast[1 << HUFFMAN_FAST_BITS]; //length << 9 | symbol of the short codes, indexed by their bits as they come, 0 for the longer ones
+	uint16_t counts[16]; //codes of every length
+	uint16_t first_code[16];
+	uint16_t first_symbol[16]; //of every length in symbols
+	uint16_t symbols[288]; //sorted by code
+
+	bool build(const uint8_t* lengths, int count); //false if the lengths give more codes than fit
+};
+
+bool sHuffman::build(const uint8_t* lengths, int count)
+{
+	memset(fast, 0, sizeof(fast));
+	memset(counts, 0, sizeof(counts));
+	for (int i = 0; i < count; ++i)
+		counts[lengths[i]]++;
+	counts[0] = 0;
+
+	//the codes of every length follow the last one of the previous length, incomplete codes are allowed
+	uint16_t next_code[16];
+	int left = 1, code = 0, symbol = 0;
+	for (int length = 1; length < 16; ++length)
+	{
+		left = (left << 1) - counts[length];
+		if (left < 0)
+			return false;
+		code = (code + counts[length - 1]) << 1;
+		first_code[length] = next_code[length] = (uint16_t)code;
+		first_symbol[length] = (uint16_t)symbol;
+		symbol += counts[length];
+	}
+
+	uint16_t offsets[16];
+	memcpy(offsets, first_symbol, sizeof(offsets));
+	for (int i = 0; i < count; ++i)
+	{
+		int length = lengths[i];
+		if (!length)
+			continue;
+		symbols[offsets[length]++] = (uint16_t)i;
+		int code = next_code[length]++;
+		if (length > HUFFMAN_FAST_BITS)
+			continue;
+		for (int j = reverseBits(code, length); j < (1 << HUFFMAN_FAST_BITS); j += 1 << length)
+			fast[j] = (uint16_t)(length << 9 | i);
+	}
+	return true;
+}
+
+//rows of the image while they are inflated: the data of the IDAT chunks comes from the file when the bits run out,
+//and the inflated bytes go to the scanlines every time the window fills
+struct sPNGDecoder
+{
+	FILE* file = NULL;
+	std::vector<uint8_t> input; //data of the IDAT chunks
+	size_t input_pos = 0, input_size = 0;
+	uint32_t chunk_left = 0; //bytes of the current IDAT still in the file
+	bool input_done = false;
+	int overrun = 0; //bytes read past the end of the data
+	uint64_t bits = 0; //the first bit of the stream is the lowest one
+	int num_bits = 0;
+
+	std::vector<uint8_t> window; //the last INFLATE_WINDOW bytes, then the ones since the last flush
+	size_t window_pos = 0, flushed = 0;
+
+	int width = 0, height = 0, bit_depth = 0, color_type = 0, channels = 0;
+	int bpp = 0; //bytes per complete pixel, at least 1
+	size_t stride = 0; //bytes per row without the filter byte
+	uint8_t palette[256 * 4]; //RGBA with the alpha of tRNS
+	bool has_key = false; //pixels equal to the key of tRNS are transparent
+	int key[3] = { 0, 0, 0 };
+
+	std::vector<uint8_t> rows[2];
+	uint8_t* row = NULL; //filter byte and the bytes of the row
+	uint8_t* prev = NULL; //bytes of the previous row, zeros for the first one
+	size_t row_filled = 0;
+	int y = 0;
+	uint8_t* pixels = NULL;
+	bool flip_y = false;
+
+	bool fillInput();
+	inline uint8_t nextByte();
+	inline void refill();
+	inline uint32_t getBits(int count);
+	inline int decodeSymbol(const sHuffman& huffman);
+
+	bool inflate();
+	bool readDynamicCodes(sHuffman& literals, sHuffman& distances);
+	bool inflateCodes(const sHuffman& literals, const sHuffman& distances);
+	bool flush(); //gives the new bytes of the window to the rows
+
+	bool addBytes(const uint8_t* data, size_t size);
+	void convertRow(const uint8_t* source, uint8_t* destination);
+};
+
+bool sPNGDecoder::fillInput()
+{
+	//the data goes on in the next chunk when it is an IDAT too
+	while (chunk_left == 0)
+	{
+		uint8_t header[12]; //CRC of the last chunk, length and type of the next one
+		if (input_done || fread(header, 1, sizeof(header), file) != sizeof(header) || memcmp(header + 8, "IDAT", 4))
+		{
+			input_done = true;
+			return false;
+		}
+		chunk_left = readBE32(header + 4);
+	}
+
+	input_pos = 0;
+	input_size = fread(&input[0], 1, std::min((size_t)chunk_left, input.size()), file);
+	chunk_left -= (uint32_t)input_size;
+	if (!input_size)
+		input_done = true;
+	return input_size > 0;
+}
+
+inline uint8_t sPNGDecoder::nextByte()
+{
+	if (input_pos == input_size && !fillInput())
+	{
+		overrun++;
+		return 0;
+	}
+	return input[input_pos++];
+}
+
+inline void sPNGDecoder::refill()
+{
+	//8 bytes at once, the ones that do not fit are loaded again by the next refill and give the same bits
+	if (input_pos + 8 <= input_size)
+	{
+		uint64_t value;
+		memcpy(&value, &input[input_pos], 8);
+		bits |= value << num_bits;
+		input_pos += (63 - num_bits) >> 3;
+		num_bits |= 56;
+		return;
+	}
+	while (num_bits <= 56)
+	{
+		bits |= (uint64_t)nextByte() << num_bits;
+		num_bits += 8;
+	}
+}
+
+inline uint32_t sPNGDecoder::getBits(int count)
+{
+	if (num_bits < count)
+		refill();
+	uint32_t value = (uint32_t)(bits & ((1ull << count) - 1));
+	bits >>= count;
+	num_bits -= count;
+	return value;
+}
+
+inline int sPNGDecoder::decodeSymbol(const sHuffman& huffman)
+{
+	if (num_bits < 16)
+		refill();
+	int entry = huffman.fast[bits & ((1 << HUFFMAN_FAST_BITS) - 1)];
+	if (entry)
+	{
+		int length = entry >> 9;
+		bits >>= length;
+		num_bits -= length;
+		return entry & 511;
+	}
+
+	//the longer codes bit by bit, the first bit is the highest one of the code
+	int code = 0;
+	for (int length = 1; length < 16; ++length)
+	{
+		code = code << 1 | (int)((bits >> (length - 1)) & 1);
+		int index = code - huffman.first_code[length];
+		if (index >= 0 && index < huffman.counts[length])
+		{
+			bits >>= length;
+			num_bits -= length;
+			return huffman.symbols[huffman.first_symbol[length] + index];
+		}
+	}
+	return -1;
+}
+
+bool sPNGDecoder::flush()
+{
+	if (!addBytes(&window[flushed], window_pos - flushed))
+		return false;
+	//only the bytes a match can reach stay
+	if (window_pos > INFLATE_WINDOW)
+	{
+		memmove(&window[0], &window[window_pos - INFLATE_WINDOW], INFLATE_WINDOW);
+		window_pos = INFLATE_WINDOW;
+	}
+	flushed = window_pos;
+	return true;
+}
+
+bool sPNGDecoder::inflateCodes(const sHuffman& literals, const sHuffman& distances)
+{
+	while (true)
+	{
+		int symbol = decodeSymbol(literals);
+		if (symbol < 256)
+		{
+			if (symbol < 0 || (window_pos == INFLATE_OUTPUT && !flush()))
+				return false;
+			window[window_pos++] = (uint8_t)symbol;
+			continue;
+		}
+		if (symbol == 256)
+			return true;
+
+		symbol -= 257;
+		if (symbol >= 29)
+			return false;
+		int length = length_base[symbol] + getBits(length_extra[symbol]);
+		int code = decodeSymbol(distances);
+		if (code < 0 || code >= 30)
+			return false;
+		size_t distance = distance_base[code] + getBits(distance_extra[code]);
+		if (distance > window_pos || overrun > 8)
+			return false;
+		if (window_pos + length > INFLATE_OUTPUT && !flush())
+			return false;
+
+		//the copy reads the bytes it writes when the distance is shorter than the length
+		uint8_t* destination = &window[window_pos];
+		const uint8_t* source = destination - distance;
+		if (distance >= (size_t)length)
+			memcpy(destination, source, length);
+		else
+			for (int i = 0; i < length; ++i)
+				destination[i] = source[i];
+		window_pos += length;
+	}
+}
+
+bool sPNGDecoder::readDynamicCodes(sHuffman& literals, sHuffman& distances)
+{
+	int num_literals = getBits(5) + 257, num_distances = getBits(5) + 1, num_code_lengths = getBits(4) + 4;
+	uint8_t code_lengths[19] = { 0 };
+	for (int i = 0; i < num_code_lengths; ++i)
+		code_lengths[code_length_order[i]] = (uint8_t)getBits(3);
+	sHuffman code_huffman;
+	if (!code_huffman.build(code_lengths, 19))
+		return false;
+
+	//the lengths of both alphabets are a single sequence, with runs of the last length and of zeros
+	uint8_t lengths[288 + 32];
+	int count = num_literals + num_distances;
+	for (int n = 0; n < count;)
+	{
+		int symbol = decodeSymbol(code_huffman);
+		if (symbol < 0)
+			return false;
+		if (symbol < 16)
+		{
+			lengths[n++] = (uint8_t)symbol;
+			continue;
+		}
+
+		uint8_t value = 0;
+		int repeat = 0;
+		if (symbol == 16)
+		{
+			if (!n)
+				return false;
+			value = lengths[n - 1];
+			repeat = 3 + getBits(2);
+		}
+		else if (symbol == 17)
+			repeat = 3 + getBits(3);
+		else
+			repeat = 11 + getBits(7);
+		if (n + repeat > count)
+			return false;
+		memset(&lengths[n], value, repeat);
+		n += repeat;
+	}
+	return literals.build(lengths, num_literals) && distances.build(lengths + num_literals, num_distances);
+}
+
+bool sPNGDecoder::inflate()
+{
+	//zlib header: deflate with a window up to 32KB and without dictionary
+	int cmf = getBits(8), flags = getBits(8);
+	if ((cmf & 15) != 8 || (cmf >> 4) > 7 || (cmf * 256 + flags) % 31 || (flags & 32))
+		return false;
+
+	sHuffman literals, distances;
+	bool fixed_codes = false; //literals and distances have the fixed codes
+	bool final_block = false;
+	while (!final_block)
+	{
+		final_block = getBits(1);
+		int type = getBits(2);
+		if (type == 0)
+		{
+			//stored, from the next byte
+			getBits(num_bits & 7);
+			int length = getBits(16), inverse = getBits(16);
+			if (length != (~inverse & 0xFFFF))
+				return false;
+			for (; length > 0; --length)
+			{
+				if (window_pos == INFLATE_OUTPUT && !flush())
+					return false;
+				window[window_pos++] = (uint8_t)getBits(8);
+			}
+		}
+		else if (type == 1)
+		{
+			if (!fixed_codes)
+			{
+				uint8_t lengths[288];
+				memset(lengths, 8, 144);
+				memset(lengths + 144, 9, 112);
+				memset(lengths + 256, 7, 24);
+				memset(lengths + 280, 8, 8);
+				literals.build(lengths, 288);
+				memset(lengths, 5, 30);
+				distances.build(lengths, 30);
+				fixed_codes = true;
+			}
+			if (!inflateCodes(literals, distances))
+				return false;
+		}
+		else if (type == 2)
+		{
+			fixed_codes = false;
+			if (!readDynamicCodes(literals, distances) || !inflateCodes(literals, distances))
+				return false;
+		}
+		else
+			return false;
+
+		if (overrun > 8)
+			return false;
+	}
+	return flush();
+}
+
+#ifdef PNG_USE_SSE
+
+static inline __m128i loadPixel(const uint8_t* data)
+{
+	int value;
+	memcpy(&value, data, 4);
+	return _mm_cvtsi32_si128(value);
+}
+
+static inline void storePixel(uint8_t* data, __m128i pixel, int bpp)
+{
+	int value = _mm_cvtsi128_si32(pixel);
+	memcpy(data, &value, bpp);
+}
+
+//the filters of 3 or 4 bytes per pixel. Up is done 16 bytes at once and Sub with the prefix sums of 4 pixels,
+//Avg and Paeth depend on the pixel on the left so they are done a pixel at once
+static void unfilterRowSSE(int filter, uint8_t* row, const uint8_t* prev, size_t stride, int bpp)
+{
+	const __m128i zero = _mm_setzero_si128();
+	if (filter == 1)
+	{
+		//the last pixel of the previous block is added to the first one before the sums
+		__m128i carry = zero;
+		size_t block = 4 * bpp;
+		for (size_t i = 0; i < stride; i += block)
+		{
+			__m128i x = _mm_add_epi8(_mm_loadu_si128((const __m128i*)(row + i)), carry);
+			x = _mm_add_epi8(x, bpp == 4 ? _mm_slli_si128(x, 4) : _mm_slli_si128(x, 3));
+			x = _mm_add_epi8(x, bpp == 4 ? _mm_slli_si128(x, 8) : _mm_slli_si128(x, 6));
+			if (bpp == 4)
+			{
+				_mm_storeu_si128((__m128i*)(row + i), x);
+				carry = _mm_srli_si128(x, 12);
+			}
+			else
+			{
+				//12 bytes, the next ones are not filtered yet
+				_mm_storel_epi64((__m128i*)(row + i), x);
+				storePixel(row + i + 8, _mm_srli_si128(x, 8), 4);
+				carry = _mm_and_si128(_mm_srli_si128(x, 9), _mm_cvtsi32_si128(0xFFFFFF));
+			}
+		}
+	}
+	else if (filter == 2)
+	{
+		for (size_t i = 0; i < stride; i += 16)
+			_mm_storeu_si128((__m128i*)(row + i), _mm_add_epi8(_mm_loadu_si128((const __m128i*)(row + i)), _mm_loadu_si128((const __m128i*)(prev + i))));
+	}
+	else if (filter == 3)
+	{
+		//the average rounded down, _mm_avg_epu8 rounds up
+		const __m128i one = _mm_set1_epi8(1);
+		__m128i a = zero;
+		for (size_t i = 0; i < stride; i += bpp)
+		{
+			__m128i b = loadPixel(prev + i);
+			__m128i average = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+			a = _mm_add_epi8(loadPixel(row + i), average);
+			storePixel(row + i, a, bpp);
+		}
+	}
+	else if (filter == 4)
+	{
+		//in 16 bits, the predictions go below 0 and above 255
+		__m128i a = zero, c = zero;
+		for (size_t i = 0; i < stride; i += bpp)
+		{
+			__m128i b = _mm_unpacklo_epi8(loadPixel(prev + i), zero);
+			__m128i pa = _mm_sub_epi16(b, c), pb = _mm_sub_epi16(a, c);
+			__m128i pc = _mm_add_epi16(pa, pb);
+			pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));
+			pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));
+			pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+			__m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+
+			__m128i use_a = _mm_cmpeq_epi16(smallest, pa), use_b = _mm_cmpeq_epi16(smallest, pb);
+			__m128i nearest = _mm_or_si128(_mm_and_si128(use_b, b), _mm_andnot_si128(use_b, c));
+			nearest = _mm_or_si128(_mm_and_si128(use_a, a), _mm_andnot_si128(use_a, nearest));
+
+			//the high bytes of the lanes stay 0
+			a = _mm_add_epi8(_mm_unpacklo_epi8(loadPixel(row + i), zero), nearest);
+			storePixel(row + i, _mm_packus_epi16(a, a), bpp);
+			c = b;
+		}
+	}
+}
+
+#endif
+
+static void unfilterRow(int filter, uint8_t* row, const uint8_t* prev, size_t stride, int bpp)
+{
+#ifdef PNG_USE_SSE
+	if (bpp == 3 || bpp == 4)
+	{
+		unfilterRowSSE(filter, row, prev, stride, bpp);
+		return;
+	}
+#endif
+	switch (filter)
+	{
+	case 1:
+		for (size_t i = bpp; i < stride; ++i)
+			row[i] += row[i - bpp];
+		break;
+	case 2:
+		for (size_t i = 0; i < stride; ++i)
+			row[i] += prev[i];
+		break;
+	case 3:
+		for (size_t i = 0; i < (size_t)bpp; ++i)
+			row[i] += prev[i] >> 1;
+		for (size_t i = bpp; i < stride; ++i)
+			row[i] += (row[i - bpp] + prev[i]) >> 1;
+		break;
+	case 4:
+		for (size_t i = 0; i < (size_t)bpp; ++i)
+			row[i] += prev[i];
+		for (size_t i = bpp; i < stride; ++i)
+			row[i] += paeth(row[i - bpp], prev[i], prev[i - bpp]);
+		break;
+	}
+}
+
+//sample index of a row with the samples of depth bits, the first one in the highest bits of a byte
+static inline int getSample(const uint8_t* row, size_t index, int depth)
+{
+	if (depth == 8)
+		return row[index];
+	if (depth == 16)
+		return row[index * 2] << 8 | row[index * 2 + 1];
+	size_t bit = index * depth;
+	return (row[bit >> 3] >> (8 - depth - (bit & 7))) & ((1 << depth) - 1);
+}
+
+void sPNGDecoder::convertRow(const uint8_t* source, uint8_t* destination)
+{
+	if (color_type == 6 && bit_depth == 8)
+	{
+		memcpy(destination, source, (size_t)width * 4);
+		return;
+	}
+	if (color_type == 2 && bit_depth == 8 && !has_key)
+	{
+		for (int x = 0; x < width; ++x, source += 3, destination += 4)
+		{
+			destination[0] = source[0];
+			destination[1] = source[1];
+			destination[2] = source[2];
+			destination[3] = 255;
+		}
+		return;
+	}
+
+	int max_value = (1 << bit_depth) - 1;
+	for (int x = 0; x < width; ++x, destination += 4)
+	{
+		if (color_type == 3)
+		{
+			memcpy(destination, &palette[getSample(source, x, bit_depth) * 4], 4);
+			continue;
+		}
+
+		int samples[4];
+		uint8_t values[4];
+		for (int c = 0; c < channels; ++c)
+		{
+			samples[c] = getSample(source, (size_t)x * channels + c, bit_depth);
+			values[c] = (uint8_t)(bit_depth == 16 ? samples[c] >> 8 : samples[c] * 255 / max_value);
+		}
+
+		if (channels <= 2) //gray, with alpha or key
+		{
+			destination[0] = destination[1] = destination[2] = values[0];
+			destination[3] = channels == 2 ? values[1] : (has_key && samples[0] == key[0] ? 0 : 255);
+		}
+		else
+		{
+			memcpy(destination, values, 3);
+			destination[3] = channels == 4 ? values[3] : (has_key && samples[0] == key[0] && samples[1] == key[1] && samples[2] == key[2] ? 0 : 255);
+		}
+	}
+}
+
+bool sPNGDecoder::addBytes(const uint8_t* data, size_t size)
+{
+	while (size)
+	{
+		if (y >= height)
+			return false;
+		size_t count = std::min(size, stride + 1 - row_filled);
+		memcpy(row + row_filled, data, count);
+		row_filled += count;
+		data += count;
+		size -= count;
+		if (row_filled < stride + 1)
+			break;
+
+		if (row[0] > 4)
+			return false;
+		unfilterRow(row[0], row + 1, prev, stride, bpp);
+		convertRow(row + 1, pixels + (size_t)(flip_y ? height - 1 - y : y) * width * 4);
+
+		//the row is the previous one of the next row, the filter byte goes before it
+		uint8_t* next = prev - 1;
+		prev = row + 1;
+		row = next;
+		row_filled = 0;
+		y++;
+	}
+	return true;
+}
+
+bool decodePNG(FILE* file, int& width, int& height, uint8_t*& pixels, bool flip_y)
+{
+	pixels = NULL;
+	uint8_t signature[8];
+	if (!file || fread(signature, 1, 8, file) != 8 || memcmp(signature, png_signature, 8))
+		return false;
+
+	sPNGDecoder decoder;
+	decoder.file = file;
+	for (int i = 0; i < 256; ++i)
+	{
+		uint8_t color[4] = { 0, 0, 0, 255 };
+		memcpy(&decoder.palette[i * 4], color, 4);
+	}
+
+	//the chunks before the image data, only the header, the palette and the transparency are read
+	bool header = false;
+	int interlace = 0;
+	while (true)
+	{
+		uint8_t chunk[8];
+		if (fread(chunk, 1, sizeof(chunk), file) != sizeof(chunk))
+			return false;
+		uint32_t length = readBE32(chunk);
+		const uint8_t* type = chunk + 4;
+		if (!memcmp(type, "IDAT", 4))
+		{
+			decoder.chunk_left = length;
+			break;
+		}
+		if (!memcmp(type, "IEND", 4) || length > 0x7FFFFFFF)
+			return false;
+		if (memcmp(type, "IHDR", 4) && memcmp(type, "PLTE", 4) && memcmp(type, "tRNS", 4))
+		{
+			if (fseek(file, (long)length + 4, SEEK_CUR))
+				return false;
+			continue;
+		}
+
+		uint8_t data[1024 + 4];
+		if (length > 1024 || fread(data, 1, length + 4, file) != length + 4)
+			return false;
+		if (!memcmp(type, "IHDR", 4))
+		{
+			if (length != 13)
+				return false;
+			decoder.width = (int)std::min(readBE32(data), (uint32_t)PNG_MAX_SIZE + 1);
+			decoder.height = (int)std::min(readBE32(data + 4), (uint32_t)PNG_MAX_SIZE + 1);
+			decoder.bit_depth = data[8];
+			decoder.color_type = data[9];
+			interlace = data[12];
+			if (data[10] || data[11])
+				return false;
+			header = true;
+		}
+		else if (!memcmp(type, "PLTE", 4))
+		{
+			for (uint32_t i = 0; i < length / 3 && i < 256; ++i)
+				memcpy(&decoder.palette[i * 4], data + i * 3, 3);
+		}
+		else if (decoder.color_type == 3)
+		{
+			for (uint32_t i = 0; i < length && i < 256; ++i)
+				decoder.palette[i * 4 + 3] = data[i];
+		}
+		else if (length >= 2)
+		{
+			decoder.has_key = true;
+			for (uint32_t c = 0; c < 3 && c * 2 + 1 < length; ++c)
+				decoder.key[c] = data[c * 2] << 8 | data[c * 2 + 1];
+		}
+	}
+
+	static const int color_channels[7] = { 1, 0, 3, 1, 2, 0, 4 };
+	int depth = decoder.bit_depth, color_type = decoder.color_type;
+	bool valid_depth = depth == 8 || (depth == 16 && color_type != 3) || ((depth == 1 || depth == 2 || depth == 4) && (color_type == 0 || color_type == 3));
+	if (!header || color_type > 6 || !color_channels[color_type] || !valid_depth || decoder.width <= 0 || decoder.height <= 0 ||
+		decoder.width > PNG_MAX_SIZE || decoder.height > PNG_MAX_SIZE)
+		return false;
+	if (interlace)
+	{
+		std::cerr << "Interlaced PNGs are not supported" << std::endl;
+		return false;
+	}
+
+	decoder.channels = color_channels[color_type];
+	int bits_per_pixel = decoder.channels * depth;
+	decoder.bpp = std::max(bits_per_pixel / 8, 1);
+	decoder.stride = ((size_t)decoder.width * bits_per_pixel + 7) / 8;
+	for (int i = 0; i < 2; ++i)
+		decoder.rows[i].assign(decoder.stride + 1 + PNG_ROW_PADDING, 0);
+	decoder.row = &decoder.rows[0][0];
+	decoder.prev = &decoder.rows[1][1];
+	decoder.input.resize(PNG_INPUT_SIZE);
+	decoder.window.resize(INFLATE_OUTPUT);
+	decoder.pixels = new uint8_t[(size_t)decoder.width * decoder.height * 4];
+	decoder.flip_y = flip_y;
+
+	if (!decoder.inflate() || decoder.y != decoder.height)
+	{
+		delete[] decoder.pixels;
+		return false;
+	}
+
+	width = decoder.width;
+	height = decoder.height;
+	pixels = decoder.pixels;
+	return true;
+}
+
+static uint32_t updateCRC(uint32_t crc, const uint8_t* data, size_t size)
+{
+	static uint32_t table[256] = { 0 };
+	if (!table[1])
+		for (uint32_t i = 0; i < 256; ++i)
+		{
+			uint32_t value = i;
+			for (int k = 0; k < 8; ++k)
+				value = value & 1 ? 0xEDB88320u ^ (value >> 1) : value >> 1;
+			table[i] = value;
+		}
+	for (size_t i = 0; i < size; ++i)
+		crc = table[(crc ^ data[i]) & 255] ^ (crc >> 8);
+	return crc;
+}
+
+static bool writeChunk(FILE* file, const char* type, const uint8_t* data, size_t size)
+{
+	uint8_t header[8], crc[4];
+	writeBE32(header, (uint32_t)size);
+	memcpy(header + 4, type, 4);
+	writeBE32(crc, ~updateCRC(updateCRC(0xFFFFFFFFu, header + 4, 4), data, size));
+	return fwrite(header, 1, 8, file) == 8 && (!size || fwrite(data, 1, size, file) == size) && fwrite(crc, 1, 4, file) == 4;
+}
+
+//deflate bits, the first one in the lowest bit of every byte
+struct sBitWriter
+{
+	std::vector<uint8_t>& output;
+	uint32_t bits = 0;
+	int num_bits = 0;
+
+	sBitWriter(std::vector<uint8_t>& output) : output(output) {}
+	void put(uint32_t value, int count)
+	{
+		bits |= value << num_bits;
+		num_bits += count;
+		for (; num_bits >= 8; num_bits -= 8, bits >>= 8)
+			output.push_back((uint8_t)bits);
+	}
+	void putCode(int code, int length) { put(reverseBits(code, length), length); } //Huffman codes start with their highest bit
+	void putLiteral(int symbol)
+	{
+		if (symbol < 144)
+			putCode(0x30 + symbol, 8);
+		else if (symbol < 256)
+			putCode(0x190 + symbol - 144, 9);
+		else if (symbol < 280)
+			putCode(symbol - 256, 7);
+		else
+			putCode(0xC0 + symbol - 280, 8);
+	}
+	void finish() { if (num_bits) put(0, 8 - num_bits); }
+};
+
+bool encodePNG(FILE* file, int width, int height, const uint8_t* pixels, bool flip_y)
+{
+	if (!file || width <= 0 || height <= 0 || !pixels)
+		return false;
+
+	//every row with the filter that gives the smallest bytes, a filter byte before it
+	size_t stride = (size_t)width * 4;
+	std::vector<uint8_t> filtered((stride + 1) * height), candidate(stride);
+	std::vector<uint8_t> zeros(stride, 0);
+	for (int y = 0; y < height; ++y)
+	{
+		const uint8_t* row = pixels + (size_t)(flip_y ? height - 1 - y : y) * stride;
+		const uint8_t* prev = y ? pixels + (size_t)(flip_y ? height - y : y - 1) * stride : &zeros[0];
+		uint8_t* destination = &filtered[y * (stride + 1)];
+		long best_sum = -1;
+		for (int filter = 0; filter < 5; ++filter)
+		{
+			long sum = 0;
+			for (size_t i = 0; i < stride; ++i)
+			{
+				int a = i >= 4 ? row[i - 4] : 0, b = prev[i], c = i >= 4 ? prev[i - 4] : 0;
+				int prediction = filter == 1 ? a : filter == 2 ? b : filter == 3 ? (a + b) >> 1 : filter == 4 ? paeth(a, b, c) : 0;
+				candidate[i] = (uint8_t)(row[i] - prediction);
+				sum += abs((int8_t)candidate[i]);
+			}
+			if (best_sum < 0 || sum < best_sum)
+			{
+				best_sum = sum;
+				destination[0] = (uint8_t)filter;
+				memcpy(destination + 1, &candidate[0], stride);
+			}
+		}
+	}
+
+	//zlib stream of a single block with the fixed codes, the longest of the last 32 matches of the same 3 bytes
+	std::vector<uint8_t> compressed = { 0x78, 0x01 };
+	sBitWriter writer(compressed);
+	writer.put(1, 1);
+	writer.put(1, 2);
+
+	const int hash_bits = 15, max_chain = 32;
+	size_t size = filtered.size();
+	const uint8_t* data = &filtered[0];
+	std::vector<int> head(1 << hash_bits, -1), chain(size, -1);
+	auto hash = [&](size_t i) { return ((data[i] << 16 | data[i + 1] << 8 | data[i + 2]) * 2654435761u) >> (32 - hash_bits); };
+	auto insert = [&](size_t i) {
+		if (i + 3 > size)
+			return;
+		uint32_t h = hash(i);
+		chain[i] = head[h];
+		head[h] = (int)i;
+	};
+
+	for (size_t i = 0; i < size;)
+	{
+		int best_length = 0, best_distance = 0;
+		if (i + 3 <= size)
+		{
+			int max_length = (int)std::min((size_t)258, size - i);
+			int candidate_pos = head[hash(i)];
+			for (int n = 0; candidate_pos >= 0 && i - candidate_pos <= INFLATE_WINDOW && n < max_chain; ++n, candidate_pos = chain[candidate_pos])
+			{
+				int length = 0;
+				while (length < max_length && data[candidate_pos + length] == data[i + length])
+					length++;
+				if (length > best_length)
+				{
+					best_length = length;
+					best_distance = (int)(i - candidate_pos);
+					if (length == max_length)
+						break;
+				}
+			}
+		}
+
+		if (best_length < 3)
+		{
+			writer.putLiteral(data[i]);
+			insert(i++);
+			continue;
+		}
+
+		int symbol = 28;
+		while (length_base[symbol] > best_length)
+			symbol--;
+		writer.putLiteral(257 + symbol);
+		writer.put(best_length - length_base[symbol], length_extra[symbol]);
+		int code = 29;
+		while (distance_base[code] > best_distance)
+			code--;
+		writer.putCode(code, 5);
+		writer.put(best_distance - distance_base[code], distance_extra[code]);
+		for (int k = 0; k < best_length; ++k)
+			insert(i++);
+	}
+	writer.putLiteral(256);
+	writer.finish();
+
+	uint32_t adler_a = 1, adler_b = 0;
+	for (size_t i = 0; i < size; ++i)
+	{
+		adler_a = (adler_a + data[i]) % 65521;
+		adler_b = (adler_b + adler_a) % 65521;
+	}
+	uint8_t adler[4];
+	writeBE32(adler, adler_b << 16 | adler_a);
+	compressed.insert(compressed.end(), adler, adler + 4);
+
+	uint8_t header[13];
+	writeBE32(header, width);
+	writeBE32(header + 4, height);
+	uint8_t format[5] = { 8, 6, 0, 0, 0 }; //8 bits RGBA, deflate, adaptive filters, not interlaced
+	memcpy(header + 8, format, 5);
+
+	return fwrite(png_signature, 1, 8, file) == 8 && writeChunk(file, "IHDR", header, 13) &&
+		writeChunk(file, "IDAT", &compressed[0], compressed.size()) && writeChunk(file, "IEND", NULL, 0);
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+
+//decodes a PNG while it is read: the data of the IDAT chunks goes through a streaming inflate with a 32KB window and
+//every scanline is unfiltered and converted to RGBA as soon as it is complete, so neither the file nor the inflated
+//image are kept in memory. The filters of 3 and 4 bytes per pixel are done with SSE2 when available.
+//all the color types and bit depths are supported, not interlaced images. CRCs and the Adler-32 are not checked.
+//pixels gets width * height * 4 bytes allocated with new[], the top row first unless flip_y
+bool decodePNG(FILE* file, int& width, int& height, uint8_t*& pixels, bool flip_y = false);
+
+//writes RGBA pixels (the top row first unless flip_y) as a PNG, choosing the filter of every row by the sum of
+//its bytes and compressing with greedy matches and the fixed Huffman codes
+bool encodePNG(FILE* file, int width, int height, const uint8_t* pixels, bool flip_y = false);
@@ -433,6 +433,7 @@ void Shader::release()
 	}
 
 	locations.clear();
+	attrib_locations.clear();
 
 	compiled = false;
 }
@@ -541,7 +542,12 @@ GLint Shader::getLocation(const char* varname, loctable* table)
 
 int Shader::getAttribLocation(const char* varname)
 {
+	auto cur = attrib_locations.find(varname);
+	if (cur != attrib_locations.end())
+		return cur->second;
+
 	int loc = glGetAttribLocation(program, varname);
+	attrib_locations.emplace(varname, loc);
 	if (loc == -1)
 	{
 		return loc;
@@ -564,9 +570,10 @@ int Shader::getUniformLocation(const char* varname)
 
 void Shader::setTexture(const char* varname, Texture* tex, int slot)
 {
-	glBindTexture(tex->texture_type, tex->texture_id);
 	glActiveTexture(GL_TEXTURE0 + slot);
+	glBindTexture(tex->texture_type, tex->texture_id);
 	setUniform1(varname, slot);
+	glActiveTexture(GL_TEXTURE0);
 }
 
 /*
@@ -819,6 +826,20 @@ Shader* Shader::getDefaultShader(std::string name)
 				gl_FragColor = u_color;\n\
 			}";
 	}
+	else if (name == "flat_instanced") //the model comes per instance, see Mesh::renderInstanced
+	{
+		vs = "attribute vec3 a_vertex;\n\
+			attribute mat4 u_model;\n\
+			uniform mat4 u_viewprojection;\n\
+			void main()\n\
+			{\n\
+				gl_Position = u_viewprojection * u_model * vec4(a_vertex, 1.0);\n\
+			}";
+		fs = "uniform vec4 u_color;\n\
+			void main() {\n\
+				gl_FragColor = u_color;\n\
+			}";
+	}
 	else if (name == "color")
 	{
 		fs = "varying vec4 v_color;\n\
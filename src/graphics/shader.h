@@ -159,4 +159,7 @@ private:
 public:
 	GLint getLocation(const char* varname, loctable* table);
 	loctable locations;
+	//also stores the missing ones (-1) so meshes can query them every frame. The names are copied, the callers may pass
+	//temporary strings, and looked up without building a string
+	std::map<std::string, int, std::less<>> attrib_locations;
 };
\ No newline at end of file
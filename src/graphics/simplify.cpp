@@ -0,0 +1,279 @@
+#include "simplify.h"
+
+#include <cmath>
+#include <cfloat>
+#include <cstring>
+#include <queue>
+#include <unordered_map>
+#include <algorithm>
+
+#include <glm/glm.hpp>
+
+//symmetric 4x4 matrix, only the upper triangle is stored
+struct sQuadric
+{
+	double a2, ab, ac, ad, b2, bc, bd, c2, cd, d2;
+
+	void clear() { memset(this, 0, sizeof(sQuadric)); }
+
+	//squared distance to the plane ax + by + cz + d = 0
+	void addPlane(double a, double b, double c, double d, double weight)
+	{
+		a2 += a * a * weight; ab += a * b * weight; ac += a * c * weight; ad += a * d * weight;
+		b2 += b * b * weight; bc += b * c * weight; bd += b * d * weight;
+		c2 += c * c * weight; cd += c * d * weight;
+		d2 += d * d * weight;
+	}
+
+	void add(const sQuadric& q)
+	{
+		a2 += q.a2; ab += q.ab; ac += q.ac; ad += q.ad;
+		b2 += q.b2; bc += q.bc; bd += q.bd;
+		c2 += q.c2; cd += q.cd;
+		d2 += q.d2;
+	}
+
+	double evaluate(const glm::vec3& p) const
+	{
+		double x = p.x, y = p.y, z = p.z;
+		return a2 * x * x + 2 * ab * x * y + 2 * ac * x * z + 2 * ad * x
+			+ b2 * y * y + 2 * bc * y * z + 2 * bd * y
+			+ c2 * z * z + 2 * cd * z
+			+ d2;
+	}
+};
+
+struct sCollapse
+{
+	float cost;
+	unsigned int from, to;
+	unsigned int from_version, to_version;
+	bool operator<(const sCollapse& o) const { return cost > o.cost; } //min heap
+};
+
+//position and attributes id of a corner
+struct sWeldKey
+{
+	glm::vec3 position;
+	unsigned int attributes;
+};
+
+struct sWeldHash
+{
+	size_t operator()(const sWeldKey& k) const
+	{
+		unsigned int h[3];
+		memcpy(h, &k.position.x, sizeof(h));
+		return (h[0] * 73856093u) ^ (h[1] * 19349663u) ^ (h[2] * 83492791u) ^ (k.attributes * 2654435761u);
+	}
+};
+
+struct sWeldEqual
+{
+	bool operator()(const sWeldKey& a, const sWeldKey& b) const
+	{
+		return a.position.x == b.position.x && a.position.y == b.position.y && a.position.z == b.position.z && a.attributes == b.attributes;
+	}
+};
+
+void simplifyMesh(const std::vector<glm::vec3>& positions, const std::vector<unsigned int>& attributes, int num_levels, float ratio, std::vector<sSimplifiedLevel>& levels)
+{
+	levels.clear();
+	size_t num_corners = (positions.size() / 3) * 3;
+	bool has_attributes = attributes.size() >= num_corners;
+
+	//weld, the first corner found of every position and attributes is the one used in the levels
+	std::unordered_map<sWeldKey, unsigned int, sWeldHash, sWeldEqual> welded_ids;
+	std::unordered_map<sWeldKey, unsigned int, sWeldHash, sWeldEqual> position_uses; //welded vertices of every position
+	std::vector<unsigned int> representative; //welded vertex -> corner
+	std::vector<glm::vec3> vertices;
+	std::vector<unsigned int> triangles; //welded ids
+	triangles.reserve(num_corners);
+	for (size_t i = 0; i < num_corners; ++i)
+	{
+		sWeldKey key = { positions[i], has_attributes ? attributes[i] : 0u };
+		auto it = welded_ids.find(key);
+		if (it == welded_ids.end())
+		{
+			it = welded_ids.emplace(key, (unsigned int)vertices.size()).first;
+			vertices.push_back(positions[i]);
+			representative.push_back((unsigned int)i);
+			position_uses[{ positions[i], 0u }]++;
+		}
+		triangles.push_back(it->second);
+	}
+
+	unsigned int num_vertices = (unsigned int)vertices.size();
+
+	//the vertices of a seam are constrained, collapsing one side would open a crack with the other
+	std::vector<bool> locked(num_vertices);
+	for (unsigned int i = 0; i < num_vertices; ++i)
+		locked[i] = position_uses[{ vertices[i], 0u }] > 1;
+	unsigned int num_triangles = (unsigned int)(triangles.size() / 3);
+	std::vector<bool> triangle_alive(num_triangles, true);
+	std::vector<std::vector<unsigned int>> vertex_triangles(num_vertices);
+	std::vector<sQuadric> quadrics(num_vertices);
+	for (sQuadric& q : quadrics)
+		q.clear();
+
+	unsigned int alive = 0;
+	for (unsigned int t = 0; t < num_triangles; ++t)
+	{
+		unsigned int* tri = &triangles[t * 3];
+		if (tri[0] == tri[1] || tri[1] == tri[2] || tri[2] == tri[0])
+		{
+			triangle_alive[t] = false;
+			continue;
+		}
+		alive++;
+
+		glm::vec3 n = glm::cross(vertices[tri[1]] - vertices[tri[0]], vertices[tri[2]] - vertices[tri[0]]);
+		float length = glm::length(n);
+		if (length > 0.0f)
+			n = n / length;
+		double d = -glm::dot(n, vertices[tri[0]]);
+		for (int k = 0; k < 3; ++k)
+		{
+			quadrics[tri[k]].addPlane(n.x, n.y, n.z, d, 1.0);
+			vertex_triangles[tri[k]].push_back(t);
+		}
+	}
+
+	//edges used by a single triangle are borders (also the seams), a perpendicular plane keeps them in place
+	std::unordered_map<unsigned long long, int> edge_use;
+	for (unsigned int t = 0; t < num_triangles; ++t)
+		if (triangle_alive[t])
+			for (int k = 0; k < 3; ++k)
+			{
+				unsigned int a = triangles[t * 3 + k], b = triangles[t * 3 + (k + 1) % 3];
+				edge_use[((unsigned long long)std::min(a, b) << 32) | std::max(a, b)]++;
+			}
+	for (unsigned int t = 0; t < num_triangles; ++t)
+	{
+		if (!triangle_alive[t])
+			continue;
+		const unsigned int* tri = &triangles[t * 3];
+		glm::vec3 n = glm::normalize(glm::cross(vertices[tri[1]] - vertices[tri[0]], vertices[tri[2]] - vertices[tri[0]]));
+		for (int k = 0; k < 3; ++k)
+		{
+			unsigned int a = tri[k], b = tri[(k + 1) % 3];
+			if (edge_use[((unsigned long long)std::min(a, b) << 32) | std::max(a, b)] != 1)
+				continue;
+			glm::vec3 edge = vertices[b] - vertices[a];
+			float length = glm::length(edge);
+			if (length <= 0.0f)
+				continue;
+			glm::vec3 border_normal = glm::normalize(glm::cross(edge, n));
+			double d = -glm::dot(border_normal, vertices[a]);
+			quadrics[a].addPlane(border_normal.x, border_normal.y, border_normal.z, d, 10.0);
+			quadrics[b].addPlane(border_normal.x, border_normal.y, border_normal.z, d, 10.0);
+		}
+	}
+
+	std::vector<unsigned int> versions(num_vertices, 0);
+	std::vector<bool> vertex_alive(num_vertices, true);
+	std::priority_queue<sCollapse> heap;
+
+	//the cheapest direction of the edge, the vertex collapsed keeps the position of the other one. Locked vertices are only targets
+	auto pushEdge = [&](unsigned int a, unsigned int b) {
+		if (locked[a] && locked[b])
+			return;
+		sQuadric q = quadrics[a];
+		q.add(quadrics[b]);
+		double cost_ab = locked[a] ? DBL_MAX : q.evaluate(vertices[b]);
+		double cost_ba = locked[b] ? DBL_MAX : q.evaluate(vertices[a]);
+		sCollapse c;
+		if (cost_ab <= cost_ba) { c.from = a; c.to = b; c.cost = (float)std::max(cost_ab, 0.0); }
+		else { c.from = b; c.to = a; c.cost = (float)std::max(cost_ba, 0.0); }
+		c.from_version = versions[c.from];
+		c.to_version = versions[c.to];
+		heap.push(c);
+	};
+
+	for (auto& it : edge_use)
+		pushEdge((unsigned int)(it.first >> 32), (unsigned int)(it.first & 0xFFFFFFFF));
+
+	double max_cost = 0.0;
+	for (int level = 0; level < num_levels; ++level)
+	{
+		unsigned int target = (unsigned int)(alive * ratio);
+		while (alive > target && !heap.empty())
+		{
+			sCollapse c = heap.top();
+			heap.pop();
+			if (!vertex_alive[c.from] || !vertex_alive[c.to] || versions[c.from] != c.from_version || versions[c.to] != c.to_version)
+				continue;
+
+			//reject collapses that flip a triangle
+			bool flips = false;
+			for (unsigned int t : vertex_triangles[c.from])
+			{
+				if (!triangle_alive[t])
+					continue;
+				const unsigned int* tri = &triangles[t * 3];
+				if (tri[0] == c.to || tri[1] == c.to || tri[2] == c.to)
+					continue;
+				glm::vec3 p[3], q[3];
+				for (int k = 0; k < 3; ++k)
+				{
+					p[k] = vertices[tri[k]];
+					q[k] = tri[k] == c.from ? vertices[c.to] : p[k];
+				}
+				glm::vec3 before = glm::cross(p[1] - p[0], p[2] - p[0]);
+				glm::vec3 after = glm::cross(q[1] - q[0], q[2] - q[0]);
+				if (glm::dot(before, after) <= 0.0f)
+				{
+					flips = true;
+					break;
+				}
+			}
+			if (flips)
+				continue;
+
+			//collapse from into to
+			for (unsigned int t : vertex_triangles[c.from])
+			{
+				if (!triangle_alive[t])
+					continue;
+				unsigned int* tri = &triangles[t * 3];
+				if (tri[0] == c.to || tri[1] == c.to || tri[2] == c.to)
+				{
+					triangle_alive[t] = false;
+					alive--;
+					continue;
+				}
+				for (int k = 0; k < 3; ++k)
+					if (tri[k] == c.from)
+						tri[k] = c.to;
+				vertex_triangles[c.to].push_back(t);
+			}
+			vertex_triangles[c.from].clear();
+			vertex_alive[c.from] = false;
+			quadrics[c.to].add(quadrics[c.from]);
+			versions[c.to]++;
+			max_cost = std::max(max_cost, (double)c.cost);
+
+			//the edges around the vertex changed their cost, the old entries are stale by its version
+			std::vector<unsigned int>& around = vertex_triangles[c.to];
+			around.erase(std::remove_if(around.begin(), around.end(), [&](unsigned int t) { return !triangle_alive[t]; }), around.end());
+			for (unsigned int t : around)
+				for (int k = 0; k < 3; ++k)
+				{
+					unsigned int a = triangles[t * 3 + k], b = triangles[t * 3 + (k + 1) % 3];
+					pushEdge(a, b);
+				}
+		}
+
+		if (alive > target || !alive)
+			break;
+
+		sSimplifiedLevel result;
+		result.error = (float)sqrt(max_cost);
+		result.corners.reserve(alive * 3);
+		for (unsigned int t = 0; t < num_triangles; ++t)
+			if (triangle_alive[t])
+				for (int k = 0; k < 3; ++k)
+					result.corners.push_back(representative[triangles[t * 3 + k]]);
+		levels.push_back(result);
+	}
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <vector>
+
+#include <glm/vec3.hpp>
+
+//one level of detail generated by simplifyMesh
+struct sSimplifiedLevel
+{
+	std::vector<unsigned int> corners; //three per triangle, index of a vertex of the input soup
+	float error; //max distance to the original surface (estimated from the quadrics), in object units
+};
+
+//quadric error metrics simplification (Garland & Heckbert) using half edge collapses, so the
+//vertices of every level are vertices of the input and keep their attributes.
+//positions is a triangle soup and attributes (optional) an id per corner of its normal and uvs, the corners with
+//the same position and attributes are welded before simplifying. Positions with several attributes are seams,
+//their vertices are never collapsed so both sides of the seam stay together.
+//every level has ratio times the triangles of the previous one, the chain stops when that can not be reached
+void simplifyMesh(const std::vector<glm::vec3>& positions, const std::vector<unsigned int>& attributes, int num_levels, float ratio, std::vector<sSimplifiedLevel>& levels);
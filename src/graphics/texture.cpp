@@ -1,6 +1,7 @@
 #include "texture.h"
 
 #include "../framework/utils.h"
+#include "../framework/volume.h"
 
 #include <iostream> //to output
 #include <cmath>
@@ -8,6 +9,9 @@
 
 #include "mesh.h"
 #include "shader.h"
+#include "upload.h"
+#include "png.h"
+#include "tga.h"
 #include <cassert>
 
 //bilinear interpolation
@@ -160,6 +164,22 @@ void Texture::create3D(unsigned int width, unsigned int height, unsigned int dep
 	upload3D(data, GL_LINEAR, GL_LINEAR, GL_CLAMP_TO_EDGE);
 }
 
+void Texture::create3D(const sEncodedVolume& volume)
+{
+	// the bytes go as they are when the rows keep the unpack alignment of 4
+	bool aligned = volume.format == VOLUME_FORMAT_R8 ? volume.width % 4 == 0 : volume.width % 2 == 0;
+	if ((volume.format == VOLUME_FORMAT_R8 || volume.format == VOLUME_FORMAT_R16F) && aligned) {
+		bool half = volume.format == VOLUME_FORMAT_R16F;
+		create3D(volume.width, volume.height, volume.depth, GL_RED, half ? GL_HALF_FLOAT : GL_UNSIGNED_BYTE, false, (uint8_t*)&volume.data[0], half ? GL_R16F : GL_R8);
+		return;
+	}
+
+	// R8 brick needs the range of every brick and BC4 is not allowed in 3D textures
+	std::vector<float> data;
+	decodeVolume(volume, data);
+	create3D(volume.width, volume.height, volume.depth, GL_RED, GL_FLOAT, false, &data[0], volume.format == VOLUME_FORMAT_BC4 || volume.format == VOLUME_FORMAT_R8 ? GL_R8 : GL_R16F);
+}
+
 void Texture::upload3D(float* data, unsigned int mag_filter, unsigned int min_filter, unsigned int wrap) {
 	assert(this->texture_id && "Must create texture before uploading data.");
 	assert(this->texture_type == GL_TEXTURE_3D && "Texture type does not match.");
@@ -173,7 +193,7 @@ void Texture::upload3D(float* data, unsigned int mag_filter, unsigned int min_fi
 	glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_T, wrap);
 	glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_R, wrap);
 
-	glTexImage3D(this->texture_type, 0, this->internal_format, this->width, this->height, this->depth, 0, this->format, this->type, data);
+	UploadManager::uploadTexture3D(this->texture_type, this->internal_format, this->width, this->height, this->depth, this->format, this->type, data);
 
 	if (data && this->mipmaps) glGenerateMipmap(texture_type);
 
@@ -181,6 +201,27 @@ void Texture::upload3D(float* data, unsigned int mag_filter, unsigned int min_fi
 	assert(checkGLErrors() && "Error uploading texture");
 }
 
+void Texture::upload3DMipmaps(const std::vector<std::vector<float>>& levels) {
+	assert(this->texture_id && this->texture_type == GL_TEXTURE_3D && "Must create the 3D texture before its mipmaps.");
+
+	glBindTexture(this->texture_type, this->texture_id);
+
+	int width = (int)this->width, height = (int)this->height, depth = (int)this->depth;
+	for (size_t i = 0; i < levels.size(); ++i) {
+		width = std::max(width / 2, 1);
+		height = std::max(height / 2, 1);
+		depth = std::max(depth / 2, 1);
+		UploadManager::uploadTexture3D(this->texture_type, this->internal_format, width, height, depth, this->format, GL_FLOAT, &levels[i][0], (int)i + 1);
+	}
+
+	glTexParameteri(this->texture_type, GL_TEXTURE_MAX_LEVEL, (GLint)levels.size());
+	glTexParameteri(this->texture_type, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	this->mipmaps = levels.size() > 0;
+
+	glBindTexture(this->texture_type, 0);
+	assert(checkGLErrors() && "Error uploading mipmaps");
+}
+
 void Texture::createCubemap(unsigned int width, unsigned int height, uint8_t** data, unsigned int format, unsigned int type, bool mipmaps, unsigned int internal_format)
 {
 	assert(width && height && "texture must have a size");
@@ -224,6 +265,34 @@ Texture* Texture::Get(const char* filename, bool mipmaps, bool wrap)
 	return texture;
 }
 
+//decodes the pixels straight into a block of the staging ring, the upload copies them from there to the texture
+static bool loadStagedTGA(const char* filename, Image* image, sStagingBlock& block)
+{
+	sMappedFile file;
+	if (!mapFile(filename, file))
+		return false;
+
+	//the rows are not padded, they must be aligned to the 4 bytes GL unpacks
+	sTGAHeader header;
+	bool loaded = readTGAHeader(file.data, file.size, header) && (header.width * header.bytes_per_pixel) % 4 == 0 &&
+		UploadManager::alloc((size_t)header.width * header.height * header.bytes_per_pixel, block, true);
+	if (loaded && !decodeTGA(file.data, file.size, header, block.data))
+	{
+		UploadManager::cancel(block);
+		loaded = false;
+	}
+	unmapFile(file);
+
+	if (loaded)
+	{
+		image->width = header.width;
+		image->height = header.height;
+		image->bytes_per_pixel = header.bytes_per_pixel;
+		image->origin_topleft = header.origin_topleft;
+	}
+	return loaded;
+}
+
 bool Texture::load(const char* filename, bool mipmaps, bool wrap, unsigned int type)
 {
 	std::string str = filename;
@@ -235,11 +304,12 @@ bool Texture::load(const char* filename, bool mipmaps, bool wrap, unsigned int t
 
 	image = new Image();
 	bool found = false;
+	sStagingBlock staged;
 
 	if (ext == ".tga" || ext == ".TGA")
-		found = image->loadTGA(filename);
+		found = (type == GL_UNSIGNED_BYTE && loadStagedTGA(filename, image, staged)) || image->loadTGA(filename);
 	else if (ext == ".png" || ext == ".PNG")
-		found = image->loadPNG(filename);
+		found = image->loadPNG(filename, true); //bottom row first like the TGAs, as GL expects
 	else
 	{
 		std::cout << "[ERROR]: unsupported format" << std::endl;
@@ -260,7 +330,8 @@ bool Texture::load(const char* filename, bool mipmaps, bool wrap, unsigned int t
 		internal_format = (image->bytes_per_pixel == 3 ? GL_RGB32F : GL_RGBA32F);
 
 	//upload to VRAM
-	create(image->width, image->height, (image->bytes_per_pixel == 3 ? GL_RGB : GL_RGBA), type, mipmaps, image->data, 0);
+	create(image->width, image->height, (image->bytes_per_pixel == 3 ? GL_RGB : GL_RGBA), type, mipmaps, staged.id ? staged.data : image->data, 0);
+	UploadManager::cancel(staged); //already released by the upload unless it could not take it from the ring
 
 	glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_S, this->mipmaps && wrap ? GL_REPEAT : GL_CLAMP_TO_EDGE);
 	glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_T, this->mipmaps && wrap ? GL_REPEAT : GL_CLAMP_TO_EDGE);
@@ -286,7 +357,7 @@ void Texture::upload(unsigned int format, unsigned int type, bool mipmaps, uint8
 
 	glBindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
 
-	glTexImage2D(this->texture_type, 0, internal_format == 0 ? format : internal_format, width, height, 0, format, type, data);
+	UploadManager::uploadTexture2D(this->texture_type, internal_format == 0 ? format : internal_format, width, height, format, type, data);
 
 	glTexParameteri(this->texture_type, GL_TEXTURE_MAG_FILTER, Texture::default_mag_filter);	//set the min filter
 	glTexParameteri(this->texture_type, GL_TEXTURE_MIN_FILTER, this->mipmaps ? Texture::default_min_filter : GL_LINEAR);   //set the mag filter
@@ -307,7 +378,7 @@ void Texture::upload3D(unsigned int format, unsigned int type, bool mipmaps, uin
 
 	glBindTexture(this->texture_type, texture_id);	//we activate this id to tell opengl we are going to use this texture
 
-	glTexImage3D(this->texture_type, 0, internal_format == 0 ? format : internal_format, width, height, depth, 0, format, type, data);
+	UploadManager::uploadTexture3D(this->texture_type, internal_format == 0 ? format : internal_format, width, height, depth, format, type, data);
 
 	glTexParameteri(this->texture_type, GL_TEXTURE_MAG_FILTER, Texture::default_mag_filter);	//set the min filter
 	glTexParameteri(this->texture_type, GL_TEXTURE_MIN_FILTER, this->mipmaps ? Texture::default_min_filter : GL_LINEAR);   //set the mag filter
@@ -513,125 +584,140 @@ void Image::fromTexture(Texture* texture)
 
 //TGA format from: http://www.paulbourke.net/dataformats/tga/
 //also on https://gshaw.ca/closecombat/formats/tga.html
+//the file is mapped and its pixels decoded in a single pass, see decodeTGA
 bool Image::loadTGA(const char* filename)
 {
-	GLubyte TGAheader[12] = { 0, 0, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
-	GLubyte TGAcompare[12];
-	GLubyte header[6];
-	GLuint imageSize;
-	//GLuint type = GL_RGBA;
-
-	FILE* file = fopen(filename, "rb");
-
-	if (file == NULL || fread(TGAcompare, 1, sizeof(TGAcompare), file) != sizeof(TGAcompare) ||
-		memcmp(TGAheader, TGAcompare, sizeof(TGAheader)) != 0 ||
-		fread(header, 1, sizeof(header), file) != sizeof(header))
-	{
-		if (file == NULL)
-			return NULL;
-		else
-		{
-			fclose(file);
-			return NULL;
-		}
-	}
-
-	width = header[1] * 256 + header[0];
-	height = header[3] * 256 + header[2];
-	bytes_per_pixel = header[4] / 8;
-
-	bool error = false;
-
-	if (bytes_per_pixel != 3 && bytes_per_pixel != 4)
-	{
-		error = true;
-		std::cerr << "File format not supported: " << bytes_per_pixel << " bytes per pixel" << std::endl;
-	}
-
-	if (width <= 0 || height <= 0)
-	{
-		error = true;
-		std::cerr << "Wrong texture size: " << width << "x" << height << " pixels" << std::endl;
-	}
+	sMappedFile file;
+	if (!mapFile(filename, file))
+		return false;
 
-	if (error)
+	sTGAHeader header;
+	if (!readTGAHeader(file.data, file.size, header))
 	{
-		fclose(file);
+		std::cerr << "File format not supported: only true color TGAs of 24 or 32 bits per pixel" << std::endl;
+		unmapFile(file);
 		return false;
 	}
 
-	imageSize = width * height * bytes_per_pixel;
-
-	data = new GLubyte[imageSize];
-	if (data == NULL || fread(data, 1, imageSize, file) != imageSize)
+	if (data)
+		delete[] data;
+	width = header.width;
+	height = header.height;
+	bytes_per_pixel = header.bytes_per_pixel;
+	origin_topleft = header.origin_topleft;
+	data = new uint8_t[(size_t)width * height * bytes_per_pixel];
+
+	bool decoded = decodeTGA(file.data, file.size, header, data);
+	unmapFile(file);
+	if (!decoded)
 	{
-		if (data != NULL)
-			delete[]data;
-		fclose(file);
-		return NULL;
+		std::cerr << "Truncated TGA: " << filename << std::endl;
+		clear();
+		return false;
 	}
+	return true;
+}
 
-	if (header[5] & (1 << 5)) //flip
-		origin_topleft = true;
+//decoded while it is read, the rows are flipped when they are written
+bool Image::loadPNG(const char* filename, bool flip_y)
+{
+	FILE* file = fopen(filename, "rb");
+	if (file == NULL)
+		return false;
 
-	//flip BGR to RGB pixels
-	for (GLuint i = 0; i < int(imageSize); i += bytes_per_pixel)
+	int png_width = 0, png_height = 0;
+	uint8_t* pixels = NULL;
+	bool decoded = decodePNG(file, png_width, png_height, pixels, flip_y);
+	fclose(file);
+	if (!decoded)
 	{
-		uint8_t temp = data[i];
-		data[i] = data[i + 2];
-		data[i + 2] = temp;
+		std::cerr << "Wrong or unsupported PNG: " << filename << std::endl;
+		return false;
 	}
 
-	fclose(file);
+	if (data)
+		delete[] data;
+	data = pixels;
+	width = png_width;
+	height = png_height;
+	bytes_per_pixel = 4;
 	return true;
 }
 
-#include <iostream>
-#include <fstream>
-
-bool Image::loadPNG(const char* filename, bool flip_y)
+bool Image::savePNG(const char* filename, bool flip_y)
 {
-	std::ifstream file(filename, std::ios::in | std::ios::binary | std::ios::ate);
-
-	//get filesize
-	std::streamsize size = 0;
-	if (file.seekg(0, std::ios::end).good()) size = file.tellg();
-	if (file.seekg(0, std::ios::beg).good()) size -= file.tellg();
-
-	if (!size)
+	if (!data || bytes_per_pixel != 4)
 		return false;
 
-	std::vector<unsigned char> buffer;
+	FILE* file = fopen(filename, "wb");
+	if (file == NULL)
+		return false;
+	bool saved = encodePNG(file, width, height, data, flip_y);
+	fclose(file);
+	return saved;
+}
 
-	//read contents of the file into the vector
-	if (size > 0)
+void Image::benchmarkDecoding(int width, int height)
+{
+	const int num_loads = 5;
+	const char* png_filename = "benchmark_decoding.png";
+	const char* tga_filename = "benchmark_decoding.tga";
+	const char* rle_filename = "benchmark_decoding_rle.tga";
+
+	// smooth gradients with some noise, like a photo
+	Image image(width, height, 4);
+	for (int y = 0; y < height; ++y)
+		for (int x = 0; x < width; ++x)
+		{
+			float wave = sinf(x * 0.01f) * cosf(y * 0.013f);
+			image.setPixel(x, y, glm::vec4(128.f + 120.f * wave + rand() % 8, (x + y) * 255.f / (width + height), 128.f + 100.f * sinf((x - y) * 0.005f), 255.f));
+		}
+	if (!image.saveTGA(tga_filename) || !image.saveTGA(rle_filename, true, true) || !image.savePNG(png_filename))
 	{
-		buffer.resize((size_t)size);
-		file.read((char*)(&buffer[0]), size);
+		std::cout << " + Image decoding: the files could not be written" << std::endl;
+		return;
 	}
-	else
-		buffer.clear();
-
-	std::vector<unsigned char> out_image;
 
-	//if (decodePNG(out_image, width, height, buffer.empty() ? 0 : &buffer[0], (unsigned long)buffer.size(), true) != 0)
-	//	return false;
+	double megabytes = width * height * 4.0 / (1024.0 * 1024.0);
+	const char* names[4] = { "TGA", "TGA RLE", "PNG", "PNG flipped" };
+	const char* filenames[4] = { tga_filename, rle_filename, png_filename, png_filename };
+	for (int mode = 0; mode < 4; ++mode)
+	{
+		bool loaded = true, same = true;
+		double start = glfwGetTime();
+		for (int i = 0; i < num_loads; ++i)
+		{
+			Image result;
+			loaded = loaded && (mode >= 2 ? result.loadPNG(png_filename, mode == 3) : result.loadTGA(filenames[mode]));
+			if (i == 0 && loaded)
+				for (int y = 0; y < height && same; ++y)
+				{
+					int row = mode == 3 ? height - 1 - y : y;
+					same = !memcmp(result.data + (size_t)row * width * 4, image.data + (size_t)y * width * 4, (size_t)width * 4);
+				}
+		}
+		double time = (glfwGetTime() - start) / num_loads;
 
-	data = new uint8_t[out_image.size()];
-	memcpy(data, &out_image[0], out_image.size());
-	bytes_per_pixel = 4;
+		FILE* file = fopen(filenames[mode], "rb");
+		fseek(file, 0, SEEK_END);
+		long file_size = ftell(file);
+		fclose(file);
 
-	//flip pixels in Y
-	if (flip_y)
-		flipY();
+		std::cout << " + " << names[mode] << " " << width << "x" << height << ": " << file_size / (1024.0 * 1024.0) << " MB file, " << time * 1000.0 << "ms, "
+			<< megabytes / time << " MB/s" << (loaded && same ? "" : "  [ERROR]: different pixels") << std::endl;
+	}
 
-	return true;
+	remove(png_filename);
+	remove(tga_filename);
+	remove(rle_filename);
 }
 
 // Saves the image to a TGA file
-bool Image::saveTGA(const char* filename, bool flip_y)
+bool Image::saveTGA(const char* filename, bool flip_y, bool rle)
 {
 	unsigned char TGAheader[12] = { 0, 0, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+	if (rle)
+		TGAheader[2] = 10;
 
 	FILE* file = fopen(filename, "wb");
 	if (file == NULL)
@@ -664,7 +750,39 @@ bool Image::saveTGA(const char* filename, bool flip_y)
 			bytes[pos + 3] = *(p + 3);
 		}
 
-	fwrite(bytes, 1, width * height * 4, file);
+	if (rle)
+	{
+		//packets of a repeated pixel or of raw pixels, without crossing the rows
+		std::vector<uint8_t> packets;
+		for (int y = 0; y < height; ++y)
+		{
+			const uint8_t* row = bytes + y * width * 4;
+			for (int x = 0; x < width;)
+			{
+				int length = 1;
+				while (x + length < width && length < 128 && !memcmp(row + (x + length) * 4, row + x * 4, 4))
+					length++;
+				if (length > 1)
+				{
+					packets.push_back((uint8_t)(128 | (length - 1)));
+					packets.insert(packets.end(), row + x * 4, row + x * 4 + 4);
+					x += length;
+					continue;
+				}
+
+				//raw until a run starts
+				while (x + length < width && length < 128 && !(x + length + 1 < width && !memcmp(row + (x + length) * 4, row + (x + length + 1) * 4, 4)))
+					length++;
+				packets.push_back((uint8_t)(length - 1));
+				packets.insert(packets.end(), row + x * 4, row + (x + length) * 4);
+				x += length;
+			}
+		}
+		fwrite(&packets[0], 1, packets.size(), file);
+	}
+	else
+		fwrite(bytes, 1, width * height * 4, file);
+	delete[] bytes;
 	fclose(file);
 	return true;
 }
@@ -7,6 +7,7 @@
 #include "../framework/includes.h"
 #include <map>
 #include <string>
+#include <vector>
 #include <cassert>
 
 #include <glm/vec4.hpp>
@@ -14,6 +15,7 @@
 class Shader;
 class FBO;
 class Texture;
+struct sEncodedVolume;
 
 //Simple class to handle images (stores RGBA always)
 class Image
@@ -52,7 +54,11 @@ public:
 
 	bool loadTGA(const char* filename);
 	bool loadPNG(const char* filename, bool flip_y = false);
-	bool saveTGA(const char* filename, bool flip_y = true);
+	bool saveTGA(const char* filename, bool flip_y = true, bool rle = false);
+	bool savePNG(const char* filename, bool flip_y = false); //RGBA images only
+
+	//MB/s of the decoded pixels of loadTGA (raw and RLE) and loadPNG with a generated image, results are printed
+	static void benchmarkDecoding(int width = 2048, int height = 2048);
 };
 
 
@@ -97,12 +103,14 @@ public:
 	void create(unsigned int width, unsigned int height, unsigned int format = GL_RGB, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, uint8_t* data = NULL, unsigned int internal_format = 0);
 	void create3D(unsigned int width, unsigned int height, unsigned int depth, unsigned int format = GL_RED, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, uint8_t* data = NULL, unsigned int internal_format = 0);
 	void create3D(unsigned int width, unsigned int height, unsigned int depth, unsigned int format = GL_RED, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, float* data = NULL, unsigned int internal_format = 0);
+	void create3D(const sEncodedVolume& volume); //linear and clamped, the formats GL can not sample are decoded first
 	void createCubemap(unsigned int width, unsigned int height, uint8_t** data = NULL, unsigned int format = GL_RGBA, unsigned int type = GL_FLOAT, bool mipmaps = true, unsigned int internal_format = GL_RGBA32F);
 
 	void upload(Image* img);
 	void upload(unsigned int format = GL_RGB, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, uint8_t* data = NULL, unsigned int internal_format = 0);
 	void upload3D(unsigned int format = GL_RED, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, uint8_t* data = NULL, unsigned int internal_format = 0);
 	void upload3D(float* data = NULL, unsigned int mag_filter = GL_LINEAR, unsigned int min_filter = GL_LINEAR, unsigned int wrap = GL_CLAMP_TO_EDGE);
+	void upload3DMipmaps(const std::vector<std::vector<float>>& levels); //levels after the first one built on the CPU, see buildVolumeMips
 	void uploadCubemap(unsigned int format = GL_RGB, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, uint8_t** data = NULL, unsigned int internal_format = 0);
 	void uploadAsArray(unsigned int texture_size, bool mipmaps = true);
 
@@ -0,0 +1,134 @@
+#include "tga.h"
+
+#include <cstring>
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_IX86)
+#define TGA_USE_SSE
+#include <emmintrin.h>
+#endif
+//the byte shuffle of 24 bit pixels needs ACG_SIMD at SSSE3 or above, MSVC only says so through __AVX__
+#if defined(__SSSE3__) || defined(__AVX__)
+#define TGA_USE_SSSE3
+#include <tmmintrin.h>
+#endif
+
+#define TGA_HEADER_SIZE 18
+
+bool readTGAHeader(const uint8_t* data, size_t size, sTGAHeader& header)
+{
+	//id length, color map type, image type, color map (5 bytes), origin (4 bytes), size, bits per pixel and descriptor
+	if (!data || size < TGA_HEADER_SIZE || data[1] != 0 || (data[2] != 2 && data[2] != 10))
+		return false;
+
+	header.width = data[12] | data[13] << 8;
+	header.height = data[14] | data[15] << 8;
+	header.bytes_per_pixel = data[16] / 8;
+	header.rle = data[2] == 10;
+	header.origin_topleft = (data[17] & (1 << 5)) != 0;
+	header.data_offset = TGA_HEADER_SIZE + data[0];
+	return header.width > 0 && header.height > 0 && (header.bytes_per_pixel == 3 || header.bytes_per_pixel == 4) && header.data_offset <= size;
+}
+
+//count raw pixels from BGR(A) to RGB(A)
+static void swizzlePixels(const uint8_t* source, uint8_t* destination, size_t count, int bpp)
+{
+	size_t i = 0;
+#ifdef TGA_USE_SSE
+	if (bpp == 4)
+	{
+		//blue and red are the bytes 0 and 2 of every 32 bits
+		const __m128i red_blue = _mm_set1_epi32(0x00FF00FF);
+		for (; i + 4 <= count; i += 4)
+		{
+			__m128i x = _mm_loadu_si128((const __m128i*)(source + i * 4));
+			__m128i rb = _mm_and_si128(x, red_blue);
+			rb = _mm_or_si128(_mm_slli_epi32(rb, 16), _mm_srli_epi32(rb, 16));
+			_mm_storeu_si128((__m128i*)(destination + i * 4), _mm_or_si128(_mm_andnot_si128(red_blue, x), rb));
+		}
+	}
+#endif
+#ifdef TGA_USE_SSSE3
+	if (bpp == 3)
+	{
+		//12 bytes per step, the 4 after them are loaded and stored too so 6 pixels must be left
+		const __m128i order = _mm_setr_epi8(2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, 12, 13, 14, 15);
+		for (; i + 6 <= count; i += 4)
+			_mm_storeu_si128((__m128i*)(destination + i * 3), _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(source + i * 3)), order));
+	}
+#endif
+	for (; i < count; ++i)
+	{
+		const uint8_t* pixel = source + i * bpp;
+		uint8_t* result = destination + i * bpp;
+		uint8_t blue = pixel[0];
+		result[0] = pixel[2];
+		result[1] = pixel[1];
+		result[2] = blue;
+		if (bpp == 4)
+			result[3] = pixel[3];
+	}
+}
+
+//count copies of a pixel already swizzled
+static void fillPixels(const uint8_t* pixel, uint8_t* destination, size_t count, int bpp)
+{
+	size_t i = 0;
+#ifdef TGA_USE_SSE
+	if (bpp == 4)
+	{
+		int value;
+		memcpy(&value, pixel, 4);
+		__m128i x = _mm_set1_epi32(value);
+		for (; i + 4 <= count; i += 4)
+			_mm_storeu_si128((__m128i*)(destination + i * 4), x);
+	}
+#endif
+	for (; i < count; ++i)
+		memcpy(destination + i * bpp, pixel, bpp);
+}
+
+bool decodeTGA(const uint8_t* data, size_t size, const sTGAHeader& header, uint8_t* pixels)
+{
+	const uint8_t* source = data + header.data_offset;
+	const uint8_t* end = data + size;
+	int bpp = header.bytes_per_pixel;
+	size_t count = (size_t)header.width * header.height;
+
+	if (!header.rle)
+	{
+		if ((size_t)(end - source) < count * bpp)
+			return false;
+		swizzlePixels(source, pixels, count, bpp);
+		return true;
+	}
+
+	//packets of up to 128 pixels, the highest bit tells if it is a single pixel repeated
+	for (size_t done = 0; done < count;)
+	{
+		if (source >= end)
+			return false;
+		int packet = *source++;
+		size_t length = (packet & 127) + 1;
+		size_t used = std::min(length, count - done);
+		if (packet & 128)
+		{
+			if (end - source < bpp)
+				return false;
+			uint8_t pixel[4];
+			swizzlePixels(source, pixel, 1, bpp);
+			fillPixels(pixel, pixels, used, bpp);
+			source += bpp;
+		}
+		else
+		{
+			if ((size_t)(end - source) < length * bpp)
+				return false;
+			swizzlePixels(source, pixels, used, bpp);
+			source += length * bpp;
+		}
+		pixels += used * bpp;
+		done += used;
+	}
+	return true;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+//what the header of a TGA says about its pixels
+struct sTGAHeader
+{
+	int width = 0;
+	int height = 0;
+	int bytes_per_pixel = 0; //3 or 4
+	bool rle = false; //type 10, packets of a repeated pixel or of raw pixels
+	bool origin_topleft = false; //the first row is the top one
+	size_t data_offset = 0; //first byte of the pixels in the file
+};
+
+//true color TGAs (types 2 and 10) of 24 or 32 bits, false for any other
+bool readTGAHeader(const uint8_t* data, size_t size, sTGAHeader& header);
+
+//the pixels as RGB or RGBA in the order of the file, expanding the runs and swapping BGR in a single pass: the raw pixels
+//are swapped 4 at once, with SSE2 for 32 bits and with the pshufb of SSSE3 for 24 bits when enabled. False if the data ends before the image
+bool decodeTGA(const uint8_t* data, size_t size, const sTGAHeader& header, uint8_t* pixels);
@@ -0,0 +1,318 @@
+#include "upload.h"
+
+#include <deque>
+#include <mutex>
+#include <cstring>
+
+#include "../framework/includes.h"
+
+#define STAGING_ALIGNMENT 256 //offsets of the blocks, enough for any copy or unpack alignment
+
+bool UploadManager::enabled = true;
+size_t UploadManager::ring_size = 64 * 1024 * 1024;
+sUploadStats UploadManager::stats;
+
+//a block of the ring from its allocation until the GPU finishes copying it
+struct sStagingRange
+{
+	unsigned int id;
+	size_t begin;
+	GLsync fence; //set when the copy is issued
+	bool done; //copy issued or cancelled
+};
+
+GLuint staging_ring_id = 0;
+uint8_t* staging_ring_data = NULL;
+size_t staging_ring_size = 0;
+std::mutex staging_mutex; //the ranges and the head are shared with the threads that allocate
+std::deque<sStagingRange> staging_ranges; //in allocation order, the first one is the tail of the ring
+size_t staging_head = 0;
+unsigned int staging_next_id = 1;
+
+bool UploadManager::init()
+{
+	if (staging_ring_data)
+		return true;
+	if (!enabled || glBufferStorage == 0)
+		return false;
+
+	GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+	glGenBuffers(1, &staging_ring_id);
+	glBindBuffer(GL_COPY_READ_BUFFER, staging_ring_id);
+	glBufferStorage(GL_COPY_READ_BUFFER, ring_size, NULL, flags);
+	uint8_t* data = (uint8_t*)glMapBufferRange(GL_COPY_READ_BUFFER, 0, ring_size, flags);
+	glBindBuffer(GL_COPY_READ_BUFFER, 0);
+
+	std::lock_guard<std::mutex> lock(staging_mutex);
+	staging_ring_data = data;
+	staging_ring_size = ring_size;
+	return staging_ring_data != NULL;
+}
+
+//pops the blocks whose copy finished, render thread only. The mutex must be locked
+static void retireRanges()
+{
+	while (staging_ranges.size() && staging_ranges.front().done)
+	{
+		GLsync fence = staging_ranges.front().fence;
+		if (fence)
+		{
+			if (glClientWaitSync(fence, 0, 0) == GL_TIMEOUT_EXPIRED)
+				break;
+			glDeleteSync(fence);
+		}
+		staging_ranges.pop_front();
+	}
+}
+
+//free space goes from the head to the first range, wrapping at the end. The mutex must be locked
+static bool findSpace(size_t size, size_t& offset)
+{
+	if (staging_ranges.empty())
+		staging_head = 0;
+	size_t tail = staging_ranges.size() ? staging_ranges.front().begin : 0;
+
+	if (staging_ranges.empty() || staging_head > tail)
+	{
+		if (staging_head + size <= staging_ring_size)
+			offset = staging_head;
+		else if (size < tail)
+			offset = 0;
+		else
+			return false;
+	}
+	else if (staging_head + size < tail)
+		offset = staging_head;
+	else
+		return false;
+
+	staging_head = offset + size;
+	return true;
+}
+
+void UploadManager::update()
+{
+	std::lock_guard<std::mutex> lock(staging_mutex);
+	retireRanges();
+}
+
+bool UploadManager::alloc(size_t size, sStagingBlock& block, bool wait)
+{
+	block = sStagingBlock();
+	if (!enabled || !size || (wait && !init()))
+		return false;
+	size_t aligned_size = (size + STAGING_ALIGNMENT - 1) & ~(size_t)(STAGING_ALIGNMENT - 1);
+
+	std::unique_lock<std::mutex> lock(staging_mutex);
+	if (!staging_ring_data || aligned_size >= staging_ring_size)
+		return false;
+
+	size_t offset = 0;
+	double start = wait ? glfwGetTime() : 0.0;
+	while (!findSpace(aligned_size, offset))
+	{
+		//only copies already issued can be waited for, not the blocks other threads are still filling
+		if (!wait)
+			return false;
+		retireRanges();
+		if (findSpace(aligned_size, offset))
+			break;
+		if (staging_ranges.empty() || !staging_ranges.front().fence)
+		{
+			stats.stall_time += glfwGetTime() - start;
+			return false;
+		}
+
+		GLsync fence = staging_ranges.front().fence;
+		lock.unlock();
+		glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 100000000);
+		lock.lock();
+		retireRanges();
+	}
+	if (wait)
+		stats.stall_time += glfwGetTime() - start;
+
+	sStagingRange range = { staging_next_id++, offset, 0, false };
+	staging_ranges.push_back(range);
+
+	block.data = staging_ring_data + offset;
+	block.offset = offset;
+	block.size = size;
+	block.id = range.id;
+	return true;
+}
+
+//marks the range of the block as done, with a fence for the copies issued until now
+static void releaseBlock(sStagingBlock& block, bool copied)
+{
+	if (!block.id)
+		return;
+	std::lock_guard<std::mutex> lock(staging_mutex);
+	for (sStagingRange& range : staging_ranges)
+		if (range.id == block.id)
+		{
+			if (copied)
+				range.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+			range.done = true;
+			break;
+		}
+	block = sStagingBlock();
+}
+
+void UploadManager::cancel(sStagingBlock& block)
+{
+	releaseBlock(block, false);
+}
+
+//the block allocated at data when it was not copied or cancelled yet
+static bool findBlock(const void* data, size_t size, sStagingBlock& block)
+{
+	std::lock_guard<std::mutex> lock(staging_mutex);
+	if (!staging_ring_data || data < staging_ring_data || data >= staging_ring_data + staging_ring_size)
+		return false;
+	size_t offset = (const uint8_t*)data - staging_ring_data;
+	for (const sStagingRange& range : staging_ranges)
+		if (range.begin == offset && !range.done)
+		{
+			block.data = staging_ring_data + offset;
+			block.offset = offset;
+			block.size = size;
+			block.id = range.id;
+			return true;
+		}
+	return false;
+}
+
+void UploadManager::uploadBuffer(unsigned int target, const void* data, size_t size, sStagingBlock* staged)
+{
+	double start = glfwGetTime();
+
+	//the staged block is only valid if the data did not change its size since it was written
+	sStagingBlock block;
+	if (staged && staged->id && staged->size == size)
+	{
+		block = *staged;
+		*staged = sStagingBlock();
+	}
+	else
+	{
+		if (staged)
+			cancel(*staged);
+		if (alloc(size, block, true))
+			memcpy(block.data, data, size);
+	}
+
+	if (block.id)
+	{
+		glBufferData(target, size, NULL, GL_STATIC_DRAW);
+		glBindBuffer(GL_COPY_READ_BUFFER, staging_ring_id);
+		glCopyBufferSubData(GL_COPY_READ_BUFFER, target, block.offset, 0, size);
+		glBindBuffer(GL_COPY_READ_BUFFER, 0);
+		releaseBlock(block, true);
+		stats.staged_bytes += size;
+	}
+	else
+	{
+		glBufferData(target, size, data, GL_STATIC_DRAW);
+		stats.direct_bytes += size;
+	}
+
+	stats.uploads++;
+	stats.copy_time += glfwGetTime() - start;
+}
+
+void UploadManager::uploadTexture2D(unsigned int target, int internal_format, int width, int height, unsigned int format, unsigned int type, const void* data)
+{
+	uploadTexture3D(target, internal_format, width, height, 0, format, type, data);
+}
+
+//depth 0 for 2D textures
+void UploadManager::uploadTexture3D(unsigned int target, int internal_format, int width, int height, int depth, unsigned int format, unsigned int type, const void* data, int level)
+{
+	double start = glfwGetTime();
+	size_t size = data ? getTextureSize(width, height, depth ? depth : 1, format, type) : 0;
+
+	sStagingBlock block;
+	bool staged = size && findBlock(data, size, block);
+	if (staged || (size && alloc(size, block, true)))
+	{
+		//with a GL_PIXEL_UNPACK_BUFFER bound the pointer is an offset in it
+		if (!staged)
+			memcpy(block.data, data, size);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, staging_ring_id);
+		if (depth)
+			glTexImage3D(target, level, internal_format, width, height, depth, 0, format, type, (void*)block.offset);
+		else
+			glTexImage2D(target, level, internal_format, width, height, 0, format, type, (void*)block.offset);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		releaseBlock(block, true);
+		stats.staged_bytes += size;
+	}
+	else
+	{
+		if (depth)
+			glTexImage3D(target, level, internal_format, width, height, depth, 0, format, type, data);
+		else
+			glTexImage2D(target, level, internal_format, width, height, 0, format, type, data);
+		stats.direct_bytes += size;
+	}
+
+	if (data)
+		stats.uploads++;
+	stats.copy_time += glfwGetTime() - start;
+}
+
+//a region of a 3D texture that already exists
+void UploadManager::uploadSubTexture3D(unsigned int target, int x, int y, int z, int width, int height, int depth, unsigned int format, unsigned int type, const void* data, int level)
+{
+	double start = glfwGetTime();
+	size_t size = getTextureSize(width, height, depth, format, type);
+
+	sStagingBlock block;
+	bool staged = size && findBlock(data, size, block);
+	if (staged || (size && alloc(size, block, true)))
+	{
+		if (!staged)
+			memcpy(block.data, data, size);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, staging_ring_id);
+		glTexSubImage3D(target, level, x, y, z, width, height, depth, format, type, (void*)block.offset);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		releaseBlock(block, true);
+		stats.staged_bytes += size;
+	}
+	else
+	{
+		glTexSubImage3D(target, level, x, y, z, width, height, depth, format, type, data);
+		stats.direct_bytes += size;
+	}
+
+	stats.uploads++;
+	stats.copy_time += glfwGetTime() - start;
+}
+
+size_t UploadManager::getTextureSize(int width, int height, int depth, unsigned int format, unsigned int type)
+{
+	size_t channels = 0;
+	switch (format)
+	{
+	case GL_RED: case GL_RED_INTEGER: case GL_DEPTH_COMPONENT: case GL_ALPHA: case GL_LUMINANCE: channels = 1; break;
+	case GL_RG: case GL_RG_INTEGER: case GL_LUMINANCE_ALPHA: channels = 2; break;
+	case GL_RGB: case GL_BGR: channels = 3; break;
+	case GL_RGBA: case GL_BGRA: channels = 4; break;
+	}
+
+	size_t bytes = 0;
+	switch (type)
+	{
+	case GL_UNSIGNED_BYTE: case GL_BYTE: bytes = 1; break;
+	case GL_UNSIGNED_SHORT: case GL_SHORT: case GL_HALF_FLOAT: bytes = 2; break;
+	case GL_UNSIGNED_INT: case GL_INT: case GL_FLOAT: bytes = 4; break;
+	case GL_UNSIGNED_INT_2_10_10_10_REV: bytes = 4; channels = 1; break; //all the channels packed in a uint
+	}
+
+	//every row starts aligned to 4 bytes, the last one is not padded
+	size_t row = width * channels * bytes;
+	size_t aligned_row = (row + 3) & ~(size_t)3;
+	size_t rows = (size_t)height * depth;
+	return rows ? aligned_row * (rows - 1) + row : 0;
+}
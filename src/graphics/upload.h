@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+//memory of the staging ring that will be copied to a buffer or a texture
+struct sStagingBlock
+{
+	uint8_t* data = NULL; //write here the bytes to upload
+	size_t offset = 0; //in the ring buffer
+	size_t size = 0;
+	unsigned int id = 0; //0 when the block is not in the ring
+};
+
+struct sUploadStats
+{
+	double staged_bytes = 0.0; //copied by the GPU from the ring
+	double direct_bytes = 0.0; //sent from client memory because the ring was full or disabled
+	double copy_time = 0.0; //render thread time issuing uploads, in seconds
+	double stall_time = 0.0; //render thread time waiting for space in the ring, in seconds
+	int uploads = 0;
+
+	void clear() { *this = sUploadStats(); }
+};
+
+//uploads to the GPU through a persistent mapped staging buffer, so the driver does not have to copy client
+//memory and synchronize. Blocks can be allocated and written from any thread, the copies are issued from
+//the render thread and a fence per block tells when its memory can be reused.
+class UploadManager
+{
+public:
+	static bool enabled;
+	static size_t ring_size; //bytes of the staging buffer
+	static sUploadStats stats;
+
+	static bool init(); //render thread, done by the first alloc that can wait
+	static void update(); //render thread, every frame: releases the blocks whose copy finished
+
+	//any thread, returns false if there is no space or the ring is not created. Waiting is only allowed from the render thread
+	static bool alloc(size_t size, sStagingBlock& block, bool wait = false);
+	static void cancel(sStagingBlock& block); //the block is not going to be copied
+
+	//render thread. Fill the buffer bound to target or the texture bound to target, from the block when there is one.
+	//texture data that starts a block allocated and not copied yet is used from the ring without copying it again
+	static void uploadBuffer(unsigned int target, const void* data, size_t size, sStagingBlock* staged = NULL);
+	static void uploadTexture2D(unsigned int target, int internal_format, int width, int height, unsigned int format, unsigned int type, const void* data);
+	static void uploadTexture3D(unsigned int target, int internal_format, int width, int height, int depth, unsigned int format, unsigned int type, const void* data, int level = 0);
+	static void uploadSubTexture3D(unsigned int target, int x, int y, int z, int width, int height, int depth, unsigned int format, unsigned int type, const void* data, int level = 0);
+
+	//bytes read by glTexImage with the default unpack alignment of 4, 0 for unknown formats
+	static size_t getTextureSize(int width, int height, int depth, unsigned int format, unsigned int type);
+};
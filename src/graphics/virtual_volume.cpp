@@ -0,0 +1,362 @@
+#include "virtual_volume.h"
+
+#include <cmath>
+#include <algorithm>
+#include <cstdlib>
+
+#include <glm/glm.hpp>
+
+#include "texture.h"
+#include "shader.h"
+#include "../framework/utils.h"
+
+void VolumeResidency::create(int num_pages, int num_slots)
+{
+	page_slot.assign(num_pages, -1);
+	slot_page.assign(num_slots, -1);
+	slot_lru.assign(num_slots, lru.end());
+	slot_frame.assign(num_slots, 0);
+	lru.clear();
+	free_slots.clear();
+	for (int slot = num_slots - 1; slot >= 0; --slot)
+		free_slots.push_back(slot);
+	stats.clear();
+	frame = 0;
+}
+
+void VolumeResidency::update(const std::vector<int>& pages, int max_loads, std::vector<sBrickLoad>& loads)
+{
+	frame++;
+	loads.clear();
+	stats.requested += (int)pages.size();
+
+	//the resident pages first, so the loads of this frame do not evict them
+	for (int page : pages)
+	{
+		int slot = page_slot[page];
+		if (slot < 0)
+			continue;
+		stats.hits++;
+		lru.splice(lru.begin(), lru, slot_lru[slot]);
+		slot_frame[slot] = frame;
+	}
+
+	for (int page : pages)
+	{
+		if (page_slot[page] >= 0)
+			continue;
+		if ((int)loads.size() >= max_loads)
+		{
+			stats.deferred++;
+			continue;
+		}
+
+		int slot, evicted = -1;
+		if (free_slots.size())
+		{
+			slot = free_slots.back();
+			free_slots.pop_back();
+		}
+		else
+		{
+			//every slot is needed by this frame, the atlas is too small for the view
+			slot = lru.back();
+			if (slot_frame[slot] == frame)
+			{
+				stats.deferred++;
+				continue;
+			}
+			evicted = slot_page[slot];
+			page_slot[evicted] = -1;
+			lru.pop_back();
+			stats.evictions++;
+		}
+
+		page_slot[page] = slot;
+		slot_page[slot] = page;
+		lru.push_front(slot);
+		slot_lru[slot] = lru.begin();
+		slot_frame[slot] = frame;
+		loads.push_back({ page, slot, evicted });
+		stats.loads++;
+	}
+}
+
+void VolumeResidency::validate(int pages_per_side, int num_slots, int num_frames)
+{
+	int num_pages = pages_per_side * pages_per_side * pages_per_side;
+	VolumeResidency residency;
+	residency.create(num_pages, num_slots);
+	std::vector<int> last_used(num_pages, -1); //frame, kept by the test to check the order of the evictions
+	std::vector<int> pages, sorted_pages;
+	std::vector<float> distances;
+	std::vector<sBrickLoad> loads;
+	int errors = 0, lru_errors = 0, max_resident = 0;
+
+	double start = glfwGetTime();
+	for (int frame = 0; frame < num_frames; ++frame)
+	{
+		// the rays touch a sphere of pages that orbits the volume, the ones closer to the eye first
+		float angle = frame * 0.01f;
+		glm::vec3 center = glm::vec3(0.5f) + glm::vec3(cosf(angle), 0.2f * sinf(angle * 3.0f), sinf(angle)) * 0.3f;
+		glm::vec3 eye = glm::vec3(0.5f) + (center - glm::vec3(0.5f)) * 4.0f;
+		float radius = 0.07f + 0.02f * sinf(frame * 0.1f);
+		pages.clear();
+		distances.clear();
+		for (int z = 0; z < pages_per_side; ++z)
+			for (int y = 0; y < pages_per_side; ++y)
+				for (int x = 0; x < pages_per_side; ++x)
+				{
+					glm::vec3 p = (glm::vec3(x, y, z) + glm::vec3(0.5f)) / (float)pages_per_side;
+					if (glm::length(p - center) < radius && rand() % 8) //some rays miss pages every frame
+					{
+						pages.push_back(x + (y + z * pages_per_side) * pages_per_side);
+						distances.push_back(glm::length(p - eye));
+					}
+				}
+		sorted_pages = pages;
+		std::vector<int> order(pages.size());
+		for (size_t i = 0; i < order.size(); ++i)
+			order[i] = (int)i;
+		std::sort(order.begin(), order.end(), [&](int a, int b) { return distances[a] < distances[b]; });
+		for (size_t i = 0; i < order.size(); ++i)
+			pages[i] = sorted_pages[order[i]];
+
+		// the evicted pages have to be the least recently used of the resident ones not touched in the frame
+		std::vector<int> candidates;
+		for (int page = 0; page < num_pages; ++page)
+			if (residency.isResident(page) && !std::binary_search(sorted_pages.begin(), sorted_pages.end(), page))
+				candidates.push_back(last_used[page]);
+		std::sort(candidates.begin(), candidates.end());
+
+		residency.update(pages, 64, loads);
+		std::vector<int> evicted;
+		for (const sBrickLoad& load : loads)
+			if (load.evicted_page >= 0)
+				evicted.push_back(last_used[load.evicted_page]);
+		std::sort(evicted.begin(), evicted.end());
+		for (size_t i = 0; i < evicted.size(); ++i)
+			lru_errors += i >= candidates.size() || evicted[i] != candidates[i];
+
+		for (int page : pages)
+			if (residency.isResident(page))
+				last_used[page] = frame;
+
+		// both tables have to agree
+		int resident = 0;
+		for (int page = 0; page < num_pages; ++page)
+		{
+			int slot = residency.page_slot[page];
+			if (slot < 0)
+				continue;
+			resident++;
+			errors += residency.slot_page[slot] != page;
+		}
+		errors += resident != residency.getNumResident();
+		max_resident = std::max(max_resident, resident);
+	}
+	double time = glfwGetTime() - start;
+
+	const sResidencyStats& stats = residency.stats;
+	std::cout << " + Residency " << pages_per_side << "^3 pages, " << num_slots << " slots, " << num_frames << " frames in " << time * 1000.0 << "ms" << std::endl;
+	std::cout << " + Requested " << stats.requested << " hit " << 100.0 * stats.hits / std::max(stats.requested, 1) << "%  loads " << stats.loads
+		<< " evictions " << stats.evictions << " deferred " << stats.deferred << "  max resident " << max_resident << std::endl;
+	std::cout << " + Table errors " << errors << ", evictions out of LRU order " << lru_errors << std::endl;
+}
+
+VirtualVolume::~VirtualVolume()
+{
+	cancelLoads();
+	delete page_table;
+	delete atlas;
+	for (int i = 0; i < VIRTUAL_FEEDBACK_BUFFERS; ++i)
+	{
+		if (feedback_fences[i])
+			glDeleteSync(feedback_fences[i]);
+		if (feedback_ssbos[i])
+			glDeleteBuffers(1, &feedback_ssbos[i]);
+	}
+}
+
+void VirtualVolume::create(int resolution, int brick_size, int atlas_bricks, const VolumeBrickProvider& provider)
+{
+	cancelLoads();
+	this->resolution = resolution;
+	this->brick_size = brick_size;
+	this->pages = (resolution + brick_size - 1) / brick_size;
+	this->atlas_bricks = atlas_bricks;
+	this->provider = provider;
+
+	int num_pages = pages * pages * pages;
+	residency.create(num_pages, atlas_bricks * atlas_bricks * atlas_bricks);
+
+	std::vector<uint8_t> entries(num_pages * 4, 0);
+	if (!page_table)
+		page_table = new Texture();
+	page_table->create3D(pages, pages, pages, GL_RGBA_INTEGER, GL_UNSIGNED_BYTE, false, &entries[0], GL_RGBA8UI);
+	glBindTexture(GL_TEXTURE_3D, page_table->texture_id);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glBindTexture(GL_TEXTURE_3D, 0);
+
+	int atlas_size = atlas_bricks * (brick_size + 2);
+	if (!atlas)
+		atlas = new Texture();
+	atlas->create3D(atlas_size, atlas_size, atlas_size, GL_RED, GL_FLOAT, false, (float*)NULL, GL_R8);
+
+	// the count, a stamp per page and the list
+	std::vector<GLuint> zeros(1 + 2 * num_pages, 0);
+	for (int i = 0; i < VIRTUAL_FEEDBACK_BUFFERS; ++i)
+	{
+		if (!feedback_ssbos[i])
+			glGenBuffers(1, &feedback_ssbos[i]);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, feedback_ssbos[i]);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, zeros.size() * sizeof(GLuint), &zeros[0], GL_DYNAMIC_READ);
+		if (feedback_fences[i])
+			glDeleteSync(feedback_fences[i]);
+		feedback_fences[i] = 0;
+	}
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	feedback_index = 0;
+	feedback_frame = 1;
+}
+
+void VirtualVolume::update(const glm::vec3& eye)
+{
+	if (!feedback_ssbos[0])
+		return;
+	int num_pages = pages * pages * pages;
+
+	finishLoads();
+
+	// the buffer of the last frame is done once the commands issued so far are completed
+	feedback_fences[feedback_index] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	feedback_index = (feedback_index + 1) % VIRTUAL_FEEDBACK_BUFFERS;
+	feedback_frame++;
+
+	// pages appended by the oldest frame, then the count is reset for this one. The stamps are not cleared, this
+	// frame writes a new one. When the GPU is still on it they are skipped, the rays request them again the next frames
+	GLsync& fence = feedback_fences[feedback_index];
+	bool ready = false;
+	if (fence)
+	{
+		GLenum status = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+		ready = status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED;
+		glDeleteSync(fence);
+		fence = 0;
+	}
+	GLuint count = 0;
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, feedback_ssbos[feedback_index]);
+	if (ready)
+	{
+		glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+		glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(GLuint), &count);
+		count = std::min(count, (GLuint)num_pages);
+		feedback_pages.resize(count);
+		if (count)
+			glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, (1 + num_pages) * sizeof(GLuint), count * sizeof(GLuint), &feedback_pages[0]);
+	}
+	if (count || !ready)
+	{
+		GLuint zero = 0;
+		glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(GLuint), &zero);
+	}
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+	requests.clear();
+	for (GLuint i = 0; i < count; ++i)
+	{
+		int page = (int)feedback_pages[i];
+		glm::vec3 center = (glm::vec3(page % pages, (page / pages) % pages, page / (pages * pages)) + glm::vec3(0.5f)) / (float)pages;
+		requests.push_back({ glm::length(center - eye), page });
+	}
+	std::sort(requests.begin(), requests.end());
+	requested.clear();
+	for (const std::pair<float, int>& request : requests)
+		requested.push_back(request.second);
+
+	// while a batch is being filled the requests only keep the resident pages in use, the missing ones are deferred
+	residency.update(requested, loading.valid() ? 0 : max_loads, loads);
+	if (loads.size())
+		startLoads();
+}
+
+void VirtualVolume::startLoads()
+{
+	// the bricks keep a voxel of their neighbours around them, so the filtering inside the atlas matches the volume
+	int padded = brick_size + 2;
+	size_t brick_voxels = (size_t)padded * padded * padded;
+	pending = loads;
+	pending_blocks.resize(pending.size());
+	pending_bricks.resize(pending.size());
+	pending_data.resize(pending.size() * brick_voxels);
+	for (size_t i = 0; i < pending.size(); ++i)
+		if (UploadManager::alloc(brick_voxels * sizeof(float), pending_blocks[i]))
+			pending_bricks[i] = (float*)pending_blocks[i].data;
+		else
+			pending_bricks[i] = &pending_data[i * brick_voxels];
+
+	loading = std::async(std::launch::async, [this, padded]() {
+		parallelFor((int)pending.size(), [this, padded](int begin, int end) {
+			for (int i = begin; i < end; ++i)
+			{
+				int page = pending[i].page;
+				glm::ivec3 first(page % pages, (page / pages) % pages, page / (pages * pages));
+				provider(first * brick_size - glm::ivec3(1), padded, pending_bricks[i]);
+			}
+		});
+	});
+}
+
+void VirtualVolume::finishLoads()
+{
+	if (!loading.valid() || loading.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+		return;
+	loading.get();
+
+	// the bricks written in the ring are copied from it, the slots of the evicted pages are unmapped at the same time
+	int padded = brick_size + 2;
+	for (size_t i = 0; i < pending.size(); ++i)
+	{
+		const sBrickLoad& load = pending[i];
+		glm::ivec3 page(load.page % pages, (load.page / pages) % pages, load.page / (pages * pages));
+		glm::ivec3 slot(load.slot % atlas_bricks, (load.slot / atlas_bricks) % atlas_bricks, load.slot / (atlas_bricks * atlas_bricks));
+
+		glBindTexture(GL_TEXTURE_3D, atlas->texture_id);
+		UploadManager::uploadSubTexture3D(GL_TEXTURE_3D, slot.x * padded, slot.y * padded, slot.z * padded, padded, padded, padded, GL_RED, GL_FLOAT, pending_bricks[i]);
+
+		glBindTexture(GL_TEXTURE_3D, page_table->texture_id);
+		if (load.evicted_page >= 0)
+		{
+			uint8_t empty[4] = { 0, 0, 0, 0 };
+			glm::ivec3 evicted(load.evicted_page % pages, (load.evicted_page / pages) % pages, load.evicted_page / (pages * pages));
+			glTexSubImage3D(GL_TEXTURE_3D, 0, evicted.x, evicted.y, evicted.z, 1, 1, 1, GL_RGBA_INTEGER, GL_UNSIGNED_BYTE, empty);
+		}
+		uint8_t entry[4] = { (uint8_t)slot.x, (uint8_t)slot.y, (uint8_t)slot.z, 1 };
+		glTexSubImage3D(GL_TEXTURE_3D, 0, page.x, page.y, page.z, 1, 1, 1, GL_RGBA_INTEGER, GL_UNSIGNED_BYTE, entry);
+	}
+	glBindTexture(GL_TEXTURE_3D, 0);
+	pending.clear();
+	pending_blocks.clear();
+}
+
+void VirtualVolume::cancelLoads()
+{
+	if (loading.valid())
+		loading.get();
+	for (sStagingBlock& block : pending_blocks)
+		UploadManager::cancel(block);
+	pending.clear();
+	pending_blocks.clear();
+}
+
+void VirtualVolume::setUniforms(Shader* shader, int first_slot)
+{
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, feedback_ssbos[feedback_index]);
+	shader->setUniform("u_use_virtual", true);
+	shader->setUniform("u_page_table", page_table, first_slot);
+	shader->setUniform("u_brick_atlas", atlas, first_slot + 1);
+	shader->setUniform3("u_virtual_pages", pages, pages, pages);
+	shader->setUniform("u_brick_size", brick_size);
+	shader->setUniform("u_feedback_frame", feedback_frame);
+}
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <vector>
+#include <list>
+#include <functional>
+#include <utility>
+#include <future>
+
+#include <glm/vec3.hpp>
+
+#include "../framework/includes.h"
+#include "upload.h"
+
+class Texture;
+class Shader;
+
+//brick that has to be copied to a slot of the atlas
+struct sBrickLoad
+{
+	int page;
+	int slot;
+	int evicted_page; //-1 if the slot was free
+};
+
+struct sResidencyStats
+{
+	int requested = 0; //pages touched by the rays
+	int hits = 0; //already resident
+	int loads = 0;
+	int evictions = 0;
+	int deferred = 0; //missing pages over the budget of loads, requested again the next frame
+
+	void clear() { *this = sResidencyStats(); }
+};
+
+//CPU side of a sparse volume: which page of the virtual volume is in which slot of the atlas.
+//The slots are reused in least recently used order, the pages touched in a frame are never evicted in it
+class VolumeResidency
+{
+public:
+	std::vector<int> page_slot; //-1 when the page is not resident
+	std::vector<int> slot_page; //-1 when the slot is free
+	sResidencyStats stats;
+
+	void create(int num_pages, int num_slots);
+
+	//marks the pages as used and returns in loads the missing ones, at most max_loads and in the given order
+	void update(const std::vector<int>& pages, int max_loads, std::vector<sBrickLoad>& loads);
+
+	bool isResident(int page) const { return page_slot[page] >= 0; }
+	int getNumResident() const { return (int)(slot_page.size() - free_slots.size()); }
+
+	//synthetic feedback of a camera moving through a volume, checks the tables and the LRU order. Results are printed
+	static void validate(int pages_per_side = 64, int num_slots = 4096, int num_frames = 300);
+
+private:
+	std::list<int> lru; //resident slots, the most recently used first
+	std::vector<std::list<int>::iterator> slot_lru;
+	std::vector<int> free_slots;
+	std::vector<unsigned int> slot_frame; //last update that used every slot
+	unsigned int frame = 0;
+};
+
+//fills size^3 voxels (x first) of the volume starting at first, which may be outside it by one voxel.
+//it is called from worker threads, for several bricks at once
+typedef std::function<void(const glm::ivec3& first, int size, float* data)> VolumeBrickProvider;
+
+//feedback buffers written by the rays, read when the GPU is done with them so the CPU never waits for the frame
+#define VIRTUAL_FEEDBACK_BUFFERS 3
+
+//volume bigger than the memory of a 3D texture: a page table points to the resident bricks in a fixed atlas.
+//the rays write the pages they need in a feedback buffer and the closest missing ones are loaded: worker threads
+//fill them in staging blocks and the render thread only copies them to the atlas once the whole batch is done
+class VirtualVolume
+{
+public:
+	int resolution = 0; //voxels per side of the virtual volume
+	int brick_size = 0; //voxels per side of a page, the atlas keeps one more around them for the filtering
+	int pages = 0; //per side
+	int atlas_bricks = 0; //slots per side of the atlas
+	int max_loads = 32; //bricks per batch, a new batch starts when the last one is copied
+	VolumeBrickProvider provider;
+	VolumeResidency residency;
+
+	Texture* page_table = NULL; //RGBA8UI, slot in the atlas and resident flag
+	Texture* atlas = NULL; //R8
+	//count of requested pages, the frame that last requested every page and the list of the requested ones.
+	//the current one in binding 3 of the volume shaders
+	GLuint feedback_ssbos[VIRTUAL_FEEDBACK_BUFFERS] = {};
+	GLsync feedback_fences[VIRTUAL_FEEDBACK_BUFFERS] = {}; //set when the frame that writes the buffer is issued
+	int feedback_index = 0; //buffer written by the current frame
+	int feedback_frame = 1; //stamp of the pages requested by the current frame, the stamps of a buffer never repeat
+
+	//kept between frames so the update does not allocate
+	std::vector<GLuint> feedback_pages;
+	std::vector<std::pair<float, int>> requests; //distance to the eye and page
+	std::vector<int> requested;
+	std::vector<sBrickLoad> loads;
+
+	//batch being filled by the workers, its pages are resident in the residency but not in the page table yet
+	std::future<void> loading;
+	std::vector<sBrickLoad> pending;
+	std::vector<sStagingBlock> pending_blocks;
+	std::vector<float*> pending_bricks; //in the staging block or in pending_data when the ring had no space
+	std::vector<float> pending_data;
+
+	~VirtualVolume();
+
+	void create(int resolution, int brick_size, int atlas_bricks, const VolumeBrickProvider& provider);
+
+	//copies the last batch when it is filled, then reads the pages touched VIRTUAL_FEEDBACK_BUFFERS - 1 frames ago and
+	//starts loading the missing ones, the closest to the eye first (texture coordinates)
+	void update(const glm::vec3& eye);
+
+	void setUniforms(Shader* shader, int first_slot);
+
+private:
+	void startLoads(); //the loads of the residency as the next batch
+	void finishLoads(); //copies the batch when the workers are done with it
+	void cancelLoads(); //waits for the workers and drops the batch
+};
@@ -29,6 +29,15 @@ void renderGUI(GLFWwindow* window, Application* app)
 		if (ImGui::TreeNodeEx("Debugger", ImGuiTreeNodeFlags_DefaultOpen)) {
 			ImGui::Checkbox("View wireframe", &app->flag_wireframe);
 			ImGui::Checkbox("View grid", &app->flag_grid);
+			ImGui::Checkbox("Frustum culling", &app->flag_culling);
+			ImGui::Text("Nodes visible: %d culled: %d (%.3f ms)", app->num_visible_nodes, app->num_culled_nodes, app->culling_time * 1000.0);
+			ImGui::Combo("Volume resolution", &app->volume_resolution, "Full\0Half\0Quarter\0");
+			ImGui::Text("GPU frame: full %.2f ms half %.2f ms quarter %.2f ms", app->gpu_frame_time[0], app->gpu_frame_time[1], app->gpu_frame_time[2]);
+			ImGui::Checkbox("Temporal volumes", &app->flag_temporal);
+			if (app->flag_temporal) {
+				ImGui::SliderFloat("New samples weight", &app->temporal_blend, 0.05f, 1.0f);
+				ImGui::SliderFloat("Step length scale", &app->temporal_step_scale, 1.0f, 8.0f);
+			}
 			if (ImGui::IsMousePosValid())
 				ImGui::Text("Mouse pos: (%g, %g)", xpos, ypos);
 			else
@@ -38,11 +47,61 @@ void renderGUI(GLFWwindow* window, Application* app)
 			ImGui::TreePop();
 		}
 
+		// results are printed to the console
+		if (ImGui::TreeNode("Benchmarks")) {
+			ImGui::Checkbox("Use VAOs", &Mesh::use_vaos);
+			ImGui::Checkbox("Multi draw indirect", &Mesh::use_multidraw);
+			if (ImGui::Button("Draw submission"))
+				Mesh::benchmarkDrawSubmission();
+			ImGui::Checkbox("Instance ring", &Mesh::use_instance_ring);
+			if (ImGui::Button("Instancing"))
+				Mesh::benchmarkInstancing();
+			if (ImGui::Button("Ray casting"))
+				Mesh::benchmarkRayCasting();
+			ImGui::Checkbox("Generate LODs", &Mesh::generate_lods);
+			ImGui::SliderFloat("LOD pixel error", &Mesh::lod_pixel_error, 0.0f, 8.0f);
+			ImGui::Text("Draw calls: %ld Triangles: %ld", Mesh::num_meshes_rendered, Mesh::num_triangles_rendered);
+			ImGui::Checkbox("Generate meshlets", &Mesh::generate_meshlets);
+			ImGui::Checkbox("Meshlet culling", &Mesh::use_meshlet_culling);
+			const sMeshletStats& stats = Mesh::meshlet_stats;
+			ImGui::Text("Meshlets: %d frustum culled: %d backface culled: %d (%.3f ms)", stats.tested, stats.frustum_culled, stats.backface_culled, stats.time * 1000.0);
+			if (ImGui::Button("Cull meshlets"))
+				Mesh::benchmarkMeshletCulling();
+			if (ImGui::Button("Adaptive step"))
+				StandardMaterial::benchmarkAdaptiveStep();
+			if (ImGui::Button("Noise texture"))
+				StandardMaterial::validateNoise();
+			if (ImGui::Button("Noise throughput"))
+				StandardMaterial::benchmarkNoise();
+			if (ImGui::Button("Volume mipmaps"))
+				StandardMaterial::validateVolumeMips();
+			if (ImGui::Button("Volume formats"))
+				StandardMaterial::validateVolumeFormats();
+			if (ImGui::Button("Volume residency"))
+				VolumeResidency::validate();
+			if (ImGui::Button("Isosurface extraction"))
+				IsosurfaceExtractor::validate();
+			if (ImGui::Button("Distance field"))
+				IsosurfaceMaterial::benchmarkDistanceField();
+			if (ImGui::Button("Image decoding"))
+				Image::benchmarkDecoding();
+			ImGui::Checkbox("Staging ring", &UploadManager::enabled);
+			const sUploadStats& uploads = UploadManager::stats;
+			ImGui::Text("Uploads: %d, %.1f MB staged %.1f MB direct, %.1f MB/s (%.2f ms stalled)", uploads.uploads, uploads.staged_bytes / (1024.0 * 1024.0), uploads.direct_bytes / (1024.0 * 1024.0),
+				uploads.copy_time > 0.0 ? (uploads.staged_bytes + uploads.direct_bytes) / (1024.0 * 1024.0) / uploads.copy_time : 0.0, uploads.stall_time * 1000.0);
+			ImGui::TreePop();
+		}
+
 		app->renderGUI();
 
 		ImGui::End();
 	}
 
+	// counters of the frame already shown
+	Mesh::num_meshes_rendered = 0;
+	Mesh::num_triangles_rendered = 0;
+	Mesh::meshlet_stats.clear();
+
 	// Rendering
 	ImGui::Render();
 	int display_w, display_h;
@@ -161,6 +220,10 @@ void mainLoop(GLFWwindow* window)
 
 		//ImGui::ShowDemoWindow();
 
+		// meshes loaded in the background
+		UploadManager::update();
+		Mesh::processUploads();
+
 		app->render();
 
 		renderGUI(window, app);